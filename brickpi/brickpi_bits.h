@@ -0,0 +1,80 @@
+/*
+ * Dexter Industries BrickPi driver
+ *
+ * Copyright (C) 2015-2016 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _BRICKPI_BITS_H_
+#define _BRICKPI_BITS_H_
+
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+
+/*
+ * Fields are packed least significant bit first, starting from the least
+ * significant bit of each byte (this is what set_bit() on the byte buffer
+ * used to do on the little-endian Raspberry Pi). A field is at most 32 bits,
+ * so it touches at most 5 bytes. These are gathered into one 64-bit word so
+ * that the whole field is moved with a single shift and mask instead of one
+ * bit at a time. They live in a header so that tools/testing can build them
+ * on the host.
+ */
+
+static inline u64 brickpi_load_bits(const u8 *buf, unsigned bytes)
+{
+	u64 word = 0;
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		word |= (u64)buf[i] << (8 * i);
+
+	return word;
+}
+
+static inline void brickpi_pack_bits(u8 *buf, unsigned pos, u8 size, long value)
+{
+	unsigned shift = pos % 8;
+	unsigned bytes = DIV_ROUND_UP(shift + size, 8);
+	u64 word, mask;
+	int i;
+
+	if (!size)
+		return;
+
+	buf += pos / 8;
+	mask = GENMASK_ULL(shift + size - 1, shift);
+	word = brickpi_load_bits(buf, bytes);
+	word = (word & ~mask) | (((u64)value << shift) & mask);
+	for (i = 0; i < bytes; i++)
+		buf[i] = word >> (8 * i);
+}
+
+static inline long brickpi_unpack_bits(const u8 *buf, unsigned pos, u8 size)
+{
+	unsigned shift = pos % 8;
+	u64 word;
+
+	if (!size)
+		return 0;
+
+	word = brickpi_load_bits(buf + pos / 8, DIV_ROUND_UP(shift + size, 8));
+	word = (word >> shift) & GENMASK_ULL(size - 1, 0);
+
+	/* bit 31 has always been sign extended, so keep doing that */
+	if (size == 32)
+		return (s32)word;
+
+	return word;
+}
+
+#endif /* _BRICKPI_BITS_H_ */
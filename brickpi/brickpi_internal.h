@@ -112,7 +112,7 @@ struct brickpi_out_port_data {
 	struct brickpi_channel_data *ch_data;
 	struct lego_port_device port;
 	struct lego_device *motor;
-	struct tm_speed speed;
+	struct tm_speed_ab speed;
 	struct tm_pid speed_pid;
 	struct tm_pid hold_pid;
 	bool speed_pid_ena;
@@ -175,6 +175,9 @@ struct brickpi_channel_data {
  * @rx_data_work: Workqueue item for handling received data.
  * @poll_work: Work for polling.
  * @poll_timer: Timer for polling.
+ * @poll_time: When the last poll started.
+ * @poll_cycle_ns: Average time taken by one poll of all channels.
+ * @poll_period_ns: Current polling period, based on poll_cycle_ns.
  * @closing: Flag to indicate that we are closing the connection and any data
  *  received should be ignored.
  */
@@ -197,6 +200,9 @@ struct brickpi_data {
 	struct work_struct rx_data_work;
 	struct work_struct poll_work;
 	struct hrtimer poll_timer;
+	ktime_t poll_time;
+	s64 poll_cycle_ns;
+	s64 poll_period_ns;
 	bool closing;
 };
 
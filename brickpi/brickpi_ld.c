@@ -64,6 +64,7 @@
 #include <linux/string.h>
 #include <linux/tty.h>
 
+#include "brickpi_bits.h"
 #include "brickpi_internal.h"
 #include "../linux/board_info/board_info.h"
 
@@ -78,13 +79,19 @@
 #endif
 
 /*
- * This is just about as fast as we can go. Each poll is 2 messages -- 1 to
- * each channel. Each message takes about 1ms. This leaves 2ms open for sending
- * commands.
+ * Each poll is 2 messages -- 1 to each channel. Each message takes about 1ms.
+ * The poll period is adjusted to twice the measured time of a poll, which
+ * leaves about half of the time open for sending commands. BRICKPI_POLL_MS is
+ * the period that we start with and the one that the motor PID gains are tuned
+ * for.
  */
 #define BRICKPI_POLL_MS		4
+#define BRICKPI_MIN_POLL_NS	(2 * NSEC_PER_MSEC)
+#define BRICKPI_MAX_POLL_NS	(BRICKPI_SPEED_PERIOD * NSEC_PER_MSEC)
 #define BRICKPI_SPEED_PERIOD	20
 
+#define BRICKPI_GET_VALUES_TIMEOUT_MS	100
+
 /* tx_buffer offsets */
 #define BRICKPI_TX_ADDR		0
 #define BRICKPI_TX_CHECKSUM	1
@@ -104,39 +111,27 @@
 
 void brickpi_append_tx(struct brickpi_data *data, u8 size, long value)
 {
-	unsigned end = data->tx_buffer_tail + size;
-
-	while (data->tx_buffer_tail < end) {
-		if (value & 0x01)
-			set_bit(data->tx_buffer_tail, (unsigned long *)data->tx_buffer);
-		else
-			clear_bit(data->tx_buffer_tail, (unsigned long *)data->tx_buffer);
-		value >>= 1;
-		data->tx_buffer_tail++;
-	}
+	brickpi_pack_bits(data->tx_buffer, data->tx_buffer_tail, size, value);
+	data->tx_buffer_tail += size;
 }
 
 long brickpi_read_rx(struct brickpi_data *data, u8 size)
 {
-	long result = 0;
-	int i = 0;
-
-	while (i < size) {
-		if (test_bit(data->rx_buffer_head, (unsigned long *)data->rx_buffer))
-			result |= 1 << i;
-		data->rx_buffer_head++;
-		i++;
-	}
+	long value = brickpi_unpack_bits(data->rx_buffer, data->rx_buffer_head,
+					 size);
+
+	data->rx_buffer_head += size;
 
-	return result;
+	return value;
 }
 
 int brickpi_send_message(struct brickpi_data *data, u8 addr,
 			 enum brickpi_message msg, unsigned timeout)
 {
-	unsigned size, i, ret;
+	unsigned size, i;
 	unsigned retries = 2;
 	u8 checksum = 0;
+	long ret = 0;
 
 	WARN_ON(!mutex_is_locked(&data->tx_mutex));
 	size = (data->tx_buffer_tail + 7) / 8;
@@ -216,17 +211,12 @@ int brickpi_set_sensors(struct brickpi_channel_data *ch_data)
 	return err;
 }
 
-int brickpi_get_values(struct brickpi_channel_data *ch_data)
+/* Builds the GET_VALUES message for a channel in tx_buffer. */
+static void brickpi_prepare_values(struct brickpi_channel_data *ch_data)
 {
 	struct brickpi_data *data = ch_data->data;
-	int i, j, err;
-	u8 port_size[NUM_BRICKPI_PORT];
+	int i, j;
 
-	mutex_lock(&data->tx_mutex);
-	if (data->closing) {
-		mutex_unlock(&data->tx_mutex);
-		return 0;
-	}
 	data->tx_buffer_tail = BRICKPI_TX_BUFFER_TAIL_INIT;
 	for (i = 0; i < NUM_BRICKPI_PORT; i++) {
 		brickpi_append_tx(data, 1, ch_data->out_port[i].motor_use_offset);
@@ -259,13 +249,14 @@ int brickpi_get_values(struct brickpi_channel_data *ch_data)
 			}
 		}
 	}
-	err = brickpi_send_message(data, ch_data->address,
-				   BRICK_PI_MESSAGE_GET_VALUES, 100);
-	if (err < 0) {
-		/* TODO: Set encoder offsets to 0 */
-		mutex_unlock(&data->tx_mutex);
-		return err;
-	}
+}
+
+/* Decodes the reply to a GET_VALUES message from rx_buffer. */
+static void brickpi_parse_values(struct brickpi_channel_data *ch_data)
+{
+	struct brickpi_data *data = ch_data->data;
+	u8 port_size[NUM_BRICKPI_PORT];
+	int i, j;
 
 	data->rx_buffer_head = BRICKPI_RX_BUFFER_HEAD_INIT;
 	port_size[BRICKPI_PORT_1] = brickpi_read_rx(data, 5);
@@ -285,7 +276,7 @@ int brickpi_get_values(struct brickpi_channel_data *ch_data)
 		if (bits & 1)
 			position *= -1;
 		port->motor_position = position;
-		tm_speed_update(&port->speed, position, data->rx_time);
+		tm_speed_ab_update(&port->speed, position, data->rx_time);
 		debug_pr("motor_position[%d]: %d\n", i, (int)position);
 		if (port->stop_at_target_position) {
 			if ((port->motor_reversed
@@ -413,9 +404,28 @@ int brickpi_get_values(struct brickpi_channel_data *ch_data)
 		}
 		lego_port_call_raw_data_func(&port->port);
 	}
+}
+
+int brickpi_get_values(struct brickpi_channel_data *ch_data)
+{
+	struct brickpi_data *data = ch_data->data;
+	int err;
+
+	mutex_lock(&data->tx_mutex);
+	if (data->closing) {
+		mutex_unlock(&data->tx_mutex);
+		return 0;
+	}
+	brickpi_prepare_values(ch_data);
+	err = brickpi_send_message(data, ch_data->address,
+				   BRICK_PI_MESSAGE_GET_VALUES,
+				   BRICKPI_GET_VALUES_TIMEOUT_MS);
+	/* TODO: Set encoder offsets to 0 on error */
+	if (!err)
+		brickpi_parse_values(ch_data);
 	mutex_unlock(&data->tx_mutex);
 
-	return 0;
+	return err;
 }
 
 static void brickpi_handle_rx_data(struct work_struct *work)
@@ -461,8 +471,40 @@ static void brickpi_handle_rx_data(struct work_struct *work)
 	complete(&data->rx_completion);
 }
 
-static void brickpi_update_motor(struct brickpi_out_port_data *port)
+/*
+ * The PID gains are tuned for an update every BRICKPI_POLL_MS. The integral
+ * and derivative gains are scaled by the measured period, so that they have
+ * the same effect per unit of time when the poll period changes. The gains
+ * are scaled in a copy, so that the values set by userspace are not touched.
+ */
+static int brickpi_pid_update(struct tm_pid *pid, int value, s64 period_ns)
+{
+	struct tm_pid scaled = *pid;
+	int duty_cycle;
+
+	scaled.Ki = div_s64((s64)pid->Ki * period_ns,
+			    BRICKPI_POLL_MS * NSEC_PER_MSEC);
+	scaled.Kd = div_s64((s64)pid->Kd * BRICKPI_POLL_MS * NSEC_PER_MSEC,
+			    period_ns);
+	duty_cycle = tm_pid_update(&scaled, value);
+
+	pid->integral = scaled.integral;
+	pid->prev_error = scaled.prev_error;
+	pid->d_filtered = scaled.d_filtered;
+	pid->output = scaled.output;
+	pid->overloaded = scaled.overloaded;
+
+	return duty_cycle;
+}
+
+static void brickpi_update_motor(struct brickpi_out_port_data *port,
+				 s64 period_ns)
 {
+	/* keep the speed averaged over BRICKPI_SPEED_PERIOD */
+	tm_speed_ab_set_count(&port->speed,
+		div_s64(BRICKPI_SPEED_PERIOD * NSEC_PER_MSEC + period_ns / 2,
+			period_ns));
+
 	if (port->motor_enabled) {
 		int duty_cycle;
 
@@ -471,11 +513,12 @@ static void brickpi_update_motor(struct brickpi_out_port_data *port)
 				duty_cycle = 0;
 				tm_pid_reinit(&port->speed_pid);
 			} else
-				duty_cycle = tm_pid_update(&port->speed_pid,
-						tm_speed_get(&port->speed));
+				duty_cycle = brickpi_pid_update(&port->speed_pid,
+						tm_speed_ab_get(&port->speed),
+						period_ns);
 		} else if (port->hold_pid_ena) {
-			duty_cycle = tm_pid_update(&port->hold_pid,
-							port->motor_position);
+			duty_cycle = brickpi_pid_update(&port->hold_pid,
+						port->motor_position, period_ns);
 		} else
 			duty_cycle = port->direct_duty_cycle;
 
@@ -514,26 +557,63 @@ static int brickpi_board_info_get_property(struct board_info *info,
 }
 
 
+static void brickpi_update_poll_period(struct brickpi_data *data, ktime_t cycle)
+{
+	/* moving average over 8 polls */
+	data->poll_cycle_ns += div_s64(ktime_to_ns(cycle) - data->poll_cycle_ns, 8);
+	WRITE_ONCE(data->poll_period_ns,
+		   clamp_t(s64, 2 * data->poll_cycle_ns, BRICKPI_MIN_POLL_NS,
+			   BRICKPI_MAX_POLL_NS));
+}
+
+/*
+ * Both channels share the serial port, so only one message can be in flight
+ * at a time. tx_mutex is only held for the message of one channel, so that
+ * commands from userspace can be sent between the two channels instead of
+ * waiting for the whole poll.
+ */
 static void brickpi_poll_work(struct work_struct *work)
 {
 	struct brickpi_data *data = container_of(work, struct brickpi_data,
 						 poll_work);
+	ktime_t start = ktime_get();
+	s64 period_ns;
 	int i, err;
 
-	if (data->closing)
-		return;
+	period_ns = clamp_t(s64, ktime_to_ns(ktime_sub(start, data->poll_time)),
+			    BRICKPI_MIN_POLL_NS, BRICKPI_MAX_POLL_NS);
+	data->poll_time = start;
 
 	for (i = 0; i < data->num_channels; i++) {
 		struct brickpi_channel_data *ch_data = &data->channel_data[i];
-		if (ch_data->init_ok) {
-			brickpi_update_motor(&ch_data->out_port[BRICKPI_PORT_1]);
-			brickpi_update_motor(&ch_data->out_port[BRICKPI_PORT_2]);
-			err = brickpi_get_values(ch_data);
-			if (err < 0)
-				debug_pr("failed to get values for address %d. (%d)\n",
-				ch_data->address, err);
+
+		if (!ch_data->init_ok)
+			continue;
+
+		mutex_lock(&data->tx_mutex);
+		if (data->closing) {
+			mutex_unlock(&data->tx_mutex);
+			return;
 		}
+
+		brickpi_update_motor(&ch_data->out_port[BRICKPI_PORT_1],
+				     period_ns);
+		brickpi_update_motor(&ch_data->out_port[BRICKPI_PORT_2],
+				     period_ns);
+		brickpi_prepare_values(ch_data);
+		err = brickpi_send_message(data, ch_data->address,
+					   BRICK_PI_MESSAGE_GET_VALUES,
+					   BRICKPI_GET_VALUES_TIMEOUT_MS);
+		if (!err)
+			brickpi_parse_values(ch_data);
+		else
+			debug_pr("failed to get values for address %d. (%d)\n",
+				 ch_data->address, err);
+
+		mutex_unlock(&data->tx_mutex);
 	}
+
+	brickpi_update_poll_period(data, ktime_sub(ktime_get(), start));
 }
 
 static void brickpi_init_work(struct work_struct *work)
@@ -576,9 +656,9 @@ static void brickpi_init_work(struct work_struct *work)
 				err);
 			return;
 		}
-		tm_speed_init(&out_port_1->speed, out_port_1->motor_position,
+		tm_speed_ab_init(&out_port_1->speed, out_port_1->motor_position,
 			data->rx_time, BRICKPI_SPEED_PERIOD / BRICKPI_POLL_MS);
-		tm_speed_init(&out_port_1->speed, out_port_1->motor_position,
+		tm_speed_ab_init(&out_port_2->speed, out_port_2->motor_position,
 			data->rx_time, BRICKPI_SPEED_PERIOD / BRICKPI_POLL_MS);
 		_brickpi_out_port_reset(out_port_1);
 		_brickpi_out_port_reset(out_port_2);
@@ -605,6 +685,8 @@ static void brickpi_init_work(struct work_struct *work)
 	}
 
 	INIT_WORK(&data->poll_work, brickpi_poll_work);
+	data->poll_time = ktime_sub_ns(ktime_get(),
+				       BRICKPI_POLL_MS * NSEC_PER_MSEC);
 	hrtimer_start(&data->poll_timer, ktime_set(0, 0), HRTIMER_MODE_REL);
 
 	data->desc.properties = brickpi_board_info_properties;
@@ -628,7 +710,7 @@ enum hrtimer_restart brickpi_poll_timer_function(struct hrtimer *timer)
 	struct brickpi_data *data = container_of(timer, struct brickpi_data,
 						 poll_timer);
 
-	hrtimer_forward_now(timer, ms_to_ktime(BRICKPI_POLL_MS));
+	hrtimer_forward_now(timer, ns_to_ktime(READ_ONCE(data->poll_period_ns)));
 	if (data->closing)
 		return HRTIMER_NORESTART;
 
@@ -655,6 +737,8 @@ static int brickpi_open(struct tty_struct *tty)
 	}
 
 	data->tty = tty;
+	data->poll_cycle_ns = BRICKPI_POLL_MS * NSEC_PER_MSEC / 2;
+	data->poll_period_ns = BRICKPI_POLL_MS * NSEC_PER_MSEC;
 	mutex_init(&data->tx_mutex);
 	init_completion(&data->rx_completion);
 	INIT_WORK(&data->rx_data_work, brickpi_handle_rx_data);
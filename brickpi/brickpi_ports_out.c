@@ -212,7 +212,7 @@ static int brickpi_out_port_run_unregulated(void *context, int duty_cycle)
 	return 0;
 }
 
-TM_SPEED_GET_SPEED_FUNC(brickpi_out_port, brickpi_out_port_data, speed);
+TM_SPEED_AB_GET_SPEED_FUNC(brickpi_out_port, brickpi_out_port_data, speed);
 
 static int brickpi_out_port_run_regulated(void *context, int speed)
 {
@@ -256,12 +256,26 @@ TM_PID_GET_FUNC(brickpi_out_port, speed_Ki, brickpi_out_port_data, speed_pid.Ki)
 TM_PID_SET_FUNC(brickpi_out_port, speed_Ki, brickpi_out_port_data, speed_pid.Ki);
 TM_PID_GET_FUNC(brickpi_out_port, speed_Kd, brickpi_out_port_data, speed_pid.Kd);
 TM_PID_SET_FUNC(brickpi_out_port, speed_Kd, brickpi_out_port_data, speed_pid.Kd);
+TM_PID_GET_FUNC(brickpi_out_port, speed_Kf, brickpi_out_port_data, speed_pid.Kf);
+TM_PID_SET_FUNC(brickpi_out_port, speed_Kf, brickpi_out_port_data, speed_pid.Kf);
+TM_PID_GET_FUNC(brickpi_out_port, speed_Tf, brickpi_out_port_data, speed_pid.Tf);
+TM_PID_SET_FUNC(brickpi_out_port, speed_Tf, brickpi_out_port_data, speed_pid.Tf);
+TM_PID_GET_FUNC(brickpi_out_port, speed_slew, brickpi_out_port_data, speed_pid.slew);
+TM_PID_SET_FUNC(brickpi_out_port, speed_slew, brickpi_out_port_data, speed_pid.slew);
+TM_PID_GET_FUNC(brickpi_out_port, speed_scale, brickpi_out_port_data, speed_pid.scale);
+TM_PID_SET_SCALE_FUNC(brickpi_out_port, speed_scale, brickpi_out_port_data, speed_pid.scale);
 TM_PID_GET_FUNC(brickpi_out_port, hold_Kp, brickpi_out_port_data, hold_pid.Kp);
 TM_PID_SET_FUNC(brickpi_out_port, hold_Kp, brickpi_out_port_data, hold_pid.Kp);
 TM_PID_GET_FUNC(brickpi_out_port, hold_Ki, brickpi_out_port_data, hold_pid.Ki);
 TM_PID_SET_FUNC(brickpi_out_port, hold_Ki, brickpi_out_port_data, hold_pid.Ki);
 TM_PID_GET_FUNC(brickpi_out_port, hold_Kd, brickpi_out_port_data, hold_pid.Kd);
 TM_PID_SET_FUNC(brickpi_out_port, hold_Kd, brickpi_out_port_data, hold_pid.Kd);
+TM_PID_GET_FUNC(brickpi_out_port, hold_Tf, brickpi_out_port_data, hold_pid.Tf);
+TM_PID_SET_FUNC(brickpi_out_port, hold_Tf, brickpi_out_port_data, hold_pid.Tf);
+TM_PID_GET_FUNC(brickpi_out_port, hold_slew, brickpi_out_port_data, hold_pid.slew);
+TM_PID_SET_FUNC(brickpi_out_port, hold_slew, brickpi_out_port_data, hold_pid.slew);
+TM_PID_GET_FUNC(brickpi_out_port, hold_scale, brickpi_out_port_data, hold_pid.scale);
+TM_PID_SET_SCALE_FUNC(brickpi_out_port, hold_scale, brickpi_out_port_data, hold_pid.scale);
 
 static int brickpi_out_port_get_state(void *context)
 {
@@ -277,7 +291,7 @@ static int brickpi_out_port_get_state(void *context)
 			state |= BIT(TM_STATE_RUNNING);
 			if (tm_pid_is_overloaded(&data->speed_pid))
 				state |= BIT(TM_STATE_OVERLOADED);
-			if (tm_speed_get(&data->speed) == 0)
+			if (tm_speed_ab_get(&data->speed) == 0)
 				state |= BIT(TM_STATE_STALLED);
 		}
 	}
@@ -324,6 +338,7 @@ void _brickpi_out_port_reset(struct brickpi_out_port_data *data)
 	data->motor_enabled = false;
 	data->stop_at_target_position = false;
 	data->motor_offset = -data->motor_position;
+	/* for an update every 4 ms, scaled by brickpi_pid_update() */
 	tm_pid_init(&data->speed_pid, 1000, 60, 0);
 	tm_pid_init(&data->hold_pid, 20000, 0, 0);
 }
@@ -361,12 +376,26 @@ struct tacho_motor_ops brickpi_out_port_tacho_motor_ops = {
 	.set_speed_Ki		= brickpi_out_port_set_speed_Ki,
 	.get_speed_Kd		= brickpi_out_port_get_speed_Kd,
 	.set_speed_Kd		= brickpi_out_port_set_speed_Kd,
+	.get_speed_Kf		= brickpi_out_port_get_speed_Kf,
+	.set_speed_Kf		= brickpi_out_port_set_speed_Kf,
+	.get_speed_Tf		= brickpi_out_port_get_speed_Tf,
+	.set_speed_Tf		= brickpi_out_port_set_speed_Tf,
+	.get_speed_slew		= brickpi_out_port_get_speed_slew,
+	.set_speed_slew		= brickpi_out_port_set_speed_slew,
+	.get_speed_scale	= brickpi_out_port_get_speed_scale,
+	.set_speed_scale	= brickpi_out_port_set_speed_scale,
 	.get_hold_Kp		= brickpi_out_port_get_hold_Kp,
 	.set_hold_Kp		= brickpi_out_port_set_hold_Kp,
 	.get_hold_Ki		= brickpi_out_port_get_hold_Ki,
 	.set_hold_Ki		= brickpi_out_port_set_hold_Ki,
 	.get_hold_Kd		= brickpi_out_port_get_hold_Kd,
 	.set_hold_Kd		= brickpi_out_port_set_hold_Kd,
+	.get_hold_Tf		= brickpi_out_port_get_hold_Tf,
+	.set_hold_Tf		= brickpi_out_port_set_hold_Tf,
+	.get_hold_slew		= brickpi_out_port_get_hold_slew,
+	.set_hold_slew		= brickpi_out_port_set_hold_slew,
+	.get_hold_scale		= brickpi_out_port_get_hold_scale,
+	.set_hold_scale		= brickpi_out_port_set_hold_scale,
 	.get_state		= brickpi_out_port_get_state,
 	.get_stop_actions	= brickpi_out_port_get_stop_actions,
 };
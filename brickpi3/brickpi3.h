@@ -19,6 +19,10 @@
 #ifndef _BRICKPI3_H_
 #define _BRICKPI3_H_
 
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+
 enum brickpi3_input_port {
 	BRICKPI3_PORT_IN1,
 	BRICKPI3_PORT_IN2,
@@ -173,8 +177,93 @@ enum brickpi3_out_port_mode {
 	NUM_BRICKPI3_OUT_PORT_MODES
 };
 
+/**
+ * struct brickpi3_motor_reading - result of brickpi3_queue_read_motor()
+ *
+ * @status: The motor status flags.
+ * @duty_cycle: The duty cycle in percent.
+ * @position: The position in degrees.
+ * @speed: The speed in degrees per second.
+ * @err: 0 if the other fields are valid, otherwise a negative error code.
+ */
+struct brickpi3_motor_reading {
+	enum brickpi3_motor_status status;
+	int duty_cycle;
+	int position;
+	int speed;
+	int err;
+};
+
+/**
+ * struct brickpi3_sensor_reading - result of brickpi3_queue_read_sensor()
+ *
+ * @type: The sensor type that the firmware is using for the port.
+ * @state: enum brickpi3_sensor_state
+ * @data: The raw sensor data.
+ * @err: 0 if the other fields are valid, otherwise a negative error code.
+ */
+struct brickpi3_sensor_reading {
+	u8 type;
+	u8 state;
+	u8 data[BRICKPI3_STRING_MSG_SIZE - 2];
+	int err;
+};
+
 struct brickpi3;
+struct brickpi3_cache;
+struct i2c_adapter;
 
+typedef void (*brickpi3_sensor_poll_func_t)(void *context,
+			const struct brickpi3_sensor_reading *reading);
+
+/**
+ * struct brickpi3_i2c_request - an I2C transaction on an input port
+ *
+ * @address: The BrickPi3 address
+ * @port: The input port
+ * @i2c_addr: The I2C address
+ * @write_buf: Array of data to write
+ * @write_size: The number of bytes to write (<= BRICKPI3_I2C_MAX_WRITE_SIZE)
+ * @read_buf: The buffer to store the read data
+ * @read_size: The number of bytes to read (<= BRICKPI3_I2C_MAX_READ_SIZE)
+ * @complete: Called when the transaction has finished.
+ * @context: For use by @complete.
+ * @err: 0 on success or negative error code. Valid when @complete is called.
+ *
+ * The remaining fields are private to brickpi3_i2c_submit().
+ */
+struct brickpi3_i2c_request {
+	u8 address;
+	enum brickpi3_input_port port;
+	u8 i2c_addr;
+	const u8 *write_buf;
+	u8 write_size;
+	u8 *read_buf;
+	u8 read_size;
+	void (*complete)(struct brickpi3_i2c_request *req);
+	void *context;
+	int err;
+	/* private */
+	struct brickpi3 *bp;
+	struct hrtimer timer;
+	struct work_struct work;
+	struct brickpi3_sensor_reading reading;
+	ktime_t start;
+	unsigned int delay_us;
+};
+
+void brickpi3_begin_batch(struct brickpi3 *bp);
+int brickpi3_end_batch(struct brickpi3 *bp);
+int brickpi3_queue_read(struct brickpi3 *bp, u8 address,
+			enum brickpi3_message msg, size_t len,
+			void (*complete)(void *context, const u8 *data, int err),
+			void *context);
+int brickpi3_queue_read_motor(struct brickpi3 *bp, u8 address,
+			      enum brickpi3_output_port port,
+			      struct brickpi3_motor_reading *reading);
+int brickpi3_queue_read_sensor(struct brickpi3 *bp, u8 address,
+			       enum brickpi3_input_port port,
+			       struct brickpi3_sensor_reading *reading);
 int brickpi3_write_u8(struct brickpi3 *bp, u8 address,
 		      enum brickpi3_message msg, u8 value);
 int brickpi3_write_u8_u8(struct brickpi3 *bp, u8 address,
@@ -206,6 +295,7 @@ int brickpi3_set_sensor_i2c(struct brickpi3 *bp, u8 address,
 			    enum brickpi3_input_port port,
 			    enum brickpi3_i2c_flags flags,
 			    u8 speed);
+int brickpi3_i2c_submit(struct brickpi3 *bp, struct brickpi3_i2c_request *req);
 int brickpi3_i2c_transact(struct brickpi3 *bp, u8 address,
 			  enum brickpi3_input_port port, u8 addr, u8 *write_buf,
 			  u8 write_size, u8 *read_buf, u8 read_size);
@@ -216,6 +306,25 @@ int brickpi3_read_motor(struct brickpi3 *bp, u8 address,
 			enum brickpi3_output_port port,
 			enum brickpi3_motor_status *status,
 			int *duty_cycle, int *position, int *speed);
+void brickpi3_record_run_to_pos(struct brickpi3 *bp, u64 move_ns, u64 lag_ns,
+				unsigned int polls);
+
+int brickpi3_cache_read_motor(struct brickpi3_cache *cache,
+			      enum brickpi3_output_port port,
+			      enum brickpi3_motor_status *status,
+			      int *duty_cycle, int *position, int *speed,
+			      bool read_through);
+void brickpi3_cache_invalidate_motor(struct brickpi3_cache *cache,
+				     enum brickpi3_output_port port);
+void brickpi3_cache_begin_command(struct brickpi3_cache *cache,
+				  enum brickpi3_output_port port);
+void brickpi3_cache_end_command(struct brickpi3_cache *cache,
+				enum brickpi3_output_port port);
+void brickpi3_cache_set_sensor_poll(struct brickpi3_cache *cache,
+				    enum brickpi3_input_port port,
+				    unsigned int poll_ms,
+				    brickpi3_sensor_poll_func_t poll,
+				    void *context);
 
 static inline int brickpi3_set_sensor_type(struct brickpi3 *bp, u8 address,
 					   enum brickpi3_input_port port,
@@ -268,10 +377,18 @@ static inline int brickpi3_run_to_position(struct brickpi3 *bp, u8 address,
 }
 
 int devm_brickpi3_register_board(struct device *dev, struct brickpi3 *bp, u8 address);
-int devm_brickpi3_register_i2c(struct device *dev, struct brickpi3 *bp, u8 address);
+int devm_brickpi3_register_i2c(struct device *dev, struct brickpi3 *bp, u8 address,
+			       struct i2c_adapter *adap[NUM_BRICKPI3_INPUT_PORTS]);
 int devm_brickpi3_register_iio(struct device *dev, struct brickpi3 *bp, u8 address);
 int devm_brickpi3_register_leds(struct device *dev, struct brickpi3 *bp, u8 address);
-int devm_brickpi3_register_in_ports(struct device *dev, struct brickpi3 *bp, u8 address);
-int devm_brickpi3_register_out_ports(struct device *dev, struct brickpi3 *bp, u8 address);
+int devm_brickpi3_register_in_ports(struct device *dev, struct brickpi3 *bp,
+				    struct brickpi3_cache *cache,
+				    struct i2c_adapter *i2c_adap[NUM_BRICKPI3_INPUT_PORTS],
+				    u8 address);
+int devm_brickpi3_register_out_ports(struct device *dev, struct brickpi3 *bp,
+				     struct brickpi3_cache *cache, u8 address);
+struct brickpi3_cache *devm_brickpi3_register_cache(struct device *dev,
+						    struct brickpi3 *bp,
+						    u8 address);
 
 #endif /* _BRICKPI3_H_ */
@@ -0,0 +1,435 @@
+/*
+ * Dexter Industries BrickPi3 state cache
+ *
+ * Copyright (C) 2026 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * DOC: userspace
+ *
+ * The state of all motors is read from each BrickPi3 at a fixed rate, all in
+ * one SPI transaction. Input ports that have a sensor attached are polled in
+ * the same transaction, every time that their ``poll_ms`` has elapsed.
+ * Reading motor attributes such as ``position`` or ``speed`` is served from
+ * this snapshot, so the amount of traffic on the SPI bus does not depend on
+ * how often userspace reads attributes. If the snapshot
+ * is older than ``cache_max_age_ms`` (for example, right after a new command
+ * was sent to a motor), the value is read from the BrickPi3 instead.
+ *
+ * .. flat-table:: Module Parameters
+ *    :widths: 1 5
+ *
+ *    * - ``cache_refresh_ms``
+ *      - The period of the snapshot in milliseconds. Values are limited to
+ *        1 to 1000. The ``poll_ms`` of sensors is rounded up to a multiple of
+ *        this when ``poll_ms`` is set. Default is 10 msec.
+ *
+ *    * - ``cache_max_age_ms``
+ *      - The oldest snapshot, in milliseconds, that will be used. Default is
+ *        20 msec.
+ *
+ *    * - ``cache_read_through``
+ *      - Setting to ``Y`` disables the snapshot of the motors. Every read goes
+ *        to the BrickPi3, which is how the driver behaved before the snapshot
+ *        was added. Sensors are still polled. Default is ``N``.
+ *
+ * .. note:: These parameters can be changed at runtime by writing to
+ *    ``/sys/module/brickpi3/parameters/<parameter>``.
+ */
+
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "brickpi3.h"
+
+#define BRICKPI3_CACHE_MIN_REFRESH_MS	1
+#define BRICKPI3_CACHE_MAX_REFRESH_MS	1000
+
+static unsigned int cache_refresh_ms = 10;
+module_param(cache_refresh_ms, uint, 0644);
+MODULE_PARM_DESC(cache_refresh_ms, "State snapshot period in milliseconds.");
+static unsigned int cache_max_age_ms = 20;
+module_param(cache_max_age_ms, uint, 0644);
+MODULE_PARM_DESC(cache_max_age_ms, "Oldest snapshot that is used, in milliseconds.");
+static bool cache_read_through;
+module_param(cache_read_through, bool, 0644);
+MODULE_PARM_DESC(cache_read_through, "Always read state from the BrickPi3.");
+
+/**
+ * struct brickpi3_cache - snapshot of the state of one BrickPi3
+ *
+ * @bp: The private driver data
+ * @address: The BrickPi3 address
+ * @lock: Protects all of the fields below
+ * @tick: Number of refreshes so far.
+ * @motor_valid: Bit mask of motors that have a usable reading.
+ * @motor_gen: Incremented by brickpi3_cache_invalidate_motor() so that a
+ *	refresh that was already on the bus does not store the old state.
+ * @motor_queued: Bit mask of motors that have commands waiting in a batch.
+ *	Their readings are not stored, see brickpi3_cache_begin_command().
+ * @command: Context of the completion that ends brickpi3_cache_end_command().
+ * @motor: The last motor readings.
+ * @motor_stamp: When each motor reading was taken.
+ * @sensor_poll_div: Each input port is polled on every Nth refresh, where N
+ *	is this value, or 0 if the port is not polled.
+ * @sensor_poll: Called with each new sensor reading.
+ * @sensor_context: Passed to @sensor_poll.
+ * @refresh_timer: Schedules @refresh_work.
+ * @refresh_work: Reads the state from the BrickPi3.
+ */
+struct brickpi3_cache_command {
+	struct brickpi3_cache *cache;
+	enum brickpi3_output_port port;
+};
+
+struct brickpi3_cache {
+	struct brickpi3 *bp;
+	u8 address;
+	spinlock_t lock;
+	unsigned long tick;
+	unsigned long motor_valid;
+	unsigned int motor_gen[NUM_BRICKPI3_OUTPUT_PORTS];
+	unsigned long motor_queued;
+	struct brickpi3_cache_command command[NUM_BRICKPI3_OUTPUT_PORTS];
+	struct brickpi3_motor_reading motor[NUM_BRICKPI3_OUTPUT_PORTS];
+	ktime_t motor_stamp[NUM_BRICKPI3_OUTPUT_PORTS];
+	unsigned int sensor_poll_div[NUM_BRICKPI3_INPUT_PORTS];
+	brickpi3_sensor_poll_func_t sensor_poll[NUM_BRICKPI3_INPUT_PORTS];
+	void *sensor_context[NUM_BRICKPI3_INPUT_PORTS];
+	struct hrtimer refresh_timer;
+	struct work_struct refresh_work;
+};
+
+static unsigned int brickpi3_cache_refresh_ms(void)
+{
+	return clamp_t(unsigned int, READ_ONCE(cache_refresh_ms),
+		       BRICKPI3_CACHE_MIN_REFRESH_MS,
+		       BRICKPI3_CACHE_MAX_REFRESH_MS);
+}
+
+static bool brickpi3_cache_fresh(ktime_t stamp, ktime_t now)
+{
+	return ktime_ms_delta(now, stamp) <= READ_ONCE(cache_max_age_ms);
+}
+
+/*
+ * Input ports are polled on every Nth refresh, counted from the same tick, so
+ * that ports with the same or related periods are read in the same batch.
+ */
+static void brickpi3_cache_refresh_work(struct work_struct *work)
+{
+	struct brickpi3_cache *cache =
+		container_of(work, struct brickpi3_cache, refresh_work);
+	struct brickpi3_motor_reading motor[NUM_BRICKPI3_OUTPUT_PORTS];
+	struct brickpi3_sensor_reading sensor[NUM_BRICKPI3_INPUT_PORTS];
+	brickpi3_sensor_poll_func_t poll[NUM_BRICKPI3_INPUT_PORTS];
+	void *context[NUM_BRICKPI3_INPUT_PORTS];
+	unsigned int gen[NUM_BRICKPI3_OUTPUT_PORTS];
+	bool read_through = READ_ONCE(cache_read_through);
+	unsigned long due = 0;
+	ktime_t now;
+	int i;
+
+	spin_lock(&cache->lock);
+	memcpy(gen, cache->motor_gen, sizeof(gen));
+	for (i = 0; i < NUM_BRICKPI3_INPUT_PORTS; i++) {
+		unsigned int div = cache->sensor_poll_div[i];
+
+		if (!div || cache->tick % div)
+			continue;
+		due |= BIT(i);
+		poll[i] = cache->sensor_poll[i];
+		context[i] = cache->sensor_context[i];
+	}
+	cache->tick++;
+	spin_unlock(&cache->lock);
+
+	if (read_through && !due)
+		return;
+
+	/*
+	 * The readings are filled in by the last brickpi3_end_batch(), so they
+	 * can live on the stack.
+	 */
+	brickpi3_begin_batch(cache->bp);
+	for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS && !read_through; i++) {
+		motor[i].err = -EAGAIN;
+		brickpi3_queue_read_motor(cache->bp, cache->address, i,
+					  &motor[i]);
+	}
+	for (i = 0; i < NUM_BRICKPI3_INPUT_PORTS; i++) {
+		sensor[i].err = -EAGAIN;
+		if (due & BIT(i))
+			brickpi3_queue_read_sensor(cache->bp, cache->address, i,
+						   &sensor[i]);
+	}
+	brickpi3_end_batch(cache->bp);
+
+	if (!read_through) {
+		now = ktime_get();
+
+		spin_lock(&cache->lock);
+		for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS; i++) {
+			if (motor[i].err || gen[i] != cache->motor_gen[i]
+			    || (cache->motor_queued & BIT(i)))
+				continue;
+			cache->motor[i] = motor[i];
+			cache->motor_stamp[i] = now;
+			cache->motor_valid |= BIT(i);
+		}
+		spin_unlock(&cache->lock);
+	}
+
+	for (i = 0; i < NUM_BRICKPI3_INPUT_PORTS; i++) {
+		if (due & BIT(i))
+			poll[i](context[i], &sensor[i]);
+	}
+}
+
+static enum hrtimer_restart brickpi3_cache_refresh_timer_function(struct hrtimer *timer)
+{
+	struct brickpi3_cache *cache =
+		container_of(timer, struct brickpi3_cache, refresh_timer);
+
+	hrtimer_forward_now(timer, ms_to_ktime(brickpi3_cache_refresh_ms()));
+	schedule_work(&cache->refresh_work);
+
+	return HRTIMER_RESTART;
+}
+
+/**
+ * brickpi3_cache_read_motor - get the motor state from the snapshot
+ *
+ * @cache: The snapshot for the BrickPi3
+ * @port: The output port
+ * @status: The current motor status flags (optional)
+ * @duty_cycle: The current duty cycle in percent (optional)
+ * @position: The current position in degrees (optional)
+ * @speed: The current speed in degrees per second (optional)
+ * @read_through: If true, the snapshot is not used. The state is read from the
+ *	BrickPi3 and the snapshot is updated with it.
+ *
+ * This works like brickpi3_read_motor(), except that the state is taken from
+ * the snapshot when it is recent enough.
+ *
+ * Returns 0 on success or negative error code.
+ */
+int brickpi3_cache_read_motor(struct brickpi3_cache *cache,
+			      enum brickpi3_output_port port,
+			      enum brickpi3_motor_status *status,
+			      int *duty_cycle, int *position, int *speed,
+			      bool read_through)
+{
+	struct brickpi3_motor_reading reading;
+	unsigned int gen;
+	ktime_t now;
+	int ret;
+
+	if (READ_ONCE(cache_read_through))
+		read_through = true;
+
+	now = ktime_get();
+
+	spin_lock(&cache->lock);
+	if (!read_through && (cache->motor_valid & BIT(port)) &&
+	    brickpi3_cache_fresh(cache->motor_stamp[port], now)) {
+		reading = cache->motor[port];
+		spin_unlock(&cache->lock);
+		goto out;
+	}
+	gen = cache->motor_gen[port];
+	spin_unlock(&cache->lock);
+
+	ret = brickpi3_read_motor(cache->bp, cache->address, port,
+				  &reading.status, &reading.duty_cycle,
+				  &reading.position, &reading.speed);
+	if (ret < 0)
+		return ret;
+
+	spin_lock(&cache->lock);
+	if (gen == cache->motor_gen[port] &&
+	    !(cache->motor_queued & BIT(port))) {
+		cache->motor[port] = reading;
+		cache->motor[port].err = 0;
+		cache->motor_stamp[port] = ktime_get();
+		cache->motor_valid |= BIT(port);
+	}
+	spin_unlock(&cache->lock);
+
+out:
+	if (status)
+		*status = reading.status;
+	if (duty_cycle)
+		*duty_cycle = reading.duty_cycle;
+	if (position)
+		*position = reading.position;
+	if (speed)
+		*speed = reading.speed;
+
+	return 0;
+}
+
+/**
+ * brickpi3_cache_invalidate_motor - discard the snapshot of a motor
+ *
+ * @cache: The snapshot for the BrickPi3
+ * @port: The output port
+ *
+ * Must be called after sending a command that changes the state of the motor
+ * so that the next read does not return the state from before the command.
+ */
+void brickpi3_cache_invalidate_motor(struct brickpi3_cache *cache,
+				     enum brickpi3_output_port port)
+{
+	spin_lock(&cache->lock);
+	cache->motor_gen[port]++;
+	cache->motor_valid &= ~BIT(port);
+	spin_unlock(&cache->lock);
+}
+
+/**
+ * brickpi3_cache_begin_command - stop storing readings of a motor
+ *
+ * @cache: The snapshot for the BrickPi3
+ * @port: The output port
+ *
+ * Must be called before queuing commands for the motor in a batch. Until the
+ * batch is sent, any reading of the motor is from before the commands, so
+ * readings are not stored until brickpi3_cache_end_command() has finished.
+ */
+void brickpi3_cache_begin_command(struct brickpi3_cache *cache,
+				  enum brickpi3_output_port port)
+{
+	spin_lock(&cache->lock);
+	cache->motor_queued |= BIT(port);
+	cache->motor_gen[port]++;
+	cache->motor_valid &= ~BIT(port);
+	spin_unlock(&cache->lock);
+}
+
+static void brickpi3_cache_command_complete(void *context, const u8 *data,
+					    int err)
+{
+	struct brickpi3_cache_command *command = context;
+	struct brickpi3_cache *cache = command->cache;
+
+	spin_lock(&cache->lock);
+	cache->motor_queued &= ~BIT(command->port);
+	cache->motor_gen[command->port]++;
+	cache->motor_valid &= ~BIT(command->port);
+	spin_unlock(&cache->lock);
+}
+
+/**
+ * brickpi3_cache_end_command - start storing readings of a motor again
+ *
+ * @cache: The snapshot for the BrickPi3
+ * @port: The output port
+ *
+ * Must be called before the brickpi3_end_batch() that matches the
+ * brickpi3_begin_batch() of brickpi3_cache_begin_command(). A read of the
+ * motor is queued after the commands, so that readings are stored again only
+ * once the last brickpi3_end_batch() has sent them. Anything read in between
+ * is discarded.
+ */
+void brickpi3_cache_end_command(struct brickpi3_cache *cache,
+				enum brickpi3_output_port port)
+{
+	int ret;
+
+	ret = brickpi3_queue_read(cache->bp, cache->address,
+				  BRICKPI3_MSG_GET_MOTOR_STATUS + port, 0,
+				  brickpi3_cache_command_complete,
+				  &cache->command[port]);
+	if (ret < 0)
+		brickpi3_cache_command_complete(&cache->command[port], NULL,
+						ret);
+}
+
+/**
+ * brickpi3_cache_set_sensor_poll - set how often an input port is polled
+ *
+ * @cache: The snapshot for the BrickPi3
+ * @port: The input port index
+ * @poll_ms: The polling period in milliseconds or 0 to stop polling. It is
+ *	rounded up to a multiple of the refresh period at the time of the call.
+ * @poll: Called from a workqueue with each new reading. The reading has not
+ *	been checked, so reading->err, type and state must be checked.
+ * @context: Passed to @poll.
+ *
+ * The port is read as part of the refresh, in the same SPI transaction as the
+ * rest of the board. When polling is stopped, this waits for a @poll callback
+ * that is already running to return, so it must not be called from @poll.
+ */
+void brickpi3_cache_set_sensor_poll(struct brickpi3_cache *cache,
+				    enum brickpi3_input_port port,
+				    unsigned int poll_ms,
+				    brickpi3_sensor_poll_func_t poll,
+				    void *context)
+{
+	unsigned int div = 0;
+
+	if (poll && poll_ms)
+		div = max(1U, DIV_ROUND_UP(poll_ms, brickpi3_cache_refresh_ms()));
+
+	spin_lock(&cache->lock);
+	cache->sensor_poll_div[port] = div;
+	cache->sensor_poll[port] = poll;
+	cache->sensor_context[port] = context;
+	spin_unlock(&cache->lock);
+
+	if (!div)
+		flush_work(&cache->refresh_work);
+}
+
+static void brickpi3_cache_release(struct device *dev, void *res)
+{
+	struct brickpi3_cache *cache = res;
+
+	hrtimer_cancel(&cache->refresh_timer);
+	cancel_work_sync(&cache->refresh_work);
+}
+
+struct brickpi3_cache *devm_brickpi3_register_cache(struct device *dev,
+						    struct brickpi3 *bp,
+						    u8 address)
+{
+	struct brickpi3_cache *cache;
+	int i;
+
+	cache = devres_alloc(brickpi3_cache_release, sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return ERR_PTR(-ENOMEM);
+
+	cache->bp = bp;
+	cache->address = address;
+	for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS; i++) {
+		cache->command[i].cache = cache;
+		cache->command[i].port = i;
+	}
+	spin_lock_init(&cache->lock);
+	INIT_WORK(&cache->refresh_work, brickpi3_cache_refresh_work);
+	hrtimer_init(&cache->refresh_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	cache->refresh_timer.function = brickpi3_cache_refresh_timer_function;
+
+	devres_add(dev, cache);
+
+	hrtimer_start(&cache->refresh_timer,
+		      ms_to_ktime(brickpi3_cache_refresh_ms()),
+		      HRTIMER_MODE_REL);
+
+	return cache;
+}
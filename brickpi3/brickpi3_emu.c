@@ -0,0 +1,675 @@
+/*
+ * Dexter Industries BrickPi3 emulator
+ *
+ * Copyright (C) 2026 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * DOC: userspace
+ *
+ * The ``brickpi3_emu`` module is an SPI controller that answers the messages
+ * of the BrickPi3 firmware, so that the ``brickpi3`` driver can be used
+ * without any hardware, for example for testing and benchmarking. When it is
+ * loaded, it registers a new SPI bus with one ``brickpi3`` device on it, which
+ * the ``brickpi3`` driver then probes like a real one.
+ *
+ * Each emulated board has four motors and four input ports. The motors are a
+ * first order model of a motor with a top speed of 1000 degrees per second.
+ * Setting the power, the speed and the position, the limits and the encoder
+ * offset work like on the real firmware. Sensors report made up data that
+ * changes over time (a touch sensor is pressed every other second and other
+ * sensors count from 0 to 100 every 10 seconds). Each input port also has an
+ * I2C device that acts like a memory with 256 registers. The first register
+ * that is written selects the register to read or write, and the ID registers
+ * are set up like a LEGO NXT Ultrasonic sensor.
+ *
+ * .. flat-table:: Module Parameters
+ *    :widths: 1 5
+ *
+ *    * - ``boards``
+ *      - The number of boards in the stack, 1 to 4. Default is 1.
+ *
+ *    * - ``spi_speed_hz``
+ *      - The speed of the emulated SPI bus. Each message takes as long as it
+ *        would take to send it at this speed. 0 makes messages take no time.
+ *        Default is 500000.
+ *
+ *    * - ``response_delay_us``
+ *      - Extra time taken by each message, in microseconds. Default is 0.
+ *
+ *    * - ``sensor_config_ms``
+ *      - How long the input port reports that it is configuring after the
+ *        sensor type has been changed, in milliseconds. Default is 100.
+ *
+ *    * - ``i2c_byte_us``
+ *      - How long each byte of an I2C transaction takes, in microseconds.
+ *        Default is 1000.
+ *
+ * .. note:: All parameters except ``boards`` can be changed at runtime by
+ *    writing to ``/sys/module/brickpi3_emu/parameters/<parameter>``.
+ */
+
+#include <linux/delay.h>
+#include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/spi/spi.h>
+#include <linux/string.h>
+
+#include "brickpi3.h"
+
+#define BRICKPI3_EMU_NAME		"brickpi3_emu"
+#define BRICKPI3_EMU_MAX_BOARDS		4
+#define BRICKPI3_EMU_HEADER_SIZE	4
+#define BRICKPI3_EMU_MAX_MSG_SIZE	32
+
+#define BRICKPI3_EMU_HW_VERSION		3002001
+#define BRICKPI3_EMU_FW_VERSION		1004000
+
+/* motor model */
+#define BRICKPI3_EMU_MAX_DPS		1000
+#define BRICKPI3_EMU_TAU_MS		50
+#define BRICKPI3_EMU_COAST_FACTOR	10
+/* position regulator gain in 1/s */
+#define BRICKPI3_EMU_POSITION_KP	10
+/* longest time that is simulated in one go */
+#define BRICKPI3_EMU_MAX_STEPS		1000
+
+#define BRICKPI3_EMU_MOTOR_FLOAT	(-128)
+
+static unsigned int boards = 1;
+module_param(boards, uint, 0444);
+MODULE_PARM_DESC(boards, "Number of emulated boards.");
+static unsigned int spi_speed_hz = 500000;
+module_param(spi_speed_hz, uint, 0644);
+MODULE_PARM_DESC(spi_speed_hz, "Emulated SPI bus speed. 0 for no delay.");
+static unsigned int response_delay_us;
+module_param(response_delay_us, uint, 0644);
+MODULE_PARM_DESC(response_delay_us, "Extra delay for each message in microseconds.");
+static unsigned int sensor_config_ms = 100;
+module_param(sensor_config_ms, uint, 0644);
+MODULE_PARM_DESC(sensor_config_ms, "Time to configure a sensor in milliseconds.");
+static unsigned int i2c_byte_us = 1000;
+module_param(i2c_byte_us, uint, 0644);
+MODULE_PARM_DESC(i2c_byte_us, "Time for each I2C byte in microseconds.");
+
+enum brickpi3_emu_motor_mode {
+	BRICKPI3_EMU_MOTOR_POWER,
+	BRICKPI3_EMU_MOTOR_DPS,
+	BRICKPI3_EMU_MOTOR_POSITION,
+};
+
+/**
+ * struct brickpi3_emu_motor - state of one emulated motor
+ *
+ * @mode: What the motor was last told to do
+ * @power: The duty cycle in percent for BRICKPI3_EMU_MOTOR_POWER or
+ *	BRICKPI3_EMU_MOTOR_FLOAT
+ * @dps_sp: The speed setpoint in degrees per second
+ * @position_sp: The position setpoint in degrees, without the offset
+ * @power_limit: The maximum duty cycle in percent or 0 for no limit
+ * @dps_limit: The maximum speed in degrees per second or 0 for no limit
+ * @offset: Subtracted from the position that is reported
+ * @position: The position in micro-degrees
+ * @speed: The speed in milli-degrees per second
+ * @duty_cycle: The duty cycle that is reported
+ */
+struct brickpi3_emu_motor {
+	enum brickpi3_emu_motor_mode mode;
+	int power;
+	int dps_sp;
+	s32 position_sp;
+	int power_limit;
+	int dps_limit;
+	s32 offset;
+	s64 position;
+	int speed;
+	int duty_cycle;
+};
+
+/**
+ * struct brickpi3_emu_sensor - state of one emulated input port
+ *
+ * @type: enum brickpi3_sensor_type
+ * @configured: When the sensor type was set
+ * @i2c_regs: The registers of the emulated I2C device
+ * @i2c_reg: The register that is read next
+ * @i2c_data: The data read by the last I2C transaction
+ * @i2c_read_size: The number of bytes in @i2c_data
+ * @i2c_done: When the last I2C transaction finishes
+ */
+struct brickpi3_emu_sensor {
+	u8 type;
+	ktime_t configured;
+	u8 i2c_regs[256];
+	u8 i2c_reg;
+	u8 i2c_data[BRICKPI3_I2C_MAX_READ_SIZE];
+	u8 i2c_read_size;
+	ktime_t i2c_done;
+};
+
+struct brickpi3_emu_board {
+	u8 address;
+	u8 id[BRICKPI3_ID_MSG_SIZE];
+	u8 led;
+	ktime_t start;
+	ktime_t last_update;
+	struct brickpi3_emu_motor motor[NUM_BRICKPI3_OUTPUT_PORTS];
+	struct brickpi3_emu_sensor sensor[NUM_BRICKPI3_INPUT_PORTS];
+};
+
+struct brickpi3_emu {
+	struct spi_device *spi;
+	unsigned int num_boards;
+	struct brickpi3_emu_board board[BRICKPI3_EMU_MAX_BOARDS];
+};
+
+static struct device *brickpi3_emu_parent;
+static struct spi_master *brickpi3_emu_master;
+
+static void brickpi3_emu_put(u8 *data, int size, int offset, int bytes,
+			     u32 value)
+{
+	int i;
+
+	/* big endian, like the real firmware */
+	for (i = 0; i < bytes && offset + i < size; i++)
+		data[offset + i] = value >> (8 * (bytes - 1 - i));
+}
+
+static u32 brickpi3_emu_get(const u8 *data, int bytes)
+{
+	u32 value = 0;
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		value = (value << 8) | data[i];
+
+	return value;
+}
+
+/* Steps the motor model one millisecond. */
+static void brickpi3_emu_motor_step(struct brickpi3_emu_motor *motor)
+{
+	int target, limit, tau = BRICKPI3_EMU_TAU_MS;
+	s64 error;
+
+	switch (motor->mode) {
+	case BRICKPI3_EMU_MOTOR_DPS:
+		target = motor->dps_sp * 1000;
+		break;
+	case BRICKPI3_EMU_MOTOR_POSITION:
+		error = (s64)motor->position_sp * 1000000 - motor->position;
+		target = clamp_t(s64, div_s64(error * BRICKPI3_EMU_POSITION_KP,
+					      1000),
+				 -BRICKPI3_EMU_MAX_DPS * 1000,
+				 BRICKPI3_EMU_MAX_DPS * 1000);
+		break;
+	default:
+		if (motor->power == BRICKPI3_EMU_MOTOR_FLOAT) {
+			target = 0;
+			tau *= BRICKPI3_EMU_COAST_FACTOR;
+		} else {
+			target = motor->power * BRICKPI3_EMU_MAX_DPS * 10;
+		}
+		break;
+	}
+
+	if (motor->mode != BRICKPI3_EMU_MOTOR_POWER) {
+		limit = BRICKPI3_EMU_MAX_DPS * 1000;
+		if (motor->dps_limit)
+			limit = min(limit, motor->dps_limit * 1000);
+		if (motor->power_limit)
+			limit = min(limit, motor->power_limit *
+					   BRICKPI3_EMU_MAX_DPS * 10);
+		target = clamp(target, -limit, limit);
+		motor->duty_cycle = target / (BRICKPI3_EMU_MAX_DPS * 10);
+	} else if (motor->power == BRICKPI3_EMU_MOTOR_FLOAT) {
+		motor->duty_cycle = BRICKPI3_EMU_MOTOR_FLOAT;
+	} else {
+		motor->duty_cycle = motor->power;
+	}
+
+	motor->speed += (target - motor->speed) / tau;
+	/* milli-degrees per second times one millisecond is micro-degrees */
+	motor->position += motor->speed;
+}
+
+static void brickpi3_emu_update(struct brickpi3_emu_board *board, ktime_t now)
+{
+	s64 steps = ktime_ms_delta(now, board->last_update);
+	int i;
+
+	if (steps <= 0)
+		return;
+
+	if (steps > BRICKPI3_EMU_MAX_STEPS) {
+		/* nobody was looking, so it does not matter what happened */
+		board->last_update = ktime_sub(now,
+						ms_to_ktime(BRICKPI3_EMU_MAX_STEPS));
+		steps = BRICKPI3_EMU_MAX_STEPS;
+	}
+	board->last_update = ktime_add_ms(board->last_update, steps);
+
+	while (steps--) {
+		for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS; i++)
+			brickpi3_emu_motor_step(&board->motor[i]);
+	}
+}
+
+static s32 brickpi3_emu_motor_position(struct brickpi3_emu_motor *motor)
+{
+	return (s32)div_s64(motor->position, 1000000) - motor->offset;
+}
+
+static void brickpi3_emu_set_motor(struct brickpi3_emu_board *board,
+				   const u8 *req, int len)
+{
+	struct brickpi3_emu_motor *motor;
+	int i;
+
+	for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS; i++) {
+		if (!(req[2] & BIT(i)))
+			continue;
+		motor = &board->motor[i];
+
+		switch (req[1]) {
+		case BRICKPI3_MSG_SET_MOTOR_POWER:
+			motor->mode = BRICKPI3_EMU_MOTOR_POWER;
+			motor->power = (s8)req[3];
+			break;
+		case BRICKPI3_MSG_SET_MOTOR_POSITION:
+			motor->mode = BRICKPI3_EMU_MOTOR_POSITION;
+			motor->position_sp = (s32)brickpi3_emu_get(&req[3], 4) +
+					     motor->offset;
+			break;
+		case BRICKPI3_MSG_SET_MOTOR_DPS:
+			motor->mode = BRICKPI3_EMU_MOTOR_DPS;
+			motor->dps_sp = (s16)brickpi3_emu_get(&req[3], 2);
+			break;
+		case BRICKPI3_MSG_SET_MOTOR_LIMITS:
+			motor->power_limit = req[3];
+			motor->dps_limit = brickpi3_emu_get(&req[4], 2);
+			break;
+		case BRICKPI3_MSG_OFFSET_MOTOR_ENCODER:
+			motor->offset += (s32)brickpi3_emu_get(&req[3], 4);
+			break;
+		}
+	}
+}
+
+static void brickpi3_emu_get_motor(struct brickpi3_emu_motor *motor,
+				   u8 *data, int size)
+{
+	u8 status = 0;
+
+	/* pushing as hard as allowed and not getting anywhere */
+	if (motor->mode != BRICKPI3_EMU_MOTOR_POWER &&
+	    abs(motor->duty_cycle) >= (motor->power_limit ?: 100) &&
+	    abs(motor->speed) < 10000)
+		status |= BRICKPI3_MOTOR_STATUS_OVERLOADED;
+
+	brickpi3_emu_put(data, size, 0, 1, status);
+	brickpi3_emu_put(data, size, 1, 1, (u8)motor->duty_cycle);
+	brickpi3_emu_put(data, size, 2, 4, brickpi3_emu_motor_position(motor));
+	brickpi3_emu_put(data, size, 6, 2, motor->speed / 1000);
+}
+
+static void brickpi3_emu_set_sensor_type(struct brickpi3_emu_board *board,
+					 const u8 *req, ktime_t now)
+{
+	int i;
+
+	for (i = 0; i < NUM_BRICKPI3_INPUT_PORTS; i++) {
+		if (!(req[2] & BIT(i)))
+			continue;
+		board->sensor[i].type = req[3];
+		board->sensor[i].configured = now;
+		board->sensor[i].i2c_read_size = 0;
+	}
+}
+
+static void brickpi3_emu_i2c_transact(struct brickpi3_emu_sensor *sensor,
+				      const u8 *req, int len, ktime_t now)
+{
+	u8 read_size = min_t(u8, req[3], BRICKPI3_I2C_MAX_READ_SIZE);
+	u8 write_size = min_t(u8, req[4], len - 5);
+	int i;
+
+	if (write_size) {
+		sensor->i2c_reg = req[5];
+		for (i = 1; i < write_size; i++)
+			sensor->i2c_regs[sensor->i2c_reg++] = req[5 + i];
+	}
+	for (i = 0; i < read_size; i++)
+		sensor->i2c_data[i] = sensor->i2c_regs[sensor->i2c_reg++];
+
+	sensor->i2c_read_size = read_size;
+	/* the address byte is sent too */
+	sensor->i2c_done = ktime_add_us(now, (write_size + read_size + 1) *
+					     READ_ONCE(i2c_byte_us));
+}
+
+static void brickpi3_emu_get_sensor(struct brickpi3_emu_board *board,
+				    struct brickpi3_emu_sensor *sensor,
+				    u8 *data, int size, ktime_t now)
+{
+	s64 ms = ktime_ms_delta(now, board->start);
+	u32 value = div_s64(ms, 100) % 101;
+	u8 state = BRICKPI3_SENSOR_STATE_VALID_DATA;
+	u8 *payload = data + 2;
+	int i;
+
+	size -= 2;
+
+	if (sensor->type == BRICKPI3_SENSOR_TYPE_NONE)
+		state = BRICKPI3_SENSOR_STATE_NOT_CONFIGURED;
+	else if (ktime_ms_delta(now, sensor->configured) <
+		 READ_ONCE(sensor_config_ms))
+		state = BRICKPI3_SENSOR_STATE_CONFIGURING;
+	else if (sensor->type == BRICKPI3_SENSOR_TYPE_I2C &&
+		 (!sensor->i2c_read_size ||
+		  ktime_compare(now, sensor->i2c_done) < 0))
+		state = BRICKPI3_SENSOR_STATE_NO_DATA;
+
+	brickpi3_emu_put(data, size + 2, 0, 1, sensor->type);
+	brickpi3_emu_put(data, size + 2, 1, 1, state);
+
+	if (state != BRICKPI3_SENSOR_STATE_VALID_DATA)
+		return;
+
+	switch (sensor->type) {
+	case BRICKPI3_SENSOR_TYPE_I2C:
+		for (i = 0; i < sensor->i2c_read_size && i < size; i++)
+			payload[i] = sensor->i2c_data[i];
+		break;
+	case BRICKPI3_SENSOR_TYPE_CUSTOM:
+		/* 12-bit ADC reading of pin 1 */
+		brickpi3_emu_put(payload, size, 2, 2, value * 4095 / 100);
+		break;
+	case BRICKPI3_SENSOR_TYPE_TOUCH:
+	case BRICKPI3_SENSOR_TYPE_NXT_TOUCH:
+	case BRICKPI3_SENSOR_TYPE_EV3_TOUCH:
+		brickpi3_emu_put(payload, size, 0, 1, div_s64(ms, 1000) & 1);
+		break;
+	case BRICKPI3_SENSOR_TYPE_EV3_GYRO_ABS:
+	case BRICKPI3_SENSOR_TYPE_EV3_GYRO_DPS:
+	case BRICKPI3_SENSOR_TYPE_EV3_ULTRASONIC_CM:
+	case BRICKPI3_SENSOR_TYPE_EV3_ULTRASONIC_INCHES:
+		brickpi3_emu_put(payload, size, 0, 2, value);
+		break;
+	case BRICKPI3_SENSOR_TYPE_EV3_GYRO_ABS_DPS:
+		brickpi3_emu_put(payload, size, 0, 2, value);
+		brickpi3_emu_put(payload, size, 2, 2, value);
+		break;
+	case BRICKPI3_SENSOR_TYPE_EV3_COLOR_RAW_REFLECTED:
+	case BRICKPI3_SENSOR_TYPE_EV3_COLOR_COLOR_COMPONENTS:
+	case BRICKPI3_SENSOR_TYPE_EV3_INFRARED_SEEK:
+		for (i = 0; i < 4; i++)
+			brickpi3_emu_put(payload, size, 2 * i, 2, value);
+		break;
+	default:
+		brickpi3_emu_put(payload, size, 0, 1, value);
+		break;
+	}
+}
+
+/*
+ * Handles one message. The reply is written to rx, which is usually the same
+ * buffer as tx.
+ */
+static void brickpi3_emu_message(struct brickpi3_emu *emu, const u8 *tx,
+				 u8 *rx, int len)
+{
+	u8 req[BRICKPI3_EMU_MAX_MSG_SIZE] = { 0 };
+	struct brickpi3_emu_board *board = NULL;
+	ktime_t now = ktime_get();
+	u8 *data;
+	int i, size;
+
+	if (tx)
+		memcpy(req, tx, min(len, BRICKPI3_EMU_MAX_MSG_SIZE));
+	if (!rx)
+		rx = req;
+	memset(rx, 0, len);
+
+	if (len < 2)
+		return;
+
+	/* setting the address is a broadcast that selects a board by id */
+	if (req[0] == 0 && req[1] == BRICKPI3_MSG_SET_ADDRESS) {
+		for (i = 0; i < emu->num_boards; i++) {
+			if (!memcmp(emu->board[i].id, &req[3],
+				    BRICKPI3_ID_MSG_SIZE))
+				emu->board[i].address = req[2];
+		}
+		return;
+	}
+
+	for (i = 0; i < emu->num_boards; i++) {
+		if (emu->board[i].address == req[0]) {
+			board = &emu->board[i];
+			break;
+		}
+	}
+	/* nobody answers, so the read fails like it would on real hardware */
+	if (!board)
+		return;
+
+	brickpi3_emu_update(board, now);
+
+	if (len > 3)
+		rx[3] = 0xA5;
+	data = rx + BRICKPI3_EMU_HEADER_SIZE;
+	size = max(len - BRICKPI3_EMU_HEADER_SIZE, 0);
+
+	switch (req[1]) {
+	case BRICKPI3_MSG_GET_MANUFACTURER:
+		strncpy(data, "Dexter Industries", size);
+		break;
+	case BRICKPI3_MSG_GET_NAME:
+		strncpy(data, "BrickPi3", size);
+		break;
+	case BRICKPI3_MSG_GET_HARDWARE_VERSION:
+		brickpi3_emu_put(data, size, 0, 4, BRICKPI3_EMU_HW_VERSION);
+		break;
+	case BRICKPI3_MSG_GET_FIRMWARE_VERSION:
+		brickpi3_emu_put(data, size, 0, 4, BRICKPI3_EMU_FW_VERSION);
+		break;
+	case BRICKPI3_MSG_GET_ID:
+		memcpy(data, board->id, min(size, BRICKPI3_ID_MSG_SIZE));
+		break;
+	case BRICKPI3_MSG_SET_LED:
+		board->led = req[2];
+		break;
+	case BRICKPI3_MSG_GET_VOLTAGE_3V3:
+		brickpi3_emu_put(data, size, 0, 2, 3300);
+		break;
+	case BRICKPI3_MSG_GET_VOLTAGE_5V:
+		brickpi3_emu_put(data, size, 0, 2, 5000);
+		break;
+	case BRICKPI3_MSG_GET_VOLTAGE_9V:
+		brickpi3_emu_put(data, size, 0, 2, 9000);
+		break;
+	case BRICKPI3_MSG_GET_VOLTAGE_VCC:
+		brickpi3_emu_put(data, size, 0, 2, 8000);
+		break;
+	case BRICKPI3_MSG_SET_SENSOR_TYPE:
+		brickpi3_emu_set_sensor_type(board, req, now);
+		break;
+	case BRICKPI3_MSG_GET_SENSOR_1 ... BRICKPI3_MSG_GET_SENSOR_4:
+		brickpi3_emu_get_sensor(board,
+			&board->sensor[req[1] - BRICKPI3_MSG_GET_SENSOR_1],
+			data, size, now);
+		break;
+	case BRICKPI3_MSG_I2C_TRANSACT_1 ... BRICKPI3_MSG_I2C_TRANSACT_4:
+		if (len < 5)
+			break;
+		brickpi3_emu_i2c_transact(
+			&board->sensor[req[1] - BRICKPI3_MSG_I2C_TRANSACT_1],
+			req, min(len, BRICKPI3_EMU_MAX_MSG_SIZE), now);
+		break;
+	case BRICKPI3_MSG_SET_MOTOR_POWER:
+	case BRICKPI3_MSG_SET_MOTOR_POSITION:
+	case BRICKPI3_MSG_SET_MOTOR_DPS:
+	case BRICKPI3_MSG_SET_MOTOR_LIMITS:
+	case BRICKPI3_MSG_OFFSET_MOTOR_ENCODER:
+		brickpi3_emu_set_motor(board, req, len);
+		break;
+	case BRICKPI3_MSG_GET_MOTOR_A_ENCODER ... BRICKPI3_MSG_GET_MOTOR_D_ENCODER:
+		brickpi3_emu_put(data, size, 0, 4, brickpi3_emu_motor_position(
+			&board->motor[req[1] - BRICKPI3_MSG_GET_MOTOR_A_ENCODER]));
+		break;
+	case BRICKPI3_MSG_GET_MOTOR_A_STATUS ... BRICKPI3_MSG_GET_MOTOR_D_STATUS:
+		brickpi3_emu_get_motor(
+			&board->motor[req[1] - BRICKPI3_MSG_GET_MOTOR_A_STATUS],
+			data, size);
+		break;
+	default:
+		/* PID constants and anything unknown are ignored */
+		break;
+	}
+}
+
+static void brickpi3_emu_delay(unsigned int bytes, unsigned int transfers)
+{
+	unsigned int speed_hz = READ_ONCE(spi_speed_hz);
+	u64 us = (u64)transfers * READ_ONCE(response_delay_us);
+
+	if (speed_hz)
+		us += div_u64((u64)bytes * 8 * USEC_PER_SEC, speed_hz);
+
+	if (!us)
+		return;
+	if (us < 10)
+		udelay(us);
+	else
+		usleep_range(us, us + us / 8);
+}
+
+static int brickpi3_emu_transfer_one_message(struct spi_master *master,
+					     struct spi_message *msg)
+{
+	struct brickpi3_emu *emu = spi_master_get_devdata(master);
+	struct spi_transfer *xfer;
+	unsigned int bytes = 0, transfers = 0;
+
+	/* chip select is toggled between transfers, so each is one message */
+	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
+		brickpi3_emu_message(emu, xfer->tx_buf, xfer->rx_buf, xfer->len);
+		msg->actual_length += xfer->len;
+		bytes += xfer->len;
+		transfers++;
+	}
+
+	brickpi3_emu_delay(bytes, transfers);
+
+	msg->status = 0;
+	spi_finalize_current_message(master);
+
+	return 0;
+}
+
+static void brickpi3_emu_init_board(struct brickpi3_emu_board *board, int index)
+{
+	struct brickpi3_emu_sensor *sensor;
+	int i;
+
+	/* the boards act as if the addresses were already set up */
+	board->address = index + 1;
+	snprintf(board->id, BRICKPI3_ID_MSG_SIZE, "EMU%d", index);
+	board->start = ktime_get();
+	board->last_update = board->start;
+
+	for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS; i++)
+		board->motor[i].power = BRICKPI3_EMU_MOTOR_FLOAT;
+
+	for (i = 0; i < NUM_BRICKPI3_INPUT_PORTS; i++) {
+		sensor = &board->sensor[i];
+		sensor->type = BRICKPI3_SENSOR_TYPE_NONE;
+		/* same id registers as the LEGO NXT Ultrasonic sensor */
+		memcpy(&sensor->i2c_regs[0x00], "V1.0", 4);
+		memcpy(&sensor->i2c_regs[0x08], "LEGO", 4);
+		memcpy(&sensor->i2c_regs[0x10], "Sonar", 5);
+	}
+}
+
+static int __init brickpi3_emu_init(void)
+{
+	struct spi_board_info info = {
+		.modalias	= "brickpi3",
+		.max_speed_hz	= 500000,
+		.chip_select	= 0,
+		.mode		= SPI_MODE_0,
+	};
+	struct spi_master *master;
+	struct brickpi3_emu *emu;
+	int i, err;
+
+	if (boards < 1 || boards > BRICKPI3_EMU_MAX_BOARDS)
+		return -EINVAL;
+
+	brickpi3_emu_parent = root_device_register(BRICKPI3_EMU_NAME);
+	if (IS_ERR(brickpi3_emu_parent))
+		return PTR_ERR(brickpi3_emu_parent);
+
+	master = spi_alloc_master(brickpi3_emu_parent, sizeof(*emu));
+	if (!master) {
+		err = -ENOMEM;
+		goto err_alloc_master;
+	}
+
+	emu = spi_master_get_devdata(master);
+	emu->num_boards = boards;
+	for (i = 0; i < emu->num_boards; i++)
+		brickpi3_emu_init_board(&emu->board[i], i);
+
+	master->bus_num = -1;
+	master->num_chipselect = 1;
+	master->transfer_one_message = brickpi3_emu_transfer_one_message;
+
+	err = spi_register_master(master);
+	if (err < 0) {
+		spi_master_put(master);
+		goto err_alloc_master;
+	}
+
+	emu->spi = spi_new_device(master, &info);
+	if (!emu->spi) {
+		err = -ENODEV;
+		goto err_new_device;
+	}
+
+	brickpi3_emu_master = master;
+
+	return 0;
+
+err_new_device:
+	spi_unregister_master(master);
+err_alloc_master:
+	root_device_unregister(brickpi3_emu_parent);
+
+	return err;
+}
+module_init(brickpi3_emu_init);
+
+static void __exit brickpi3_emu_exit(void)
+{
+	spi_unregister_master(brickpi3_emu_master);
+	root_device_unregister(brickpi3_emu_parent);
+}
+module_exit(brickpi3_emu_exit);
+
+MODULE_DESCRIPTION("Dexter Industries BrickPi3 emulator");
+MODULE_AUTHOR("David Lechner <david@lechnology.com>");
+MODULE_LICENSE("GPL");
@@ -85,7 +85,8 @@ static void brickpi3_i2c_release(struct device *dev, void *res)
 
 static int devm_brickpi3_i2c_register_one(struct device *dev,
 					  struct brickpi3 *bp, u8 address,
-					  enum brickpi3_input_port port)
+					  enum brickpi3_input_port port,
+					  struct i2c_adapter **adap)
 {
 	struct brickpi3_i2c *data;
 	int ret;
@@ -112,17 +113,20 @@ static int devm_brickpi3_i2c_register_one(struct device *dev,
 		return ret;
 
 	devres_add(dev, data);
+	*adap = &data->adap;
 
 	return 0;
 }
 
 int devm_brickpi3_register_i2c(struct device *dev, struct brickpi3 *bp,
-			       u8 address)
+			       u8 address,
+			       struct i2c_adapter *adap[NUM_BRICKPI3_INPUT_PORTS])
 {
 	int i, ret;
 
 	for (i = 0; i < NUM_BRICKPI3_INPUT_PORTS; i++) {
-		ret = devm_brickpi3_i2c_register_one(dev, bp, address, i);
+		ret = devm_brickpi3_i2c_register_one(dev, bp, address, i,
+						      &adap[i]);
 		if (ret < 0)
 			return ret;
 	}
@@ -26,19 +26,48 @@
  *
  * .. _Industrial I/O: http://lxr.free-electrons.com/source/drivers/staging/iio/Documentation/overview.txt?v=4.4
  *
+ * The voltages can also be captured into the IIO buffer, for example to log
+ * how the supplies droop when the motors are loaded. Each trigger reads all of
+ * the enabled channels in one SPI transaction and adds them to the buffer with
+ * a timestamp. Any trigger can be used, such as an ``iio-trig-hrtimer``
+ * trigger to capture at a fixed rate.
+ *
+ * The buffered samples are the same values as ``in_voltage_N_input``, that is
+ * millivolts as unsigned 16-bit integers in CPU byte order. There is no
+ * ``scale`` attribute, so no scaling has to be applied to them. The timestamp
+ * is a signed 64-bit integer in nanoseconds.
+ *
  * .. tip:: You can use the `Battery`_ driver for monitoring the battery
  *    instead of using this driver.
  */
 
+#include <linux/bitops.h>
 #include <linux/device.h>
+#include <linux/iio/buffer.h>
 #include <linux/iio/iio.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
 
 #include "brickpi3.h"
 
+#define BRICKPI3_IIO_NUM_VOLTAGES	4
+
+struct brickpi3_iio_read {
+	u16 *value;
+	int err;
+};
+
 struct brickpi3_iio {
 	struct iio_dev *iio;
 	struct brickpi3 *bp;
 	u8 address;
+	struct brickpi3_iio_read read[BRICKPI3_IIO_NUM_VOLTAGES];
+	/* enabled channels are packed at the start, timestamp is 8-byte aligned */
+	struct {
+		u16 value[BRICKPI3_IIO_NUM_VOLTAGES];
+		s64 timestamp __aligned(8);
+	} scan;
 };
 
 static int brickpi3_iio_read_raw(struct iio_dev *iio,
@@ -64,6 +93,52 @@ static int brickpi3_iio_read_raw(struct iio_dev *iio,
 	return -EINVAL;
 }
 
+static void brickpi3_iio_read_complete(void *context, const u8 *data, int err)
+{
+	struct brickpi3_iio_read *read = context;
+
+	read->err = err;
+	if (!err)
+		*read->value = (data[0] << 8) | data[1];
+}
+
+/*
+ * Reads all enabled channels in one batch, so that a scan only takes one SPI
+ * transaction no matter how many channels are enabled.
+ */
+static irqreturn_t brickpi3_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *iio = pf->indio_dev;
+	struct brickpi3_iio *data = iio_priv(iio);
+	int i, n = 0, ret;
+
+	brickpi3_begin_batch(data->bp);
+	for_each_set_bit(i, iio->active_scan_mask, iio->masklength) {
+		if (i >= BRICKPI3_IIO_NUM_VOLTAGES)
+			break;
+		data->read[n].value = &data->scan.value[n];
+		data->read[n].err = -EAGAIN;
+		brickpi3_queue_read(data->bp, data->address,
+				    iio->channels[i].address, 2,
+				    brickpi3_iio_read_complete, &data->read[n]);
+		n++;
+	}
+	ret = brickpi3_end_batch(data->bp);
+
+	for (i = 0; i < n && !ret; i++)
+		ret = data->read[i].err;
+
+	/* a scan that could not be read is dropped rather than pushed */
+	if (!ret)
+		iio_push_to_buffers_with_timestamp(iio, &data->scan,
+						   pf->timestamp);
+
+	iio_trigger_notify_done(iio->trig);
+
+	return IRQ_HANDLED;
+}
+
 #define BRICKPI3_V_CHAN(index, name)				\
 {								\
 	.type = IIO_VOLTAGE,					\
@@ -86,7 +161,7 @@ static const struct iio_chan_spec brickpi3_iio_channels[] = {
 	BRICKPI3_V_CHAN(1, 5V),
 	BRICKPI3_V_CHAN(2, 9V),
 	BRICKPI3_V_CHAN(3, VCC),
-	IIO_CHAN_SOFT_TIMESTAMP(4),
+	IIO_CHAN_SOFT_TIMESTAMP(BRICKPI3_IIO_NUM_VOLTAGES),
 };
 
 static const struct iio_info brickpi3_iio_info = {
@@ -117,6 +192,14 @@ int devm_brickpi3_register_iio(struct device *dev, struct brickpi3 *bp,
 	iio->num_channels = ARRAY_SIZE(brickpi3_iio_channels);
 	iio->info = &brickpi3_iio_info;
 
+	ret = devm_iio_triggered_buffer_setup(dev, iio, iio_pollfunc_store_time,
+					      brickpi3_iio_trigger_handler,
+					      NULL);
+	if (ret) {
+		dev_err(dev, "Failed to setup triggered buffer.\n");
+		return ret;
+	}
+
 	ret = devm_iio_device_register(dev, iio);
 	if (ret) {
 		dev_err(dev, "Failed to register iio device.\n");
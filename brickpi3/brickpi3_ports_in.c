@@ -19,12 +19,18 @@
  * The BrickPi3 has four input ports, labeled S1, S2, S3 and S4. These ports
  * are similar to the input ports on the EV3, but lack the ability to
  * automatically detect sensors.
+ *
+ * Sensors that use the port for reading data (all except NXT/I2C sensors)
+ * support the ``poll_ms`` attribute. The default depends on the sensor: 20
+ * msec for the EV3 Touch sensor, 50 msec for the EV3 Ultrasonic and Infrared
+ * sensors and 10 msec for everything else. All input ports on a BrickPi3 are
+ * read together with the motors, so ``poll_ms`` is rounded up to a multiple
+ * of the ``cache_refresh_ms`` module parameter at the time it is set. Values
+ * from 1 to 60000 msec are accepted; 0 stops polling.
  */
 
 #include <linux/device.h>
-#include <linux/hrtimer.h>
 #include <linux/i2c.h>
-#include <linux/workqueue.h>
 
 #include "brickpi3.h"
 #include "../sensors/ev3_analog_sensor.h"
@@ -32,17 +38,21 @@
 #include "../sensors/nxt_analog_sensor.h"
 #include "../sensors/nxt_i2c_sensor.h"
 
+#define BRICKPI3_IN_PORT_DEFAULT_POLL_MS	10
+#define BRICKPI3_IN_PORT_MAX_POLL_MS		60000
+
 struct brickpi3_in_port {
 	struct brickpi3 *bp;
+	struct brickpi3_cache *cache;
 	struct lego_port_device port;
-	struct work_struct poll_work;
-	struct hrtimer poll_timer;
 	struct lego_device *sensor;
 	struct i2c_adapter *i2c_adap;
 	struct i2c_client *i2c_sensor;
 	struct nxt_i2c_sensor_platform_data i2c_pdata;
 	enum brickpi3_input_port index;
 	enum brickpi3_sensor_type sensor_type;
+	unsigned int poll_ms;
+	bool poll_ms_set;
 	u8 address;
 };
 
@@ -160,21 +170,19 @@ static const struct lego_port_mode_info brickpi3_in_port_mode_info[NUM_BRICKPI3_
 	},
 };
 
-static void brickpi3_in_port_poll_work(struct work_struct *work)
+static void brickpi3_in_port_poll(void *context,
+				  const struct brickpi3_sensor_reading *reading)
 {
-	struct brickpi3_in_port *data =
-		container_of(work, struct brickpi3_in_port, poll_work);
+	struct brickpi3_in_port *data = context;
+	const u8 *msg = reading->data;
 	u8 *raw_data = data->port.raw_data;
-	u8 msg[16];
-	int ret;
+
+	if (reading->err || reading->type != data->sensor_type ||
+	    reading->state != BRICKPI3_SENSOR_STATE_VALID_DATA)
+		return;
 
 	switch (data->sensor_type) {
 	case BRICKPI3_SENSOR_TYPE_CUSTOM:
-		ret = brickpi3_read_sensor(data->bp, data->address, data->index,
-					   data->sensor_type, msg, 4);
-		if (ret < 0)
-			return;
-
 		/* for now, just handling NXT analog (pin 1) */
 		if (raw_data) {
 			u16 raw = ((msg[2] & 0x0f) << 8) | msg[3];
@@ -182,11 +190,6 @@ static void brickpi3_in_port_poll_work(struct work_struct *work)
 		}
 		break;
 	case BRICKPI3_SENSOR_TYPE_EV3_TOUCH:
-		ret = brickpi3_read_sensor(data->bp, data->address, data->index,
-					   data->sensor_type, msg, 1);
-		if (ret < 0)
-			return;
-
 		/* convert to value that the EV3 analog driver expects  */
 		if (raw_data)
 			*(u16 *)raw_data = msg[0] ? 500 : 0;
@@ -197,11 +200,6 @@ static void brickpi3_in_port_poll_work(struct work_struct *work)
 	case BRICKPI3_SENSOR_TYPE_EV3_ULTRASONIC_LISTEN:
 	case BRICKPI3_SENSOR_TYPE_EV3_INFRARED_PROXIMITY:
 	case BRICKPI3_SENSOR_TYPE_EV3_INFRARED_REMOTE:
-		ret = brickpi3_read_sensor(data->bp, data->address, data->index,
-					   data->sensor_type, msg, 1);
-		if (ret < 0)
-			return;
-
 		if (raw_data)
 			raw_data[0] = msg[0];
 		break;
@@ -209,11 +207,6 @@ static void brickpi3_in_port_poll_work(struct work_struct *work)
 	case BRICKPI3_SENSOR_TYPE_EV3_GYRO_DPS:
 	case BRICKPI3_SENSOR_TYPE_EV3_ULTRASONIC_CM:
 	case BRICKPI3_SENSOR_TYPE_EV3_ULTRASONIC_INCHES:
-		ret = brickpi3_read_sensor(data->bp, data->address, data->index,
-					   data->sensor_type, msg, 2);
-		if (ret < 0)
-			return;
-
 		if (raw_data) {
 			raw_data[0] = msg[1];
 			raw_data[1] = msg[0];
@@ -221,11 +214,6 @@ static void brickpi3_in_port_poll_work(struct work_struct *work)
 		break;
 	case BRICKPI3_SENSOR_TYPE_EV3_GYRO_ABS_DPS:
 	case BRICKPI3_SENSOR_TYPE_EV3_COLOR_RAW_REFLECTED:
-		ret = brickpi3_read_sensor(data->bp, data->address, data->index,
-					   data->sensor_type, msg, 4);
-		if (ret < 0)
-			return;
-
 		if (raw_data) {
 			raw_data[0] = msg[3];
 			raw_data[1] = msg[2];
@@ -234,11 +222,6 @@ static void brickpi3_in_port_poll_work(struct work_struct *work)
 		}
 		break;
 	case BRICKPI3_SENSOR_TYPE_EV3_COLOR_COLOR_COMPONENTS:
-		ret = brickpi3_read_sensor(data->bp, data->address, data->index,
-					   data->sensor_type, msg, 8);
-		if (ret < 0)
-			return;
-
 		if (raw_data) {
 			raw_data[0] = msg[1];
 			raw_data[1] = msg[0];
@@ -251,11 +234,6 @@ static void brickpi3_in_port_poll_work(struct work_struct *work)
 		}
 		break;
 	case BRICKPI3_SENSOR_TYPE_EV3_INFRARED_SEEK:
-		ret = brickpi3_read_sensor(data->bp, data->address, data->index,
-					   data->sensor_type, msg, 8);
-		if (ret < 0)
-			return;
-
 		if (raw_data)
 			memcpy(raw_data, msg, 8);
 		break;
@@ -268,16 +246,53 @@ static void brickpi3_in_port_poll_work(struct work_struct *work)
 	}
 }
 
-static enum hrtimer_restart brickpi3_in_port_poll_timer_function(struct hrtimer *timer)
+static unsigned int brickpi3_in_port_default_poll_ms(enum brickpi3_sensor_type type)
 {
-	struct brickpi3_in_port *data =
-		container_of(timer, struct brickpi3_in_port, poll_timer);
+	switch (type) {
+	case BRICKPI3_SENSOR_TYPE_EV3_TOUCH:
+		return 20;
+	case BRICKPI3_SENSOR_TYPE_EV3_ULTRASONIC_CM:
+	case BRICKPI3_SENSOR_TYPE_EV3_ULTRASONIC_INCHES:
+	case BRICKPI3_SENSOR_TYPE_EV3_ULTRASONIC_LISTEN:
+	case BRICKPI3_SENSOR_TYPE_EV3_INFRARED_PROXIMITY:
+	case BRICKPI3_SENSOR_TYPE_EV3_INFRARED_SEEK:
+	case BRICKPI3_SENSOR_TYPE_EV3_INFRARED_REMOTE:
+		return 50;
+	default:
+		return BRICKPI3_IN_PORT_DEFAULT_POLL_MS;
+	}
+}
+
+static void brickpi3_in_port_update_poll(struct brickpi3_in_port *data)
+{
+	if (!data->poll_ms_set)
+		data->poll_ms = brickpi3_in_port_default_poll_ms(data->sensor_type);
+
+	brickpi3_cache_set_sensor_poll(data->cache, data->index, data->poll_ms,
+				       brickpi3_in_port_poll, data);
+}
+
+static int brickpi3_in_port_get_poll_ms(void *context)
+{
+	struct brickpi3_in_port *data = context;
 
-	/* TODO: make poll time configurable */
-	hrtimer_forward_now(&data->poll_timer, ms_to_ktime(10));
-	schedule_work(&data->poll_work);
+	return data->poll_ms;
+}
+
+static int brickpi3_in_port_set_poll_ms(void *context, unsigned value)
+{
+	struct brickpi3_in_port *data = context;
+
+	if (!data->sensor)
+		return -ENODEV;
+	if (value > BRICKPI3_IN_PORT_MAX_POLL_MS)
+		return -EINVAL;
 
-	return HRTIMER_RESTART;
+	data->poll_ms = value;
+	data->poll_ms_set = true;
+	brickpi3_in_port_update_poll(data);
+
+	return 0;
 }
 
 static int brickpi3_in_port_register_sensor(struct brickpi3_in_port *data,
@@ -308,7 +323,8 @@ static int brickpi3_in_port_register_sensor(struct brickpi3_in_port *data,
 			return PTR_ERR(new_sensor);
 
 		data->sensor = new_sensor;
-		hrtimer_start(&data->poll_timer, ms_to_ktime(10), HRTIMER_MODE_REL);
+		data->poll_ms_set = false;
+		brickpi3_in_port_update_poll(data);
 	}
 
 	return 0;
@@ -317,8 +333,8 @@ static int brickpi3_in_port_register_sensor(struct brickpi3_in_port *data,
 static void brickpi3_in_port_unregister_sensor(struct brickpi3_in_port *data)
 {
 	if (data->sensor) {
-		hrtimer_cancel(&data->poll_timer);
-		cancel_work_sync(&data->poll_work);
+		brickpi3_cache_set_sensor_poll(data->cache, data->index, 0,
+					       NULL, NULL);
 		lego_device_unregister(data->sensor);
 		data->sensor = NULL;
 	}
@@ -482,6 +498,9 @@ static int brickpi3_in_port_set_ev3_uart_sensor_mode(void *context, u8 type_id,
 	else
 		return -EINVAL;
 
+	if (data->sensor)
+		brickpi3_in_port_update_poll(data);
+
 	return brickpi3_set_sensor_type(data->bp, data->address, data->index,
 					data->sensor_type);
 }
@@ -500,6 +519,8 @@ static void brickpi3_ports_in_release(struct device *dev, void *res)
 
 static int devm_brickpi3_port_in_register_one(struct device *dev,
 					      struct brickpi3 *bp,
+					      struct brickpi3_cache *cache,
+					      struct i2c_adapter *i2c_adap,
 					      u8 address,
 					      enum brickpi3_input_port port)
 {
@@ -511,29 +532,12 @@ static int devm_brickpi3_port_in_register_one(struct device *dev,
 		return -ENOMEM;
 
 	data->bp = bp;
+	data->cache = cache;
 	data->address = address;
 	data->index = port;
-	INIT_WORK(&data->poll_work, brickpi3_in_port_poll_work);
-	hrtimer_init(&data->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	data->poll_timer.function = brickpi3_in_port_poll_timer_function;
 	data->i2c_pdata.in_port = &data->port;
 
-	/*
-	 * FIXME: there is no guarantee this is the correct adapter.
-	 * This works as long as the device tree specifies aliases for 3 I2C
-	 * adapters and there are no other dynamic I2C adapters.
-	 */
-	data->i2c_adap = i2c_get_adapter(port + 3);
-	if (!data->i2c_adap) {
-		dev_err(dev, "Could not get I2C adapter %d\n", port + 3);
-		return -ENXIO;
-	}
-	/*
-	 * This module also owns the i2c adapters, so we would cause a reference
-	 * cycle if we held on to the reference, which would prevent the module
-	 * from ever being unloaded.
-	 */
-	i2c_put_adapter(data->i2c_adap);
+	data->i2c_adap = i2c_adap;
 
 	data->port.name = brickpi3_in_port_type.name;
 	snprintf(data->port.address, LEGO_NAME_SIZE, "%s:S%d", dev_name(dev),
@@ -543,6 +547,8 @@ static int devm_brickpi3_port_in_register_one(struct device *dev,
 	data->port.mode_info = brickpi3_in_port_mode_info;
 	data->port.set_mode = brickpi3_in_port_set_mode;
 	data->port.set_device = brickpi3_in_port_set_device;
+	data->port.get_poll_ms = brickpi3_in_port_get_poll_ms;
+	data->port.set_poll_ms = brickpi3_in_port_set_poll_ms;
 	data->port.context = data;
 	data->port.nxt_analog_ops = &brickpi3_in_port_nxt_analog_ops;
 	data->port.nxt_i2c_ops = &brickpi3_in_port_nxt_i2c_ops;
@@ -561,12 +567,15 @@ static int devm_brickpi3_port_in_register_one(struct device *dev,
 }
 
 int devm_brickpi3_register_in_ports(struct device *dev, struct brickpi3 *bp,
+				    struct brickpi3_cache *cache,
+				    struct i2c_adapter *i2c_adap[NUM_BRICKPI3_INPUT_PORTS],
 				    u8 address)
 {
 	int i, ret;
 
 	for (i = 0; i < NUM_BRICKPI3_INPUT_PORTS; i++) {
-		ret = devm_brickpi3_port_in_register_one(dev, bp, address, i);
+		ret = devm_brickpi3_port_in_register_one(dev, bp, cache,
+							 i2c_adap[i], address, i);
 		if (ret < 0)
 			return ret;
 	}
@@ -22,16 +22,27 @@
  * By default, the ``lego-nxt-motor`` driver is loaded, so you don't need to
  * manually set the mode or device unless you want to use something else.
  *
+ * The ``position``, ``speed``, ``duty_cycle`` and ``state`` attributes are
+ * read from the BrickPi3 state snapshot, so they can be up to
+ * ``cache_max_age_ms`` old. See the module parameters below.
+ *
+ * After ``run-to-*-pos`` commands, the motor is checked more often as it gets
+ * closer to the target, based on its position and speed, so that ``state``
+ * changes and the stop action is applied soon after the motor arrives. The
+ * time taken by each move and how late the arrival was noticed are shown in
+ * the ``stats`` file in debugfs.
+ *
  * .. warning:: Not all :ref:`tacho-motor-class` features are supported.
  *
  *    - The ``state`` attribute will never return the ``stalled`` flag.
  *    - The ``state`` attribute will only return the ``overloaded`` flag with
  *      firmware >= v1.4.3.
- *    - The ``state`` attribtue does not support ``poll`` syscall.
  */
 
 #include <linux/bitops.h>
 #include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/workqueue.h>
 
 #include <dc_motor_class.h>
@@ -44,12 +55,25 @@
 #define BRICKPI3_MOTOR_BRAKE (0)
 #define BRICKPI3_MOTOR_COAST (-128)
 
+/* the motor is at the target when it stopped this close to it, in degrees */
+#define BRICKPI3_RUN_TO_POS_TOLERANCE		10
+#define BRICKPI3_RUN_TO_POS_MIN_POLL_US		2000
+#define BRICKPI3_RUN_TO_POS_MAX_POLL_US		100000
+/* used while the motor is not moving, e.g. right after the command was sent */
+#define BRICKPI3_RUN_TO_POS_IDLE_POLL_US	10000
+
 struct brickpi3_out_port {
 	struct brickpi3 *bp;
+	struct brickpi3_cache *cache;
 	struct lego_port_device port;
 	struct lego_device *motor;
-	struct delayed_work run_to_pos_work;
+	struct hrtimer run_to_pos_timer;
+	struct work_struct run_to_pos_work;
 	enum tm_stop_action run_to_pos_stop_action;
+	ktime_t run_to_pos_start;
+	ktime_t run_to_pos_last_poll;
+	unsigned int run_to_pos_polls;
+	bool run_to_pos_fresh;
 	enum brickpi3_output_port index;
 	s32 position_sp;
 	s8 duty_cycle;
@@ -209,8 +233,8 @@ static int brickpi3_out_port_get_position(void *context, int *position)
 {
 	struct brickpi3_out_port *data = context;
 
-	return brickpi3_get_motor_encoder(data->bp, data->address, data->index,
-					  position);
+	return brickpi3_cache_read_motor(data->cache, data->index, NULL, NULL,
+					 position, NULL, false);
 }
 
 static int brickpi3_out_port_set_position(void *context, int position)
@@ -225,8 +249,11 @@ static int brickpi3_out_port_set_position(void *context, int position)
 
 	position += current_pos;
 
-	return brickpi3_set_motor_offset(data->bp, data->address, data->index,
-					 position);
+	ret = brickpi3_set_motor_offset(data->bp, data->address, data->index,
+					position);
+	brickpi3_cache_invalidate_motor(data->cache, data->index);
+
+	return ret;
 }
 
 static int brickpi3_out_port_run_unregulated(void *context, int duty_cycle)
@@ -239,6 +266,7 @@ static int brickpi3_out_port_run_unregulated(void *context, int duty_cycle)
 
 	ret = brickpi3_run_unregulated(data->bp, data->address, data->index,
 				       duty_cycle);
+	brickpi3_cache_invalidate_motor(data->cache, data->index);
 	if (ret < 0)
 		return ret;
 
@@ -255,6 +283,7 @@ static int brickpi3_out_port_run_regulated(void *context, int speed)
 	int ret;
 
 	ret = brickpi3_run_regulated(data->bp, data->address, data->index, speed);
+	brickpi3_cache_invalidate_motor(data->cache, data->index);
 	if (ret < 0)
 		return ret;
 
@@ -277,51 +306,63 @@ static int brickpi3_out_port_run_to_pos(void *context, int pos, int speed,
 		return ret;
 
 	ret = brickpi3_run_to_position(data->bp, data->address, data->index, pos);
+	brickpi3_cache_invalidate_motor(data->cache, data->index);
 	if (ret < 0)
 		return ret;
 
 	data->run_to_pos_stop_action = stop_action;
+	data->run_to_pos_start = ktime_get();
+	data->run_to_pos_last_poll = data->run_to_pos_start;
+	data->run_to_pos_polls = 0;
+	data->run_to_pos_fresh = false;
 
 	data->position_sp = pos;
 	data->running = true;
 	data->holding = false;
 	data->positioning = true;
 
-	schedule_delayed_work(&data->run_to_pos_work, 0);
+	hrtimer_cancel(&data->run_to_pos_timer);
+	schedule_work(&data->run_to_pos_work);
 
 	return 0;
 }
 
-static int brickpi3_out_port_get_state(void *context)
+static unsigned brickpi3_out_port_state(struct brickpi3_out_port *data,
+					enum brickpi3_motor_status flags)
 {
-	struct brickpi3_out_port *data = context;
-	enum brickpi3_motor_status flags;
 	unsigned state = 0;
-	int ret;
 
 	if (data->running)
 		state |= BIT(TM_STATE_RUNNING);
 	if (data->holding)
 		state |= BIT(TM_STATE_HOLDING);
-
-	ret = brickpi3_read_motor(data->bp, data->address, data->index, &flags,
-				  NULL, NULL, NULL);
-	if (ret < 0)
-		return ret;
-
 	if (flags & BRICKPI3_MOTOR_STATUS_OVERLOADED)
 		state |= BIT(TM_STATE_OVERLOADED);
 
 	return state;
 }
 
+static int brickpi3_out_port_get_state(void *context)
+{
+	struct brickpi3_out_port *data = context;
+	enum brickpi3_motor_status flags;
+	int ret;
+
+	ret = brickpi3_cache_read_motor(data->cache, data->index, &flags, NULL,
+					NULL, NULL, false);
+	if (ret < 0)
+		return ret;
+
+	return brickpi3_out_port_state(data, flags);
+}
+
 static int brickpi3_out_port_get_duty_cycle2(void *context, int *duty_cycle)
 {
 	struct brickpi3_out_port *data = context;
 	int ret;
 
-	ret = brickpi3_read_motor(data->bp, data->address, data->index, NULL,
-				  duty_cycle, NULL, NULL);
+	ret = brickpi3_cache_read_motor(data->cache, data->index, NULL,
+					duty_cycle, NULL, NULL, false);
 	if (ret < 0)
 		return ret;
 
@@ -335,8 +376,29 @@ static int brickpi3_out_port_get_speed(void *context, int *speed)
 {
 	struct brickpi3_out_port *data = context;
 
-	return brickpi3_read_motor(data->bp, data->address, data->index, NULL,
-				   NULL, NULL, speed);
+	return brickpi3_cache_read_motor(data->cache, data->index, NULL, NULL,
+					 NULL, speed, false);
+}
+
+static int brickpi3_out_port_get_status(void *context,
+					struct tacho_motor_status *status)
+{
+	struct brickpi3_out_port *data = context;
+	enum brickpi3_motor_status flags;
+	int ret;
+
+	ret = brickpi3_cache_read_motor(data->cache, data->index, &flags,
+					&status->duty_cycle, &status->position,
+					&status->speed, false);
+	if (ret < 0)
+		return ret;
+
+	if (status->duty_cycle == BRICKPI3_MOTOR_COAST)
+		status->duty_cycle = 0;
+
+	status->state = brickpi3_out_port_state(data, flags);
+
+	return 0;
 }
 
 static int brickpi3_out_port_stop(void *context, enum tm_stop_action stop_action)
@@ -368,6 +430,7 @@ static int brickpi3_out_port_stop(void *context, enum tm_stop_action stop_action
 		return -EINVAL;
 	}
 
+	brickpi3_cache_invalidate_motor(data->cache, data->index);
 	if (ret < 0)
 		return ret;
 
@@ -397,6 +460,23 @@ static unsigned brickpi3_out_port_get_stop_actions(void *context)
 	       BIT(TM_STOP_ACTION_HOLD);
 }
 
+static void brickpi3_out_port_begin_batch(void *context)
+{
+	struct brickpi3_out_port *data = context;
+
+	brickpi3_begin_batch(data->bp);
+	brickpi3_cache_begin_command(data->cache, data->index);
+}
+
+static int brickpi3_out_port_end_batch(void *context)
+{
+	struct brickpi3_out_port *data = context;
+
+	brickpi3_cache_end_command(data->cache, data->index);
+
+	return brickpi3_end_batch(data->bp);
+}
+
 struct tacho_motor_ops brickpi3_out_port_tacho_motor_ops = {
 	.get_position		= brickpi3_out_port_get_position,
 	.set_position		= brickpi3_out_port_set_position,
@@ -408,7 +488,10 @@ struct tacho_motor_ops brickpi3_out_port_tacho_motor_ops = {
 	.get_state		= brickpi3_out_port_get_state,
 	.get_duty_cycle		= brickpi3_out_port_get_duty_cycle2,
 	.get_speed		= brickpi3_out_port_get_speed,
+	.get_status		= brickpi3_out_port_get_status,
 	.get_stop_actions	= brickpi3_out_port_get_stop_actions,
+	.begin_batch		= brickpi3_out_port_begin_batch,
+	.end_batch		= brickpi3_out_port_end_batch,
 };
 
 static int brickpi3_out_port_register_motor(struct brickpi3_out_port *out_port,
@@ -430,7 +513,10 @@ static int brickpi3_out_port_register_motor(struct brickpi3_out_port *out_port,
 static void brickpi3_out_port_unregister_motor(struct brickpi3_out_port *data)
 {
 	if (data->motor) {
-		cancel_delayed_work_sync(&data->run_to_pos_work);
+		data->positioning = false;
+		hrtimer_cancel(&data->run_to_pos_timer);
+		cancel_work_sync(&data->run_to_pos_work);
+		hrtimer_cancel(&data->run_to_pos_timer);
 		lego_device_unregister(data->motor);
 		data->motor = NULL;
 		brickpi3_run_unregulated(data->bp, data->address, data->index,
@@ -449,43 +535,93 @@ static int brickpi3_out_port_set_mode(void *context, u8 mode)
 				brickpi3_out_port_default_driver[mode]);
 }
 
+/*
+ * Predicts when the motor will reach the target from its speed and checks
+ * again halfway there, so the polling gets faster as the motor gets closer.
+ */
+static unsigned int brickpi3_run_to_pos_next_poll_us(int error, int speed)
+{
+	u64 eta_us;
+
+	if (!speed)
+		return BRICKPI3_RUN_TO_POS_IDLE_POLL_US;
+	if (error < BRICKPI3_RUN_TO_POS_TOLERANCE)
+		return BRICKPI3_RUN_TO_POS_MIN_POLL_US;
+
+	eta_us = div_u64((u64)error * USEC_PER_SEC, abs(speed));
+
+	return clamp_t(u64, eta_us / 2, BRICKPI3_RUN_TO_POS_MIN_POLL_US,
+		       BRICKPI3_RUN_TO_POS_MAX_POLL_US);
+}
+
 static void brickpi3_run_to_pos_work(struct work_struct *work)
 {
-	struct delayed_work *delayed_work = to_delayed_work(work);
-	struct brickpi3_out_port *data = container_of(delayed_work,
+	struct brickpi3_out_port *data = container_of(work,
 						      struct brickpi3_out_port,
 						      run_to_pos_work);
-	int ret, speed, position;
+	unsigned int delay_us;
+	int ret, speed, position, error;
+	ktime_t now;
 
 	/* another command was run, so positioning is canceled */
 	if (!data->positioning)
 		return;
 
-	ret = brickpi3_read_motor(data->bp, data->address, data->index, NULL,
-				  NULL, &position, &speed);
+	ret = brickpi3_cache_read_motor(data->cache, data->index, NULL, NULL,
+					&position, &speed,
+					data->run_to_pos_fresh);
+	now = ktime_get();
 
 	if (ret == -EAGAIN) {
 		/* do what it says, try again */
-		schedule_delayed_work(&data->run_to_pos_work,
-				      msecs_to_jiffies(20));
-		return;
+		delay_us = BRICKPI3_RUN_TO_POS_IDLE_POLL_US;
+		goto again;
 	} else if (ret < 0) {
 		/* Giving up for now. Might be better if we did a retry. */
 		return;
 	}
 
-	if (abs(data->position_sp - position) < 10 && speed == 0) {
-		/* we have reached the target position */
+	data->run_to_pos_polls++;
+	error = abs(data->position_sp - position);
+
+	if (error < BRICKPI3_RUN_TO_POS_TOLERANCE && speed == 0) {
+		/*
+		 * We have reached the target position. It happened some time
+		 * since the last poll, which is how late we are.
+		 */
+		brickpi3_record_run_to_pos(data->bp,
+			ktime_to_ns(ktime_sub(now, data->run_to_pos_start)),
+			ktime_to_ns(ktime_sub(now, data->run_to_pos_last_poll)),
+			data->run_to_pos_polls);
 		if (data->run_to_pos_stop_action == TM_STOP_ACTION_HOLD)
 			data->holding = true;
 		else
 			brickpi3_out_port_stop(data,
 					       data->run_to_pos_stop_action);
-	} else  {
-		/* keep polling... */
-		schedule_delayed_work(&data->run_to_pos_work,
-				      msecs_to_jiffies(100));
+		lego_port_call_motor_state_func(&data->port);
+		return;
 	}
+
+	delay_us = brickpi3_run_to_pos_next_poll_us(error, speed);
+	/* the snapshot is too slow when polling faster than it is refreshed */
+	data->run_to_pos_fresh = delay_us < BRICKPI3_RUN_TO_POS_IDLE_POLL_US;
+	data->run_to_pos_last_poll = now;
+
+again:
+	hrtimer_start(&data->run_to_pos_timer,
+		      ns_to_ktime((u64)delay_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart brickpi3_run_to_pos_timer_function(struct hrtimer *timer)
+{
+	struct brickpi3_out_port *data = container_of(timer,
+						      struct brickpi3_out_port,
+						      run_to_pos_timer);
+
+	schedule_work(&data->run_to_pos_work);
+
+	return HRTIMER_NORESTART;
 }
 
 static void brickpi3_out_port_release(struct device *dev, void *res)
@@ -498,6 +634,7 @@ static void brickpi3_out_port_release(struct device *dev, void *res)
 
 static int devm_brickpi3_out_port_register_one(struct device *dev,
 					       struct brickpi3 *bp,
+					       struct brickpi3_cache *cache,
 					       u8 address,
 					       enum brickpi3_output_port port)
 {
@@ -509,6 +646,7 @@ static int devm_brickpi3_out_port_register_one(struct device *dev,
 		return -ENOMEM;
 
 	data->bp = bp;
+	data->cache = cache;
 	data->address = address;
 	data->index = port;
 
@@ -523,7 +661,9 @@ static int devm_brickpi3_out_port_register_one(struct device *dev,
 	data->port.tacho_motor_ops = &brickpi3_out_port_tacho_motor_ops;
 	data->port.context = data;
 
-	INIT_DELAYED_WORK(&data->run_to_pos_work, brickpi3_run_to_pos_work);
+	INIT_WORK(&data->run_to_pos_work, brickpi3_run_to_pos_work);
+	hrtimer_init(&data->run_to_pos_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	data->run_to_pos_timer.function = brickpi3_run_to_pos_timer_function;
 
 	ret = lego_port_register(&data->port, &brickpi3_out_port_type, dev);
 	if (ret < 0) {
@@ -545,12 +685,13 @@ static int devm_brickpi3_out_port_register_one(struct device *dev,
 
 
 int devm_brickpi3_register_out_ports(struct device *dev, struct brickpi3 *bp,
-				     u8 address)
+				     struct brickpi3_cache *cache, u8 address)
 {
 	int i, ret;
 
 	for (i = 0; i < NUM_BRICKPI3_OUTPUT_PORTS; i++) {
-		ret = devm_brickpi3_out_port_register_one (dev, bp, address, i);
+		ret = devm_brickpi3_out_port_register_one(dev, bp, cache, address,
+							  i);
 		if (ret < 0)
 			return ret;
 	}
@@ -16,12 +16,21 @@
  * GNU General Public License for more details.
  */
 
-#include <linux/delay.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/of.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/spi/spi.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
+#include <linux/workqueue.h>
 
 #include "brickpi3.h"
 
@@ -31,17 +40,593 @@
 /* technically max address is 255, but we want a reasonable number to probe */
 #define BRICKPI3_MAX_ADDRESS		4
 #define BRICKPI3_MAX_MSG_SIZE (BRICKPI3_HEADER_SIZE + BRICKPI3_STRING_MSG_SIZE)
+/* enough for a full refresh of the motors, sensors and voltages of two boards */
+#define BRICKPI3_MAX_BATCH_SIZE		32
 
 #define BRICKPI3_READ_FAILED(b)	((b)[3] != 0xA5)
 
+/* waiters older than this get the bus ahead of higher priority classes */
+#define BRICKPI3_BUS_AGING_NS		(20 * NSEC_PER_MSEC)
+
+/**
+ * enum brickpi3_bus_class - priority of a message, highest first
+ *
+ * @BRICKPI3_BUS_MOTOR: Motor commands and motor state
+ * @BRICKPI3_BUS_SENSOR: Sensor configuration and polling
+ * @BRICKPI3_BUS_I2C: I2C transactions
+ * @BRICKPI3_BUS_HOUSEKEEPING: LEDs, voltages, board info, etc.
+ */
+enum brickpi3_bus_class {
+	BRICKPI3_BUS_MOTOR,
+	BRICKPI3_BUS_SENSOR,
+	BRICKPI3_BUS_I2C,
+	BRICKPI3_BUS_HOUSEKEEPING,
+	NUM_BRICKPI3_BUS_CLASSES
+};
+
+static const char * const brickpi3_bus_class_names[] = {
+	[BRICKPI3_BUS_MOTOR]		= "motor",
+	[BRICKPI3_BUS_SENSOR]		= "sensor",
+	[BRICKPI3_BUS_I2C]		= "i2c",
+	[BRICKPI3_BUS_HOUSEKEEPING]	= "housekeeping",
+};
+
+/**
+ * struct brickpi3_bus_waiter - a thread waiting for the bus
+ *
+ * @list: Entry in the queue of the class
+ * @done: Completed when the bus has been handed over to this waiter
+ * @address: The BrickPi3 address that the messages are for
+ * @class: The priority class
+ * @start: When the thread started waiting
+ */
+struct brickpi3_bus_waiter {
+	struct list_head list;
+	struct completion done;
+	u8 address;
+	enum brickpi3_bus_class class;
+	ktime_t start;
+};
+
+/**
+ * struct brickpi3_bus_stats - bus scheduler statistics of one class
+ *
+ * @depth: The number of waiters in the queue right now
+ * @max_depth: The highest @depth
+ * @grants: The number of times the bus was locked
+ * @waits: The number of times the bus was busy and the thread had to wait
+ * @wait_ns: The total time spent waiting
+ * @max_wait_ns: The longest wait
+ * @aged: The number of times a waiter went ahead because of its age
+ */
+struct brickpi3_bus_stats {
+	unsigned int depth;
+	unsigned int max_depth;
+	u64 grants;
+	u64 waits;
+	u64 wait_ns;
+	u64 max_wait_ns;
+	u64 aged;
+};
+
+/**
+ * struct brickpi3_batch_entry - a message waiting to be sent in a batch
+ *
+ * @buf: The data to send. Received data is written to the same buffer.
+ * @complete: Called after the message has been sent or NULL for messages that
+ *	only write data.
+ * @context: Passed to @complete.
+ */
+struct brickpi3_batch_entry {
+	u8 buf[BRICKPI3_MAX_MSG_SIZE];
+	void (*complete)(void *context, const u8 *data, int err);
+	void *context;
+};
+
 struct brickpi3 {
 	struct spi_device *spi;
 	u8 buf[BRICKPI3_MAX_MSG_SIZE];
 	struct spi_message msg;
 	struct spi_transfer xfer;
-	struct mutex xfer_lock;
+	/* bus scheduling, see brickpi3_bus_lock() */
+	spinlock_t sched_lock;
+	bool bus_busy;
+	u8 bus_address;
+	enum brickpi3_bus_class bus_class;
+	u8 sched_last_address;
+	struct list_head sched_queue[NUM_BRICKPI3_BUS_CLASSES];
+	/* scheduler statistics, protected by sched_lock */
+	struct brickpi3_bus_stats sched_stats[NUM_BRICKPI3_BUS_CLASSES];
+	u64 sched_board_grants[BRICKPI3_MAX_ADDRESS + 1];
+	/* run-to-pos completion statistics, also protected by sched_lock */
+	u64 move_count;
+	u64 move_ns;
+	u64 move_max_ns;
+	u64 move_lag_ns;
+	u64 move_lag_max_ns;
+	u64 move_polls;
+	/* batching */
+	struct mutex batch_lock;
+	struct task_struct *batch_owner;
+	unsigned int batch_depth;
+	unsigned int batch_len;
+	u8 batch_address;
+	enum brickpi3_bus_class batch_class;
+	struct brickpi3_batch_entry batch[BRICKPI3_MAX_BATCH_SIZE];
+	struct spi_transfer batch_xfer[BRICKPI3_MAX_BATCH_SIZE];
+	struct spi_message batch_msg;
+	/* statistics, protected by the bus lock */
+	ktime_t stats_start;
+	u64 stats_busy_ns;
+	u64 stats_messages;
+	u64 stats_transfers;
+	u64 stats_bytes;
+	u64 stats_batches;
+	u64 stats_batch_ns;
+	u64 stats_batch_max_ns;
+	struct dentry *debug;
 };
 
+static enum brickpi3_bus_class brickpi3_msg_class(enum brickpi3_message msg)
+{
+	if (msg >= BRICKPI3_MSG_SET_MOTOR_POWER)
+		return BRICKPI3_BUS_MOTOR;
+	if (msg >= BRICKPI3_MSG_I2C_TRANSACT)
+		return BRICKPI3_BUS_I2C;
+	if (msg >= BRICKPI3_MSG_SET_SENSOR_TYPE)
+		return BRICKPI3_BUS_SENSOR;
+
+	return BRICKPI3_BUS_HOUSEKEEPING;
+}
+
+/*
+ * Picks the waiter that gets the bus next. A waiter that has waited longer
+ * than BRICKPI3_BUS_AGING_NS goes first so that lower classes are not starved.
+ * Otherwise, the highest class wins and the boards take turns within a class.
+ * Must be called with sched_lock held.
+ */
+static struct brickpi3_bus_waiter *brickpi3_bus_next(struct brickpi3 *bp,
+						     ktime_t now)
+{
+	struct brickpi3_bus_waiter *waiter, *next = NULL;
+	u8 distance, best = 0;
+	int i;
+
+	for (i = 0; i < NUM_BRICKPI3_BUS_CLASSES; i++) {
+		if (list_empty(&bp->sched_queue[i]))
+			continue;
+		waiter = list_first_entry(&bp->sched_queue[i],
+					  struct brickpi3_bus_waiter, list);
+		if (ktime_to_ns(ktime_sub(now, waiter->start)) >
+		    BRICKPI3_BUS_AGING_NS) {
+			bp->sched_stats[i].aged++;
+			return waiter;
+		}
+	}
+
+	for (i = 0; i < NUM_BRICKPI3_BUS_CLASSES; i++) {
+		list_for_each_entry(waiter, &bp->sched_queue[i], list) {
+			/* the board after the last one served is closest */
+			distance = waiter->address - bp->sched_last_address - 1;
+			if (!next || distance < best) {
+				next = waiter;
+				best = distance;
+			}
+		}
+		if (next)
+			break;
+	}
+
+	return next;
+}
+
+/*
+ * Takes exclusive use of the SPI bus and bp->buf. This works like a mutex,
+ * except that when the bus is released, it is handed to the waiter picked by
+ * brickpi3_bus_next() instead of whoever happens to get there first.
+ */
+static void brickpi3_bus_lock(struct brickpi3 *bp, u8 address,
+			      enum brickpi3_bus_class class)
+{
+	struct brickpi3_bus_stats *stats = &bp->sched_stats[class];
+	struct brickpi3_bus_waiter waiter;
+
+	spin_lock(&bp->sched_lock);
+
+	stats->grants++;
+	if (address <= BRICKPI3_MAX_ADDRESS)
+		bp->sched_board_grants[address]++;
+
+	if (!bp->bus_busy) {
+		bp->bus_busy = true;
+		bp->sched_last_address = address;
+		spin_unlock(&bp->sched_lock);
+		goto out;
+	}
+
+	waiter.address = address;
+	waiter.class = class;
+	waiter.start = ktime_get();
+	init_completion(&waiter.done);
+	list_add_tail(&waiter.list, &bp->sched_queue[class]);
+	stats->waits++;
+	if (++stats->depth > stats->max_depth)
+		stats->max_depth = stats->depth;
+
+	spin_unlock(&bp->sched_lock);
+
+	wait_for_completion(&waiter.done);
+
+out:
+	bp->bus_address = address;
+	bp->bus_class = class;
+}
+
+static void brickpi3_bus_unlock(struct brickpi3 *bp)
+{
+	struct brickpi3_bus_waiter *next;
+	struct brickpi3_bus_stats *stats;
+	ktime_t now = ktime_get();
+	u64 ns;
+
+	spin_lock(&bp->sched_lock);
+
+	next = brickpi3_bus_next(bp, now);
+	if (next) {
+		stats = &bp->sched_stats[next->class];
+		list_del(&next->list);
+		stats->depth--;
+		ns = ktime_to_ns(ktime_sub(now, next->start));
+		stats->wait_ns += ns;
+		if (ns > stats->max_wait_ns)
+			stats->max_wait_ns = ns;
+		bp->sched_last_address = next->address;
+		complete(&next->done);
+	} else {
+		bp->bus_busy = false;
+	}
+
+	spin_unlock(&bp->sched_lock);
+}
+
+/*
+ * All SPI messages go through here so that the time that the bus is busy can
+ * be counted. Must be called with the bus locked.
+ */
+static int brickpi3_spi_sync(struct brickpi3 *bp, struct spi_message *msg)
+{
+	struct spi_transfer *xfer;
+	ktime_t start;
+	int ret;
+
+	start = ktime_get();
+	ret = spi_sync(bp->spi, msg);
+	bp->stats_busy_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	bp->stats_messages++;
+	list_for_each_entry(xfer, &msg->transfers, transfer_list)
+		bp->stats_transfers++;
+	if (ret == 0)
+		bp->stats_bytes += msg->actual_length;
+
+	return ret;
+}
+
+/*
+ * Sends all queued messages as a single SPI message. Chip select is toggled
+ * between each transfer so that the BrickPi3 sees them as separate messages.
+ * The completion callbacks of queued reads are called afterwards, still with
+ * the bus locked. Must be called with the bus locked.
+ */
+static int brickpi3_flush_batch(struct brickpi3 *bp)
+{
+	struct brickpi3_batch_entry *entry;
+	int i, ret, err;
+
+	if (!bp->batch_len)
+		return 0;
+
+	spi_message_init(&bp->batch_msg);
+	for (i = 0; i < bp->batch_len; i++) {
+		bp->batch_xfer[i].cs_change = i < bp->batch_len - 1;
+		spi_message_add_tail(&bp->batch_xfer[i], &bp->batch_msg);
+	}
+
+	ret = brickpi3_spi_sync(bp, &bp->batch_msg);
+
+	for (i = 0; i < bp->batch_len; i++) {
+		entry = &bp->batch[i];
+		if (!entry->complete)
+			continue;
+
+		err = ret;
+		if (!err && BRICKPI3_READ_FAILED(entry->buf))
+			err = -EIO;
+		entry->complete(entry->context,
+				&entry->buf[BRICKPI3_HEADER_SIZE], err);
+	}
+
+	bp->batch_len = 0;
+
+	return ret;
+}
+
+/*
+ * Adds a message of len bytes to the batch, flushing it first if it is full.
+ * Returns the buffer for the message. Must be called with the bus locked.
+ */
+static struct brickpi3_batch_entry *
+brickpi3_batch_add(struct brickpi3 *bp, size_t len, int *ret)
+{
+	struct brickpi3_batch_entry *entry;
+	struct spi_transfer *xfer;
+
+	*ret = 0;
+	if (bp->batch_len == BRICKPI3_MAX_BATCH_SIZE) {
+		*ret = brickpi3_flush_batch(bp);
+		if (*ret < 0)
+			return NULL;
+	}
+
+	/* the batch is sent with the highest class of any of its messages */
+	if (!bp->batch_len) {
+		bp->batch_address = bp->bus_address;
+		bp->batch_class = bp->bus_class;
+	} else if (bp->bus_class < bp->batch_class) {
+		bp->batch_class = bp->bus_class;
+	}
+
+	entry = &bp->batch[bp->batch_len];
+	entry->complete = NULL;
+	entry->context = NULL;
+	xfer = &bp->batch_xfer[bp->batch_len];
+	memset(xfer, 0, sizeof(*xfer));
+	xfer->tx_buf = entry->buf;
+	xfer->rx_buf = entry->buf;
+	xfer->len = len;
+	bp->batch_len++;
+
+	return entry;
+}
+
+/*
+ * Sends the write-only message that has been placed in bp->buf. If the calling
+ * thread has started a batch with brickpi3_begin_batch(), the message is
+ * queued instead. Must be called with the bus locked.
+ */
+static int brickpi3_spi_write(struct brickpi3 *bp)
+{
+	struct brickpi3_batch_entry *entry;
+	int ret;
+
+	if (bp->batch_owner != current)
+		return brickpi3_spi_sync(bp, &bp->msg);
+
+	entry = brickpi3_batch_add(bp, bp->xfer.len, &ret);
+	if (entry)
+		memcpy(entry->buf, bp->buf, bp->xfer.len);
+
+	return ret;
+}
+
+/**
+ * brickpi3_queue_read - Queue a message that reads data
+ *
+ * @bp: The private driver data
+ * @address: The BrickPi3 address
+ * @msg: The command to send
+ * @len: The number of bytes of data to read (after the header), must be
+ *	<= BRICKPI3_STRING_MSG_SIZE
+ * @complete: Called with the data that was read, or with a negative error code
+ *	if the message failed. It is called with the SPI bus locked, so it must
+ *	not call any other brickpi3_* function.
+ * @context: Passed to @complete.
+ *
+ * If the calling thread has started a batch with brickpi3_begin_batch(), the
+ * message is sent along with the rest of the batch and @complete is called
+ * from the last brickpi3_end_batch(). Otherwise, it is sent right away in
+ * bp->buf, without touching a batch that another thread may be building, and
+ * @complete is called before this function returns.
+ *
+ * Returns 0 on success or negative error code.
+ */
+int brickpi3_queue_read(struct brickpi3 *bp, u8 address,
+			enum brickpi3_message msg, size_t len,
+			void (*complete)(void *context, const u8 *data, int err),
+			void *context)
+{
+	struct brickpi3_batch_entry *entry;
+	int ret;
+
+	if (len > BRICKPI3_STRING_MSG_SIZE)
+		return -EINVAL;
+
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
+
+	if (bp->batch_owner != current) {
+		memset(bp->buf, 0, BRICKPI3_HEADER_SIZE + len);
+		bp->buf[0] = address;
+		bp->buf[1] = msg;
+		bp->xfer.len = BRICKPI3_HEADER_SIZE + len;
+
+		ret = brickpi3_spi_sync(bp, &bp->msg);
+		if (!ret && BRICKPI3_READ_FAILED(bp->buf))
+			ret = -EIO;
+		complete(context, &bp->buf[BRICKPI3_HEADER_SIZE], ret);
+	} else {
+		entry = brickpi3_batch_add(bp, BRICKPI3_HEADER_SIZE + len, &ret);
+		if (entry) {
+			memset(entry->buf, 0, BRICKPI3_HEADER_SIZE + len);
+			entry->buf[0] = address;
+			entry->buf[1] = msg;
+			entry->complete = complete;
+			entry->context = context;
+		}
+	}
+
+	brickpi3_bus_unlock(bp);
+
+	return ret;
+}
+
+/* motor status replies have 8 bytes of data after the header */
+#define BRICKPI3_MOTOR_DATA_SIZE	8
+
+static void brickpi3_decode_motor(const u8 *data,
+				  enum brickpi3_motor_status *status,
+				  int *duty_cycle, int *position, int *speed)
+{
+	if (status)
+		*status = data[0];
+	if (duty_cycle)
+		*duty_cycle = (s8)data[1];
+	if (position)
+		*position = (data[2] << 24) | (data[3] << 16) |
+			    (data[4] << 8) | data[5];
+	if (speed)
+		*speed = (s16)((data[6] << 8) | data[7]);
+}
+
+static void brickpi3_queue_read_motor_complete(void *context, const u8 *data,
+					       int err)
+{
+	struct brickpi3_motor_reading *reading = context;
+
+	reading->err = err;
+	if (err)
+		return;
+
+	brickpi3_decode_motor(data, &reading->status, &reading->duty_cycle,
+			      &reading->position, &reading->speed);
+}
+
+/**
+ * brickpi3_queue_read_motor - Queue a read of the motor state
+ *
+ * @bp: The private driver data
+ * @address: The BrickPi3 address
+ * @port: The output port
+ * @reading: Filled in when the message has been sent. reading->err is set to
+ *	0 on success or to a negative error code.
+ *
+ * This is the queued version of brickpi3_read_motor(). See
+ * brickpi3_queue_read() for when @reading is filled in.
+ *
+ * Returns 0 on success or negative error code.
+ */
+int brickpi3_queue_read_motor(struct brickpi3 *bp, u8 address,
+			      enum brickpi3_output_port port,
+			      struct brickpi3_motor_reading *reading)
+{
+	return brickpi3_queue_read(bp, address,
+				   BRICKPI3_MSG_GET_MOTOR_STATUS + port,
+				   BRICKPI3_MOTOR_DATA_SIZE,
+				   brickpi3_queue_read_motor_complete, reading);
+}
+
+static void brickpi3_queue_read_sensor_complete(void *context, const u8 *data,
+						int err)
+{
+	struct brickpi3_sensor_reading *reading = context;
+
+	reading->err = err;
+	if (err)
+		return;
+
+	reading->type = data[0];
+	reading->state = data[1];
+	memcpy(reading->data, &data[2], sizeof(reading->data));
+}
+
+/**
+ * brickpi3_queue_read_sensor - Queue a read of the sensor data
+ *
+ * @bp: The private driver data
+ * @address: The BrickPi3 address
+ * @port: The input port
+ * @reading: Filled in when the message has been sent. reading->err is set to
+ *	0 on success or to a negative error code. Unlike brickpi3_read_sensor(),
+ *	the type and state are not checked, so it is up to the caller to do so.
+ *
+ * This is the queued version of brickpi3_read_sensor(). See
+ * brickpi3_queue_read() for when @reading is filled in.
+ *
+ * Returns 0 on success or negative error code.
+ */
+int brickpi3_queue_read_sensor(struct brickpi3 *bp, u8 address,
+			       enum brickpi3_input_port port,
+			       struct brickpi3_sensor_reading *reading)
+{
+	return brickpi3_queue_read(bp, address, BRICKPI3_MSG_GET_SENSOR + port,
+				   2 + sizeof(reading->data),
+				   brickpi3_queue_read_sensor_complete, reading);
+}
+
+/**
+ * brickpi3_begin_batch - Start queuing messages
+ *
+ * @bp: The private driver data
+ *
+ * Messages that only write data and reads sent with brickpi3_queue_read() by
+ * the calling thread will be queued until the matching call to
+ * brickpi3_end_batch(). Other messages that read data, e.g. from
+ * brickpi3_read_u16(), are still sent right away, ahead of the queued ones.
+ * Messages from other threads are not added to the batch. Calls may be nested.
+ */
+void brickpi3_begin_batch(struct brickpi3 *bp)
+{
+	if (bp->batch_owner == current) {
+		bp->batch_depth++;
+		return;
+	}
+
+	mutex_lock(&bp->batch_lock);
+	bp->batch_owner = current;
+	bp->batch_depth = 1;
+}
+
+/**
+ * brickpi3_end_batch - Stop queuing messages
+ *
+ * @bp: The private driver data
+ *
+ * The last of nested calls sends all queued messages in one SPI transaction.
+ *
+ * Returns 0 on success or negative error code.
+ */
+int brickpi3_end_batch(struct brickpi3 *bp)
+{
+	ktime_t start;
+	u64 ns;
+	int ret;
+
+	if (WARN_ON(bp->batch_owner != current))
+		return -EINVAL;
+
+	if (--bp->batch_depth)
+		return 0;
+
+	start = ktime_get();
+	brickpi3_bus_lock(bp, READ_ONCE(bp->batch_address),
+			  READ_ONCE(bp->batch_class));
+	if (bp->batch_len) {
+		ret = brickpi3_flush_batch(bp);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		bp->stats_batches++;
+		bp->stats_batch_ns += ns;
+		if (ns > bp->stats_batch_max_ns)
+			bp->stats_batch_max_ns = ns;
+	} else {
+		ret = 0;
+	}
+	bp->batch_owner = NULL;
+	brickpi3_bus_unlock(bp);
+
+	mutex_unlock(&bp->batch_lock);
+
+	return ret;
+}
+
 /**
  * brickpi3_write_u8 - Write message with one byte of data
  *
@@ -57,16 +642,16 @@ int brickpi3_write_u8(struct brickpi3 *bp, u8 address, enum brickpi3_message msg
 {
 	int ret;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
 
 	bp->buf[0] = address;
 	bp->buf[1] = msg;
 	bp->buf[2] = value;
 	bp->xfer.len = 3;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_write(bp);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -76,7 +661,7 @@ int brickpi3_write_u8_u8(struct brickpi3 *bp, u8 address,
 {
 	int ret;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
 
 	bp->buf[0] = address;
 	bp->buf[1] = msg;
@@ -84,9 +669,9 @@ int brickpi3_write_u8_u8(struct brickpi3 *bp, u8 address,
 	bp->buf[3] = value2;
 	bp->xfer.len = 4;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_write(bp);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -106,7 +691,7 @@ int brickpi3_read_u16(struct brickpi3 *bp, u8 address, enum brickpi3_message msg
 {
 	int ret = 0;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
 
 	bp->buf[0] = address;
 	bp->buf[1] = msg;
@@ -116,7 +701,7 @@ int brickpi3_read_u16(struct brickpi3 *bp, u8 address, enum brickpi3_message msg
 	bp->buf[5] = 0;
 	bp->xfer.len = 6;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_sync(bp, &bp->msg);
 	if (ret < 0)
 		goto out;
 
@@ -128,7 +713,7 @@ int brickpi3_read_u16(struct brickpi3 *bp, u8 address, enum brickpi3_message msg
 	*value = (bp->buf[4] << 8) | bp->buf[5];
 
 out:
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -148,7 +733,7 @@ int brickpi3_write_u16(struct brickpi3 *bp, u8 address,
 {
 	int ret;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
 
 	bp->buf[0] = address;
 	bp->buf[1] = msg;
@@ -156,9 +741,9 @@ int brickpi3_write_u16(struct brickpi3 *bp, u8 address,
 	bp->buf[3] = value & 0xff;
 	bp->xfer.len = 4;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_write(bp);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -168,7 +753,7 @@ int brickpi3_write_u8_u16(struct brickpi3 *bp, u8 address,
 {
 	int ret;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
 
 	bp->buf[0] = address;
 	bp->buf[1] = msg;
@@ -177,9 +762,9 @@ int brickpi3_write_u8_u16(struct brickpi3 *bp, u8 address,
 	bp->buf[4] = value2 & 0xff;
 	bp->xfer.len = 5;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_write(bp);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -199,7 +784,7 @@ int brickpi3_write_u24(struct brickpi3 *bp, u8 address,
 {
 	int ret;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
 
 	bp->buf[0] = address;
 	bp->buf[1] = msg;
@@ -208,9 +793,9 @@ int brickpi3_write_u24(struct brickpi3 *bp, u8 address,
 	bp->buf[4] = value & 0xff;
 	bp->xfer.len = 5;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_write(bp);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -230,7 +815,7 @@ int brickpi3_read_u32(struct brickpi3 *bp, u8 address,
 {
 	int ret = 0;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
 
 	bp->buf[0] = address;
 	bp->buf[1] = msg;
@@ -242,7 +827,7 @@ int brickpi3_read_u32(struct brickpi3 *bp, u8 address,
 	bp->buf[7] = 0;
 	bp->xfer.len = 8;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_sync(bp, &bp->msg);
 	if (ret < 0)
 		goto out;
 
@@ -255,7 +840,7 @@ int brickpi3_read_u32(struct brickpi3 *bp, u8 address,
 		 (bp->buf[6] << 8) | bp->buf[7];
 
 out:
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -275,7 +860,7 @@ int brickpi3_write_u32(struct brickpi3 *bp, u8 address,
 {
 	int ret;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
 
 	bp->buf[0] = address;
 	bp->buf[1] = msg;
@@ -285,9 +870,9 @@ int brickpi3_write_u32(struct brickpi3 *bp, u8 address,
 	bp->buf[5] = value & 0xff;
 	bp->xfer.len = 6;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_write(bp);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -297,7 +882,7 @@ int brickpi3_write_u8_u32(struct brickpi3 *bp, u8 address,
 {
 	int ret;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
 
 	bp->buf[0] = address;
 	bp->buf[1] = msg;
@@ -308,9 +893,9 @@ int brickpi3_write_u8_u32(struct brickpi3 *bp, u8 address,
 	bp->buf[6] = value2 & 0xff;
 	bp->xfer.len = 7;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_write(bp);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -331,7 +916,7 @@ int brickpi3_read_string(struct brickpi3 *bp, u8 address,
 {
 	int ret = 0;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, brickpi3_msg_class(msg));
 
 	bp->buf[0] = address;
 	bp->buf[1] = msg;
@@ -340,7 +925,7 @@ int brickpi3_read_string(struct brickpi3 *bp, u8 address,
 	memset(&bp->buf[BRICKPI3_HEADER_SIZE], 0, len);
 	bp->xfer.len = BRICKPI3_HEADER_SIZE + len;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_sync(bp, &bp->msg);
 	if (ret < 0)
 		goto out;
 
@@ -352,7 +937,7 @@ int brickpi3_read_string(struct brickpi3 *bp, u8 address,
 	memcpy(value, &bp->buf[BRICKPI3_HEADER_SIZE], len);
 
 out:
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -361,7 +946,7 @@ static int brickpi3_set_address(struct brickpi3 *bp, u8 address, u8 id[16])
 {
 	int ret;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, 0, BRICKPI3_BUS_HOUSEKEEPING);
 
 	bp->buf[0] = 0;
 	bp->buf[1] = BRICKPI3_MSG_SET_ADDRESS;
@@ -369,9 +954,9 @@ static int brickpi3_set_address(struct brickpi3 *bp, u8 address, u8 id[16])
 	strncpy(&bp->buf[3], id, 16);
 	bp->xfer.len = 19;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_sync(bp, &bp->msg);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -395,7 +980,7 @@ int brickpi3_read_sensor(struct brickpi3 *bp, u8 address,
 {
 	int ret = 0;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, BRICKPI3_BUS_SENSOR);
 
 	bp->buf[0] = address;
 	bp->buf[1] = BRICKPI3_MSG_GET_SENSOR + port;
@@ -406,7 +991,7 @@ int brickpi3_read_sensor(struct brickpi3 *bp, u8 address,
 	memset(&bp->buf[6], 0, len);
 	bp->xfer.len = 6 + len;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_sync(bp, &bp->msg);
 	if (ret < 0)
 		goto out;
 
@@ -428,7 +1013,7 @@ int brickpi3_read_sensor(struct brickpi3 *bp, u8 address,
 	memcpy(value, &bp->buf[6], len);
 
 out:
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -449,7 +1034,7 @@ int brickpi3_set_sensor_custom(struct brickpi3 *bp, u8 address,
 {
 	int ret = 0;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, BRICKPI3_BUS_SENSOR);
 
 	bp->buf[0] = address;
 	bp->buf[1] = BRICKPI3_MSG_SET_SENSOR_TYPE;
@@ -459,9 +1044,9 @@ int brickpi3_set_sensor_custom(struct brickpi3 *bp, u8 address,
 	bp->buf[5] = flags & 0xff;
 	bp->xfer.len = 6;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_write(bp);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -484,7 +1069,7 @@ int brickpi3_set_sensor_i2c(struct brickpi3 *bp, u8 address,
 {
 	int ret = 0;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, BRICKPI3_BUS_SENSOR);
 
 	bp->buf[0] = address;
 	bp->buf[1] = BRICKPI3_MSG_SET_SENSOR_TYPE;
@@ -495,40 +1080,99 @@ int brickpi3_set_sensor_i2c(struct brickpi3 *bp, u8 address,
 	bp->xfer.len = 6;
 	/* TODO: handle extra params for (flags & BRICKPI3_I2C_SAME) */
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_write(bp);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
 
-/**
- * brickpi3_i2c_transact - Do and I2C transaction
- *
- * @bp: The private driver data
- * @address: The BrickPi3 address
- * @port: The input port
- * @i2c_addr: The I2C address
- * @write_buf: Array of data to write
- * @write_size: The number of bytes to write (<= BRICKPI3_I2C_MAX_WRITE_SIZE)
- * @read_buf: The buffer to store the read data
- * @read_size: The number of bytes to read (<= BRICKPI3_I2C_MAX_READ_SIZE)
- *
- * Returns 0 on success or negative error code.
+/*
+ * The BrickPi3 runs the I2C bus at about 10kHz, so each byte takes about one
+ * millisecond. The result is not polled before the bytes could possibly have
+ * been sent, then the poll interval is doubled each time up to a limit.
  */
-int brickpi3_i2c_transact(struct brickpi3 *bp, u8 address,
-			  enum brickpi3_input_port port, u8 i2c_addr,
-			  u8 *write_buf, u8 write_size,
-			  u8 *read_buf, u8 read_size)
+#define BRICKPI3_I2C_BYTE_US		1000
+#define BRICKPI3_I2C_MIN_POLL_US	500
+#define BRICKPI3_I2C_MAX_POLL_US	4000
+#define BRICKPI3_I2C_TIMEOUT_US		100000
+
+static void brickpi3_i2c_finish(struct brickpi3_i2c_request *req, int err)
 {
-	int ret = 0;
+	req->err = err;
+	/* req may be freed by the callback, so it must not be touched after */
+	req->complete(req);
+}
+
+static void brickpi3_i2c_poll_work(struct work_struct *work)
+{
+	struct brickpi3_i2c_request *req =
+		container_of(work, struct brickpi3_i2c_request, work);
+	int ret;
+
+	ret = brickpi3_queue_read_sensor(req->bp, req->address, req->port,
+					 &req->reading);
+	if (ret == 0)
+		ret = req->reading.err;
+	if (ret < 0) {
+		brickpi3_i2c_finish(req, ret);
+		return;
+	}
+
+	if (req->reading.type != BRICKPI3_SENSOR_TYPE_I2C) {
+		brickpi3_i2c_finish(req, -EBUSY);
+		return;
+	}
+
+	switch (req->reading.state) {
+	case BRICKPI3_SENSOR_STATE_VALID_DATA:
+		memcpy(req->read_buf, req->reading.data, req->read_size);
+		brickpi3_i2c_finish(req, 0);
+		return;
+	case BRICKPI3_SENSOR_STATE_I2C_ERROR:
+		brickpi3_i2c_finish(req, -EIO);
+		return;
+	}
+
+	if (ktime_us_delta(ktime_get(), req->start) > BRICKPI3_I2C_TIMEOUT_US) {
+		brickpi3_i2c_finish(req, -ETIMEDOUT);
+		return;
+	}
+
+	req->delay_us = min_t(unsigned int, req->delay_us * 2,
+			      BRICKPI3_I2C_MAX_POLL_US);
+	hrtimer_start(&req->timer, ns_to_ktime(req->delay_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart brickpi3_i2c_timer_function(struct hrtimer *timer)
+{
+	struct brickpi3_i2c_request *req =
+		container_of(timer, struct brickpi3_i2c_request, timer);
 
-	if (read_size > BRICKPI3_I2C_MAX_READ_SIZE)
+	schedule_work(&req->work);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Sends the request and starts polling for the result. req->work and
+ * req->timer must already be initialized.
+ */
+static int __brickpi3_i2c_submit(struct brickpi3 *bp,
+				 struct brickpi3_i2c_request *req)
+{
+	int ret;
+
+	if (req->read_size > BRICKPI3_I2C_MAX_READ_SIZE)
 		return -EINVAL;
-	if (write_size > BRICKPI3_I2C_MAX_WRITE_SIZE)
+	if (req->write_size > BRICKPI3_I2C_MAX_WRITE_SIZE)
 		return -EINVAL;
 
-	mutex_lock(&bp->xfer_lock);
+	req->bp = bp;
+	req->timer.function = brickpi3_i2c_timer_function;
+
+	brickpi3_bus_lock(bp, req->address, BRICKPI3_BUS_I2C);
 
 	/*
 	 * TODO: It might be better to error early if we know the port is not
@@ -536,61 +1180,117 @@ int brickpi3_i2c_transact(struct brickpi3 *bp, u8 address,
 	 * read back the response if the mode was not set.
 	 */
 
-	bp->buf[0] = address;
-	bp->buf[1] = BRICKPI3_MSG_I2C_TRANSACT + port;
-	bp->buf[2] = i2c_addr << 1;
-	bp->buf[3] = read_size;
-	bp->buf[4] = write_size;
-	memcpy(&bp->buf[5], write_buf, write_size);
-	bp->xfer.len = 5 + write_size;
-
-	ret = spi_sync(bp->spi, &bp->msg);
-	if (ret < 0)
-		goto out;
+	bp->buf[0] = req->address;
+	bp->buf[1] = BRICKPI3_MSG_I2C_TRANSACT + req->port;
+	bp->buf[2] = req->i2c_addr << 1;
+	bp->buf[3] = req->read_size;
+	bp->buf[4] = req->write_size;
+	memcpy(&bp->buf[5], req->write_buf, req->write_size);
+	bp->xfer.len = 5 + req->write_size;
 
-	if (BRICKPI3_READ_FAILED(bp->buf)) {
+	ret = brickpi3_spi_sync(bp, &bp->msg);
+	if (ret == 0 && BRICKPI3_READ_FAILED(bp->buf))
 		ret = -EIO;
-		goto out;
+
+	brickpi3_bus_unlock(bp);
+
+	if (ret < 0)
+		return ret;
+
+	if (!req->read_buf || !req->read_size) {
+		brickpi3_i2c_finish(req, 0);
+		return 0;
 	}
 
-	if (read_buf && read_size) {
-		/*
-		 * FIXME: msleep is never a good idea. Perhaps we could keep
-		 * polling until spi_sync() returns BRICKPI3_SENSOR_STATE_VALID_DATA
-		 * along with a timeout mechanism.
-		 *
-		 * For now, we are estimating one msec per byte (I2C operates
-		 * at 10kHz)
-		 */
-		msleep(write_size + read_size + 2);
+	req->start = ktime_get();
+	req->delay_us = BRICKPI3_I2C_MIN_POLL_US;
+	/* the address byte is sent too */
+	hrtimer_start(&req->timer,
+		      ns_to_ktime((req->write_size + req->read_size + 1) *
+				  BRICKPI3_I2C_BYTE_US * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
 
-		bp->buf[0] = address;
-		bp->buf[1] = BRICKPI3_MSG_GET_SENSOR + port;
-		memset(&bp->buf[2], 0, 4 + read_size);
-		bp->xfer.len = 6 + read_size;
+	return 0;
+}
 
-		ret = spi_sync(bp->spi, &bp->msg);
-		if (ret < 0)
-			goto out;
+/**
+ * brickpi3_i2c_submit - Start an I2C transaction
+ *
+ * @bp: The private driver data
+ * @req: The transaction. It must stay valid until req->complete is called.
+ *
+ * The request is sent to the BrickPi3 and then the SPI bus is released while
+ * the BrickPi3 does the I2C transaction, so other messages, including I2C
+ * transactions on other ports, can be sent in the meantime. The input port is
+ * polled until the read data is available and then req->complete is called
+ * from a workqueue. Write-only transactions are completed right away.
+ *
+ * Returns 0 on success or negative error code. If an error is returned,
+ * req->complete is not called.
+ */
+int brickpi3_i2c_submit(struct brickpi3 *bp, struct brickpi3_i2c_request *req)
+{
+	INIT_WORK(&req->work, brickpi3_i2c_poll_work);
+	hrtimer_init(&req->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 
-		if (BRICKPI3_READ_FAILED(bp->buf)) {
-			ret = -EIO;
-			goto out;
-		}
-		if (bp->buf[4] != BRICKPI3_SENSOR_TYPE_I2C) {
-			ret = -EBUSY;
-			goto out;
-		}
-		if (bp->buf[5] != BRICKPI3_SENSOR_STATE_VALID_DATA) {
-			ret = -EIO;
-			goto out;
-		}
+	return __brickpi3_i2c_submit(bp, req);
+}
 
-		memcpy(read_buf, &bp->buf[6], read_size);
+static void brickpi3_i2c_transact_complete(struct brickpi3_i2c_request *req)
+{
+	complete(req->context);
+}
+
+/**
+ * brickpi3_i2c_transact - Do and I2C transaction
+ *
+ * @bp: The private driver data
+ * @address: The BrickPi3 address
+ * @port: The input port
+ * @i2c_addr: The I2C address
+ * @write_buf: Array of data to write
+ * @write_size: The number of bytes to write (<= BRICKPI3_I2C_MAX_WRITE_SIZE)
+ * @read_buf: The buffer to store the read data
+ * @read_size: The number of bytes to read (<= BRICKPI3_I2C_MAX_READ_SIZE)
+ *
+ * This is the synchronous version of brickpi3_i2c_submit(). It sleeps until
+ * the transaction has finished, but does not keep the SPI bus locked.
+ *
+ * Returns 0 on success or negative error code.
+ */
+int brickpi3_i2c_transact(struct brickpi3 *bp, u8 address,
+			  enum brickpi3_input_port port, u8 i2c_addr,
+			  u8 *write_buf, u8 write_size,
+			  u8 *read_buf, u8 read_size)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct brickpi3_i2c_request req = {
+		.address	= address,
+		.port		= port,
+		.i2c_addr	= i2c_addr,
+		.write_buf	= write_buf,
+		.write_size	= write_size,
+		.read_buf	= read_buf,
+		.read_size	= read_size,
+		.complete	= brickpi3_i2c_transact_complete,
+		.context	= &done,
+	};
+	int ret;
+
+	INIT_WORK_ONSTACK(&req.work, brickpi3_i2c_poll_work);
+	hrtimer_init_on_stack(&req.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+
+	ret = __brickpi3_i2c_submit(bp, &req);
+	if (ret == 0) {
+		wait_for_completion(&done);
+		ret = req.err;
 	}
 
-out:
-	mutex_unlock(&bp->xfer_lock);
+	/* the timer callback or the work may still be returning */
+	hrtimer_cancel(&req.timer);
+	cancel_work_sync(&req.work);
+	destroy_hrtimer_on_stack(&req.timer);
+	destroy_work_on_stack(&req.work);
 
 	return ret;
 }
@@ -601,7 +1301,7 @@ int brickpi3_set_motor_limits(struct brickpi3 *bp, u8 address,
 {
 	int ret;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, BRICKPI3_BUS_MOTOR);
 
 	bp->buf[0] = address;
 	bp->buf[1] = BRICKPI3_MSG_SET_MOTOR_LIMITS;
@@ -611,9 +1311,9 @@ int brickpi3_set_motor_limits(struct brickpi3 *bp, u8 address,
 	bp->buf[5] = speed & 0xff;
 	bp->xfer.len = 6;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_write(bp);
 
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -636,14 +1336,14 @@ int brickpi3_read_motor(struct brickpi3 *bp, u8 address,
 {
 	int ret;
 
-	mutex_lock(&bp->xfer_lock);
+	brickpi3_bus_lock(bp, address, BRICKPI3_BUS_MOTOR);
 
 	bp->buf[0] = address;
 	bp->buf[1] = BRICKPI3_MSG_GET_MOTOR_STATUS + port;
-	memset(&bp->buf[2], 0, 10);
-	bp->xfer.len = 12;
+	memset(&bp->buf[2], 0, 2 + BRICKPI3_MOTOR_DATA_SIZE);
+	bp->xfer.len = BRICKPI3_HEADER_SIZE + BRICKPI3_MOTOR_DATA_SIZE;
 
-	ret = spi_sync(bp->spi, &bp->msg);
+	ret = brickpi3_spi_sync(bp, &bp->msg);
 	if (ret < 0)
 		goto out;
 
@@ -652,18 +1352,11 @@ int brickpi3_read_motor(struct brickpi3 *bp, u8 address,
 		goto out;
 	}
 
-	if (status)
-		*status = bp->buf[4];
-	if (duty_cycle)
-		*duty_cycle = (s8)bp->buf[5];
-	if (position)
-		*position = (bp->buf[6] << 24) | (bp->buf[7] << 16) |
-			    (bp->buf[8] << 8) | bp->buf[9];
-	if (speed)
-		*speed = (s16)((bp->buf[10] << 8) | bp->buf[11]);
+	brickpi3_decode_motor(&bp->buf[BRICKPI3_HEADER_SIZE], status,
+			      duty_cycle, position, speed);
 
 out:
-	mutex_unlock(&bp->xfer_lock);
+	brickpi3_bus_unlock(bp);
 
 	return ret;
 }
@@ -771,9 +1464,181 @@ static void brickpi3_set_addresses(struct brickpi3 *bp) {
 	}
 }
 
+static void brickpi3_stats_reset(struct brickpi3 *bp)
+{
+	int i;
+
+	bp->stats_start = ktime_get();
+	bp->stats_busy_ns = 0;
+	bp->stats_messages = 0;
+	bp->stats_transfers = 0;
+	bp->stats_bytes = 0;
+	bp->stats_batches = 0;
+	bp->stats_batch_ns = 0;
+	bp->stats_batch_max_ns = 0;
+
+	spin_lock(&bp->sched_lock);
+	for (i = 0; i < NUM_BRICKPI3_BUS_CLASSES; i++) {
+		struct brickpi3_bus_stats *stats = &bp->sched_stats[i];
+
+		/* waiters that are still in the queue are counted */
+		stats->max_depth = stats->depth;
+		stats->grants = 0;
+		stats->waits = 0;
+		stats->wait_ns = 0;
+		stats->max_wait_ns = 0;
+		stats->aged = 0;
+	}
+	memset(bp->sched_board_grants, 0, sizeof(bp->sched_board_grants));
+	bp->move_count = 0;
+	bp->move_ns = 0;
+	bp->move_max_ns = 0;
+	bp->move_lag_ns = 0;
+	bp->move_lag_max_ns = 0;
+	bp->move_polls = 0;
+	spin_unlock(&bp->sched_lock);
+}
+
+/**
+ * brickpi3_record_run_to_pos - add a finished move to the statistics
+ *
+ * @bp: The private driver data
+ * @move_ns: The time from the command until the arrival was noticed
+ * @lag_ns: The longest that the arrival could have gone unnoticed
+ * @polls: The number of times the motor was read during the move
+ */
+void brickpi3_record_run_to_pos(struct brickpi3 *bp, u64 move_ns, u64 lag_ns,
+				unsigned int polls)
+{
+	spin_lock(&bp->sched_lock);
+	bp->move_count++;
+	bp->move_ns += move_ns;
+	bp->move_max_ns = max(bp->move_max_ns, move_ns);
+	bp->move_lag_ns += lag_ns;
+	bp->move_lag_max_ns = max(bp->move_lag_max_ns, lag_ns);
+	bp->move_polls += polls;
+	spin_unlock(&bp->sched_lock);
+}
+
+/*
+ * Bus utilisation is the time spent in spi_sync() divided by the time since
+ * the statistics were reset. Batch latency is the time from the last
+ * brickpi3_end_batch() until the batch has been sent, so it includes waiting
+ * for the bus. The queue of each class shows how many threads are waiting for
+ * the bus and for how long. The move lag is the time between the last two
+ * reads of a motor that was running to a position, so it is the most that the
+ * arrival could have been noticed late.
+ */
+static int brickpi3_stats_show(struct seq_file *s, void *unused)
+{
+	struct brickpi3 *bp = s->private;
+	struct brickpi3_bus_stats sched[NUM_BRICKPI3_BUS_CLASSES];
+	u64 board_grants[BRICKPI3_MAX_ADDRESS + 1];
+	u64 move_count, move_ns, move_max_ns, move_lag_ns, move_lag_max_ns;
+	u64 move_polls;
+	u64 elapsed_ns, busy_permille = 0, batch_avg_us = 0, wait_avg_us;
+	int i;
+
+	brickpi3_bus_lock(bp, 0, BRICKPI3_BUS_HOUSEKEEPING);
+
+	elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), bp->stats_start));
+	if (elapsed_ns)
+		busy_permille = div64_u64(bp->stats_busy_ns * 1000, elapsed_ns);
+	if (bp->stats_batches)
+		batch_avg_us = div64_u64(bp->stats_batch_ns,
+					 bp->stats_batches * NSEC_PER_USEC);
+
+	seq_printf(s, "elapsed_ms: %llu\n", div_u64(elapsed_ns, NSEC_PER_MSEC));
+	seq_printf(s, "busy_ms: %llu\n",
+		   div_u64(bp->stats_busy_ns, NSEC_PER_MSEC));
+	seq_printf(s, "utilisation: %llu.%llu%%\n", busy_permille / 10,
+		   busy_permille % 10);
+	seq_printf(s, "messages: %llu\n", bp->stats_messages);
+	seq_printf(s, "transfers: %llu\n", bp->stats_transfers);
+	seq_printf(s, "bytes: %llu\n", bp->stats_bytes);
+	seq_printf(s, "batches: %llu\n", bp->stats_batches);
+	seq_printf(s, "batch_latency_avg_us: %llu\n", batch_avg_us);
+	seq_printf(s, "batch_latency_max_us: %llu\n",
+		   div_u64(bp->stats_batch_max_ns, NSEC_PER_USEC));
+
+	brickpi3_bus_unlock(bp);
+
+	spin_lock(&bp->sched_lock);
+	memcpy(sched, bp->sched_stats, sizeof(sched));
+	memcpy(board_grants, bp->sched_board_grants, sizeof(board_grants));
+	move_count = bp->move_count;
+	move_ns = bp->move_ns;
+	move_max_ns = bp->move_max_ns;
+	move_lag_ns = bp->move_lag_ns;
+	move_lag_max_ns = bp->move_lag_max_ns;
+	move_polls = bp->move_polls;
+	spin_unlock(&bp->sched_lock);
+
+	for (i = 0; i < NUM_BRICKPI3_BUS_CLASSES; i++) {
+		wait_avg_us = 0;
+		if (sched[i].waits)
+			wait_avg_us = div64_u64(sched[i].wait_ns,
+						sched[i].waits * NSEC_PER_USEC);
+		seq_printf(s, "queue_%s: depth=%u max_depth=%u grants=%llu "
+			   "waits=%llu wait_avg_us=%llu wait_max_us=%llu "
+			   "aged=%llu\n", brickpi3_bus_class_names[i],
+			   sched[i].depth, sched[i].max_depth, sched[i].grants,
+			   sched[i].waits, wait_avg_us,
+			   div_u64(sched[i].max_wait_ns, NSEC_PER_USEC),
+			   sched[i].aged);
+	}
+	for (i = BRICKPI3_MIN_ADDRESS; i <= BRICKPI3_MAX_ADDRESS; i++)
+		seq_printf(s, "board%d_grants: %llu\n", i, board_grants[i]);
+
+	seq_printf(s, "moves: %llu\n", move_count);
+	if (move_count) {
+		move_ns = div64_u64(move_ns, move_count);
+		move_lag_ns = div64_u64(move_lag_ns, move_count);
+		move_polls = div64_u64(move_polls, move_count);
+	}
+	seq_printf(s, "move_avg_ms: %llu\n", div_u64(move_ns, NSEC_PER_MSEC));
+	seq_printf(s, "move_max_ms: %llu\n", div_u64(move_max_ns, NSEC_PER_MSEC));
+	seq_printf(s, "move_lag_avg_us: %llu\n",
+		   div_u64(move_lag_ns, NSEC_PER_USEC));
+	seq_printf(s, "move_lag_max_us: %llu\n",
+		   div_u64(move_lag_max_ns, NSEC_PER_USEC));
+	seq_printf(s, "move_polls_avg: %llu\n", move_polls);
+
+	return 0;
+}
+
+static int brickpi3_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, brickpi3_stats_show, inode->i_private);
+}
+
+/* writing anything to the file resets the statistics */
+static ssize_t brickpi3_stats_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct brickpi3 *bp = s->private;
+
+	brickpi3_bus_lock(bp, 0, BRICKPI3_BUS_HOUSEKEEPING);
+	brickpi3_stats_reset(bp);
+	brickpi3_bus_unlock(bp);
+
+	return count;
+}
+
+static const struct file_operations brickpi3_stats_fops = {
+	.open		= brickpi3_stats_open,
+	.read		= seq_read,
+	.write		= brickpi3_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int brickpi3_probe(struct spi_device *spi)
 {
 	struct device *dev = &spi->dev;
+	struct i2c_adapter *i2c_adap[NUM_BRICKPI3_INPUT_PORTS];
+	struct brickpi3_cache *cache;
 	struct brickpi3 *bp;
 	int i, ret;
 	bool ok = false;
@@ -788,7 +1653,11 @@ static int brickpi3_probe(struct spi_device *spi)
 	bp->xfer.tx_buf = bp->buf;
 	bp->xfer.rx_buf = bp->buf;
 	spi_message_init_with_transfers(&bp->msg, &bp->xfer, 1);
-	mutex_init(&bp->xfer_lock);
+	spin_lock_init(&bp->sched_lock);
+	for (i = 0; i < NUM_BRICKPI3_BUS_CLASSES; i++)
+		INIT_LIST_HEAD(&bp->sched_queue[i]);
+	mutex_init(&bp->batch_lock);
+	brickpi3_stats_reset(bp);
 
 	brickpi3_set_addresses(bp);
 
@@ -809,22 +1678,42 @@ static int brickpi3_probe(struct spi_device *spi)
 		if (ret < 0)
 			return ret;
 
-		ret = devm_brickpi3_register_i2c(dev, bp, i);
+		ret = devm_brickpi3_register_i2c(dev, bp, i, i2c_adap);
 		if (ret < 0)
 			return ret;
 
-		ret = devm_brickpi3_register_in_ports(dev, bp, i);
+		cache = devm_brickpi3_register_cache(dev, bp, i);
+		if (IS_ERR(cache))
+			return PTR_ERR(cache);
+
+		ret = devm_brickpi3_register_in_ports(dev, bp, cache, i2c_adap,
+						      i);
 		if (ret < 0)
 			return ret;
 
-		ret = devm_brickpi3_register_out_ports(dev, bp, i);
+		ret = devm_brickpi3_register_out_ports(dev, bp, cache, i);
 		if (ret < 0)
 			return ret;
 
 		ok = true;
 	}
 
-	return ok ? 0 : -ENODEV;
+	if (!ok)
+		return -ENODEV;
+
+	bp->debug = debugfs_create_dir(dev_name(dev), NULL);
+	debugfs_create_file("stats", 0644, bp->debug, bp, &brickpi3_stats_fops);
+
+	return 0;
+}
+
+static int brickpi3_remove(struct spi_device *spi)
+{
+	struct brickpi3 *bp = dev_get_drvdata(&spi->dev);
+
+	debugfs_remove_recursive(bp->debug);
+
+	return 0;
 }
 
 const static struct of_device_id brickpi3_of_match_table[] = {
@@ -839,6 +1728,7 @@ static struct spi_driver brickpi3_driver = {
 		.of_match_table	= brickpi3_of_match_table,
 	},
 	.probe	= brickpi3_probe,
+	.remove	= brickpi3_remove,
 };
 module_spi_driver(brickpi3_driver);
 
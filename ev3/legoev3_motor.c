@@ -29,7 +29,11 @@
 #include <linux/irq.h>
 #include <linux/interrupt.h>
 #include <linux/math64.h>
+#include <linux/mutex.h>
 #include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
 
 #include <lego.h>
 #include <lego_port_class.h>
@@ -42,12 +46,24 @@
 
 #define TACHO_MOTOR_POLL_MS	2	/* 2 msec */
 
+/* range of the control_period_us attribute */
+#define LEGOEV3_MOTOR_MIN_PERIOD_US	500
+#define LEGOEV3_MOTOR_MAX_PERIOD_US	10000
+
+#define HIST_BUCKETS		16
+
 #define TACHO_SAMPLES		128
 
-#define MAX_SYNC_MOTORS		2
+/* time constant for correcting the position error of a synchronized pair */
+#define SYNC_CORRECTION_MS	50
 
 #define TACHO_MOTOR_STALLED_MS  100
 
+/* time constant for correcting the position error when following a profile */
+#define PROFILE_CORRECTION_MS	50
+/* how long to wait for the motor to catch up at the end of a profile */
+#define PROFILE_SETTLE_MS	100
+
 enum legoev3_motor_command {
 	UNKNOWN,
 	FORWARD,
@@ -62,23 +78,41 @@ enum legoev3_motor_state {
 	NUM_STATES,
 };
 
+/*
+ * Histogram with power of 2 buckets. Bucket n counts the values from 2^(n-1)
+ * to 2^n - 1, bucket 0 counts 0 and the last bucket counts everything larger.
+ */
+struct legoev3_motor_hist {
+	u32 count[HIST_BUCKETS];
+	u32 max;
+};
+
 struct legoev3_motor_data {
 	struct tacho_motor_device tm;
 	struct lego_device *ldev;
 
 	struct hrtimer timer;
+	unsigned period_us;
 	struct work_struct notify_state_change_work;
 	struct work_struct notify_position_ramp_down_work;
 	struct tm_pid speed_pid;
 	struct tm_pid hold_pid;
 
+	/* protects everything that the commands and the timer share */
+	spinlock_t lock;
+
+	/* written only by the tacho ISR, read with tacho_seq */
+	seqcount_t tacho_seq;
 	ktime_t tacho_samples[TACHO_SAMPLES];
 	unsigned tacho_samples_head;
+	unsigned tacho_count;
+	int dir_chg_samples;
 
-	bool got_new_sample;
+	/* tacho_count at the last speed update and at the last stop */
+	unsigned speed_count;
+	unsigned stop_count;
 
 	int num_samples;
-	int dir_chg_samples;
 
 	int max_us_per_sample;
 
@@ -96,30 +130,53 @@ struct legoev3_motor_data {
 	enum legoev3_motor_state state;
 	enum tm_stop_action run_to_pos_stop_action;
 	bool run_to_pos_active;
+	struct tm_profile profile;
+	int profile_position;
+	ktime_t profile_end;
+	bool profile_active;
 	bool hold_pos_sp;
 	bool speed_pid_ena;
 	bool hold_pid_ena;
 
+	/* synchronized pair, see update_sync() */
+	struct legoev3_motor_data *sync_partner;
+	int sync_speed;
+	int sync_partner_speed;
+	int sync_start;
+	int sync_partner_start;
+	int sync_counts;
+	ktime_t sync_end;
+	enum tm_stop_action sync_stop_action;
+	struct list_head entry;
+
+	/* timing statistics of the timer callback, see legoev3_motor_hist_show */
+	struct legoev3_motor_hist late_hist;
+	struct legoev3_motor_hist duration_hist;
+	struct legoev3_motor_hist rate_hist;
+	unsigned hist_count;
+	ktime_t hist_time;
+
 	struct dentry *debug;
 };
 
-static DEFINE_SPINLOCK(lock);
+/* all motors, so that synchronized pairs can be taken apart safely */
+static LIST_HEAD(legoev3_motor_list);
+static DEFINE_MUTEX(legoev3_motor_list_lock);
 
-static void set_num_samples_for_speed(struct legoev3_motor_data *ev3_tm,
-				      int speed)
+static int num_samples_for_speed(int speed)
 {
 	if (speed > 1250)
-		ev3_tm->num_samples = 64;
+		return 64;
 	else if (speed > 1000)
-		ev3_tm->num_samples = 32;
+		return 32;
 	else if (speed > 750)
-		ev3_tm->num_samples = 16;
+		return 16;
 	else if (speed > 500)
-		ev3_tm->num_samples = 8;
+		return 8;
 	else if (speed > 250)
-		ev3_tm->num_samples = 4;
+		return 4;
 	else
-		ev3_tm->num_samples = 2;
+		return 2;
 }
 
 /*
@@ -197,6 +254,12 @@ static void set_num_samples_for_speed(struct legoev3_motor_data *ev3_tm,
  * It is clear that the correct transition to use for changing the
  * value of `TachoCount` is C - so if the delta from A-C is less than
  * the threshold, we should "undo" whatever the A transition told us.
+ *
+ * The ISR is the only writer of the samples, so it does not take a lock.
+ * Instead, it bumps tacho_seq around its updates and the timer callback
+ * retries its read if a tacho interrupt came in the middle of it. Counters
+ * that the timer used to reset (got_new_sample, dir_chg_samples) are
+ * replaced by comparing tacho_count to values kept by the timer.
  */
 
 static irqreturn_t tacho_motor_isr(int irq, void *id)
@@ -210,6 +273,8 @@ static irqreturn_t tacho_motor_isr(int irq, void *id)
 	unsigned next_sample = (ev3_tm->tacho_samples_head + 1) % TACHO_SAMPLES;
 	enum legoev3_motor_command next_direction = ev3_tm->run_direction;
 
+	write_seqcount_begin(&ev3_tm->tacho_seq);
+
 	/*
 	 * If the difference in timestamps is too small, then undo the
 	 * previous increment - it's OK for a count to waver once in
@@ -265,7 +330,9 @@ static irqreturn_t tacho_motor_isr(int irq, void *id)
 	else
 		ev3_tm->position--;
 
-	ev3_tm->got_new_sample = true;
+	ev3_tm->tacho_count++;
+
+	write_seqcount_end(&ev3_tm->tacho_seq);
 
 	return IRQ_HANDLED;
 }
@@ -296,17 +363,22 @@ static void set_duty_cycle(struct legoev3_motor_data *ev3_tm, int duty_cycle)
 
 }
 
-static int legoev3_motor_stop(void *context, enum tm_stop_action action)
+/* Must be called with ev3_tm->lock held. */
+static void __legoev3_motor_stop(struct legoev3_motor_data *ev3_tm,
+				 enum tm_stop_action action)
 {
-	struct legoev3_motor_data *ev3_tm = context;
 	const struct dc_motor_ops *motor_ops = ev3_tm->ldev->port->dc_motor_ops;
 	void *dc_ctx = ev3_tm->ldev->port->context;
 	bool use_pos_sp_for_hold = ev3_tm->hold_pos_sp;
-	unsigned long flags;
+	bool was_regulated;
+	int old_duty_cycle;
 
-	spin_lock_irqsave(&lock, flags);
+	was_regulated = ev3_tm->speed_pid_ena || ev3_tm->hold_pid_ena;
+	old_duty_cycle = ev3_tm->duty_cycle;
 
 	ev3_tm->run_to_pos_active = false;
+	ev3_tm->profile_active = false;
+	ev3_tm->sync_partner = NULL;
 	ev3_tm->hold_pos_sp = false;
 	ev3_tm->speed_pid_ena = false;
 	ev3_tm->hold_pid_ena = false;
@@ -332,6 +404,10 @@ static int legoev3_motor_stop(void *context, enum tm_stop_action action)
 			ev3_tm->hold_pid.setpoint = ev3_tm->position_sp;
 		else
 			ev3_tm->hold_pid.setpoint = ev3_tm->position;
+		/* bumpless transfer from the speed PID to the hold PID */
+		if (was_regulated)
+			tm_pid_transfer(&ev3_tm->hold_pid, ev3_tm->position,
+					old_duty_cycle);
 		ev3_tm->hold_pid_ena = true;
 		break;
 	default:
@@ -339,8 +415,62 @@ static int legoev3_motor_stop(void *context, enum tm_stop_action action)
 	}
 
 	ev3_tm->state = STATE_STOPPED;
+}
 
-	spin_unlock_irqrestore(&lock, flags);
+/*
+ * Switches ev3_tm to speed regulation at the given speed. If the motor was
+ * holding position, this is a bumpless transfer from the hold PID, the reverse
+ * of the one in __legoev3_motor_stop(). Must be called with ev3_tm->lock held.
+ */
+static void __legoev3_motor_start_speed_pid(struct legoev3_motor_data *ev3_tm,
+					    int speed)
+{
+	ev3_tm->speed_pid.setpoint = speed;
+	if (ev3_tm->hold_pid_ena)
+		tm_pid_transfer(&ev3_tm->speed_pid, ev3_tm->speed,
+				ev3_tm->duty_cycle);
+	ev3_tm->speed_pid_ena = true;
+	ev3_tm->hold_pid_ena = false;
+}
+
+/*
+ * Takes ev3_tm out of its synchronized pair, if any, and stops the partner so
+ * that it does not keep running on its own. Must be called without any motor
+ * lock held, before ev3_tm is given a new command. The list lock keeps the
+ * partner from being freed by legoev3_motor_remove() in the meantime.
+ */
+static void legoev3_motor_stop_partner(struct legoev3_motor_data *ev3_tm)
+{
+	struct legoev3_motor_data *partner;
+	unsigned long flags;
+
+	mutex_lock(&legoev3_motor_list_lock);
+
+	spin_lock_irqsave(&ev3_tm->lock, flags);
+	partner = ev3_tm->sync_partner;
+	ev3_tm->sync_partner = NULL;
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
+
+	if (partner) {
+		spin_lock_irqsave(&partner->lock, flags);
+		if (partner->sync_partner == ev3_tm)
+			__legoev3_motor_stop(partner, partner->sync_stop_action);
+		spin_unlock_irqrestore(&partner->lock, flags);
+	}
+
+	mutex_unlock(&legoev3_motor_list_lock);
+}
+
+static int legoev3_motor_stop(void *context, enum tm_stop_action action)
+{
+	struct legoev3_motor_data *ev3_tm = context;
+	unsigned long flags;
+
+	legoev3_motor_stop_partner(ev3_tm);
+
+	spin_lock_irqsave(&ev3_tm->lock, flags);
+	__legoev3_motor_stop(ev3_tm, action);
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
 
 	return 0;
 }
@@ -358,12 +488,19 @@ static int legoev3_motor_reset(void *context)
 
 	legoev3_motor_stop(ev3_tm, TM_STOP_ACTION_COAST);
 
-	spin_lock_irqsave(&lock, flags);
+	/*
+	 * The ISR is the only other writer of the tacho samples. It cannot run
+	 * while interrupts are off on the uniprocessor EV3.
+	 */
+	spin_lock_irqsave(&ev3_tm->lock, flags);
+	write_seqcount_begin(&ev3_tm->tacho_seq);
 
-	memset(ev3_tm->tacho_samples, 0, sizeof(unsigned) * TACHO_SAMPLES);
+	memset(ev3_tm->tacho_samples, 0, sizeof(ev3_tm->tacho_samples));
 
 	ev3_tm->tacho_samples_head	= 0;
-	ev3_tm->got_new_sample		= false;
+	ev3_tm->tacho_count		= 0;
+	ev3_tm->speed_count		= 0;
+	ev3_tm->stop_count		= 0;
 	ev3_tm->num_samples		= 2;
 	ev3_tm->dir_chg_samples		= 0;
 	ev3_tm->max_us_per_sample	= info->max_us_per_sample;
@@ -382,7 +519,8 @@ static int legoev3_motor_reset(void *context)
 	tm_pid_init(&ev3_tm->hold_pid, info->position_pid_k.p,
 		    info->position_pid_k.i, info->position_pid_k.d);
 
-	spin_unlock_irqrestore(&lock, flags);
+	write_seqcount_end(&ev3_tm->tacho_seq);
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
 
 	return 0;
 };
@@ -546,10 +684,10 @@ static int legoev3_motor_reset(void *context)
 
 static void calculate_speed(struct legoev3_motor_data *ev3_tm)
 {
-	unsigned diff_idx;
-	ktime_t diff;
-
-	/* TODO - Don't run this if we're updating the ev3_tm in the isr! */
+	enum legoev3_motor_command direction;
+	ktime_t last, first, diff;
+	unsigned seq, head, count;
+	int dir_chg_samples, num_samples;
 
 	/*
 	 * Determine the approximate speed of the motor using the difference
@@ -568,22 +706,35 @@ static void calculate_speed(struct legoev3_motor_data *ev3_tm)
 	 * Only do this estimated speed calculation if we've accumulated at
 	 * least two tacho pulses where the motor is turning in the same
 	 * direction!
+	 *
+	 * The samples are read without a lock, so start over if the ISR
+	 * changed them while we were reading.
 	 */
 
-	diff_idx = ev3_tm->tacho_samples_head;
+	do {
+		seq = read_seqcount_begin(&ev3_tm->tacho_seq);
 
-	/* TODO - This should really be a boolean value that gets set at the ISR level */
-	/* TODO - Can/Should we change this to not set_samples_per_speed every time we're called? */
+		head = ev3_tm->tacho_samples_head;
+		count = ev3_tm->tacho_count;
+		direction = ev3_tm->run_direction;
+		dir_chg_samples = min_t(unsigned, ev3_tm->dir_chg_samples,
+					count - ev3_tm->stop_count);
+		num_samples = ev3_tm->num_samples;
+		last = ev3_tm->tacho_samples[head];
 
-	if (ev3_tm->dir_chg_samples >= 1) {
-		diff = ktime_sub(ev3_tm->tacho_samples[diff_idx],
-			ev3_tm->tacho_samples[(diff_idx + TACHO_SAMPLES - 1) % TACHO_SAMPLES]);
+		if (dir_chg_samples >= 1) {
+			diff = ktime_sub(last, ev3_tm->tacho_samples[(head + TACHO_SAMPLES - 1) % TACHO_SAMPLES]);
 
-		if (unlikely(ktime_equal(diff, ktime_set(0, 0))))
-			diff = ktime_set(0, 1);
+			if (unlikely(ktime_equal(diff, ktime_set(0, 0))))
+				diff = ktime_set(0, 1);
 
-		set_num_samples_for_speed(ev3_tm, USEC_PER_SEC / (int)ktime_to_us(diff));
-	}
+			num_samples = num_samples_for_speed(USEC_PER_SEC / (int)ktime_to_us(diff));
+		}
+
+		first = ev3_tm->tacho_samples[(head + TACHO_SAMPLES - num_samples) % TACHO_SAMPLES];
+	} while (read_seqcount_retry(&ev3_tm->tacho_seq, seq));
+
+	ev3_tm->num_samples = num_samples;
 
 	/*
 	 * Now get a better estimate of the motor speed by using the total
@@ -602,30 +753,29 @@ static void calculate_speed(struct legoev3_motor_data *ev3_tm)
 	 * using the last captured sample as the start point for the difference
 	 * we use the current time.
 	 */
-	if (ev3_tm->got_new_sample && (ev3_tm->dir_chg_samples >= ev3_tm->num_samples)) {
+	if (count != ev3_tm->speed_count && dir_chg_samples >= num_samples) {
 		s64 new_speed;
 
-		diff = ktime_sub(ev3_tm->tacho_samples[diff_idx],
-			ev3_tm->tacho_samples[(diff_idx + TACHO_SAMPLES - ev3_tm->num_samples) % TACHO_SAMPLES]);
+		diff = ktime_sub(last, first);
 
 		if (unlikely(ktime_equal(diff, ktime_set(0, 0))))
 			diff = ktime_set(0, 1);
 
-		new_speed = USEC_PER_SEC * ev3_tm->num_samples;
+		new_speed = USEC_PER_SEC * num_samples;
 		new_speed = div64_s64(new_speed, ktime_to_us(diff));
 
-		if (ev3_tm->run_direction == FORWARD)
+		if (direction == FORWARD)
 			ev3_tm->speed  = new_speed;
 		else
 			ev3_tm->speed  = -new_speed;
 
 		ev3_tm->stalled = 0;
 		ev3_tm->stalling = 0;
-		ev3_tm->got_new_sample = false;
+		ev3_tm->speed_count = count;
 
-	} else if (ev3_tm->max_us_per_sample < ktime_to_us(ktime_sub(ktime_get(), ev3_tm->tacho_samples[diff_idx]))) {
+	} else if (ev3_tm->max_us_per_sample < ktime_to_us(ktime_sub(ktime_get(), last))) {
 
-		ev3_tm->dir_chg_samples = 0;
+		ev3_tm->stop_count = count;
 		ev3_tm->speed = 0;
 		ev3_tm->stalled = 0;
 
@@ -642,16 +792,15 @@ static void calculate_speed(struct legoev3_motor_data *ev3_tm)
                 }
 	}
 
-	else if (TACHO_MOTOR_POLL_MS < ktime_to_ms(ktime_sub(ktime_get(), ev3_tm->tacho_samples[diff_idx]))) {
+	else if (ev3_tm->period_us < ktime_to_us(ktime_sub(ktime_get(), last))) {
 		s64 new_speed;
 
-		diff = ktime_sub(ktime_get(),
-			ev3_tm->tacho_samples[(diff_idx + TACHO_SAMPLES - ev3_tm->num_samples) % TACHO_SAMPLES]);
+		diff = ktime_sub(ktime_get(), first);
 
-		new_speed = USEC_PER_SEC * ev3_tm->num_samples;
+		new_speed = USEC_PER_SEC * num_samples;
 		new_speed = div64_s64(new_speed, ktime_to_us(diff));
 
-		if (ev3_tm->run_direction == FORWARD)
+		if (direction == FORWARD)
 			ev3_tm->speed  = new_speed;
 		else
 			ev3_tm->speed  = -new_speed;
@@ -690,8 +839,8 @@ static void update_position(struct legoev3_motor_data *ev3_tm)
 		if (ev3_tm->position >= ev3_tm->position_sp) {
 			schedule_work(&ev3_tm->notify_position_ramp_down_work);
 			ev3_tm->hold_pos_sp = true;
-			legoev3_motor_stop(ev3_tm,
-					   ev3_tm->run_to_pos_stop_action);
+			__legoev3_motor_stop(ev3_tm,
+					     ev3_tm->run_to_pos_stop_action);
 			ev3_tm->ramping = false;
 		}
 	} else if (ev3_tm->speed_pid.setpoint < 0) {
@@ -703,25 +852,179 @@ static void update_position(struct legoev3_motor_data *ev3_tm)
 		if (ev3_tm->position <= ev3_tm->position_sp) {
 			schedule_work(&ev3_tm->notify_position_ramp_down_work);
 			ev3_tm->hold_pos_sp = true;
-			legoev3_motor_stop(ev3_tm,
-					   ev3_tm->run_to_pos_stop_action);
+			__legoev3_motor_stop(ev3_tm,
+					     ev3_tm->run_to_pos_stop_action);
 			ev3_tm->ramping = false;
 		}
 	}
 }
 
+/*
+ * Follows the profile planned by the tacho motor class. The reference speed is
+ * used as the speed setpoint and the position error is added on top of it so
+ * that the motor stays on the profile instead of drifting away from it. At the
+ * end, the motor is given a little time to catch up before it is stopped.
+ */
+static void update_profile(struct legoev3_motor_data *ev3_tm)
+{
+	ktime_t now = ktime_get();
+	int position, speed;
+
+	if (tm_profile_eval(&ev3_tm->profile, now, &position, &speed)) {
+		if (!ktime_to_ns(ev3_tm->profile_end))
+			ev3_tm->profile_end = now;
+		ev3_tm->ramping = false;
+	} else {
+		ev3_tm->ramping = speed != ev3_tm->profile.speed;
+	}
+
+	ev3_tm->profile_position = position;
+	ev3_tm->speed_pid.setpoint = speed + (position - ev3_tm->position)
+					* MSEC_PER_SEC / PROFILE_CORRECTION_MS;
+
+	if (!ktime_to_ns(ev3_tm->profile_end))
+		return;
+
+	if (ev3_tm->position != ev3_tm->profile.target
+	    && ktime_ms_delta(now, ev3_tm->profile_end) < PROFILE_SETTLE_MS)
+		return;
+
+	schedule_work(&ev3_tm->notify_position_ramp_down_work);
+	ev3_tm->hold_pos_sp = true;
+	__legoev3_motor_stop(ev3_tm, ev3_tm->run_to_pos_stop_action);
+}
+
+/*
+ * Keeps the positions of a synchronized pair in the ratio of their speeds.
+ *
+ * With p and v the position since the start and the speed of this motor and
+ * pp and pv the same for the partner, the pair is in sync when
+ * e = p * pv - pp * v is 0. Each motor corrects its own speed along the
+ * gradient of e, i.e. by -K * e * pv / (v^2 + pv^2) for this motor, which
+ * makes e decay with the rate K. The partner does the same from its side, so
+ * a motor that falls behind slows down the other one instead of only
+ * speeding up itself, which is what keeps a robot driving straight.
+ *
+ * The partner's position is read without its lock. It is updated by the
+ * partner's own timer and may be one period old, which is fine at this rate.
+ */
+static void update_sync(struct legoev3_motor_data *ev3_tm)
+{
+	struct legoev3_motor_data *partner = ev3_tm->sync_partner;
+	s64 v = ev3_tm->sync_speed;
+	s64 pv = ev3_tm->sync_partner_speed;
+	s64 p = ev3_tm->position - ev3_tm->sync_start;
+	s64 pp = READ_ONCE(partner->position) - ev3_tm->sync_partner_start;
+	s64 norm = v * v + pv * pv;
+	s64 error;
+
+	if (ktime_to_ns(ev3_tm->sync_end)
+	    && ktime_after(ktime_get(), ev3_tm->sync_end)) {
+		__legoev3_motor_stop(ev3_tm, ev3_tm->sync_stop_action);
+		return;
+	}
+
+	if (ev3_tm->sync_counts
+	    && abs(abs(v) >= abs(pv) ? p : pp) >= ev3_tm->sync_counts) {
+		__legoev3_motor_stop(ev3_tm, ev3_tm->sync_stop_action);
+		return;
+	}
+
+	if (!norm) {
+		ev3_tm->speed_pid.setpoint = 0;
+		return;
+	}
+
+	error = p * pv - pp * v;
+	error = div_s64(error * pv * MSEC_PER_SEC, SYNC_CORRECTION_MS);
+	ev3_tm->speed_pid.setpoint = v - div64_s64(error, norm);
+	ev3_tm->ramping = false;
+}
+
+static int legoev3_motor_get_state(void *context);
+
+static void legoev3_motor_push_telemetry(struct legoev3_motor_data *ev3_tm)
+{
+	struct tacho_motor_telemetry rec = {
+		.timestamp	= ktime_to_ns(ktime_get()),
+		.position	= ev3_tm->position,
+		.speed		= ev3_tm->speed,
+		.position_sp	= ev3_tm->hold_pid_ena ? ev3_tm->hold_pid.setpoint
+				: ev3_tm->profile_active ? ev3_tm->profile_position
+				: ev3_tm->position_sp,
+		.speed_sp	= ev3_tm->speed_pid_ena ? ev3_tm->speed_pid.setpoint
+							: 0,
+		.duty_cycle	= ev3_tm->duty_cycle,
+		.state		= legoev3_motor_get_state(ev3_tm),
+	};
+
+	tacho_motor_push_telemetry(&ev3_tm->tm, &rec);
+}
+
+static void legoev3_motor_hist_add(struct legoev3_motor_hist *hist, s64 value)
+{
+	unsigned bucket;
+
+	if (value < 0)
+		value = 0;
+	if (value > U32_MAX)
+		value = U32_MAX;
+
+	bucket = min(fls(value), HIST_BUCKETS - 1);
+	hist->count[bucket]++;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/*
+ * The histograms are only statistics, so they are updated without the lock.
+ * The tacho interrupt rate is the number of tacho interrupts since the last
+ * callback divided by the measured time since then, not by the nominal period,
+ * so late callbacks do not inflate it. There is no rate for the first callback.
+ */
+static void legoev3_motor_update_hist(struct legoev3_motor_data *ev3_tm,
+				      ktime_t start, s64 late_us)
+{
+	unsigned count = READ_ONCE(ev3_tm->tacho_count);
+	s64 delta_us = ktime_us_delta(start, ev3_tm->hist_time);
+
+	legoev3_motor_hist_add(&ev3_tm->late_hist, late_us);
+	if (ktime_to_ns(ev3_tm->hist_time) && delta_us > 0)
+		legoev3_motor_hist_add(&ev3_tm->rate_hist,
+			div64_s64((s64)(count - ev3_tm->hist_count) * USEC_PER_SEC,
+				  delta_us));
+	ev3_tm->hist_count = count;
+	ev3_tm->hist_time = start;
+	legoev3_motor_hist_add(&ev3_tm->duration_hist,
+			       ktime_us_delta(ktime_get(), start));
+}
+
 static enum hrtimer_restart legoev3_motor_timer_callback(struct hrtimer *timer)
 {
 	struct legoev3_motor_data *ev3_tm =
 			container_of(timer, struct legoev3_motor_data, timer);
-	int duty_cycle = ev3_tm->duty_cycle;
+	ktime_t start = ktime_get();
+	s64 late_us = ktime_us_delta(start, hrtimer_get_expires(timer));
+	int duty_cycle;
 
-	hrtimer_forward_now(timer, ktime_set(0, TACHO_MOTOR_POLL_MS * NSEC_PER_MSEC));
+	hrtimer_forward_now(timer, ktime_set(0, ev3_tm->period_us * NSEC_PER_USEC));
+
+	/* interrupts are already off in the timer callback */
+	spin_lock(&ev3_tm->lock);
+
+	duty_cycle = ev3_tm->duty_cycle;
 
 	calculate_speed(ev3_tm);
 
+	if (ev3_tm->profile_active)
+		update_profile(ev3_tm);
+
+	if (ev3_tm->sync_partner)
+		update_sync(ev3_tm);
+
 	if (ev3_tm->speed_pid_ena) {
-		if (ev3_tm->speed_pid.setpoint == 0) {
+		if (ev3_tm->speed_pid.setpoint == 0
+		    && !ev3_tm->profile_active && !ev3_tm->sync_partner) {
 			duty_cycle = 0;
 			tm_pid_reinit(&ev3_tm->speed_pid);
 		} else
@@ -735,8 +1038,14 @@ static enum hrtimer_restart legoev3_motor_timer_callback(struct hrtimer *timer)
 	if (ev3_tm->run_to_pos_active)
 		update_position(ev3_tm);
 
+	spin_unlock(&ev3_tm->lock);
+
+	legoev3_motor_push_telemetry(ev3_tm);
+
 	schedule_work(&ev3_tm->notify_state_change_work);
 
+	legoev3_motor_update_hist(ev3_tm, start, late_us);
+
 	return HRTIMER_RESTART;
 }
 
@@ -765,18 +1074,23 @@ static int legoev3_motor_get_position(void *context, int *position)
 	return 0;
 }
 
-static int legoev3_motor_get_state(void *context);
-
 static int legoev3_motor_set_position(void *context, int position)
 {
 	struct legoev3_motor_data *ev3_tm = context;
+	unsigned long flags;
 
 	if (legoev3_motor_get_state(ev3_tm) & TM_STATE_RUNNING)
 		return -EBUSY;
 
+	spin_lock_irqsave(&ev3_tm->lock, flags);
+	write_seqcount_begin(&ev3_tm->tacho_seq);
+
 	ev3_tm->position    = position;
 	ev3_tm->position_sp = position;
 
+	write_seqcount_end(&ev3_tm->tacho_seq);
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
+
 	return 0;
 }
 
@@ -795,15 +1109,19 @@ static int legoev3_motor_run_unregulated(void *context, int duty_cycle)
 	struct legoev3_motor_data *ev3_tm = context;
 	unsigned long flags;
 
-	spin_lock_irqsave(&lock, flags);
+	legoev3_motor_stop_partner(ev3_tm);
+
+	spin_lock_irqsave(&ev3_tm->lock, flags);
 
 	ev3_tm->run_to_pos_active = false;
+	ev3_tm->profile_active = false;
+	ev3_tm->sync_partner = NULL;
 	ev3_tm->speed_pid_ena = false;
 	ev3_tm->hold_pid_ena = false;
 	set_duty_cycle(ev3_tm, duty_cycle);
 	ev3_tm->state = STATE_RUNNING;
 
-	spin_unlock_irqrestore(&lock, flags);
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
 
 	return 0;
 }
@@ -841,20 +1159,44 @@ static int legoev3_motor_get_speed(void *context, int *speed)
 	return 0;
 }
 
+/*
+ * The lock keeps the timer callback from updating the values in the middle of
+ * the copy.
+ */
+static int legoev3_motor_get_status(void *context,
+				    struct tacho_motor_status *status)
+{
+	struct legoev3_motor_data *ev3_tm = context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ev3_tm->lock, flags);
+
+	status->position = ev3_tm->position;
+	status->speed = ev3_tm->speed;
+	status->duty_cycle = ev3_tm->duty_cycle;
+	status->state = legoev3_motor_get_state(ev3_tm);
+
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
+
+	return 0;
+}
+
 static int legoev3_motor_run_regulated(void *context, int speed)
 {
 	struct legoev3_motor_data *ev3_tm = context;
 	unsigned long flags;
 
-	spin_lock_irqsave(&lock, flags);
+	legoev3_motor_stop_partner(ev3_tm);
+
+	spin_lock_irqsave(&ev3_tm->lock, flags);
 
 	ev3_tm->run_to_pos_active = false;
-	ev3_tm->speed_pid_ena = true;
-	ev3_tm->hold_pid_ena = false;
-	ev3_tm->speed_pid.setpoint = speed;
+	ev3_tm->profile_active = false;
+	ev3_tm->sync_partner = NULL;
+	__legoev3_motor_start_speed_pid(ev3_tm, speed);
 	ev3_tm->state = STATE_RUNNING;
 
-	spin_unlock_irqrestore(&lock, flags);
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
 
 	return 0;
 }
@@ -865,21 +1207,106 @@ static int legoev3_motor_run_to_pos(void *context, int pos, int speed,
 	struct legoev3_motor_data *ev3_tm = context;
 	unsigned long flags;
 
-	spin_lock_irqsave(&lock, flags);
+	legoev3_motor_stop_partner(ev3_tm);
+
+	spin_lock_irqsave(&ev3_tm->lock, flags);
 
 	speed = abs(speed);
 	if (ev3_tm->position > pos)
 		speed *= -1;
 
 	ev3_tm->run_to_pos_active = true;
-	ev3_tm->speed_pid_ena = true;
-	ev3_tm->hold_pid_ena = false;
+	ev3_tm->profile_active = false;
+	ev3_tm->sync_partner = NULL;
 	ev3_tm->position_sp = pos;
-	ev3_tm->speed_pid.setpoint = speed;
+	__legoev3_motor_start_speed_pid(ev3_tm, speed);
 	ev3_tm->run_to_pos_stop_action = stop_action;
 	ev3_tm->state = STATE_RUNNING;
 
-	spin_unlock_irqrestore(&lock, flags);
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
+
+	return 0;
+}
+
+static int legoev3_motor_run_profile(void *context,
+				     const struct tm_profile *profile,
+				     enum tm_stop_action stop_action)
+{
+	struct legoev3_motor_data *ev3_tm = context;
+	unsigned long flags;
+
+	legoev3_motor_stop_partner(ev3_tm);
+
+	spin_lock_irqsave(&ev3_tm->lock, flags);
+
+	ev3_tm->profile = *profile;
+	ev3_tm->profile_position = profile->start;
+	ev3_tm->profile_end = ktime_set(0, 0);
+	ev3_tm->profile_active = true;
+	ev3_tm->run_to_pos_active = false;
+	ev3_tm->sync_partner = NULL;
+	ev3_tm->position_sp = profile->target;
+	__legoev3_motor_start_speed_pid(ev3_tm, profile->start_speed);
+	ev3_tm->run_to_pos_stop_action = stop_action;
+	ev3_tm->state = STATE_RUNNING;
+
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
+
+	return 0;
+}
+
+static void legoev3_motor_start_sync(struct legoev3_motor_data *ev3_tm,
+				     struct legoev3_motor_data *partner,
+				     int speed, int partner_speed,
+				     const struct tm_steering *steering,
+				     ktime_t end)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ev3_tm->lock, flags);
+
+	ev3_tm->sync_partner = partner;
+	ev3_tm->sync_speed = speed;
+	ev3_tm->sync_partner_speed = partner_speed;
+	ev3_tm->sync_start = ev3_tm->position;
+	ev3_tm->sync_partner_start = READ_ONCE(partner->position);
+	ev3_tm->sync_counts = steering->counts;
+	ev3_tm->sync_end = end;
+	ev3_tm->sync_stop_action = steering->stop_action;
+	ev3_tm->run_to_pos_active = false;
+	ev3_tm->profile_active = false;
+	__legoev3_motor_start_speed_pid(ev3_tm, speed);
+	ev3_tm->state = STATE_RUNNING;
+
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
+}
+
+/*
+ * Both motors get a copy of the parameters, so each one only ever takes its
+ * own lock. The start positions are read at almost the same time, so the
+ * pair starts out in sync. A motor that was in another pair leaves it first,
+ * which stops its old partner.
+ */
+static int legoev3_motor_run_steering(void *context, void *partner_context,
+				      const struct tm_steering *steering)
+{
+	struct legoev3_motor_data *ev3_tm = context;
+	struct legoev3_motor_data *partner = partner_context;
+	ktime_t end = ktime_set(0, 0);
+
+	if (partner == ev3_tm)
+		return -EINVAL;
+
+	legoev3_motor_stop_partner(ev3_tm);
+	legoev3_motor_stop_partner(partner);
+
+	if (steering->time)
+		end = ktime_add_ms(ktime_get(), steering->time);
+
+	legoev3_motor_start_sync(ev3_tm, partner, steering->speed,
+				 steering->partner_speed, steering, end);
+	legoev3_motor_start_sync(partner, ev3_tm, steering->partner_speed,
+				 steering->speed, steering, end);
 
 	return 0;
 }
@@ -890,18 +1317,49 @@ static unsigned legoev3_motor_get_stop_actions(void *context)
 		BIT(TM_STOP_ACTION_HOLD);
 }
 
+static int legoev3_motor_set_control_period(void *context, int us)
+{
+	struct legoev3_motor_data *ev3_tm = context;
+	unsigned long flags;
+
+	if (us < LEGOEV3_MOTOR_MIN_PERIOD_US || us > LEGOEV3_MOTOR_MAX_PERIOD_US)
+		return -EINVAL;
+
+	/* the timer picks up the new period the next time it is forwarded */
+	spin_lock_irqsave(&ev3_tm->lock, flags);
+	ev3_tm->period_us = us;
+	ev3_tm->tm.pid_period_us = us;
+	spin_unlock_irqrestore(&ev3_tm->lock, flags);
+
+	return 0;
+}
+
 TM_PID_GET_FUNC(legoev3_motor, speed_Kp, legoev3_motor_data, speed_pid.Kp);
 TM_PID_SET_FUNC(legoev3_motor, speed_Kp, legoev3_motor_data, speed_pid.Kp);
 TM_PID_GET_FUNC(legoev3_motor, speed_Ki, legoev3_motor_data, speed_pid.Ki);
 TM_PID_SET_FUNC(legoev3_motor, speed_Ki, legoev3_motor_data, speed_pid.Ki);
 TM_PID_GET_FUNC(legoev3_motor, speed_Kd, legoev3_motor_data, speed_pid.Kd);
 TM_PID_SET_FUNC(legoev3_motor, speed_Kd, legoev3_motor_data, speed_pid.Kd);
+TM_PID_GET_FUNC(legoev3_motor, speed_Kf, legoev3_motor_data, speed_pid.Kf);
+TM_PID_SET_FUNC(legoev3_motor, speed_Kf, legoev3_motor_data, speed_pid.Kf);
+TM_PID_GET_FUNC(legoev3_motor, speed_Tf, legoev3_motor_data, speed_pid.Tf);
+TM_PID_SET_FUNC(legoev3_motor, speed_Tf, legoev3_motor_data, speed_pid.Tf);
+TM_PID_GET_FUNC(legoev3_motor, speed_slew, legoev3_motor_data, speed_pid.slew);
+TM_PID_SET_FUNC(legoev3_motor, speed_slew, legoev3_motor_data, speed_pid.slew);
+TM_PID_GET_FUNC(legoev3_motor, speed_scale, legoev3_motor_data, speed_pid.scale);
+TM_PID_SET_SCALE_FUNC(legoev3_motor, speed_scale, legoev3_motor_data, speed_pid.scale);
 TM_PID_GET_FUNC(legoev3_motor, position_Kp, legoev3_motor_data, hold_pid.Kp);
 TM_PID_SET_FUNC(legoev3_motor, position_Kp, legoev3_motor_data, hold_pid.Kp);
 TM_PID_GET_FUNC(legoev3_motor, position_Ki, legoev3_motor_data, hold_pid.Ki);
 TM_PID_SET_FUNC(legoev3_motor, position_Ki, legoev3_motor_data, hold_pid.Ki);
 TM_PID_GET_FUNC(legoev3_motor, position_Kd, legoev3_motor_data, hold_pid.Kd);
 TM_PID_SET_FUNC(legoev3_motor, position_Kd, legoev3_motor_data, hold_pid.Kd);
+TM_PID_GET_FUNC(legoev3_motor, position_Tf, legoev3_motor_data, hold_pid.Tf);
+TM_PID_SET_FUNC(legoev3_motor, position_Tf, legoev3_motor_data, hold_pid.Tf);
+TM_PID_GET_FUNC(legoev3_motor, position_slew, legoev3_motor_data, hold_pid.slew);
+TM_PID_SET_FUNC(legoev3_motor, position_slew, legoev3_motor_data, hold_pid.slew);
+TM_PID_GET_FUNC(legoev3_motor, position_scale, legoev3_motor_data, hold_pid.scale);
+TM_PID_SET_SCALE_FUNC(legoev3_motor, position_scale, legoev3_motor_data, hold_pid.scale);
 
 static const struct tacho_motor_ops legoev3_motor_ops = {
 	.get_position		= legoev3_motor_get_position,
@@ -910,14 +1368,18 @@ static const struct tacho_motor_ops legoev3_motor_ops = {
 	.get_state		= legoev3_motor_get_state,
 	.get_duty_cycle		= legoev3_motor_get_duty_cycle,
 	.get_speed		= legoev3_motor_get_speed,
+	.get_status		= legoev3_motor_get_status,
 
 	.run_unregulated	= legoev3_motor_run_unregulated,
 	.run_regulated		= legoev3_motor_run_regulated,
 	.run_to_pos		= legoev3_motor_run_to_pos,
+	.run_profile		= legoev3_motor_run_profile,
+	.run_steering		= legoev3_motor_run_steering,
 	.stop			= legoev3_motor_stop,
 	.reset			= legoev3_motor_reset,
 
 	.get_stop_actions	= legoev3_motor_get_stop_actions,
+	.set_control_period	= legoev3_motor_set_control_period,
 
 	.get_speed_Kp		= legoev3_motor_get_speed_Kp,
 	.set_speed_Kp		= legoev3_motor_set_speed_Kp,
@@ -925,6 +1387,14 @@ static const struct tacho_motor_ops legoev3_motor_ops = {
 	.set_speed_Ki		= legoev3_motor_set_speed_Ki,
 	.get_speed_Kd		= legoev3_motor_get_speed_Kd,
 	.set_speed_Kd		= legoev3_motor_set_speed_Kd,
+	.get_speed_Kf		= legoev3_motor_get_speed_Kf,
+	.set_speed_Kf		= legoev3_motor_set_speed_Kf,
+	.get_speed_Tf		= legoev3_motor_get_speed_Tf,
+	.set_speed_Tf		= legoev3_motor_set_speed_Tf,
+	.get_speed_slew		= legoev3_motor_get_speed_slew,
+	.set_speed_slew		= legoev3_motor_set_speed_slew,
+	.get_speed_scale	= legoev3_motor_get_speed_scale,
+	.set_speed_scale	= legoev3_motor_set_speed_scale,
 
 	.get_hold_Kp		= legoev3_motor_get_position_Kp,
 	.set_hold_Kp		= legoev3_motor_set_position_Kp,
@@ -932,9 +1402,73 @@ static const struct tacho_motor_ops legoev3_motor_ops = {
 	.set_hold_Ki		= legoev3_motor_set_position_Ki,
 	.get_hold_Kd		= legoev3_motor_get_position_Kd,
 	.set_hold_Kd		= legoev3_motor_set_position_Kd,
+	.get_hold_Tf		= legoev3_motor_get_position_Tf,
+	.set_hold_Tf		= legoev3_motor_set_position_Tf,
+	.get_hold_slew		= legoev3_motor_get_position_slew,
+	.set_hold_slew		= legoev3_motor_set_position_slew,
+	.get_hold_scale		= legoev3_motor_get_position_scale,
+	.set_hold_scale		= legoev3_motor_set_position_scale,
 };
 
 
+static void legoev3_motor_hist_print(struct seq_file *s, const char *name,
+				     const struct legoev3_motor_hist *hist)
+{
+	int i;
+
+	seq_printf(s, "%s (max %u):\n", name, hist->max);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!hist->count[i])
+			continue;
+		if (i == HIST_BUCKETS - 1)
+			seq_printf(s, "  >= %u: %u\n", 1 << (i - 1), hist->count[i]);
+		else
+			seq_printf(s, "  < %u: %u\n", 1 << i, hist->count[i]);
+	}
+}
+
+static int legoev3_motor_hist_show(struct seq_file *s, void *unused)
+{
+	struct legoev3_motor_data *ev3_tm = s->private;
+
+	seq_printf(s, "period: %u us\n", ev3_tm->period_us);
+	legoev3_motor_hist_print(s, "timer lateness (us)", &ev3_tm->late_hist);
+	legoev3_motor_hist_print(s, "callback duration (us)",
+				 &ev3_tm->duration_hist);
+	legoev3_motor_hist_print(s, "tacho interrupts per second",
+				 &ev3_tm->rate_hist);
+
+	return 0;
+}
+
+static int legoev3_motor_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, legoev3_motor_hist_show, inode->i_private);
+}
+
+/* writing anything to the file clears the histograms */
+static ssize_t legoev3_motor_hist_write(struct file *file,
+					const char __user *buf, size_t count,
+					loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct legoev3_motor_data *ev3_tm = s->private;
+
+	memset(&ev3_tm->late_hist, 0, sizeof(ev3_tm->late_hist));
+	memset(&ev3_tm->duration_hist, 0, sizeof(ev3_tm->duration_hist));
+	memset(&ev3_tm->rate_hist, 0, sizeof(ev3_tm->rate_hist));
+
+	return count;
+}
+
+static const struct file_operations legoev3_motor_hist_fops = {
+	.open		= legoev3_motor_hist_open,
+	.read		= seq_read,
+	.write		= legoev3_motor_hist_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int legoev3_motor_probe(struct lego_device *ldev)
 {
 	struct legoev3_motor_data *ev3_tm;
@@ -953,12 +1487,18 @@ static int legoev3_motor_probe(struct lego_device *ldev)
 		return -ENOMEM;
 
 	ev3_tm->ldev = ldev;
+	spin_lock_init(&ev3_tm->lock);
+	seqcount_init(&ev3_tm->tacho_seq);
 
 	ev3_tm->tm.driver_name = ldev->entry_id->name;
 	ev3_tm->tm.address = ldev->port->address;
 	ev3_tm->tm.ops = &legoev3_motor_ops;
 	ev3_tm->tm.info = &ev3_motor_defs[ldev->entry_id->driver_data];
 	ev3_tm->tm.context = ev3_tm;
+	ev3_tm->tm.driver_telemetry = true;
+	ev3_tm->tm.driver_state_notify = true;
+	ev3_tm->period_us = TACHO_MOTOR_POLL_MS * USEC_PER_MSEC;
+	ev3_tm->tm.pid_period_us = ev3_tm->period_us;
 
 	dev_set_drvdata(&ldev->dev, ev3_tm);
 
@@ -984,11 +1524,11 @@ static int legoev3_motor_probe(struct lego_device *ldev)
 	if (err)
 		goto err_request_irq;
 
-	hrtimer_start(&ev3_tm->timer, ktime_set(0, TACHO_MOTOR_POLL_MS * NSEC_PER_MSEC),
+	hrtimer_start(&ev3_tm->timer, ktime_set(0, ev3_tm->period_us * NSEC_PER_USEC),
 		      HRTIMER_MODE_REL);
 
 	ev3_tm->debug = debugfs_create_dir(ev3_tm->tm.address, NULL);
-	debugfs_create_bool("got_new_sample", 0444, ev3_tm->debug, &ev3_tm->got_new_sample);
+	debugfs_create_u32("tacho_count", 0444, ev3_tm->debug, &ev3_tm->tacho_count);
 	debugfs_create_u32("num_samples", 0444, ev3_tm->debug, &ev3_tm->num_samples);
 	debugfs_create_u32("dir_chg_samples", 0444, ev3_tm->debug, &ev3_tm->dir_chg_samples);
 	debugfs_create_u32("max_us_per_sample", 0444, ev3_tm->debug, &ev3_tm->max_us_per_sample);
@@ -1002,8 +1542,16 @@ static int legoev3_motor_probe(struct lego_device *ldev)
 	debugfs_create_u32("state", 0444, ev3_tm->debug, &ev3_tm->state);
 	debugfs_create_u32("run_to_pos_stop_action", 0444, ev3_tm->debug, &ev3_tm->run_to_pos_stop_action);
 	debugfs_create_bool("run_to_pos_active", 0444, ev3_tm->debug, &ev3_tm->run_to_pos_active);
+	debugfs_create_bool("profile_active", 0444, ev3_tm->debug, &ev3_tm->profile_active);
+	debugfs_create_u32("profile_position", 0444, ev3_tm->debug, &ev3_tm->profile_position);
 	debugfs_create_bool("speed_pid_ena", 0444, ev3_tm->debug, &ev3_tm->speed_pid_ena);
 	debugfs_create_bool("hold_pid_ena", 0444, ev3_tm->debug, &ev3_tm->hold_pid_ena);
+	debugfs_create_file("histograms", 0644, ev3_tm->debug, ev3_tm,
+			    &legoev3_motor_hist_fops);
+
+	mutex_lock(&legoev3_motor_list_lock);
+	list_add_tail(&ev3_tm->entry, &legoev3_motor_list);
+	mutex_unlock(&legoev3_motor_list_lock);
 
 	return 0;
 
@@ -1016,6 +1564,26 @@ err_register_tacho_motor:
 	return err;
 }
 
+/*
+ * Stops any motor that is still synchronized with ev3_tm. Must be called after
+ * ev3_tm is unregistered so that no new pair can be started with it.
+ */
+static void legoev3_motor_remove_sync(struct legoev3_motor_data *ev3_tm)
+{
+	struct legoev3_motor_data *other;
+	unsigned long flags;
+
+	mutex_lock(&legoev3_motor_list_lock);
+	list_del(&ev3_tm->entry);
+	list_for_each_entry(other, &legoev3_motor_list, entry) {
+		spin_lock_irqsave(&other->lock, flags);
+		if (other->sync_partner == ev3_tm)
+			__legoev3_motor_stop(other, other->sync_stop_action);
+		spin_unlock_irqrestore(&other->lock, flags);
+	}
+	mutex_unlock(&legoev3_motor_list_lock);
+}
+
 static int legoev3_motor_remove(struct lego_device *ldev)
 {
 	struct ev3_motor_platform_data *pdata = ldev->dev.platform_data;
@@ -1029,6 +1597,7 @@ static int legoev3_motor_remove(struct lego_device *ldev)
 	free_irq(gpio_to_irq(pdata->tacho_int_gpio), ev3_tm);
 	dev_set_drvdata(&ldev->dev, NULL);
 	unregister_tacho_motor(&ev3_tm->tm);
+	legoev3_motor_remove_sync(ev3_tm);
 	kfree(ev3_tm);
 	return 0;
 }
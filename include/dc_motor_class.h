@@ -21,6 +21,8 @@
 #include <linux/hrtimer.h>
 #include <linux/types.h>
 
+#include <motor_ramp.h>
+
 #define DC_MOTOR_NAME_SIZE	30
 #define DC_MOTOR_MAX_DUTY_CYCLE	100
 
@@ -112,7 +114,7 @@ struct dc_motor_ops {
  * @dev: The device struct used by the class.
  * @parms: The parameters set via sysfs attributes.
  * @active_params: Copy of params updated when command is sent.
- * @ramp_work: For ramp callbacks.
+ * @ramp: For ramp callbacks.
  * @run_timed_work: For run-timed command callback;
  * @duty_cycle: The current requested duty cycle.
  */
@@ -128,9 +130,8 @@ struct dc_motor_device {
 	enum dc_motor_command command;
 	int ramp_delta_duty_cycle;
 	int ramp_delta_time;
-	unsigned long ramp_end_time;
-	unsigned long last_ramp_work_time;
-	struct delayed_work ramp_work;
+	ktime_t ramp_end_time;
+	struct motor_ramp ramp;
 	struct delayed_work run_timed_work;
 	int duty_cycle;
 };
@@ -25,6 +25,7 @@
  * Used by sensor drivers to get notified when a port has new raw data available.
  */
 typedef void (*lego_port_notify_raw_data_func_t)(void *context);
+typedef void (*lego_port_notify_motor_state_func_t)(void *context);
 
 /**
  * struct lego_port_mode_info
@@ -75,6 +76,10 @@ struct lego_port_ev3_uart_ops {
  * @set_mode: Callback to set the sensor mode.
  * @set_device: Callback to load a device attached to this port.
  * @get_status: Callback to get the status string. (optional)
+ * @get_poll_ms: Callback to get the period in milliseconds at which the port
+ * 	polls the attached sensor for raw data. (optional)
+ * @set_poll_ms: Callback to set the polling period. 0 disables polling.
+ * 	(optional)
  * @nxt_analog_ops: Functions used by NXT/Analog ports (optional).
  * @nxt_i2c_ops: Functions used by NXT/I2C ports (optional).
  * @ev3_uart_ops: Functions used by EV3/UART ports (optional).
@@ -87,6 +92,10 @@ struct lego_port_ev3_uart_ops {
  * @notify_raw_data_func: Registered by sensor drivers to be notified of new
  * 	raw data.
  * @notify_raw_data_context: Send to notify_raw_data_func as parameter.
+ * @notify_motor_state_func: Registered by motor drivers to be notified when
+ * 	the port detects a change of the motor state, e.g. when a target
+ * 	position has been reached.
+ * @notify_motor_state_context: Send to notify_motor_state_func as parameter.
  */
 struct lego_port_device {
 	const char *name;
@@ -101,6 +110,8 @@ struct lego_port_device {
 	int (*set_mode)(void *context, u8 mode);
 	int (*set_device)(void *context, const char *device_name);
 	const char *(*get_status)(void *context);
+	int (*get_poll_ms)(void *context);
+	int (*set_poll_ms)(void *context, unsigned value);
 	const struct lego_port_nxt_analog_ops *nxt_analog_ops;
 	const struct lego_port_nxt_i2c_ops *nxt_i2c_ops;
 	const struct lego_port_ev3_analog_ops *ev3_analog_ops;
@@ -114,6 +125,8 @@ struct lego_port_device {
 	unsigned raw_data_size;
 	lego_port_notify_raw_data_func_t notify_raw_data_func;
 	void *notify_raw_data_context;
+	lego_port_notify_motor_state_func_t notify_motor_state_func;
+	void *notify_motor_state_context;
 };
 
 #define to_lego_port_device(_dev) container_of(_dev, struct lego_port_device, dev)
@@ -142,6 +155,63 @@ lego_port_call_raw_data_func(struct lego_port_device *port)
 		port->notify_raw_data_func(port->notify_raw_data_context);
 }
 
+static inline void
+lego_port_set_motor_state_func(struct lego_port_device *port,
+			       lego_port_notify_motor_state_func_t func,
+			       void *context)
+{
+	port->notify_motor_state_func = func;
+	port->notify_motor_state_context = context;
+}
+
+static inline void
+lego_port_call_motor_state_func(struct lego_port_device *port)
+{
+	if (port->notify_motor_state_func)
+		port->notify_motor_state_func(port->notify_motor_state_context);
+}
+
+/*
+ * Sensors on ports that poll the sensor themselves use the polling period of
+ * the port. These return -EOPNOTSUPP if the port can't change it.
+ */
+static inline int lego_port_get_poll_ms(struct lego_port_device *port)
+{
+	if (!port->get_poll_ms)
+		return -EOPNOTSUPP;
+
+	return port->get_poll_ms(port->context);
+}
+
+static inline int lego_port_set_poll_ms(struct lego_port_device *port,
+					unsigned value)
+{
+	if (!port->set_poll_ms)
+		return -EOPNOTSUPP;
+
+	return port->set_poll_ms(port->context, value);
+}
+
+/*
+ * Defines <prefix>_get_poll_ms() and <prefix>_set_poll_ms() for use as the
+ * get_poll_ms and set_poll_ms callbacks of a lego-sensor device. The sensor
+ * context must be a struct <type> with an ldev field.
+ */
+#define LEGO_PORT_POLL_MS_FUNCS(prefix, type)				\
+static int prefix##_get_poll_ms(void *context)				\
+{									\
+	struct type *data = context;					\
+									\
+	return lego_port_get_poll_ms(data->ldev->port);			\
+}									\
+									\
+static int prefix##_set_poll_ms(void *context, unsigned value)		\
+{									\
+	struct type *data = context;					\
+									\
+	return lego_port_set_poll_ms(data->ldev->port, value);		\
+}
+
 extern struct class lego_port_class;
 
 #endif /* _LEGO_PORT_CLASS_H_ */
@@ -0,0 +1,64 @@
+/*
+ * High resolution ramp timer for motor classes
+ *
+ * Copyright (C) 2017 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _MOTOR_RAMP_H
+#define _MOTOR_RAMP_H
+
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#define MOTOR_RAMP_MIN_PERIOD_MS	1
+#define MOTOR_RAMP_MAX_PERIOD_MS	100
+#define MOTOR_RAMP_DEFAULT_PERIOD_MS	100
+
+/**
+ * struct motor_ramp - ramp step timer
+ *
+ * @step: Callback for each step of the ramp. It is called in process context,
+ *	so it may sleep. It must call motor_ramp_schedule() if there should be
+ *	another step.
+ * @period: The time between steps.
+ * @expires: The time that the current step was supposed to run at.
+ * @steps: The number of timed steps since motor_ramp_start().
+ * @error_sum: The sum of how late each timed step was.
+ * @error_max: The longest time that a step was late.
+ */
+struct motor_ramp {
+	void (*step)(struct motor_ramp *ramp);
+	ktime_t period;
+	ktime_t expires;
+	unsigned steps;
+	ktime_t error_sum;
+	ktime_t error_max;
+	/* private */
+	struct hrtimer timer;
+	struct work_struct work;
+	bool cancelled;
+};
+
+void motor_ramp_init(struct motor_ramp *ramp,
+		     void (*step)(struct motor_ramp *ramp));
+void motor_ramp_start(struct motor_ramp *ramp);
+void motor_ramp_trigger(struct motor_ramp *ramp);
+void motor_ramp_schedule(struct motor_ramp *ramp);
+void motor_ramp_cancel(struct motor_ramp *ramp);
+bool motor_ramp_pending(struct motor_ramp *ramp);
+int motor_ramp_get_period(struct motor_ramp *ramp);
+int motor_ramp_set_period(struct motor_ramp *ramp, int ms);
+ssize_t motor_ramp_show_timing(struct motor_ramp *ramp, char *buf);
+
+#endif /* _MOTOR_RAMP_H */
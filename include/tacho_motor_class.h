@@ -18,13 +18,19 @@
 #define __LINUX_LEGOEV3_TACHO_MOTOR_CLASS_H
 
 #include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
 
 #include <dc_motor_class.h>
 #include <lego_port_class.h>
+#include <motor_ramp.h>
 
 /*
- * Note: run-timed is handled completely in the tacho-motor class, so
- * TM_COMMAND_RUN_TIMED is never passed to implementing drivers.
+ * Note: run-timed, run-trajectory and auto-tune are handled completely in the
+ * tacho-motor class, so TM_COMMAND_RUN_TIMED, TM_COMMAND_RUN_TRAJECTORY and
+ * TM_COMMAND_AUTO_TUNE are never passed to implementing drivers.
  */
 enum tacho_motor_command {
 	TM_COMMAND_RUN_FOREVER,
@@ -32,6 +38,8 @@ enum tacho_motor_command {
 	TM_COMMAND_RUN_TO_REL_POS,
 	TM_COMMAND_RUN_TIMED,
 	TM_COMMAND_RUN_DIRECT,
+	TM_COMMAND_RUN_TRAJECTORY,
+	TM_COMMAND_AUTO_TUNE,
 	TM_COMMAND_STOP,
 	TM_COMMAND_RESET,
 	NUM_TM_COMMAND
@@ -51,6 +59,12 @@ enum tm_stop_action {
 	NUM_TM_STOP_ACTION,
 };
 
+enum tm_ramp_profile {
+	TM_RAMP_PROFILE_LINEAR,
+	TM_RAMP_PROFILE_S_CURVE,
+	NUM_TM_RAMP_PROFILE,
+};
+
 enum tacho_motor_state
 {
 	TM_STATE_RUNNING,
@@ -68,6 +82,114 @@ enum tacho_motor_motion {
 };
 
 struct tacho_motor_ops;
+struct tm_telemetry;
+
+#define TM_TRAJECTORY_SIZE 64
+
+/**
+ * struct tm_waypoint - one point of a trajectory
+ *
+ * @time: Milliseconds since the run-trajectory command was sent.
+ * @position: The target position in tacho counts.
+ * @speed: The target speed in tacho counts per second.
+ */
+struct tm_waypoint {
+	int time;
+	int position;
+	int speed;
+};
+
+/**
+ * struct tacho_motor_telemetry - one record of the telemetry character device
+ *
+ * This is part of the userspace ABI, so the layout must not change.
+ *
+ * @timestamp: CLOCK_MONOTONIC time of the sample in nanoseconds.
+ * @sequence: Counts up by one for each record since the device was opened.
+ *	Gaps mean that records were dropped because the buffer was full.
+ * @position: The position in tacho counts.
+ * @speed: The speed in tacho counts per second.
+ * @position_sp: The position setpoint in tacho counts.
+ * @speed_sp: The speed setpoint in tacho counts per second.
+ * @duty_cycle: The duty cycle in percent.
+ * @state: Bit flags of enum tacho_motor_state.
+ * @reserved: Always 0.
+ */
+struct tacho_motor_telemetry {
+	s64 timestamp;
+	u32 sequence;
+	s32 position;
+	s32 speed;
+	s32 position_sp;
+	s32 speed_sp;
+	s8 duty_cycle;
+	u8 state;
+	u16 reserved;
+};
+
+enum tm_auto_tune_status {
+	TM_AUTO_TUNE_NONE,
+	TM_AUTO_TUNE_RUNNING,
+	TM_AUTO_TUNE_DONE,
+	TM_AUTO_TUNE_FAILED,
+	NUM_TM_AUTO_TUNE_STATUS,
+};
+
+struct tm_auto_tune_sample {
+	int time;
+	int speed;
+};
+
+/**
+ * struct tm_auto_tune - state and results of the auto-tune command
+ *
+ * @status: The status of the last auto-tune command.
+ * @error: The error code if the status is failed.
+ * @gain: Measured steady state speed per 100% duty cycle in tacho counts per
+ *	second.
+ * @deadband: Measured duty cycle needed to overcome friction in percent.
+ * @time_constant: Measured time constant of the speed in microseconds.
+ * @dead_time: Measured dead time of the speed in microseconds.
+ * @speed_Kp: The speed proportional constant that was installed.
+ * @speed_Ki: The speed integral constant that was installed.
+ * @speed_Kf: The speed feed-forward constant that was installed.
+ * @hold_Kp: The hold proportional constant that was installed.
+ */
+struct tm_auto_tune {
+	enum tm_auto_tune_status status;
+	int error;
+	int gain;
+	int deadband;
+	int time_constant;
+	int dead_time;
+	int speed_Kp;
+	int speed_Ki;
+	int speed_Kf;
+	int hold_Kp;
+	/* private */
+	struct motor_ramp timer;
+	struct tm_auto_tune_sample *samples;
+	unsigned num_samples;
+	bool stepped;
+	ktime_t start;
+	s64 speed_sum;
+	unsigned speed_count;
+};
+
+/**
+ * struct tacho_motor_status - values read from the motor controller at once
+ *
+ * @position: The position in tacho counts.
+ * @speed: The speed in tacho counts per second.
+ * @duty_cycle: The duty cycle in percent.
+ * @state: Bit flags of enum tacho_motor_state.
+ */
+struct tacho_motor_status {
+	int position;
+	int speed;
+	int duty_cycle;
+	unsigned state;
+};
 
 /**
  * struct tacho_motor_params - user specified parameters
@@ -82,6 +204,9 @@ struct tacho_motor_ops;
  * @ time_sp: The time in milliseconds used by the run-timed command.
  * @ ramp_up_sp: In milliseconds.
  * @ ramp_down_sp: In milliseconds.
+ * @ ramp_smoothing_sp: In milliseconds. Used only with the s-curve profile.
+ * @ turn_ratio_sp: Used by the steer-* sync commands. -200 to 200.
+ * @ramp_profile: The shape of the speed ramps.
  * @stop_action: What to do for stop command or when run command ends.
  */
 struct tacho_motor_params {
@@ -91,6 +216,9 @@ struct tacho_motor_params {
 	int time_sp;
 	int ramp_up_sp;
 	int ramp_down_sp;
+	int ramp_smoothing_sp;
+	int turn_ratio_sp;
+	enum tm_ramp_profile ramp_profile;
 	enum tacho_motor_command command;
 	enum tm_stop_action stop_action;
 };
@@ -102,6 +230,19 @@ struct tacho_motor_params {
  * The tacho motor class will set the default values for params, so if a driver
  * needs to change them, it should be done after the tacho_motor_device is
  * registered.
+ *
+ * Drivers that call tacho_motor_push_telemetry() from their control loop
+ * should set driver_telemetry. Otherwise, the tacho motor class polls the
+ * ops to fill the telemetry device.
+ *
+ * Drivers should call tacho_motor_notify_state_change() when they detect a
+ * change of state, e.g. when the target position of run_to_pos is reached.
+ * Drivers that do this for all state changes should set driver_state_notify.
+ * Otherwise, the tacho motor class polls the state while the motor is running.
+ *
+ * Drivers that regulate speed and position with the tm_pid helper should set
+ * pid_period_us to the period of their control loop. This is needed by the
+ * auto-tune command.
  */
 struct tacho_motor_device {
 	const char *driver_name;
@@ -116,15 +257,60 @@ struct tacho_motor_device {
 	int ramp_end_speed;
 	int ramp_last_speed;
 	int ramp_delta_time;
-	unsigned long ramp_end_time;
-	unsigned long last_ramp_work_time;
+	int ramp_smooth_time;
+	ktime_t ramp_end_time;
 	enum tacho_motor_state oldstate;
+	ktime_t state_time;
 	bool ramping;
+	bool ramp_stopping;
 	enum dc_motor_polarity polarity;
+	int sync_group;
+	int sync_command;
+	ktime_t sync_commit_time;
+	struct tm_waypoint trajectory[TM_TRAJECTORY_SIZE];
+	unsigned trajectory_head;
+	unsigned trajectory_count;
+	unsigned trajectory_underruns;
+	ktime_t trajectory_start;
+	bool trajectory_running;
+	bool driver_telemetry;
+	bool driver_state_notify;
+	int pid_period_us;
+	struct tm_auto_tune tune;
+	int telemetry_period;
 	/* private */
 	struct device dev;
 	struct delayed_work run_timed_work;
-	struct delayed_work ramp_work;
+	struct motor_ramp ramp;
+	struct delayed_work trajectory_work;
+	struct mutex trajectory_lock;
+	struct list_head sync_entry;
+	struct tm_telemetry __rcu *telemetry;
+	struct delayed_work telemetry_work;
+	struct delayed_work state_work;
+	struct mutex state_lock;
+};
+
+struct tm_profile;
+
+/**
+ * struct tm_steering - parameters of a synchronized pair of motors
+ *
+ * @speed: The speed of the motor in tacho counts per second.
+ * @partner_speed: The speed of the partner motor in tacho counts per second.
+ * @time: The run time in milliseconds or 0 for no limit.
+ * @counts: The number of tacho counts that the faster of the two motors runs
+ *	or 0 for no limit.
+ * @stop_action: What to do with both motors at the end.
+ *
+ * Speeds are as seen by the driver, i.e. polarity has already been applied.
+ */
+struct tm_steering {
+	int speed;
+	int partner_speed;
+	int time;
+	int counts;
+	enum tm_stop_action stop_action;
 };
 
 /**
@@ -137,6 +323,9 @@ struct tacho_motor_device {
  * @get_state: Gets the state flags for the motor.
  * @get_duty_cycle: Gets the current PWM duty cycle being sent to the motor.
  * @get_speed: Gets the current speed of the motor in tacho counts per second.
+ * @get_status: Optional. Gets the position, speed, duty cycle and state flags
+ *	from a single read of the motor controller. Drivers should implement
+ *	this if the other get_* functions are separate bus transactions.
  * @run_unregulated: Sends message to the motor controller to run in unregulated
  *	mode with the specified duty cycle.
  * @run_regulated: Sends message to the motor controller to run in regulated
@@ -144,12 +333,32 @@ struct tacho_motor_device {
  * @run_to_pos: Sends message to the motor controller to run to the specified
  *	position using speed regulation and do the specified stop action when
  *	the target position is reached.
+ * @run_profile: Optional. Makes the motor follow the reference position and
+ *	speed of the profile (see tm_profile_eval()) and do the specified stop
+ *	action at the end. Drivers that do not have position profiles in the
+ *	motor controller should implement this. The tacho motor class then
+ *	plans the run-to-*-pos commands itself instead of using @run_to_pos.
+ * @run_steering: Optional. Runs the motor and the partner motor (the context
+ *	of another motor of the same driver) at the speeds of @steering and
+ *	keeps the ratio of their positions while they run. Both motors stop
+ *	when the time or count limit is reached. Running or stopping either
+ *	motor ends the pair for that motor.
  * @stop: Sends message to the motor controller to stop using the specified
  *	action.
  * @reset: Sends message to the motor controller to reset. This will stop the
  *	motor and reset any motor controller parameters.
  * @get_stop_actions: Gets flags representing the valid stop actions supported
  * 	by the driver.
+ * @set_control_period: Optional. Sets the period of the control loop in
+ *	microseconds and updates pid_period_us. Returns -EINVAL if the driver
+ *	does not support the period.
+ * @begin_batch: Optional. Tells the motor controller that the following run
+ *	and stop operations from the calling thread should be queued instead of
+ *	sent. Reads are not queued, so they may be sent ahead of operations that
+ *	were queued before them. Calls may be nested, e.g. once for each motor
+ *	in a sync group.
+ * @end_batch: Optional. Must be called once for each call to @begin_batch.
+ *	The last call sends all queued operations in a single bus transaction.
  * @get_speed_Kp: Gets the current proportional PID constant for the speed PID.
  * @set_speed_Kp: Sets the current proportional PID constant for the speed PID.
  * @get_speed_Ki: Gets the current integral PID constant for the speed PID.
@@ -162,6 +371,14 @@ struct tacho_motor_device {
  * @set_position_Ki: Sets the current integral PID constant for the position PID.
  * @get_position_Kd: Gets the current derivative PID constant for the position PID.
  * @set_position_Kd: Sets the current derivative PID constant for the position PID.
+ * @get_speed_Kf, @set_speed_Kf: Optional. Gets or sets the feed-forward gain
+ *	of the speed PID. There is no hold equivalent.
+ * @get_speed_Tf, @set_speed_Tf, @get_hold_Tf, @set_hold_Tf: Optional. Gets or
+ *	sets the time constant of the derivative filter of the PID.
+ * @get_speed_slew, @set_speed_slew, @get_hold_slew, @set_hold_slew: Optional.
+ *	Gets or sets the output slew rate limit of the PID.
+ * @get_speed_scale, @set_speed_scale, @get_hold_scale, @set_hold_scale:
+ *	Optional. Gets or sets the fixed point scale of the PID constants.
  */
 struct tacho_motor_ops {
 	int (*get_position)(void *context, int *position);
@@ -171,22 +388,40 @@ struct tacho_motor_ops {
 
 	int (*get_duty_cycle)(void *context, int *duty_cycle);
 	int (*get_speed)(void *context, int *speed);
+	int (*get_status)(void *context, struct tacho_motor_status *status);
 
 	int (*run_unregulated)(void *context, int duty_cycle);
 	int (*run_regulated)(void *context, int speed);
 	int (*run_to_pos)(void *context, int pos, int speed,
 			  enum tm_stop_action action);
+	int (*run_profile)(void *context, const struct tm_profile *profile,
+			   enum tm_stop_action action);
+	int (*run_steering)(void *context, void *partner,
+			    const struct tm_steering *steering);
 	int (*stop)(void *context, enum tm_stop_action action);
 	int (*reset)(void *context);
 
 	unsigned (*get_stop_actions)(void *context);
 
+	int (*set_control_period)(void *context, int us);
+
+	void (*begin_batch)(void *context);
+	int (*end_batch)(void *context);
+
 	int (*get_speed_Kp)(void *context);
 	int (*set_speed_Kp)(void *context, int k);
 	int (*get_speed_Ki)(void *context);
 	int (*set_speed_Ki)(void *context, int k);
 	int (*get_speed_Kd)(void *context);
 	int (*set_speed_Kd)(void *context, int k);
+	int (*get_speed_Kf)(void *context);
+	int (*set_speed_Kf)(void *context, int k);
+	int (*get_speed_Tf)(void *context);
+	int (*set_speed_Tf)(void *context, int k);
+	int (*get_speed_slew)(void *context);
+	int (*set_speed_slew)(void *context, int k);
+	int (*get_speed_scale)(void *context);
+	int (*set_speed_scale)(void *context, int k);
 
 	int (*get_hold_Kp)(void *context);
 	int (*set_hold_Kp)(void *context, int k);
@@ -194,10 +429,18 @@ struct tacho_motor_ops {
 	int (*set_hold_Ki)(void *context, int k);
 	int (*get_hold_Kd)(void *context);
 	int (*set_hold_Kd)(void *context, int k);
+	int (*get_hold_Tf)(void *context);
+	int (*set_hold_Tf)(void *context, int k);
+	int (*get_hold_slew)(void *context);
+	int (*set_hold_slew)(void *context, int k);
+	int (*get_hold_scale)(void *context);
+	int (*set_hold_scale)(void *context, int k);
 };
 
 extern void tacho_motor_notify_state_change(struct tacho_motor_device *);
 extern void tacho_motor_notify_position_ramp_down(struct tacho_motor_device *);
+extern void tacho_motor_push_telemetry(struct tacho_motor_device *,
+				       struct tacho_motor_telemetry *);
 
 extern int register_tacho_motor(struct tacho_motor_device *, struct device *);
 
@@ -42,11 +42,43 @@ struct tm_speed {
 	int speed;
 };
 
+#define TM_SPEED_AB_SHIFT	16
+
+/**
+ * struct tm_speed_ab - private data of the alpha-beta speed estimator
+ *
+ * @pos: The estimated position in tacho counts, shifted by TM_SPEED_AB_SHIFT.
+ * @speed: The estimated speed in tacho counts per second, shifted by
+ *	TM_SPEED_AB_SHIFT.
+ * @time: The timestamp of the last update.
+ * @alpha: Position gain, shifted by TM_SPEED_AB_SHIFT.
+ * @beta: Speed gain, shifted by TM_SPEED_AB_SHIFT.
+ *
+ * This is an alternative to struct tm_speed that does not keep a history
+ * of positions. The fields should not be accessed directly. Use
+ * tm_speed_ab_get() to read the speed.
+ */
+struct tm_speed_ab {
+	s64 pos;
+	s64 speed;
+	ktime_t time;
+	int alpha;
+	int beta;
+};
+
 extern void tm_speed_init(struct tm_speed *spd, int pos, ktime_t t, int count);
 extern void tm_speed_update(struct tm_speed *spd, int pos, ktime_t t);
 #define tm_speed_update_now(s, p) \
 	tm_speed_update((s), (p), ktime_get())
 #define tm_speed_get(s) ((s)->speed)
+
+extern void tm_speed_ab_init(struct tm_speed_ab *ab, int pos, ktime_t t,
+			     int count);
+extern void tm_speed_ab_update(struct tm_speed_ab *ab, int pos, ktime_t t);
+extern void tm_speed_ab_set_count(struct tm_speed_ab *ab, int count);
+#define tm_speed_ab_get(ab) \
+	((int)(((ab)->speed + (1 << (TM_SPEED_AB_SHIFT - 1))) \
+	       >> TM_SPEED_AB_SHIFT))
 /* Use this template to implement tacho_motor_ops.get_speed */
 #define TM_SPEED_GET_SPEED_FUNC(prefix, type, field) \
 static int prefix##_get_speed(void *context, int *speed)	\
@@ -57,20 +89,106 @@ static int prefix##_get_speed(void *context, int *speed)	\
 								\
 	return 0;						\
 }
+/* Same as above for struct tm_speed_ab */
+#define TM_SPEED_AB_GET_SPEED_FUNC(prefix, type, field) \
+static int prefix##_get_speed(void *context, int *speed)	\
+{								\
+	struct type *data = context;				\
+								\
+	*speed = tm_speed_ab_get(&data->field);			\
+								\
+	return 0;						\
+}
 
+#define TM_PROFILE_MAX_KNOTS		5
+#define TM_PROFILE_MAX_SMOOTH_MS	1000
+
+/**
+ * struct tm_profile_knot - corner of the speed of a position profile
+ *
+ * @time: Microseconds since the start of the profile.
+ * @pos: Position relative to the start in millionths of a tacho count.
+ * @speed: Speed in tacho counts per second.
+ */
+struct tm_profile_knot {
+	s64 time;
+	s64 pos;
+	int speed;
+};
+
+/**
+ * struct tm_profile - reference trajectory of a run-to-*-pos command
+ *
+ * @start: The position at the start in tacho counts.
+ * @target: The position at the end in tacho counts.
+ * @start_speed: The speed at the start in tacho counts per second.
+ * @speed: The cruise speed in tacho counts per second.
+ * @smooth: Width of the moving average that turns the trapezoid into an
+ *	s-curve in microseconds. 0 for a trapezoid.
+ * @start_time: The time of the start.
+ * @num_knots: The number of used entries in @knots.
+ * @knots: The speed is linear between knots. The speed of the last knot is 0.
+ *
+ * Profiles are planned by the tacho motor class and followed by drivers that
+ * implement tacho_motor_ops.run_profile using tm_profile_eval().
+ */
+struct tm_profile {
+	int start;
+	int target;
+	int start_speed;
+	int speed;
+	int smooth;
+	ktime_t start_time;
+	unsigned num_knots;
+	struct tm_profile_knot knots[TM_PROFILE_MAX_KNOTS];
+};
+
+extern bool tm_profile_eval(const struct tm_profile *prof, ktime_t now,
+			    int *position, int *speed);
+
+#define TM_PID_DEFAULT_SCALE	10000
+#define TM_PID_MAX_TF		1000
+
+/**
+ * struct tm_pid - PID controller state
+ *
+ * @setpoint: The target process value.
+ * @Kp: Proportional gain.
+ * @Ki: Integral gain.
+ * @Kd: Derivative gain.
+ * @Kf: Feed-forward gain. The setpoint times Kf is added to the output.
+ * @Tf: Time constant of the derivative low-pass filter in number of updates.
+ *	0 disables the filter.
+ * @slew: Maximum change of the output per update in percent. 0 means no
+ *	limit.
+ * @scale: Divisor applied to the gains, i.e. the gains are fixed point
+ *	numbers with this as 1.0.
+ * @integral: Sum of the errors.
+ * @prev_error: The error of the last update.
+ * @d_filtered: Filtered derivative term, times 256 to keep the fraction.
+ * @output: The output of the last update.
+ * @overloaded: The last output had to be limited to 100%.
+ */
 struct tm_pid {
 	int setpoint;
 	int Kp;
 	int Ki;
 	int Kd;
+	int Kf;
+	int Tf;
+	int slew;
+	int scale;
 	int integral;
 	int prev_error;
+	int d_filtered;
+	int output;
 	bool overloaded;
 };
 
 extern void tm_pid_reinit(struct tm_pid *pid);
 extern void tm_pid_init(struct tm_pid *pid, int Kp, int Ki, int Kd);
 extern int tm_pid_update(struct tm_pid *pid, int speed);
+extern void tm_pid_transfer(struct tm_pid *pid, int value, int output);
 #define tm_pid_is_overloaded(pid) ((pid)->overloaded)
 /*
  * Use this template to implement tacho_motor_ops.get_{speed,position}_K{p,i.d}.
@@ -94,5 +212,20 @@ static int prefix##_set_##suffix(void *context, int value)	\
 								\
 	return 0;						\
 }
+/*
+ * Use this template to implement tacho_motor_ops.set_{speed,position}_scale
+ */
+#define TM_PID_SET_SCALE_FUNC(prefix, suffix, type, field) \
+static int prefix##_set_##suffix(void *context, int value)	\
+{								\
+	struct type *data = context;				\
+								\
+	if (value <= 0)						\
+		return -EINVAL;					\
+								\
+	data->field = value;					\
+								\
+	return 0;						\
+}
 
 #endif /* _TACHO_MOTOR_HELPER_H */
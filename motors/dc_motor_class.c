@@ -125,6 +125,18 @@
  *      - Sets the time in milliseconds that it take the motor to up ramp from
  *        0% to 100%. Valid values are 0 to 10000 (10 seconds). Default is 0.
  *
+ *    * - ``ramp_period``
+ *      - read/write
+ *      - Sets the time in milliseconds between steps of a ramp. Valid values
+ *        are 1 to 100. Default is 100. Shorter periods give smoother ramps at
+ *        the cost of more CPU time and bus traffic.
+ *
+ *    * - ``ramp_timing``
+ *      - read-only
+ *      - Returns three space separated values for the steps of the last ramp:
+ *        the number of steps, the average and the maximum time in microseconds
+ *        that a step ran after the time it was scheduled for.
+ *
  *    * - ``time_sp``
  *      - read/write
  *      -  Sets the time setpoint used with the ``run-timed`` command.
@@ -132,12 +144,11 @@
  */
 
 #include <linux/device.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 
 #include <dc_motor_class.h>
-
-#define RAMP_PERIOD	msecs_to_jiffies(100)
-
+#include <motor_ramp.h>
 const char *dc_motor_command_names[] = {
 	[DC_MOTOR_COMMAND_RUN_FOREVER]	= "run-forever",
 	[DC_MOTOR_COMMAND_RUN_TIMED]	= "run-timed",
@@ -163,28 +174,29 @@ const char *dc_motor_state_names[] = {
 
 void dc_motor_class_start_motor_ramp(struct dc_motor_device *motor)
 {
-	unsigned long ramp_sp, now;
+	int ramp_sp;
 
 	motor->ramp_delta_duty_cycle =
 		motor->active_params.duty_cycle_sp - motor->duty_cycle;
 	if (motor->ramp_delta_duty_cycle > 0)
-		ramp_sp = msecs_to_jiffies(motor->active_params.ramp_up_sp);
+		ramp_sp = motor->active_params.ramp_up_sp;
 	else
-		ramp_sp = msecs_to_jiffies(motor->active_params.ramp_down_sp);
-	motor->ramp_delta_time = ramp_sp * abs(motor->ramp_delta_duty_cycle) / 100;
-	now = jiffies;
-	motor->ramp_end_time = now + motor->ramp_delta_time;
-	motor->last_ramp_work_time = now;
-	schedule_delayed_work(&motor->ramp_work, 0);
+		ramp_sp = motor->active_params.ramp_down_sp;
+	/* in microseconds */
+	motor->ramp_delta_time = div_s64((s64)ramp_sp * USEC_PER_MSEC
+				* abs(motor->ramp_delta_duty_cycle), 100);
+	motor_ramp_start(&motor->ramp);
+	motor->ramp_end_time = ktime_add_us(motor->ramp.expires,
+					    motor->ramp_delta_time);
+	motor_ramp_trigger(&motor->ramp);
 }
 
-static void dc_motor_class_ramp_work(struct work_struct *work)
+static void dc_motor_class_ramp_step(struct motor_ramp *ramp)
 {
 	struct dc_motor_device *motor =
-		container_of(to_delayed_work(work), struct dc_motor_device, ramp_work);
+		container_of(ramp, struct dc_motor_device, ramp);
 	enum dc_motor_internal_command internal_command;
-	unsigned long remaining_ramp_time = 0;
-	unsigned long last_ramp_time;
+	s64 remaining_ramp_time = 0;
 	int  err;
 
 	/* check to see if we are running and done ramping */
@@ -199,12 +211,13 @@ static void dc_motor_class_ramp_work(struct work_struct *work)
 	 * to the appropriate point along the ramp, otherwise set the duty
 	 * directly to the setpoint.
 	 */
-	if (time_is_after_jiffies(motor->ramp_end_time))
-		remaining_ramp_time = motor->ramp_end_time - jiffies;
+	remaining_ramp_time = ktime_us_delta(motor->ramp_end_time, ktime_get());
+	if (remaining_ramp_time < 0)
+		remaining_ramp_time = 0;
 	if (motor->ramp_delta_time != 0 && remaining_ramp_time != 0) {
 		motor->duty_cycle = motor->active_params.duty_cycle_sp
-			- motor->ramp_delta_duty_cycle * (int)remaining_ramp_time
-				/ motor->ramp_delta_time;
+			- div_s64(motor->ramp_delta_duty_cycle
+				  * remaining_ramp_time, motor->ramp_delta_time);
 		if (motor->duty_cycle > DC_MOTOR_MAX_DUTY_CYCLE)
 			motor->duty_cycle = DC_MOTOR_MAX_DUTY_CYCLE;
 		else if (motor->duty_cycle < -DC_MOTOR_MAX_DUTY_CYCLE)
@@ -234,21 +247,14 @@ static void dc_motor_class_ramp_work(struct work_struct *work)
 					 abs(motor->duty_cycle));
 	WARN_ONCE(err, "Failed to set duty cycle.");
 
-	/* don't reschedule ramp_work if we are stopped */
+	/* don't reschedule the ramp if we are stopped */
 	if (!IS_DC_MOTOR_RUN_COMMAND(motor->command)
 		&& !IS_DC_MOTOR_INTERNAL_RUN_COMMAND(internal_command))
 	{
 		return;
 	}
 
-	/*
-	 * Measure how long it took since the last call to ramp_work and
-	 * schedule the next ramp as close to RAMP_PERIOD as we can get
-	 */
-	last_ramp_time = jiffies - motor->last_ramp_work_time;
-	motor->last_ramp_work_time = jiffies;
-	schedule_delayed_work(&motor->ramp_work,
-		last_ramp_time >= RAMP_PERIOD ? 0 : RAMP_PERIOD - last_ramp_time);
+	motor_ramp_schedule(&motor->ramp);
 }
 
 static void dc_motor_class_run_timed_work(struct work_struct *work)
@@ -321,6 +327,40 @@ static ssize_t ramp_down_sp_store(struct device *dev,
 	return count;
 }
 
+static ssize_t ramp_period_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dc_motor_device *motor = to_dc_motor_device(dev);
+
+	return sprintf(buf, "%d\n", motor_ramp_get_period(&motor->ramp));
+}
+
+static ssize_t ramp_period_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct dc_motor_device *motor = to_dc_motor_device(dev);
+	int err, value;
+
+	err = kstrtoint(buf, 10, &value);
+	if (err < 0)
+		return err;
+
+	err = motor_ramp_set_period(&motor->ramp, value);
+	if (err < 0)
+		return err;
+
+	return count;
+}
+
+static ssize_t ramp_timing_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct dc_motor_device *motor = to_dc_motor_device(dev);
+
+	return motor_ramp_show_timing(&motor->ramp, buf);
+}
+
 static ssize_t polarity_show(struct device *dev,
 			     struct device_attribute *attr, char *buf)
 {
@@ -522,7 +562,7 @@ static ssize_t state_show(struct device *dev, struct device_attribute *attr,
 	if (IS_DC_MOTOR_INTERNAL_RUN_COMMAND(command))
 		flags |= BIT(DC_MOTOR_STATE_RUNNING);
 
-	if (delayed_work_pending(&motor->ramp_work))
+	if (motor_ramp_pending(&motor->ramp))
 		flags |= BIT(DC_MOTOR_STATE_RAMPING);
 
 	for (i = 0; i < NUM_DC_MOTOR_STATE; i++) {
@@ -568,6 +608,8 @@ static DEVICE_ATTR_RO(driver_name);
 static DEVICE_ATTR_RO(address);
 static DEVICE_ATTR_RW(ramp_up_sp);
 static DEVICE_ATTR_RW(ramp_down_sp);
+static DEVICE_ATTR_RW(ramp_period);
+static DEVICE_ATTR_RO(ramp_timing);
 static DEVICE_ATTR_RW(polarity);
 static DEVICE_ATTR_RW(duty_cycle_sp);
 static DEVICE_ATTR_RO(duty_cycle);
@@ -583,6 +625,8 @@ static struct attribute *dc_motor_class_attrs[] = {
 	&dev_attr_address.attr,
 	&dev_attr_ramp_up_sp.attr,
 	&dev_attr_ramp_down_sp.attr,
+	&dev_attr_ramp_period.attr,
+	&dev_attr_ramp_timing.attr,
 	&dev_attr_polarity.attr,
 	&dev_attr_duty_cycle_sp.attr,
 	&dev_attr_duty_cycle.attr,
@@ -623,7 +667,7 @@ int register_dc_motor(struct dc_motor_device *dc, struct device *parent)
 	dc->dev.class = &dc_motor_class;
 	dev_set_name(&dc->dev, "motor%d", dc_motor_class_id++);
 
-	INIT_DELAYED_WORK(&dc->ramp_work, dc_motor_class_ramp_work);
+	motor_ramp_init(&dc->ramp, dc_motor_class_ramp_step);
 	INIT_DELAYED_WORK(&dc->run_timed_work, dc_motor_class_run_timed_work);
 
 	err = device_register(&dc->dev);
@@ -640,7 +684,7 @@ void unregister_dc_motor(struct dc_motor_device *dc)
 {
 	dev_info(&dc->dev, "Unregistered '%s' on '%s'.\n", dc->name, dc->address);
 	cancel_delayed_work_sync(&dc->run_timed_work);
-	cancel_delayed_work_sync(&dc->ramp_work);
+	motor_ramp_cancel(&dc->ramp);
 	device_unregister(&dc->dev);
 }
 EXPORT_SYMBOL_GPL(unregister_dc_motor);
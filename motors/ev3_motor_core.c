@@ -27,6 +27,13 @@ struct ev3_motor_data {
 	struct lego_device *data;
 };
 
+static void ev3_motor_notify_state(void *context)
+{
+	struct tacho_motor_device *tm = context;
+
+	tacho_motor_notify_state_change(tm);
+}
+
 static int ev3_motor_probe(struct lego_device *ldev)
 {
 	struct ev3_motor_data *data;
@@ -59,6 +66,9 @@ static int ev3_motor_probe(struct lego_device *ldev)
 	if (err)
 		goto err_register_tacho_motor;
 
+	lego_port_set_motor_state_func(ldev->port, ev3_motor_notify_state,
+				       &data->tm);
+
 	return 0;
 
 err_register_tacho_motor:
@@ -72,6 +82,7 @@ static int ev3_motor_remove(struct lego_device *ldev)
 {
 	struct ev3_motor_data *data = dev_get_drvdata(&ldev->dev);
 
+	lego_port_set_motor_state_func(ldev->port, NULL, NULL);
 	unregister_tacho_motor(&data->tm);
 	dev_set_drvdata(&ldev->dev, NULL);
 	kfree(data);
@@ -0,0 +1,211 @@
+/*
+ * High resolution ramp timer for motor classes
+ *
+ * Copyright (C) 2026 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The dc-motor and tacho-motor classes step their speed ramps with this
+ * timer. An hrtimer is used so that the period is not limited to jiffies, but
+ * the steps themselves run in a work item on the high priority workqueue
+ * because motor controller operations may sleep (e.g. SPI or I2C).
+ *
+ * Steps are scheduled at absolute times that are multiples of the period from
+ * the start of the ramp, so a late step does not delay the ones after it.
+ */
+
+#include <linux/export.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include <motor_ramp.h>
+
+static enum hrtimer_restart motor_ramp_timer_callback(struct hrtimer *timer)
+{
+	struct motor_ramp *ramp = container_of(timer, struct motor_ramp, timer);
+
+	queue_work(system_highpri_wq, &ramp->work);
+
+	return HRTIMER_NORESTART;
+}
+
+static void motor_ramp_work(struct work_struct *work)
+{
+	struct motor_ramp *ramp = container_of(work, struct motor_ramp, work);
+	ktime_t error;
+
+	if (ramp->cancelled)
+		return;
+
+	error = ktime_sub(ktime_get(), ramp->expires);
+	if (ktime_to_ns(error) < 0)
+		error = ktime_set(0, 0);
+	ramp->steps++;
+	ramp->error_sum = ktime_add(ramp->error_sum, error);
+	if (ktime_after(error, ramp->error_max))
+		ramp->error_max = error;
+
+	ramp->step(ramp);
+}
+
+/**
+ * motor_ramp_init - initialize a ramp timer
+ *
+ * @ramp: The ramp timer.
+ * @step: The callback for each step.
+ */
+void motor_ramp_init(struct motor_ramp *ramp,
+		     void (*step)(struct motor_ramp *ramp))
+{
+	ramp->step = step;
+	ramp->period = ms_to_ktime(MOTOR_RAMP_DEFAULT_PERIOD_MS);
+	ramp->cancelled = true;
+	hrtimer_init(&ramp->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	ramp->timer.function = motor_ramp_timer_callback;
+	INIT_WORK(&ramp->work, motor_ramp_work);
+}
+EXPORT_SYMBOL_GPL(motor_ramp_init);
+
+/**
+ * motor_ramp_start - start the time base of a new ramp
+ *
+ * @ramp: The ramp timer.
+ *
+ * The caller is expected to do the first step itself (or call
+ * motor_ramp_trigger()). This also resets the timing statistics.
+ */
+void motor_ramp_start(struct motor_ramp *ramp)
+{
+	ramp->expires = ktime_get();
+	ramp->steps = 0;
+	ramp->error_sum = ktime_set(0, 0);
+	ramp->error_max = ktime_set(0, 0);
+	ramp->cancelled = false;
+}
+EXPORT_SYMBOL_GPL(motor_ramp_start);
+
+/**
+ * motor_ramp_trigger - run the next step as soon as possible
+ *
+ * @ramp: The ramp timer.
+ */
+void motor_ramp_trigger(struct motor_ramp *ramp)
+{
+	queue_work(system_highpri_wq, &ramp->work);
+}
+EXPORT_SYMBOL_GPL(motor_ramp_trigger);
+
+/**
+ * motor_ramp_schedule - schedule the next step one period after the last one
+ *
+ * @ramp: The ramp timer.
+ *
+ * If the next step is already in the past (because the last step ran too
+ * late), it is skipped rather than run right away.
+ */
+void motor_ramp_schedule(struct motor_ramp *ramp)
+{
+	ktime_t now = ktime_get();
+
+	if (ramp->cancelled)
+		return;
+
+	ramp->expires = ktime_add(ramp->expires, ramp->period);
+	while (!ktime_after(ramp->expires, now))
+		ramp->expires = ktime_add(ramp->expires, ramp->period);
+
+	hrtimer_start(&ramp->timer, ramp->expires, HRTIMER_MODE_ABS);
+}
+EXPORT_SYMBOL_GPL(motor_ramp_schedule);
+
+/**
+ * motor_ramp_cancel - stop the ramp and wait for any running step
+ *
+ * @ramp: The ramp timer.
+ *
+ * Must not be called from the step callback.
+ */
+void motor_ramp_cancel(struct motor_ramp *ramp)
+{
+	ramp->cancelled = true;
+	hrtimer_cancel(&ramp->timer);
+	cancel_work_sync(&ramp->work);
+	/* the step may have started the timer again before it was cancelled */
+	hrtimer_cancel(&ramp->timer);
+}
+EXPORT_SYMBOL_GPL(motor_ramp_cancel);
+
+/**
+ * motor_ramp_pending - check if there is another step waiting to run
+ *
+ * @ramp: The ramp timer.
+ */
+bool motor_ramp_pending(struct motor_ramp *ramp)
+{
+	return hrtimer_active(&ramp->timer) || work_pending(&ramp->work);
+}
+EXPORT_SYMBOL_GPL(motor_ramp_pending);
+
+/**
+ * motor_ramp_get_period - get the step period in milliseconds
+ *
+ * @ramp: The ramp timer.
+ */
+int motor_ramp_get_period(struct motor_ramp *ramp)
+{
+	return ktime_to_ms(ramp->period);
+}
+EXPORT_SYMBOL_GPL(motor_ramp_get_period);
+
+/**
+ * motor_ramp_set_period - set the step period
+ *
+ * @ramp: The ramp timer.
+ * @ms: The new period in milliseconds.
+ *
+ * Returns 0 on success or -EINVAL if the period is out of range.
+ */
+int motor_ramp_set_period(struct motor_ramp *ramp, int ms)
+{
+	if (ms < MOTOR_RAMP_MIN_PERIOD_MS || ms > MOTOR_RAMP_MAX_PERIOD_MS)
+		return -EINVAL;
+
+	ramp->period = ms_to_ktime(ms);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(motor_ramp_set_period);
+
+/**
+ * motor_ramp_show_timing - format the timing statistics for sysfs
+ *
+ * @ramp: The ramp timer.
+ * @buf: The sysfs buffer.
+ *
+ * Writes the number of timed steps, the average and the maximum time in
+ * microseconds that the steps ran after they were due.
+ */
+ssize_t motor_ramp_show_timing(struct motor_ramp *ramp, char *buf)
+{
+	s64 avg = 0;
+
+	if (ramp->steps)
+		avg = div_s64(ktime_to_us(ramp->error_sum), ramp->steps);
+
+	return sprintf(buf, "%u %lld %lld\n", ramp->steps, avg,
+		       ktime_to_us(ramp->error_max));
+}
+EXPORT_SYMBOL_GPL(motor_ramp_show_timing);
+
+MODULE_DESCRIPTION("High resolution ramp timer for LEGO motor classes");
+MODULE_AUTHOR("David Lechner <david@lechnology.com>");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,891 @@
+/*
+ * Simulated tacho motor driver
+ *
+ * Copyright (C) 2026 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * DOC: userspace
+ *
+ * The ``sim-tacho-motor`` module registers tacho motors that are not connected
+ * to anything. Each motor is a model of a DC motor with an encoder that is
+ * driven by the same kind of software control loop as the EV3 output ports,
+ * so the ``tacho-motor`` class, the PID constants and the position planner
+ * can be tried out without any hardware.
+ *
+ * The motors are created when the module is loaded. The ``motors`` module
+ * parameter is a comma separated list of driver names from the list of
+ * supported motors (e.g. ``lego-ev3-l-motor,lego-ev3-m-motor``). The default
+ * is two ``lego-ev3-l-motor``. The ``max_speed`` and the default PID
+ * constants are the ones of the real motor. The addresses are ``sim:motor0``,
+ * ``sim:motor1`` and so on.
+ *
+ * The ``speedup`` module parameter runs the simulation faster than real time.
+ * For each period of the timer, the plant and the control loop are stepped
+ * ``speedup`` times (1 to 100, default 1) and the telemetry timestamps are in
+ * simulated time. The steps run in a work item, so if they take longer than
+ * the period, the simulation falls behind instead of holding up the CPU.
+ * Things that the ``tacho-motor`` class does itself, like ``run-timed`` and
+ * the ramps of motors that do not have a position profile, still run in real
+ * time.
+ *
+ * The plant is a first order model of a DC motor in terms of the duty cycle::
+ *
+ *     d(speed)/dt = (max_speed * (duty_cycle - friction - load) / 100 - speed) / tau
+ *
+ * where the back-EMF and the inertia are lumped into the time constant
+ * ``tau`` and ``friction`` (Coulomb friction) and ``load`` (load torque) are
+ * in percent of the stall torque. Friction always opposes the motion and also
+ * keeps a stopped motor from moving. When coasting, there is no electrical
+ * braking, so the time constant is 10 times longer. The encoder position is
+ * the integral of the speed, truncated to whole counts.
+ *
+ * The model parameters can be changed at any time in debugfs, in
+ * ``/sys/kernel/debug/sim:motor<N>/``: ``tau_ms`` (1 to 10000), ``friction``
+ * (0 to 100) and ``load`` (-100 to 100; a negative load pushes the motor
+ * forward). Values out of range are rejected.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include <tacho_motor_class.h>
+#include <tacho_motor_helper.h>
+
+#include "ev3_motor.h"
+
+#define SIM_TACHO_MOTOR_NAME		"sim_tacho_motor"
+#define SIM_TACHO_MOTOR_MAX		8
+
+#define SIM_DEFAULT_PERIOD_US		2000
+#define SIM_MIN_PERIOD_US		500
+#define SIM_MAX_PERIOD_US		10000
+#define SIM_MAX_SPEEDUP			100
+#define SIM_MAX_TAU_MS			10000
+#define SIM_MAX_FRICTION		100
+#define SIM_MAX_LOAD			100
+
+/* integration step of the plant */
+#define SIM_STEP_US			100
+/* the time constant is this much longer while coasting */
+#define SIM_COAST_FACTOR		10
+#define SIM_DEFAULT_FRICTION		5
+
+/* averaging window of the speed estimator in number of periods */
+#define SIM_SPEED_SAMPLES		8
+/* time constant for correcting the position error of run-to-*-pos */
+#define SIM_CORRECTION_MS		50
+/* how long to wait for the motor to catch up at the end of a profile */
+#define SIM_SETTLE_MS			100
+
+static char *motors[SIM_TACHO_MOTOR_MAX];
+static int num_motors;
+module_param_array(motors, charp, &num_motors, 0444);
+MODULE_PARM_DESC(motors, "Comma separated list of motor driver names");
+
+static unsigned speedup = 1;
+module_param(speedup, uint, 0444);
+MODULE_PARM_DESC(speedup, "Number of simulated periods per real period (1 to 100)");
+
+/* time constant of the unloaded motor, by motor type */
+static const int sim_tacho_motor_tau_ms[NUM_EV3_MOTOR_ID] = {
+	[LEGO_NXT_MOTOR]	= 80,
+	[LEGO_EV3_LARGE_MOTOR]	= 80,
+	[LEGO_EV3_MEDIUM_MOTOR]	= 30,
+	[ACT_L12_EV3_50]	= 20,
+	[ACT_L12_EV3_100]	= 20,
+};
+
+struct sim_tacho_motor {
+	struct tacho_motor_device tm;
+	char address[16];
+	int id;
+
+	struct hrtimer timer;
+	struct work_struct period_work;
+	struct work_struct notify_state_change_work;
+	struct work_struct notify_position_ramp_down_work;
+
+	/* protects everything that the ops and the timer share */
+	spinlock_t lock;
+	unsigned period_us;
+	ktime_t time;
+
+	/* plant, in milli-counts per second and micro-counts */
+	s64 plant_speed;
+	s64 plant_pos;
+	int offset;
+	int tau_ms;
+	int friction;
+	int load;
+	bool coasting;
+
+	/* control loop, as seen by the driver */
+	struct tm_speed_ab speed_ab;
+	struct tm_pid speed_pid;
+	struct tm_pid hold_pid;
+	int position;
+	int speed;
+	int duty_cycle;
+	unsigned state;
+	bool running;
+	bool speed_pid_ena;
+	bool hold_pid_ena;
+	bool run_to_pos_active;
+	int run_to_pos_speed;
+	bool profile_active;
+	struct tm_profile profile;
+	int profile_position;
+	ktime_t profile_end;
+	int position_sp;
+	bool hold_pos_sp;
+	enum tm_stop_action stop_action;
+
+	struct dentry *debug;
+};
+
+static struct device *sim_tacho_motor_parent;
+static struct sim_tacho_motor *sim_tacho_motors[SIM_TACHO_MOTOR_MAX];
+
+/*
+ * Steps the plant by dt_us. Must be called with sim->lock held.
+ */
+static void sim_tacho_motor_step(struct sim_tacho_motor *sim, int dt_us)
+{
+	int max_speed = sim->tm.info->max_speed;
+	s64 tau_us = (s64)max(sim->tau_ms, 1) * USEC_PER_MSEC;
+	s64 old_speed = sim->plant_speed;
+	s64 target;
+	int drive, friction;
+
+	drive = sim->coasting ? 0 : sim->duty_cycle;
+	drive -= sim->load;
+
+	if (sim->coasting)
+		tau_us *= SIM_COAST_FACTOR;
+
+	if (old_speed > 0)
+		friction = sim->friction;
+	else if (old_speed < 0)
+		friction = -sim->friction;
+	else if (abs(drive) <= sim->friction)
+		return; /* static friction holds the motor */
+	else
+		friction = drive > 0 ? sim->friction : -sim->friction;
+
+	if (sim->coasting)
+		target = (s64)max_speed * (drive - friction) * 10 * SIM_COAST_FACTOR;
+	else
+		target = (s64)max_speed * (drive - friction) * 10;
+
+	sim->plant_speed += div64_s64((target - old_speed) * dt_us, tau_us);
+
+	/* friction can stop the motor, but not turn it around */
+	if ((old_speed > 0 && sim->plant_speed < 0)
+	    || (old_speed < 0 && sim->plant_speed > 0))
+		sim->plant_speed = 0;
+
+	sim->plant_pos += div_s64((old_speed + sim->plant_speed) * dt_us, 2000);
+}
+
+/* Must be called with sim->lock held. */
+static void __sim_tacho_motor_stop(struct sim_tacho_motor *sim,
+				   enum tm_stop_action action)
+{
+	bool was_regulated = sim->speed_pid_ena || sim->hold_pid_ena;
+	int old_duty_cycle = sim->duty_cycle;
+
+	sim->running = false;
+	sim->run_to_pos_active = false;
+	sim->profile_active = false;
+	sim->speed_pid_ena = false;
+	sim->hold_pid_ena = false;
+	sim->duty_cycle = 0;
+	tm_pid_reinit(&sim->speed_pid);
+	tm_pid_reinit(&sim->hold_pid);
+
+	switch (action) {
+	case TM_STOP_ACTION_COAST:
+		sim->coasting = true;
+		break;
+	case TM_STOP_ACTION_BRAKE:
+		sim->coasting = false;
+		break;
+	case TM_STOP_ACTION_HOLD:
+		sim->coasting = false;
+		sim->hold_pid.setpoint = sim->hold_pos_sp ? sim->position_sp
+							  : sim->position;
+		if (was_regulated)
+			tm_pid_transfer(&sim->hold_pid, sim->position,
+					old_duty_cycle);
+		sim->hold_pid_ena = true;
+		break;
+	default:
+		WARN(true, "bad action: %d\n", action);
+	}
+
+	sim->hold_pos_sp = false;
+}
+
+/* Must be called with sim->lock held. */
+static void sim_tacho_motor_reached(struct sim_tacho_motor *sim)
+{
+	schedule_work(&sim->notify_position_ramp_down_work);
+	sim->hold_pos_sp = true;
+	__sim_tacho_motor_stop(sim, sim->stop_action);
+}
+
+/*
+ * Runs towards position_sp at up to run_to_pos_speed, slowing down in
+ * proportion to the remaining distance. This is only used when the tacho
+ * motor class does not plan a profile, i.e. for ramps and speed_sp of 0.
+ */
+static void sim_tacho_motor_update_position(struct sim_tacho_motor *sim)
+{
+	int error = sim->position_sp - sim->position;
+	int speed = abs(sim->run_to_pos_speed);
+	int limit = abs(error) * MSEC_PER_SEC / SIM_CORRECTION_MS;
+
+	if (!error || !speed || (error > 0) != (sim->run_to_pos_speed > 0)) {
+		sim_tacho_motor_reached(sim);
+		return;
+	}
+
+	speed = min(speed, max(limit, 1));
+	sim->speed_pid.setpoint = error > 0 ? speed : -speed;
+}
+
+static void sim_tacho_motor_update_profile(struct sim_tacho_motor *sim)
+{
+	int position, speed;
+
+	if (tm_profile_eval(&sim->profile, sim->time, &position, &speed)
+	    && !ktime_to_ns(sim->profile_end))
+		sim->profile_end = sim->time;
+
+	sim->profile_position = position;
+	sim->speed_pid.setpoint = speed + (position - sim->position)
+					* MSEC_PER_SEC / SIM_CORRECTION_MS;
+
+	if (!ktime_to_ns(sim->profile_end))
+		return;
+
+	if (sim->position != sim->profile.target
+	    && ktime_ms_delta(sim->time, sim->profile_end) < SIM_SETTLE_MS)
+		return;
+
+	sim_tacho_motor_reached(sim);
+}
+
+static unsigned sim_tacho_motor_state(struct sim_tacho_motor *sim)
+{
+	unsigned state = 0;
+
+	if (sim->running) {
+		state |= BIT(TM_STATE_RUNNING);
+		if (sim->speed_pid_ena && tm_pid_is_overloaded(&sim->speed_pid))
+			state |= BIT(TM_STATE_OVERLOADED);
+		if (sim->profile_active
+		    && sim->speed_pid.setpoint != sim->profile.speed)
+			state |= BIT(TM_STATE_RAMPING);
+	}
+	if (sim->hold_pid_ena) {
+		state |= BIT(TM_STATE_HOLDING);
+		if (tm_pid_is_overloaded(&sim->hold_pid))
+			state |= BIT(TM_STATE_OVERLOADED);
+	}
+
+	return state;
+}
+
+/*
+ * Does one period of the simulation: moves the plant and then runs the control
+ * loop on the new encoder position, like the EV3 driver does in its timer.
+ * Must be called with sim->lock held.
+ */
+static void sim_tacho_motor_period(struct sim_tacho_motor *sim)
+{
+	int remaining = sim->period_us;
+	int duty_cycle = sim->duty_cycle;
+
+	while (remaining > 0) {
+		int dt = min(remaining, SIM_STEP_US);
+
+		sim_tacho_motor_step(sim, dt);
+		remaining -= dt;
+	}
+	sim->time = ktime_add_us(sim->time, sim->period_us);
+
+	sim->position = div_s64(sim->plant_pos, 1000000) + sim->offset;
+	tm_speed_ab_update(&sim->speed_ab, sim->position, sim->time);
+	sim->speed = tm_speed_ab_get(&sim->speed_ab);
+
+	if (sim->profile_active)
+		sim_tacho_motor_update_profile(sim);
+	else if (sim->run_to_pos_active)
+		sim_tacho_motor_update_position(sim);
+
+	if (sim->speed_pid_ena)
+		duty_cycle = tm_pid_update(&sim->speed_pid, sim->speed);
+	else if (sim->hold_pid_ena)
+		duty_cycle = tm_pid_update(&sim->hold_pid, sim->position);
+	else if (!sim->running)
+		duty_cycle = 0;
+
+	sim->duty_cycle = duty_cycle;
+}
+
+static void sim_tacho_motor_push_telemetry(struct sim_tacho_motor *sim)
+{
+	struct tacho_motor_telemetry rec = {
+		.timestamp	= ktime_to_ns(sim->time),
+		.position	= sim->position,
+		.speed		= sim->speed,
+		.position_sp	= sim->hold_pid_ena ? sim->hold_pid.setpoint
+				: sim->profile_active ? sim->profile_position
+				: sim->position_sp,
+		.speed_sp	= sim->speed_pid_ena ? sim->speed_pid.setpoint
+						     : 0,
+		.duty_cycle	= sim->duty_cycle,
+		.state		= sim->state,
+	};
+
+	tacho_motor_push_telemetry(&sim->tm, &rec);
+}
+
+/*
+ * With speedup, one period of the timer can be a lot of plant steps, so they
+ * are done here instead of in the timer callback. If the work is still
+ * running when the timer fires again, that period is skipped.
+ */
+static void sim_tacho_motor_period_work(struct work_struct *work)
+{
+	struct sim_tacho_motor *sim = container_of(work, struct sim_tacho_motor,
+						   period_work);
+	unsigned old_state = sim->state;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < speedup; i++) {
+		spin_lock_irqsave(&sim->lock, flags);
+		sim_tacho_motor_period(sim);
+		sim->state = sim_tacho_motor_state(sim);
+		spin_unlock_irqrestore(&sim->lock, flags);
+
+		sim_tacho_motor_push_telemetry(sim);
+	}
+
+	if (sim->state != old_state)
+		schedule_work(&sim->notify_state_change_work);
+}
+
+static enum hrtimer_restart sim_tacho_motor_timer_callback(struct hrtimer *timer)
+{
+	struct sim_tacho_motor *sim =
+			container_of(timer, struct sim_tacho_motor, timer);
+
+	hrtimer_forward_now(timer, ktime_set(0, sim->period_us * NSEC_PER_USEC));
+	queue_work(system_highpri_wq, &sim->period_work);
+
+	return HRTIMER_RESTART;
+}
+
+static void sim_tacho_motor_notify_state_change_work(struct work_struct *work)
+{
+	struct sim_tacho_motor *sim = container_of(work, struct sim_tacho_motor,
+						   notify_state_change_work);
+
+	tacho_motor_notify_state_change(&sim->tm);
+}
+
+static void
+sim_tacho_motor_notify_position_ramp_down_work(struct work_struct *work)
+{
+	struct sim_tacho_motor *sim = container_of(work, struct sim_tacho_motor,
+						   notify_position_ramp_down_work);
+
+	tacho_motor_notify_position_ramp_down(&sim->tm);
+}
+
+static int sim_tacho_motor_get_position(void *context, int *position)
+{
+	struct sim_tacho_motor *sim = context;
+
+	*position = sim->position;
+
+	return 0;
+}
+
+static int sim_tacho_motor_set_position(void *context, int position)
+{
+	struct sim_tacho_motor *sim = context;
+	unsigned long flags;
+	int err = 0;
+
+	spin_lock_irqsave(&sim->lock, flags);
+
+	if (sim->running) {
+		err = -EBUSY;
+	} else {
+		sim->offset += position - sim->position;
+		sim->position = position;
+		sim->position_sp = position;
+		sim->hold_pid.setpoint = position;
+		tm_speed_ab_init(&sim->speed_ab, position, sim->time,
+				 SIM_SPEED_SAMPLES);
+	}
+
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return err;
+}
+
+static int sim_tacho_motor_get_state(void *context)
+{
+	struct sim_tacho_motor *sim = context;
+
+	return sim->state;
+}
+
+static int sim_tacho_motor_get_duty_cycle(void *context, int *duty_cycle)
+{
+	struct sim_tacho_motor *sim = context;
+
+	*duty_cycle = sim->duty_cycle;
+
+	return 0;
+}
+
+static int sim_tacho_motor_get_status(void *context,
+				      struct tacho_motor_status *status)
+{
+	struct sim_tacho_motor *sim = context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+
+	status->position = sim->position;
+	status->speed = sim->speed;
+	status->duty_cycle = sim->duty_cycle;
+	status->state = sim->state;
+
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+
+TM_SPEED_AB_GET_SPEED_FUNC(sim_tacho_motor, sim_tacho_motor, speed_ab);
+
+/*
+ * Must be called with sim->lock held. If regulated, speed is the setpoint and a
+ * motor that was holding position gets a bumpless transfer to the speed PID.
+ */
+static void sim_tacho_motor_start(struct sim_tacho_motor *sim, bool regulated,
+				  int speed)
+{
+	if (regulated) {
+		sim->speed_pid.setpoint = speed;
+		if (sim->hold_pid_ena)
+			tm_pid_transfer(&sim->speed_pid, sim->speed,
+					sim->duty_cycle);
+	}
+	sim->running = true;
+	sim->coasting = false;
+	sim->run_to_pos_active = false;
+	sim->profile_active = false;
+	sim->speed_pid_ena = regulated;
+	sim->hold_pid_ena = false;
+	sim->state = sim_tacho_motor_state(sim);
+}
+
+static int sim_tacho_motor_run_unregulated(void *context, int duty_cycle)
+{
+	struct sim_tacho_motor *sim = context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim_tacho_motor_start(sim, false, 0);
+	sim->duty_cycle = duty_cycle;
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+
+static int sim_tacho_motor_run_regulated(void *context, int speed)
+{
+	struct sim_tacho_motor *sim = context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim_tacho_motor_start(sim, true, speed);
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+
+static int sim_tacho_motor_run_to_pos(void *context, int pos, int speed,
+				      enum tm_stop_action action)
+{
+	struct sim_tacho_motor *sim = context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	speed = sim->position > pos ? -abs(speed) : abs(speed);
+	sim_tacho_motor_start(sim, true, speed);
+	sim->run_to_pos_active = true;
+	sim->run_to_pos_speed = speed;
+	sim->position_sp = pos;
+	sim->stop_action = action;
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+
+/*
+ * The profile is started in real time by the tacho motor class, so it is moved
+ * to simulated time here.
+ */
+static int sim_tacho_motor_run_profile(void *context,
+				       const struct tm_profile *profile,
+				       enum tm_stop_action action)
+{
+	struct sim_tacho_motor *sim = context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim_tacho_motor_start(sim, true, profile->start_speed);
+	sim->profile = *profile;
+	sim->profile.start_time = sim->time;
+	sim->profile_position = profile->start;
+	sim->profile_end = ktime_set(0, 0);
+	sim->profile_active = true;
+	sim->position_sp = profile->target;
+	sim->stop_action = action;
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+
+static int sim_tacho_motor_stop(void *context, enum tm_stop_action action)
+{
+	struct sim_tacho_motor *sim = context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	__sim_tacho_motor_stop(sim, action);
+	sim->state = sim_tacho_motor_state(sim);
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+
+static int sim_tacho_motor_reset(void *context)
+{
+	struct sim_tacho_motor *sim = context;
+	const struct legoev3_motor_info *info = &sim->tm.info->legoev3_info;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim->lock, flags);
+
+	__sim_tacho_motor_stop(sim, TM_STOP_ACTION_COAST);
+	sim->offset = -div_s64(sim->plant_pos, 1000000);
+	sim->position = 0;
+	sim->position_sp = 0;
+	sim->speed = 0;
+	sim->state = 0;
+	tm_speed_ab_init(&sim->speed_ab, 0, sim->time, SIM_SPEED_SAMPLES);
+	tm_pid_init(&sim->speed_pid, info->speed_pid_k.p, info->speed_pid_k.i,
+		    info->speed_pid_k.d);
+	tm_pid_init(&sim->hold_pid, info->position_pid_k.p,
+		    info->position_pid_k.i, info->position_pid_k.d);
+
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+
+static unsigned sim_tacho_motor_get_stop_actions(void *context)
+{
+	return BIT(TM_STOP_ACTION_COAST) | BIT(TM_STOP_ACTION_BRAKE) |
+	       BIT(TM_STOP_ACTION_HOLD);
+}
+
+static int sim_tacho_motor_set_control_period(void *context, int us)
+{
+	struct sim_tacho_motor *sim = context;
+	unsigned long flags;
+
+	if (us < SIM_MIN_PERIOD_US || us > SIM_MAX_PERIOD_US)
+		return -EINVAL;
+
+	spin_lock_irqsave(&sim->lock, flags);
+	sim->period_us = us;
+	sim->tm.pid_period_us = us;
+	spin_unlock_irqrestore(&sim->lock, flags);
+
+	return 0;
+}
+
+TM_PID_GET_FUNC(sim_tacho_motor, speed_Kp, sim_tacho_motor, speed_pid.Kp);
+TM_PID_SET_FUNC(sim_tacho_motor, speed_Kp, sim_tacho_motor, speed_pid.Kp);
+TM_PID_GET_FUNC(sim_tacho_motor, speed_Ki, sim_tacho_motor, speed_pid.Ki);
+TM_PID_SET_FUNC(sim_tacho_motor, speed_Ki, sim_tacho_motor, speed_pid.Ki);
+TM_PID_GET_FUNC(sim_tacho_motor, speed_Kd, sim_tacho_motor, speed_pid.Kd);
+TM_PID_SET_FUNC(sim_tacho_motor, speed_Kd, sim_tacho_motor, speed_pid.Kd);
+TM_PID_GET_FUNC(sim_tacho_motor, speed_Kf, sim_tacho_motor, speed_pid.Kf);
+TM_PID_SET_FUNC(sim_tacho_motor, speed_Kf, sim_tacho_motor, speed_pid.Kf);
+TM_PID_GET_FUNC(sim_tacho_motor, speed_Tf, sim_tacho_motor, speed_pid.Tf);
+TM_PID_SET_FUNC(sim_tacho_motor, speed_Tf, sim_tacho_motor, speed_pid.Tf);
+TM_PID_GET_FUNC(sim_tacho_motor, speed_slew, sim_tacho_motor, speed_pid.slew);
+TM_PID_SET_FUNC(sim_tacho_motor, speed_slew, sim_tacho_motor, speed_pid.slew);
+TM_PID_GET_FUNC(sim_tacho_motor, speed_scale, sim_tacho_motor, speed_pid.scale);
+TM_PID_SET_SCALE_FUNC(sim_tacho_motor, speed_scale, sim_tacho_motor, speed_pid.scale);
+TM_PID_GET_FUNC(sim_tacho_motor, hold_Kp, sim_tacho_motor, hold_pid.Kp);
+TM_PID_SET_FUNC(sim_tacho_motor, hold_Kp, sim_tacho_motor, hold_pid.Kp);
+TM_PID_GET_FUNC(sim_tacho_motor, hold_Ki, sim_tacho_motor, hold_pid.Ki);
+TM_PID_SET_FUNC(sim_tacho_motor, hold_Ki, sim_tacho_motor, hold_pid.Ki);
+TM_PID_GET_FUNC(sim_tacho_motor, hold_Kd, sim_tacho_motor, hold_pid.Kd);
+TM_PID_SET_FUNC(sim_tacho_motor, hold_Kd, sim_tacho_motor, hold_pid.Kd);
+TM_PID_GET_FUNC(sim_tacho_motor, hold_Tf, sim_tacho_motor, hold_pid.Tf);
+TM_PID_SET_FUNC(sim_tacho_motor, hold_Tf, sim_tacho_motor, hold_pid.Tf);
+TM_PID_GET_FUNC(sim_tacho_motor, hold_slew, sim_tacho_motor, hold_pid.slew);
+TM_PID_SET_FUNC(sim_tacho_motor, hold_slew, sim_tacho_motor, hold_pid.slew);
+TM_PID_GET_FUNC(sim_tacho_motor, hold_scale, sim_tacho_motor, hold_pid.scale);
+TM_PID_SET_SCALE_FUNC(sim_tacho_motor, hold_scale, sim_tacho_motor, hold_pid.scale);
+
+static const struct tacho_motor_ops sim_tacho_motor_ops = {
+	.get_position		= sim_tacho_motor_get_position,
+	.set_position		= sim_tacho_motor_set_position,
+
+	.get_state		= sim_tacho_motor_get_state,
+	.get_duty_cycle		= sim_tacho_motor_get_duty_cycle,
+	.get_speed		= sim_tacho_motor_get_speed,
+	.get_status		= sim_tacho_motor_get_status,
+
+	.run_unregulated	= sim_tacho_motor_run_unregulated,
+	.run_regulated		= sim_tacho_motor_run_regulated,
+	.run_to_pos		= sim_tacho_motor_run_to_pos,
+	.run_profile		= sim_tacho_motor_run_profile,
+	.stop			= sim_tacho_motor_stop,
+	.reset			= sim_tacho_motor_reset,
+
+	.get_stop_actions	= sim_tacho_motor_get_stop_actions,
+	.set_control_period	= sim_tacho_motor_set_control_period,
+
+	.get_speed_Kp		= sim_tacho_motor_get_speed_Kp,
+	.set_speed_Kp		= sim_tacho_motor_set_speed_Kp,
+	.get_speed_Ki		= sim_tacho_motor_get_speed_Ki,
+	.set_speed_Ki		= sim_tacho_motor_set_speed_Ki,
+	.get_speed_Kd		= sim_tacho_motor_get_speed_Kd,
+	.set_speed_Kd		= sim_tacho_motor_set_speed_Kd,
+	.get_speed_Kf		= sim_tacho_motor_get_speed_Kf,
+	.set_speed_Kf		= sim_tacho_motor_set_speed_Kf,
+	.get_speed_Tf		= sim_tacho_motor_get_speed_Tf,
+	.set_speed_Tf		= sim_tacho_motor_set_speed_Tf,
+	.get_speed_slew		= sim_tacho_motor_get_speed_slew,
+	.set_speed_slew		= sim_tacho_motor_set_speed_slew,
+	.get_speed_scale	= sim_tacho_motor_get_speed_scale,
+	.set_speed_scale	= sim_tacho_motor_set_speed_scale,
+
+	.get_hold_Kp		= sim_tacho_motor_get_hold_Kp,
+	.set_hold_Kp		= sim_tacho_motor_set_hold_Kp,
+	.get_hold_Ki		= sim_tacho_motor_get_hold_Ki,
+	.set_hold_Ki		= sim_tacho_motor_set_hold_Ki,
+	.get_hold_Kd		= sim_tacho_motor_get_hold_Kd,
+	.set_hold_Kd		= sim_tacho_motor_set_hold_Kd,
+	.get_hold_Tf		= sim_tacho_motor_get_hold_Tf,
+	.set_hold_Tf		= sim_tacho_motor_set_hold_Tf,
+	.get_hold_slew		= sim_tacho_motor_get_hold_slew,
+	.set_hold_slew		= sim_tacho_motor_set_hold_slew,
+	.get_hold_scale		= sim_tacho_motor_get_hold_scale,
+	.set_hold_scale		= sim_tacho_motor_set_hold_scale,
+};
+
+/* signed debugfs attribute for a plant parameter that rejects bad values */
+#define SIM_PLANT_ATTR(name, min, max)					\
+static int sim_tacho_motor_##name##_get(void *data, u64 *val)		\
+{									\
+	struct sim_tacho_motor *sim = data;				\
+									\
+	*val = (s64)sim->name;						\
+									\
+	return 0;							\
+}									\
+									\
+static int sim_tacho_motor_##name##_set(void *data, u64 val)		\
+{									\
+	struct sim_tacho_motor *sim = data;				\
+	s64 value = (s64)val;						\
+									\
+	if (value < (min) || value > (max))				\
+		return -EINVAL;						\
+									\
+	WRITE_ONCE(sim->name, value);					\
+									\
+	return 0;							\
+}									\
+									\
+DEFINE_DEBUGFS_ATTRIBUTE(sim_tacho_motor_##name##_fops,			\
+			 sim_tacho_motor_##name##_get,			\
+			 sim_tacho_motor_##name##_set, "%lld\n")
+
+SIM_PLANT_ATTR(tau_ms, 1, SIM_MAX_TAU_MS);
+SIM_PLANT_ATTR(friction, 0, SIM_MAX_FRICTION);
+SIM_PLANT_ATTR(load, -SIM_MAX_LOAD, SIM_MAX_LOAD);
+
+static int sim_tacho_motor_find_id(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_EV3_MOTOR_ID; i++) {
+		if (sysfs_streq(name, ev3_motor_defs[i].name))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+static struct sim_tacho_motor *sim_tacho_motor_create(int index, int id)
+{
+	struct sim_tacho_motor *sim;
+	int err;
+
+	sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+	if (!sim)
+		return ERR_PTR(-ENOMEM);
+
+	snprintf(sim->address, sizeof(sim->address), "sim:motor%d", index);
+	sim->id = id;
+	spin_lock_init(&sim->lock);
+	sim->period_us = SIM_DEFAULT_PERIOD_US;
+	sim->tau_ms = sim_tacho_motor_tau_ms[id];
+	sim->friction = SIM_DEFAULT_FRICTION;
+
+	sim->tm.driver_name = ev3_motor_defs[id].name;
+	sim->tm.address = sim->address;
+	sim->tm.ops = &sim_tacho_motor_ops;
+	sim->tm.info = &ev3_motor_defs[id];
+	sim->tm.context = sim;
+	sim->tm.driver_telemetry = true;
+	sim->tm.driver_state_notify = true;
+	sim->tm.pid_period_us = sim->period_us;
+
+	hrtimer_init(&sim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sim->timer.function = sim_tacho_motor_timer_callback;
+
+	INIT_WORK(&sim->period_work, sim_tacho_motor_period_work);
+	INIT_WORK(&sim->notify_state_change_work,
+		  sim_tacho_motor_notify_state_change_work);
+	INIT_WORK(&sim->notify_position_ramp_down_work,
+		  sim_tacho_motor_notify_position_ramp_down_work);
+
+	err = register_tacho_motor(&sim->tm, sim_tacho_motor_parent);
+	if (err < 0) {
+		kfree(sim);
+		return ERR_PTR(err);
+	}
+
+	sim_tacho_motor_reset(sim);
+
+	hrtimer_start(&sim->timer, ktime_set(0, sim->period_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+
+	sim->debug = debugfs_create_dir(sim->address, NULL);
+	debugfs_create_file("tau_ms", 0644, sim->debug, sim,
+			    &sim_tacho_motor_tau_ms_fops);
+	debugfs_create_file("friction", 0644, sim->debug, sim,
+			    &sim_tacho_motor_friction_fops);
+	debugfs_create_file("load", 0644, sim->debug, sim,
+			    &sim_tacho_motor_load_fops);
+
+	return sim;
+}
+
+static void sim_tacho_motor_destroy(struct sim_tacho_motor *sim)
+{
+	debugfs_remove_recursive(sim->debug);
+	hrtimer_cancel(&sim->timer);
+	cancel_work_sync(&sim->period_work);
+	cancel_work_sync(&sim->notify_state_change_work);
+	cancel_work_sync(&sim->notify_position_ramp_down_work);
+	unregister_tacho_motor(&sim->tm);
+	kfree(sim);
+}
+
+static int __init sim_tacho_motor_init(void)
+{
+	int ids[SIM_TACHO_MOTOR_MAX];
+	int count, i, err;
+
+	if (!speedup || speedup > SIM_MAX_SPEEDUP)
+		return -EINVAL;
+
+	if (num_motors) {
+		count = num_motors;
+		for (i = 0; i < count; i++) {
+			ids[i] = sim_tacho_motor_find_id(motors[i]);
+			if (ids[i] < 0) {
+				pr_err("Unknown motor '%s'\n", motors[i]);
+				return ids[i];
+			}
+		}
+	} else {
+		count = 2;
+		ids[0] = ids[1] = LEGO_EV3_LARGE_MOTOR;
+	}
+
+	sim_tacho_motor_parent = root_device_register(SIM_TACHO_MOTOR_NAME);
+	if (IS_ERR(sim_tacho_motor_parent))
+		return PTR_ERR(sim_tacho_motor_parent);
+
+	for (i = 0; i < count; i++) {
+		struct sim_tacho_motor *sim = sim_tacho_motor_create(i, ids[i]);
+
+		if (IS_ERR(sim)) {
+			err = PTR_ERR(sim);
+			goto err_create;
+		}
+		sim_tacho_motors[i] = sim;
+	}
+
+	return 0;
+
+err_create:
+	while (i--)
+		sim_tacho_motor_destroy(sim_tacho_motors[i]);
+	root_device_unregister(sim_tacho_motor_parent);
+
+	return err;
+}
+module_init(sim_tacho_motor_init);
+
+static void __exit sim_tacho_motor_exit(void)
+{
+	int i;
+
+	for (i = 0; i < SIM_TACHO_MOTOR_MAX; i++) {
+		if (sim_tacho_motors[i])
+			sim_tacho_motor_destroy(sim_tacho_motors[i]);
+	}
+	root_device_unregister(sim_tacho_motor_parent);
+}
+module_exit(sim_tacho_motor_exit);
+
+MODULE_DESCRIPTION("Simulated tacho motor driver");
+MODULE_AUTHOR("David Lechner <david@lechnology.com>");
+MODULE_LICENSE("GPL");
@@ -42,6 +42,24 @@
  *      - read-only
  *      - Returns the name of the port that the motor is connected to.
  *
+ *    * - ``auto_tune``
+ *      - read-only
+ *      - Returns the result of the last ``auto-tune`` command as lines of
+ *        ``<name> <value>``. ``status`` is ``none``, ``running``, ``done`` or
+ *        ``failed`` (with ``error`` set to the error code). When done, the
+ *        measured motor parameters are given: ``gain`` (speed at 100% duty
+ *        cycle in tacho counts per second), ``deadband`` (duty cycle needed
+ *        to overcome friction in percent), ``time_constant_us`` and
+ *        ``dead_time_us``, followed by the PID constants that were set.
+ *        Userspace can use ``poll()`` on this attribute to wait for the
+ *        result.
+ *
+ *    * - ``bin_status``
+ *      - read-only
+ *      - Reading returns a 32-byte binary record in the same format as the
+ *        telemetry device (see below). All values are from a single read of
+ *        the motor controller. The sequence number is always 0.
+ *
  *    * - ``command``
  *      - write-only
  *      - Sends a command to the motor controller. Possible values are:
@@ -55,12 +73,29 @@
  *          current `position` value. The new position will be current
  *          ``position`` + ``position_sp``. When the new position is reached,
  *          the motor will stop using the command specified by ``stop_action``.
+ *
+ *          For motors that are regulated in software (e.g. EV3 output ports),
+ *          both ``run-to-*-pos`` commands follow a planned position profile:
+ *          the speed ramps up to ``speed_sp`` and back down to 0 using
+ *          ``ramp_up_sp`` and ``ramp_down_sp`` so that the motor arrives at
+ *          the target without overshooting. With the ``s-curve`` ramp
+ *          profile, ``ramp_smoothing_sp`` is limited to 1000 ms.
  *        - ``run-timed``: Run the motor for the amount of time specified in
  *          ``time_sp`` and then stops the motor using the command specified by
  *          ``stop_action``.
  *        - ``run-direct``: Runs the motor using the duty cycle specified by
  *          ``duty_cycle_sp``. Unlike other run commands, changing
  *          ``duty_cycle_sp`` while running *will* take effect immediately.
+ *        - ``run-trajectory``: Runs the motor along the waypoints written to
+ *          ``trajectory_sp``. When the last waypoint is reached, the motor
+ *          runs to the position of the last waypoint and then stops using the
+ *          command specified by ``stop_action``. Sending any other command
+ *          discards the remaining waypoints.
+ *        - ``auto-tune``: Measures the response of the motor and sets the
+ *          speed and hold PID constants to match it. The motor is run with
+ *          a duty cycle of 30% and then 60% for 1.5 seconds in total, so it
+ *          must be free to turn. The results are in ``auto_tune``. Only
+ *          available for drivers that regulate the motor in software.
  *        - ``stop``: Stop any of the run commands before they are complete
  *          using the command specified by ``stop_action``.
  *        - ``reset``: Resets all of the motor parameter attributes to their
@@ -82,6 +117,15 @@
  *        can use this value to convert from rotations or degrees to tacho
  *        counts. (rotation motors only)
  *
+ *    * - ``control_period_us``
+ *      - read/write
+ *      - Reading returns the period of the control loop of the driver in
+ *        microseconds. Writing changes it. Only available for drivers that
+ *        regulate the motor in software. For EV3 output ports, valid values
+ *        are 500 to 10000 and the default is 2000. The PID constants are
+ *        applied once per period, so they may need to be changed (e.g. with
+ *        the ``auto-tune`` command) after changing the period.
+ *
  *    * - ``count_per_m``
  *      - read-only
  *      - Returns the number of tacho counts in one meter of travel of the
@@ -141,6 +185,21 @@
  *      - read/write
  *      - The proportional constant for the position PID.
  *
+ *    * - ``hold_pid/scale``
+ *      - read/write
+ *      - The fixed point scale of the position PID constants, i.e. a constant
+ *        with this value has a gain of 1. Must be greater than 0.
+ *
+ *    * - ``hold_pid/slew``
+ *      - read/write
+ *      - The maximum change of the duty cycle per iteration of the position
+ *        PID, in percent. 0 means no limit.
+ *
+ *    * - ``hold_pid/Tf``
+ *      - read/write
+ *      - The time constant of the low-pass filter on the derivative term of
+ *        the position PID in number of iterations. 0 disables the filter.
+ *
  *    * - ``max_speed``
  *      - read
  *      - Returns the maximum value that is accepted by the ``speed_sp``
@@ -192,10 +251,51 @@
  *        ``speed`` and ``max_speed`` multiplied by ``ramp_down_sp``. Values
  *        must not be negative.
  *
+ *    * - ``ramp_period``
+ *      - read/write
+ *      - Writing sets the time in milliseconds between the speed steps of a
+ *        ramp. Reading returns the current value. Valid values are 1 to 100.
+ *        Default is 100. Shorter periods give smoother ramps at the cost of
+ *        more CPU time and bus traffic.
+ *
+ *    * - ``ramp_timing``
+ *      - read-only
+ *      - Returns three space separated values for the steps of the last ramp:
+ *        the number of steps, the average and the maximum time in microseconds
+ *        that a step ran after the time it was scheduled for.
+ *
+ *    * - ``ramp_profile``
+ *      - read/write
+ *      - Reading returns the current ramp profile. Writing sets the ramp
+ *        profile. Possible values are:
+ *
+ *        - ``linear``: The speed changes at a constant rate. The acceleration
+ *          jumps at the start and end of each ramp. This is the default.
+ *        - ``s-curve``: The acceleration builds up and dies down gradually
+ *          over the time given by ``ramp_smoothing_sp`` (jerk-limited ramp).
+ *          For ``run-to-*-pos`` commands, the ramp down is planned ahead so
+ *          that the motor is already slow when it reaches ``position_sp``.
+ *
+ *    * - ``ramp_smoothing_sp``
+ *      - read/write
+ *      - Writing sets the ramp smoothing setpoint. Reading returns the current
+ *        value. Units are in milliseconds. Only used when ``ramp_profile`` is
+ *        ``s-curve``. This is the time it takes the acceleration to go from
+ *        0 to its full value at the start of a ramp and back to 0 at the end.
+ *        Each ramp takes this much longer than a ``linear`` ramp. The full
+ *        acceleration is the same as for ``linear`` ramps. Values must not be
+ *        negative.
+ *
  *    * - ``speed_pid/Kd``
  *      - read/write
  *      - The derivative constant for the speed regulation PID.
  *
+ *    * - ``speed_pid/Kf``
+ *      - read/write
+ *      - The feed-forward constant for the speed regulation PID. The speed
+ *        setpoint times this value is added to the output, so that the PID
+ *        only has to correct the difference.
+ *
  *    * - ``speed_pid/Ki``
  *      - read/write
  *      - The integral constant for the speed regulation PID.
@@ -204,6 +304,22 @@
  *      - read/write
  *      - The proportional constant for the speed regulation PID.
  *
+ *    * - ``speed_pid/scale``
+ *      - read/write
+ *      - The fixed point scale of the speed regulation PID constants, i.e. a
+ *        constant with this value has a gain of 1. Must be greater than 0.
+ *
+ *    * - ``speed_pid/slew``
+ *      - read/write
+ *      - The maximum change of the duty cycle per iteration of the speed
+ *        regulation PID, in percent. 0 means no limit.
+ *
+ *    * - ``speed_pid/Tf``
+ *      - read/write
+ *      - The time constant of the low-pass filter on the derivative term of
+ *        the speed regulation PID in number of iterations. 0 disables the
+ *        filter.
+ *
  *    * - ``state``
  *      - read-only
  *      - Reading returns a space separated list of state flags.
@@ -218,6 +334,23 @@
  *          reach its ``speed_sp``.
  *        - ``stalled``: The motor is trying to run but is not turning at all.
  *
+ *        Userspace can use ``poll()`` on this attribute to wait for a change,
+ *        e.g. for a ``run-to-*-pos`` command to finish.
+ *
+ *    * - ``state_timestamp``
+ *      - read-only
+ *      - Returns the ``CLOCK_MONOTONIC`` time in nanoseconds of the last
+ *        change of ``state``. For motor controllers that are polled, this can
+ *        be up to 20 ms later than the actual change.
+ *
+ *    * - ``status``
+ *      - read-only
+ *      - Reading returns ``position``, ``speed`` and ``duty_cycle`` followed by
+ *        the ``state`` flags, all separated by spaces. Unlike reading the
+ *        individual attributes, all values are from the same point in time
+ *        and motor controllers on a bus only need one transaction for them
+ *        (if the driver supports it).
+ *
  *    * - ``stop_action``
  *      - read/write
  *      - Reading returns the current stop action. Writing sets the stop
@@ -243,22 +376,200 @@
  *      - Returns a space-separated list of stop actions supported by the
  *        motor controller.
  *
+ *    * - ``sync_command``
+ *      - write-only
+ *      - Sends a command to all motors in the same ``sync_group``. Possible
+ *        values are:
+ *
+ *        - ``commit``: Sends the command that was written to ``command`` of
+ *          each motor in the group at the same time. Each motor uses its own
+ *          setpoints as they are at the time of the commit. Motor controllers
+ *          that support it will receive all of the commands in a single bus
+ *          transaction, otherwise the commands are sent back-to-back.
+ *        - ``discard``: Throws away the commands that are waiting to be
+ *          committed.
+ *        - ``steer-forever``: Runs the two motors of the group as a pair
+ *          until one of them is stopped. The group must have exactly two
+ *          motors. The motor that the command is written to uses its own
+ *          ``speed_sp`` and ``turn_ratio_sp`` for both motors and its
+ *          ``stop_action`` for the end. Any pending ``command`` is
+ *          discarded. The driver keeps the ratio of the positions of the two
+ *          motors at the rate of its control loop, so if one motor is held
+ *          back, the other one waits for it.
+ *        - ``steer-timed``: Same as ``steer-forever``, but both motors stop
+ *          after ``time_sp``.
+ *        - ``steer-to-rel-pos``: Same as ``steer-forever``, but both motors
+ *          stop when the faster one has turned by ``position_sp`` tacho
+ *          counts. The sign of ``position_sp`` is ignored, the direction is
+ *          given by ``speed_sp``.
+ *
+ *        The ``steer-*`` commands are only available for drivers that
+ *        regulate the motors in software, e.g. EV3 output ports.
+ *
+ *    * - ``sync_commit_us``
+ *      - read-only
+ *      - Returns how long the last ``commit`` of the motor's ``sync_group``
+ *        took to send all of the commands of the group, in microseconds. All
+ *        motors of the group start within this time, so it is an upper bound
+ *        on the start skew, not the skew itself.
+ *
+ *    * - ``sync_group``
+ *      - read/write
+ *      - Reading returns the synchronization group of the motor. Writing sets
+ *        the group. Valid values are 0 to 8. When set to a non-zero value,
+ *        writing to ``command`` does not send the command right away. Instead,
+ *        it is held until ``commit`` is written to ``sync_command`` of any
+ *        motor in the same group. The ``stop`` and ``reset`` commands are the
+ *        exception: they are always sent right away and also discard the
+ *        commands of the group that have not been committed. Setting to 0
+ *        (the default) removes the motor from the group and discards any
+ *        command that has not been committed.
+ *
+ *    * - ``trajectory_sp``
+ *      - read/write
+ *      - Writing appends one or more waypoints to the trajectory used by the
+ *        ``run-trajectory`` command. Each waypoint is three integers separated
+ *        by spaces: the time in milliseconds since the ``run-trajectory``
+ *        command was sent, the position in tacho counts and the speed in
+ *        tacho counts per second. Multiple waypoints are separated by
+ *        newlines. Times must be increasing. Up to 64 waypoints can be queued
+ *        and more can be appended while the motor is running. Writing
+ *        ``clear`` removes all waypoints when the motor is not running a
+ *        trajectory. Reading returns the number of waypoints that have not
+ *        been passed yet. Userspace can use ``poll()`` on this attribute to
+ *        be notified when the buffer is running low or the trajectory ends.
+ *
+ *    * - ``trajectory_underruns``
+ *      - read-only
+ *      - Returns the number of times that the last trajectory ran out of
+ *        waypoints while the motor was still moving, i.e. the last waypoint
+ *        had a non-zero speed. This is reset by the ``run-trajectory``
+ *        command.
+ *
+ *    * - ``telemetry_overruns``
+ *      - read-only
+ *      - Returns the number of telemetry records that were dropped because
+ *        the buffer of the telemetry device was full. This is reset each time
+ *        the telemetry device is opened.
+ *
+ *    * - ``telemetry_period``
+ *      - read/write
+ *      - Sets the minimum time in milliseconds between records of the
+ *        telemetry device. Valid values are 0 to 1000. The default is 0,
+ *        which gives one record for each sample of the motor controller (every
+ *        2 ms for EV3 output ports). For motors where the tacho-motor class
+ *        has to poll the driver, records are at least 10 ms apart.
+ *
  *    * - ``time_sp``
  *      - read/write
  *      - Writing specifies the amount of time the motor will run when using
  *        the ``run-timed`` command. Reading returns the current value. Units
  *        are in milliseconds. Values must not be negative.
+ *
+ *    * - ``turn_ratio_sp``
+ *      - read/write
+ *      - Writing specifies the turn ratio used by the ``steer-*`` sync
+ *        commands. Reading returns the current value. Valid values are -200
+ *        to 200. At 0, both motors run at ``speed_sp``. Positive values slow
+ *        down the other motor of the group, e.g. at 100 it does not move and
+ *        at 200 it runs at ``-speed_sp``. Negative values do the same to the
+ *        motor that the command is written to.
+ *
+ * Telemetry
+ * ---------
+ *
+ * Each tacho motor also has a character device at
+ * ``/dev/tacho-motor/motor<N>`` (or ``linear<N>``) that can be used to log
+ * the motor at the rate of the motor controller without reading sysfs
+ * attributes. Only one process can have it open at a time. Reading returns
+ * an array of binary records in native byte order. Reads must be at least
+ * one record long and never return partial records. Records are buffered
+ * (256 records) starting when the device is opened. ``poll()`` is supported.
+ *
+ * Each record is 32 bytes:
+ *
+ * .. flat-table:: telemetry records
+ *    :widths: 1 1 5
+ *    :header-rows: 1
+ *
+ *    * - Offset
+ *      - Type
+ *      - Description
+ *
+ *    * - 0
+ *      - s64
+ *      - ``CLOCK_MONOTONIC`` timestamp in nanoseconds.
+ *
+ *    * - 8
+ *      - u32
+ *      - Sequence number. Gaps mean that records were dropped.
+ *
+ *    * - 12
+ *      - s32
+ *      - ``position``
+ *
+ *    * - 16
+ *      - s32
+ *      - ``speed``
+ *
+ *    * - 20
+ *      - s32
+ *      - Position setpoint in tacho counts.
+ *
+ *    * - 24
+ *      - s32
+ *      - Speed setpoint in tacho counts per second.
+ *
+ *    * - 28
+ *      - s8
+ *      - ``duty_cycle``
+ *
+ *    * - 29
+ *      - u8
+ *      - ``state`` as bit flags: 0x01 ``running``, 0x02 ``ramping``,
+ *        0x04 ``holding``, 0x08 ``overloaded``, 0x10 ``stalled``.
+ *
+ *    * - 30
+ *      - u16
+ *      - Reserved, always 0.
  */
 
+#include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/wait.h>
 
 #include <dc_motor_class.h>
+#include <motor_ramp.h>
 #include <tacho_motor_class.h>
+#include <tacho_motor_helper.h>
 
 #include "ev3_motor.h"
 
-#define RAMP_PERIOD	msecs_to_jiffies(100)
+/* fixed point scale for the fraction of an s-curve ramp that is done */
+#define RAMP_SCALE	1024
+
+#define TRAJECTORY_PERIOD	msecs_to_jiffies(10)
+/* time in which the trajectory position error is corrected */
+#define TRAJECTORY_CORRECTION_MS	100
+/* userspace is notified when the buffer has no more than this many points */
+#define TRAJECTORY_LOW_WATER	(TM_TRAJECTORY_SIZE / 4)
+
+#define TM_SYNC_MAX_GROUP	8
+
+/* protects tm_sync_list and the sync_* fields of all tacho motors */
+static DEFINE_MUTEX(tm_sync_lock);
+static LIST_HEAD(tm_sync_list);
 
 struct tacho_motor_value_names {
 	const char *name;
@@ -271,6 +582,12 @@ tm_stop_action_names[NUM_TM_STOP_ACTION] = {
 	[TM_STOP_ACTION_HOLD]      =  { "hold" },
 };
 
+static struct tacho_motor_value_names
+tm_ramp_profile_names[NUM_TM_RAMP_PROFILE] = {
+	[TM_RAMP_PROFILE_LINEAR]	= { "linear" },
+	[TM_RAMP_PROFILE_S_CURVE]	= { "s-curve" },
+};
+
 static struct tacho_motor_value_names
 tacho_motor_command_names[NUM_TM_COMMAND] = {
 	[TM_COMMAND_RUN_FOREVER]	= { "run-forever" },
@@ -278,6 +595,8 @@ tacho_motor_command_names[NUM_TM_COMMAND] = {
 	[TM_COMMAND_RUN_TO_REL_POS]	= { "run-to-rel-pos" },
 	[TM_COMMAND_RUN_TIMED]		= { "run-timed" },
 	[TM_COMMAND_RUN_DIRECT]		= { "run-direct" },
+	[TM_COMMAND_RUN_TRAJECTORY]	= { "run-trajectory" },
+	[TM_COMMAND_AUTO_TUNE]		= { "auto-tune" },
 	[TM_COMMAND_STOP]		= { "stop" },
 	[TM_COMMAND_RESET]		= { "reset" },
 };
@@ -305,11 +624,30 @@ inline struct tacho_motor_device *to_tacho_motor(struct device *dev)
 
 static int tm_do_one_ramp_step(struct tacho_motor_device *tm,
 			       struct tacho_motor_params *params);
+static int tm_update_state(struct tacho_motor_device *tm);
+
+static bool tm_params_ramp(struct tacho_motor_params *params)
+{
+	if (params->ramp_profile == TM_RAMP_PROFILE_S_CURVE
+	    && params->ramp_smoothing_sp)
+		return true;
+
+	return params->ramp_up_sp || params->ramp_down_sp;
+}
+
+static int tm_ramp_smooth_time(struct tacho_motor_params *params)
+{
+	if (params->ramp_profile != TM_RAMP_PROFILE_S_CURVE)
+		return 0;
+
+	return params->ramp_smoothing_sp * USEC_PER_MSEC;
+}
 
 static int tacho_motor_class_start_motor_ramp(struct tacho_motor_device *tm,
 					      struct tacho_motor_params *params)
 {
-	unsigned long ramp_sp, now;
+	ktime_t start;
+	int ramp_sp;
 
 	/* Determine if the target and current speed require a
 	 * transition through the 0 setpoint. If yes, then we need
@@ -332,54 +670,173 @@ static int tacho_motor_class_start_motor_ramp(struct tacho_motor_device *tm,
 	 */
 
 	if (0 <= (tm->ramp_start_speed * tm->ramp_delta_speed))
-		ramp_sp = msecs_to_jiffies(params->ramp_up_sp);
+		ramp_sp = params->ramp_up_sp;
 	else
-		ramp_sp = msecs_to_jiffies(params->ramp_down_sp);
+		ramp_sp = params->ramp_down_sp;
 
-	tm->ramp_delta_time = (ramp_sp * abs(tm->ramp_delta_speed))
-				/ tm->info->max_speed;
+	/* in microseconds */
+	tm->ramp_delta_time = div_s64((s64)ramp_sp * USEC_PER_MSEC
+				* abs(tm->ramp_delta_speed), tm->info->max_speed);
+	tm->ramp_smooth_time = tm_ramp_smooth_time(params);
 
-	/* Set the start time to about half a RAMP_PERIOD in the past so
+	/* Set the start time to about half a ramp period in the past so
 	 * that the first expiry starts the motor running at a non-zero
 	 * speed
 	 */
 
-	now = jiffies - RAMP_PERIOD/2;
-	tm->ramp_end_time = now + tm->ramp_delta_time;
-	tm->last_ramp_work_time = now;
+	motor_ramp_start(&tm->ramp);
+	start = ktime_sub_ns(tm->ramp.expires, ktime_to_ns(tm->ramp.period) / 2);
+	tm->ramp_end_time = ktime_add_us(start,
+				tm->ramp_delta_time + tm->ramp_smooth_time);
 	tm->ramping = true;
+	tm->ramp_stopping = false;
 
 	return tm_do_one_ramp_step(tm, params);
 }
 
-static void tacho_motor_class_ramp_work(struct work_struct *work)
+/*
+ * The speed the motor slows down to when the ramp down of a run-to-*-pos
+ * command is planned by the tacho-motor class. The motor controller takes
+ * care of the last bit of travel from there.
+ */
+static int tm_ramp_crawl_speed(struct tacho_motor_device *tm)
 {
-	struct tacho_motor_device *tm = container_of(to_delayed_work(work),
-					struct tacho_motor_device, ramp_work);
+	return tm->info->max_speed / 20;
+}
+
+/*
+ * Checks if the ramp down of a run-to-*-pos command has to start now in order
+ * to reach the crawl speed by the time the motor gets to position_sp.
+ */
+static bool tm_position_ramp_down_needed(struct tacho_motor_device *tm,
+					 struct tacho_motor_params *params)
+{
+	int position, speed, crawl, stop_time, distance;
+
+	if (tm->ops->get_position(tm->context, &position) < 0)
+		return false;
+
+	speed = abs(tm->ramp_last_speed);
+	crawl = tm_ramp_crawl_speed(tm);
+	if (speed <= crawl)
+		return false;
+
+	/*
+	 * An s-curve is symmetric, so the average speed during the ramp is
+	 * halfway between the start and end speed. Add one ramp period of
+	 * travel since that is how late we could notice.
+	 */
+	stop_time = params->ramp_down_sp * (speed - crawl) / tm->info->max_speed
+		    + params->ramp_smoothing_sp;
+	distance = (speed + crawl) * stop_time / 2 / MSEC_PER_SEC
+		   + speed * motor_ramp_get_period(&tm->ramp) / MSEC_PER_SEC;
+
+	return abs(params->position_sp - position) <= distance;
+}
+
+static int tm_start_position_ramp_down(struct tacho_motor_device *tm,
+				       struct tacho_motor_params *params)
+{
+	int crawl = tm_ramp_crawl_speed(tm);
+
+	tm->ramp_start_speed = tm->ramp_last_speed;
+	tm->ramp_end_speed = tm->ramp_last_speed < 0 ? -crawl : crawl;
+	tm->ramp_delta_speed = tm->ramp_end_speed - tm->ramp_start_speed;
+	tm->ramp_delta_time = div_s64((s64)params->ramp_down_sp * USEC_PER_MSEC
+				* abs(tm->ramp_delta_speed), tm->info->max_speed);
+	tm->ramp_smooth_time = tm_ramp_smooth_time(params);
+
+	motor_ramp_start(&tm->ramp);
+	tm->ramp_end_time = ktime_add_us(tm->ramp.expires,
+				tm->ramp_delta_time + tm->ramp_smooth_time);
+	tm->ramping = true;
+	tm->ramp_stopping = true;
+
+	return tm_do_one_ramp_step(tm, params);
+}
+
+/*
+ * Returns how much of the speed change of an s-curve ramp should be done
+ * after @elapsed time, scaled to RAMP_SCALE. The s-curve is the linear ramp of
+ * length @ramp smoothed over @smooth, so the acceleration has the shape of a
+ * trapezoid and the jerk is limited to 1 / (@ramp * @smooth).
+ */
+static int tm_ramp_fraction(unsigned long elapsed, unsigned long ramp,
+			    unsigned long smooth)
+{
+	u64 a = min(ramp, smooth);
+	u64 b = max(ramp, smooth);
+	u64 d = a + b;
+	u64 t = elapsed;
+
+	if (t >= d)
+		return RAMP_SCALE;
+	if (!a)
+		return div64_u64(t * RAMP_SCALE, b);
+	if (t < a)
+		return div64_u64(t * t * RAMP_SCALE, 2 * a * b);
+	if (t < b)
+		return div64_u64((2 * t - a) * RAMP_SCALE, 2 * b);
+
+	return RAMP_SCALE - div64_u64((d - t) * (d - t) * RAMP_SCALE, 2 * a * b);
+}
+
+static void tacho_motor_class_ramp_step(struct motor_ramp *ramp)
+{
+	struct tacho_motor_device *tm =
+		container_of(ramp, struct tacho_motor_device, ramp);
+	bool was_ramping = tm->ramping;
 	int err;
 
 	err = tm_do_one_ramp_step(tm, &tm->active_params);
 	WARN_ONCE(err, "Ramp failed.");
+
+	/*
+	 * The ramping flag belongs to the class, so drivers that notify state
+	 * changes themselves don't know when it is cleared.
+	 */
+	if (was_ramping && !tm->ramping && tm->driver_state_notify)
+		tm_update_state(tm);
 }
 
 static int tm_do_one_ramp_step(struct tacho_motor_device *tm,
 			       struct tacho_motor_params *params)
 {
-	unsigned long remaining_ramp_time = 0;
-	unsigned long last_ramp_time;
-	int err;
+	s64 remaining_ramp_time;
+	s64 total_ramp_time;
+	bool plan_ramp_down;
+	int err, fraction;
+
+	/*
+	 * With the s-curve profile, the class keeps watching the position
+	 * of run-to-*-pos commands, even when not ramping, so that it can
+	 * start the ramp down in time.
+	 */
+	plan_ramp_down = IS_POS_CMD(params->command)
+		&& params->ramp_profile == TM_RAMP_PROFILE_S_CURVE;
+
+	if (plan_ramp_down && !tm->ramp_stopping
+	    && tm_position_ramp_down_needed(tm, params))
+		return tm_start_position_ramp_down(tm, params);
 
 	/* Check to see if we are running and done ramping, or if we're
 	 * running and have hit the 0 crossover point and need to restart
 	 * the ramp
 	 */
 
-	if (params->speed_sp == tm->ramp_last_speed) {
+	if (tm->ramp_stopping) {
+		if (tm->ramp_end_speed == tm->ramp_last_speed) {
+			tm->ramping = false;
+			return 0;
+		}
+	} else if (params->speed_sp == tm->ramp_last_speed) {
 		tm->ramping = false;
 		if (params->command == TM_COMMAND_STOP)
 			return tm->ops->stop(tm->context,
 					     params->stop_action);
-		return 0;
+		if (!plan_ramp_down)
+			return 0;
+		goto schedule;
 	} else if (tm->ramp_end_speed == tm->ramp_last_speed)
 		return tacho_motor_class_start_motor_ramp(tm, params);
 
@@ -390,15 +847,22 @@ static int tm_do_one_ramp_step(struct tacho_motor_device *tm,
 	 * the fact that the target setpoint may cross the 0 point.
 	 */
 
-	if (time_is_after_jiffies(tm->ramp_end_time))
-		remaining_ramp_time = tm->ramp_end_time - jiffies;
-	else
+	remaining_ramp_time = ktime_us_delta(tm->ramp_end_time, ktime_get());
+	if (remaining_ramp_time < 0)
 		remaining_ramp_time = 0;
 
-	if (tm->ramp_delta_time != 0) {
+	total_ramp_time = tm->ramp_delta_time + tm->ramp_smooth_time;
+
+	if (tm->ramp_smooth_time != 0) {
+		fraction = tm_ramp_fraction(total_ramp_time - remaining_ramp_time,
+					    tm->ramp_delta_time,
+					    tm->ramp_smooth_time);
+		tm->ramp_last_speed = tm->ramp_start_speed
+			+ tm->ramp_delta_speed * fraction / RAMP_SCALE;
+	} else if (tm->ramp_delta_time != 0) {
 		tm->ramp_last_speed = tm->ramp_end_speed
-			- ((tm->ramp_delta_speed * (int)remaining_ramp_time)
-				/ tm->ramp_delta_time);
+			- div_s64(tm->ramp_delta_speed * remaining_ramp_time,
+				  tm->ramp_delta_time);
 	} else {
 		tm->ramp_last_speed = tm->ramp_end_speed;
 		tm->ramping = false;
@@ -412,16 +876,8 @@ static int tm_do_one_ramp_step(struct tacho_motor_device *tm,
 	if (err)
 		return err;
 
-	/*
-	 * Measure how long it took since the last call to ramp_work and
-	 * schedule the next ramp as close to RAMP_PERIOD as we can get
-	 */
-	last_ramp_time = jiffies - tm->last_ramp_work_time;
-	tm->last_ramp_work_time = jiffies;
-	schedule_delayed_work(&tm->ramp_work,
-		last_ramp_time >= RAMP_PERIOD
-					? 0
-					: RAMP_PERIOD - last_ramp_time);
+schedule:
+	motor_ramp_schedule(&tm->ramp);
 
 	return 0;
 }
@@ -438,6 +894,9 @@ void tacho_motor_class_reset(struct tacho_motor_device *tm)
 	tm->params.time_sp		= 0;
 	tm->params.ramp_up_sp		= 0;
 	tm->params.ramp_down_sp		= 0;
+	tm->params.ramp_smoothing_sp	= 0;
+	tm->params.turn_ratio_sp	= 0;
+	tm->params.ramp_profile		= TM_RAMP_PROFILE_LINEAR;
 	tm->params.stop_action		= TM_STOP_ACTION_COAST;
 }
 
@@ -507,6 +966,45 @@ static int tacho_motor_get_state(struct tacho_motor_device *tm)
 	return ret;
 }
 
+/*
+ * Gets the status as seen by the driver, i.e. without polarity and without
+ * the ramping flag of the tacho motor class.
+ */
+static int tm_read_status(struct tacho_motor_device *tm,
+			  struct tacho_motor_status *status)
+{
+	int ret;
+
+	if (tm->ops->get_status)
+		return tm->ops->get_status(tm->context, status);
+
+	memset(status, 0, sizeof(*status));
+
+	ret = tm->ops->get_position(tm->context, &status->position);
+	if (ret < 0)
+		return ret;
+
+	if (tm->ops->get_speed) {
+		ret = tm->ops->get_speed(tm->context, &status->speed);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (tm->ops->get_duty_cycle) {
+		ret = tm->ops->get_duty_cycle(tm->context, &status->duty_cycle);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = tm->ops->get_state(tm->context);
+	if (ret < 0)
+		return ret;
+
+	status->state = ret;
+
+	return 0;
+}
+
 static ssize_t state_show(struct device *dev, struct device_attribute *attr,
 			  char *buf)
 {
@@ -530,6 +1028,14 @@ static ssize_t state_show(struct device *dev, struct device_attribute *attr,
 	return size;
 }
 
+static ssize_t state_timestamp_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	return sprintf(buf, "%lld\n", ktime_to_ns(tm->state_time));
+}
+
 static ssize_t count_per_rot_show(struct device *dev,
 				  struct device_attribute *attr, char *buf)
 {
@@ -600,6 +1106,14 @@ static ssize_t speed_show(struct device *dev, struct device_attribute *attr,
 	return sprintf(buf, "%d\n", speed);
 }
 
+static bool tm_supports_auto_tune(struct tacho_motor_device *tm)
+{
+	return tm->pid_period_us && tm->ops->run_unregulated
+		&& tm->ops->get_speed && tm->ops->stop
+		&& tm->ops->set_speed_Kp && tm->ops->set_speed_Ki
+		&& tm->ops->set_hold_Kp;
+}
+
 static unsigned get_supported_commands(struct tacho_motor_device *tm)
 {
 	unsigned supported_commands = 0;
@@ -612,8 +1126,12 @@ static unsigned get_supported_commands(struct tacho_motor_device *tm)
 		supported_commands |= BIT(TM_COMMAND_RUN_TO_ABS_POS);
 		supported_commands |= BIT(TM_COMMAND_RUN_TO_REL_POS);
 	}
-	if (tm->ops->run_regulated && tm->ops->stop)
+	if (tm->ops->run_regulated && tm->ops->stop) {
 		supported_commands |= BIT(TM_COMMAND_RUN_TIMED);
+		supported_commands |= BIT(TM_COMMAND_RUN_TRAJECTORY);
+	}
+	if (tm_supports_auto_tune(tm))
+		supported_commands |= BIT(TM_COMMAND_AUTO_TUNE);
 	if (tm->ops->stop)
 		supported_commands |= BIT(TM_COMMAND_STOP);
 	if (tm->ops->reset)
@@ -642,86 +1160,510 @@ static ssize_t commands_show(struct device *dev, struct device_attribute *attr,
 	return size;
 }
 
-static int tm_send_command(struct tacho_motor_device *tm,
-			   enum tacho_motor_command cmd)
+static int tm_update_state(struct tacho_motor_device *tm)
 {
-	struct tacho_motor_params new_params;
-	int err;
-	bool ramp = false;
+	int newstate;
 
-	/* stop any previous async commands */
-	cancel_delayed_work_sync(&tm->run_timed_work);
-	cancel_delayed_work_sync(&tm->ramp_work);
+	mutex_lock(&tm->state_lock);
+	newstate = tacho_motor_get_state(tm);
+	if (newstate >= 0 && newstate != tm->oldstate) {
+		tm->state_time = ktime_get();
+		tm->oldstate = newstate;
+		sysfs_notify(&tm->dev.kobj, NULL, "state");
+	}
+	mutex_unlock(&tm->state_lock);
 
-	/* do any extra manipulation of params if needed */
+	return newstate;
+}
 
-	if (cmd == TM_COMMAND_RESET)
-		tacho_motor_class_reset(tm);
+/* How often the state is polled for drivers that don't notify themselves */
+#define TM_STATE_POLL_MS	20
 
-	new_params = tm->params;
+static void tacho_motor_class_state_work(struct work_struct *work)
+{
+	struct tacho_motor_device *tm = container_of(to_delayed_work(work),
+				struct tacho_motor_device, state_work);
+	int state;
 
-	/* Caution: The new_params.command must be set here to avoid
-	 *          race conditions when doing any ramping if the
-	 *          ramp_up time is calculated to be a very small
-	 *          value.
-	 */
+	state = tm_update_state(tm);
+	if (state == -EAGAIN || (state >= 0 && (state & BIT(TM_STATE_RUNNING))))
+		schedule_delayed_work(&tm->state_work,
+				      msecs_to_jiffies(TM_STATE_POLL_MS));
+}
 
-	new_params.command = cmd;
+/*
+ * Starts polling the state until the motor stops running. Holding is not
+ * polled since it can last forever and each poll may be a bus transaction.
+ */
+static void tm_watch_state(struct tacho_motor_device *tm)
+{
+	if (!tm->driver_state_notify)
+		mod_delayed_work(system_wq, &tm->state_work, 0);
+}
 
-	if (cmd == TM_COMMAND_RUN_TO_REL_POS) {
-		if (new_params.position_sp == 0) {
-			/*
-			 * If the relative position setpoint is 0, then don't
-			 * try to run, just stop.
-			 */
-			cmd = TM_COMMAND_STOP;
-		} else if (tm->params.command == TM_COMMAND_RUN_TO_REL_POS) {
-			/*
-			* To check the previous command, we MUST be looking at
-			* tm->params.command because that's the previous command
-			* that the user sent! If the previous command was also
-			* run-to-rel-pos then we try to be "smart" about the new
-			* setpoint by making it relative to the previous
-			* setpoint.
-			*
-			* This will eliminate cumulative error due to the motor
-			* not holding the position exactly when the position
-			* setpoint is reached.
-			*/
-			new_params.position_sp = tm->active_params.position_sp +
-							tm->params.position_sp;
-		} else {
-			int position;
+/*
+ * Auto-tune:
+ *
+ * The motor is run at a low duty cycle until the speed settles, then a step
+ * to a higher duty cycle is applied and the speed is recorded. This gives a
+ * first order plus dead time model of the speed (gain, time constant and dead
+ * time, using the 28%/63% two point method). Gains are then computed with
+ * the SIMC tuning rules and installed through the driver's PID ops.
+ */
 
-			tm->ops->get_position(tm->context, &position);
-			new_params.position_sp = position +
-							tm->params.position_sp;
-		}
+#define TM_TUNE_PERIOD_MS	5
+#define TM_TUNE_DUTY_LOW	30
+#define TM_TUNE_DUTY_HIGH	60
+#define TM_TUNE_SETTLE_MS	500
+#define TM_TUNE_STEP_MS		1000
+#define TM_TUNE_AVERAGE_MS	100
+#define TM_TUNE_SAMPLES		(TM_TUNE_STEP_MS / TM_TUNE_PERIOD_MS + 1)
+/* the hold PID should overcome friction with an error of this many counts */
+#define TM_TUNE_HOLD_ERROR	4
+
+static const char * const tm_auto_tune_status_names[] = {
+	[TM_AUTO_TUNE_NONE]	= "none",
+	[TM_AUTO_TUNE_RUNNING]	= "running",
+	[TM_AUTO_TUNE_DONE]	= "done",
+	[TM_AUTO_TUNE_FAILED]	= "failed",
+};
+
+/* Returns the time when the speed first crosses @level or -1 */
+static int tm_tune_crossing(struct tm_auto_tune *tune, int level)
+{
+	int i;
+
+	for (i = 0; i < tune->num_samples; i++) {
+		if (tune->samples[i].speed >= level)
+			return tune->samples[i].time;
 	}
 
-	if (!IS_RUN_CMD(cmd)) {
-		new_params.duty_cycle_sp = 0;
-		new_params.speed_sp = 0;
+	return -1;
+}
+
+static int tm_tune_compute(struct tacho_motor_device *tm)
+{
+	struct tm_auto_tune *tune = &tm->tune;
+	int scale = TM_PID_DEFAULT_SCALE;
+	int speed0, speed1, delta, t28, t63, tau, theta, tau_c, ti, i;
+	s64 sum = 0;
+	unsigned count = 0;
+	int ret;
+
+	if (!tune->speed_count)
+		return -EIO;
+	speed0 = div_s64(tune->speed_sum, tune->speed_count);
+
+	for (i = 0; i < tune->num_samples; i++) {
+		if (tune->samples[i].time < (TM_TUNE_STEP_MS - TM_TUNE_AVERAGE_MS)
+					    * USEC_PER_MSEC)
+			continue;
+		sum += tune->samples[i].speed;
+		count++;
+	}
+	if (!count)
+		return -EIO;
+	speed1 = div_s64(sum, count);
+
+	/* the motor must speed up, otherwise it is blocked or not connected */
+	delta = speed1 - speed0;
+	if (delta <= 0 || speed0 <= 0)
+		return -EIO;
+
+	t28 = tm_tune_crossing(tune, speed0 + delta * 283 / 1000);
+	t63 = tm_tune_crossing(tune, speed0 + delta * 632 / 1000);
+	if (t28 < 0 || t63 < 0)
+		return -EIO;
+
+	tau = max(3 * (t63 - t28) / 2, TM_TUNE_PERIOD_MS * USEC_PER_MSEC);
+	theta = max(t63 - tau, tm->pid_period_us);
+
+	tune->gain = delta * 100 / (TM_TUNE_DUTY_HIGH - TM_TUNE_DUTY_LOW);
+	tune->deadband = clamp(TM_TUNE_DUTY_LOW - speed0 * 100 / tune->gain,
+			       0, TM_TUNE_DUTY_LOW);
+	tune->time_constant = tau;
+	tune->dead_time = theta;
+
+	if (tm->ops->get_speed_scale) {
+		ret = tm->ops->get_speed_scale(tm->context);
+		if (ret > 0)
+			scale = ret;
 	}
 
-	/* now actually send the command to the motor controller */
+	/*
+	 * Speed PI (SIMC): Kc = tau / (k * (tau_c + theta)),
+	 * Ti = min(tau, 4 * (tau_c + theta)) where k = gain / 100.
+	 * tau_c is at least tau / 2 to keep the loop smooth with the noisy
+	 * speed estimate. The integral of tm_pid is per iteration, so Ki is
+	 * Kc * period / Ti.
+	 */
+	tau_c = max(theta, tau / 2);
+	ti = min(tau, 4 * (tau_c + theta));
+	tune->speed_Kp = div_s64((s64)scale * 100 * tau,
+				 (s64)tune->gain * (tau_c + theta));
+	tune->speed_Ki = div_s64((s64)tune->speed_Kp * tm->pid_period_us, ti);
+	tune->speed_Kf = scale * 100 / tune->gain;
 
-	switch (cmd) {
-	case TM_COMMAND_RUN_DIRECT:
-		err = tm->ops->run_unregulated(tm->context,
-					       new_params.duty_cycle_sp);
-		break;
-	case TM_COMMAND_RUN_FOREVER:
-	case TM_COMMAND_RUN_TIMED:
-		if (new_params.ramp_up_sp || new_params.ramp_down_sp)
-			ramp = true;
-		else
-			err = tm->ops->run_regulated(tm->context,
-						     new_params.speed_sp);
-		break;
-	case TM_COMMAND_RUN_TO_ABS_POS:
+	/*
+	 * Hold P (SIMC for an integrating process): the position is the
+	 * integral of the speed, so the lag of the speed is added to the dead
+	 * time and Kc = 1 / (k * theta) with tau_c = 0.
+	 */
+	tune->hold_Kp = div_s64((s64)scale * 100 * USEC_PER_SEC,
+				(s64)tune->gain * (theta + tau));
+	tune->hold_Kp = max(tune->hold_Kp,
+			    scale * tune->deadband / TM_TUNE_HOLD_ERROR);
+
+	ret = tm->ops->set_speed_Kp(tm->context, tune->speed_Kp);
+	if (ret < 0)
+		return ret;
+	ret = tm->ops->set_speed_Ki(tm->context, tune->speed_Ki);
+	if (ret < 0)
+		return ret;
+	if (tm->ops->set_speed_Kf) {
+		ret = tm->ops->set_speed_Kf(tm->context, tune->speed_Kf);
+		if (ret < 0)
+			return ret;
+	} else {
+		tune->speed_Kf = 0;
+	}
+
+	return tm->ops->set_hold_Kp(tm->context, tune->hold_Kp);
+}
+
+static void tm_tune_stop(struct tacho_motor_device *tm, int err)
+{
+	struct tm_auto_tune *tune = &tm->tune;
+
+	if (tune->status != TM_AUTO_TUNE_RUNNING)
+		return;
+
+	tm->ops->stop(tm->context, TM_STOP_ACTION_COAST);
+	kfree(tune->samples);
+	tune->samples = NULL;
+	tune->error = err;
+	tune->status = err ? TM_AUTO_TUNE_FAILED : TM_AUTO_TUNE_DONE;
+	tm->active_params.command = TM_COMMAND_STOP;
+	sysfs_notify(&tm->dev.kobj, NULL, "auto_tune");
+}
+
+static void tacho_motor_class_tune_step(struct motor_ramp *timer)
+{
+	struct tacho_motor_device *tm = container_of(timer,
+				struct tacho_motor_device, tune.timer);
+	struct tm_auto_tune *tune = &tm->tune;
+	s64 elapsed = ktime_us_delta(ktime_get(), tune->start);
+	int speed, err;
+
+	err = tm->ops->get_speed(tm->context, &speed);
+	if (err < 0)
+		goto stop;
+
+	if (!tune->stepped) {
+		if (elapsed >= (TM_TUNE_SETTLE_MS - TM_TUNE_AVERAGE_MS)
+			       * USEC_PER_MSEC) {
+			tune->speed_sum += speed;
+			tune->speed_count++;
+		}
+		if (elapsed >= TM_TUNE_SETTLE_MS * USEC_PER_MSEC) {
+			err = tm->ops->run_unregulated(tm->context,
+						       TM_TUNE_DUTY_HIGH);
+			if (err < 0)
+				goto stop;
+			tune->start = ktime_get();
+			tune->stepped = true;
+		}
+	} else {
+		tune->samples[tune->num_samples].time = elapsed;
+		tune->samples[tune->num_samples].speed = speed;
+		tune->num_samples++;
+		if (elapsed >= TM_TUNE_STEP_MS * USEC_PER_MSEC
+		    || tune->num_samples == TM_TUNE_SAMPLES) {
+			err = tm_tune_compute(tm);
+			goto stop;
+		}
+	}
+
+	motor_ramp_schedule(timer);
+
+	return;
+
+stop:
+	tm_tune_stop(tm, err);
+	tm_update_state(tm);
+}
+
+static int tm_tune_start(struct tacho_motor_device *tm)
+{
+	struct tm_auto_tune *tune = &tm->tune;
+	int err;
+
+	tune->samples = kcalloc(TM_TUNE_SAMPLES, sizeof(*tune->samples),
+				GFP_KERNEL);
+	if (!tune->samples)
+		return -ENOMEM;
+
+	err = tm->ops->run_unregulated(tm->context, TM_TUNE_DUTY_LOW);
+	if (err < 0) {
+		kfree(tune->samples);
+		tune->samples = NULL;
+		return err;
+	}
+
+	tune->num_samples = 0;
+	tune->speed_sum = 0;
+	tune->speed_count = 0;
+	tune->stepped = false;
+	tune->error = 0;
+	tune->status = TM_AUTO_TUNE_RUNNING;
+	tune->start = ktime_get();
+
+	motor_ramp_start(&tune->timer);
+	motor_ramp_schedule(&tune->timer);
+
+	return 0;
+}
+
+/*
+ * Position planner:
+ *
+ * For drivers that implement run_profile, run-to-*-pos commands are planned
+ * here as a trapezoid of the speed: ramp up (or down) from the current speed
+ * to speed_sp, cruise, then ramp down to stop exactly at position_sp. The
+ * rates are the same as the ramps of the other run commands. If the move is
+ * too short to reach speed_sp, the cruise speed is lowered so that the ramp
+ * down still fits (triangle). If the motor is moving away from the target or
+ * is too fast to stop before it, it is stopped first. With the s-curve ramp
+ * profile, the driver smooths the result over ramp_smoothing_sp.
+ *
+ * Since the reference slows down to the target, the driver does not have to
+ * guess when to start slowing down and the motor does not overshoot.
+ */
+
+/* Returns the time in microseconds to change the speed by delta. */
+static s64 tm_profile_ramp_time(struct tacho_motor_device *tm, int ramp_sp,
+				int delta)
+{
+	return div_s64((s64)ramp_sp * USEC_PER_MSEC * abs(delta),
+		       tm->info->max_speed);
+}
+
+static void tm_profile_append(struct tm_profile *prof, s64 time, int speed)
+{
+	struct tm_profile_knot *k = &prof->knots[prof->num_knots - 1];
+
+	k[1].time = k->time + time;
+	k[1].pos = k->pos + div_s64((s64)(k->speed + speed) * time, 2);
+	k[1].speed = speed;
+	prof->num_knots++;
+}
+
+static void tm_plan_profile(struct tacho_motor_device *tm,
+			    struct tacho_motor_params *params,
+			    int position, int speed, struct tm_profile *prof)
+{
+	int ramp_up = params->ramp_up_sp;
+	int ramp_down = params->ramp_down_sp;
+	int max_speed = min(abs(params->speed_sp), tm->info->max_speed);
+	s64 dist, covered, need, room, stop_time;
+	int dir, vc;
+
+	memset(prof, 0, sizeof(*prof));
+	prof->start = position;
+	prof->target = params->position_sp;
+	prof->start_speed = speed;
+	prof->num_knots = 1;
+	if (params->ramp_profile == TM_RAMP_PROFILE_S_CURVE)
+		prof->smooth = min(params->ramp_smoothing_sp,
+				   TM_PROFILE_MAX_SMOOTH_MS) * USEC_PER_MSEC;
+
+	/* positions are in millionths of a count, relative to the start */
+	prof->knots[0].pos = div_s64((s64)speed * prof->smooth, 2);
+	prof->knots[0].speed = speed;
+	dist = (s64)(prof->target - position) * USEC_PER_SEC
+	       - prof->knots[0].pos;
+
+	if (speed) {
+		stop_time = tm_profile_ramp_time(tm, ramp_down, speed);
+		if ((speed < 0) != (dist < 0) || !dist
+		    || div_s64((s64)abs(speed) * stop_time, 2) > abs(dist)) {
+			tm_profile_append(prof, stop_time, 0);
+			dist -= prof->knots[1].pos - prof->knots[0].pos;
+			speed = 0;
+		}
+	}
+
+	if (!dist)
+		return;
+
+	dir = dist < 0 ? -1 : 1;
+	dist = abs(dist);
+	speed = abs(speed);
+	vc = max_speed;
+
+	if (speed <= vc) {
+		/*
+		 * The distance of a ramp from v0 to v1 is
+		 * (v1^2 - v0^2) * ramp_sp / (2 * max_speed), so check if both
+		 * ramps fit and solve for the highest cruise speed if not.
+		 */
+		need = ((s64)vc * vc - (s64)speed * speed) * ramp_up
+		       + (s64)vc * vc * ramp_down;
+		room = div_s64(dist, USEC_PER_MSEC) * 2 * tm->info->max_speed;
+		if (need > room) {
+			vc = int_sqrt(div_s64(room + (s64)speed * speed
+					      * ramp_up, ramp_up + ramp_down));
+			vc = clamp(vc, max(speed, 1), max_speed);
+		}
+	}
+
+	covered = prof->knots[prof->num_knots - 1].pos;
+	tm_profile_append(prof, tm_profile_ramp_time(tm, speed <= vc ? ramp_up
+						     : ramp_down, vc - speed),
+			  dir * vc);
+	covered = abs(prof->knots[prof->num_knots - 1].pos - covered);
+
+	/* the ramp down covers vc * stop_time / 2 */
+	stop_time = tm_profile_ramp_time(tm, ramp_down, vc);
+	dist -= covered + div_s64((s64)vc * stop_time, 2);
+	tm_profile_append(prof, dist > 0 ? div_s64(dist, vc) : 0, dir * vc);
+	tm_profile_append(prof, stop_time, 0);
+
+	prof->speed = dir * vc;
+}
+
+static int tm_run_profile(struct tacho_motor_device *tm,
+			  struct tacho_motor_params *params)
+{
+	struct tacho_motor_status status;
+	struct tm_profile prof;
+	int err;
+
+	err = tm_read_status(tm, &status);
+	if (err < 0)
+		return err;
+
+	if (!(status.state & BIT(TM_STATE_RUNNING)))
+		status.speed = 0;
+
+	tm_plan_profile(tm, params, status.position, status.speed, &prof);
+	prof.start_time = ktime_get();
+
+	return tm->ops->run_profile(tm->context, &prof, params->stop_action);
+}
+
+/* stops any previous async commands */
+static void tm_cancel_async(struct tacho_motor_device *tm)
+{
+	cancel_delayed_work_sync(&tm->run_timed_work);
+	motor_ramp_cancel(&tm->ramp);
+	cancel_delayed_work_sync(&tm->trajectory_work);
+	motor_ramp_cancel(&tm->tune.timer);
+	tm_tune_stop(tm, -EINTR);
+
+	mutex_lock(&tm->trajectory_lock);
+	if (tm->trajectory_running) {
+		tm->trajectory_running = false;
+		tm->trajectory_count = 0;
+	}
+	mutex_unlock(&tm->trajectory_lock);
+}
+
+static int tm_send_command(struct tacho_motor_device *tm,
+			   enum tacho_motor_command cmd)
+{
+	struct tacho_motor_params new_params;
+	int err;
+	bool ramp = false;
+
+	tm_cancel_async(tm);
+
+	/* do any extra manipulation of params if needed */
+
+	if (cmd == TM_COMMAND_RESET)
+		tacho_motor_class_reset(tm);
+
+	new_params = tm->params;
+
+	/* Caution: The new_params.command must be set here to avoid
+	 *          race conditions when doing any ramping if the
+	 *          ramp_up time is calculated to be a very small
+	 *          value.
+	 */
+
+	new_params.command = cmd;
+
+	if (cmd == TM_COMMAND_RUN_TO_REL_POS) {
+		if (new_params.position_sp == 0) {
+			/*
+			 * If the relative position setpoint is 0, then don't
+			 * try to run, just stop.
+			 */
+			cmd = TM_COMMAND_STOP;
+		} else if (tm->params.command == TM_COMMAND_RUN_TO_REL_POS) {
+			/*
+			* To check the previous command, we MUST be looking at
+			* tm->params.command because that's the previous command
+			* that the user sent! If the previous command was also
+			* run-to-rel-pos then we try to be "smart" about the new
+			* setpoint by making it relative to the previous
+			* setpoint.
+			*
+			* This will eliminate cumulative error due to the motor
+			* not holding the position exactly when the position
+			* setpoint is reached.
+			*/
+			new_params.position_sp = tm->active_params.position_sp +
+							tm->params.position_sp;
+		} else {
+			int position;
+
+			tm->ops->get_position(tm->context, &position);
+			new_params.position_sp = position +
+							tm->params.position_sp;
+		}
+	}
+
+	if (!IS_RUN_CMD(cmd)) {
+		new_params.duty_cycle_sp = 0;
+		new_params.speed_sp = 0;
+	}
+
+	/* now actually send the command to the motor controller */
+
+	switch (cmd) {
+	case TM_COMMAND_RUN_DIRECT:
+		err = tm->ops->run_unregulated(tm->context,
+					       new_params.duty_cycle_sp);
+		break;
+	case TM_COMMAND_RUN_TRAJECTORY:
+		mutex_lock(&tm->trajectory_lock);
+		if (tm->trajectory_count) {
+			tm->trajectory_start = ktime_get();
+			tm->trajectory_underruns = 0;
+			tm->trajectory_running = true;
+			err = 0;
+		} else {
+			err = -EINVAL;
+		}
+		mutex_unlock(&tm->trajectory_lock);
+		break;
+	case TM_COMMAND_AUTO_TUNE:
+		err = tm_tune_start(tm);
+		break;
+	case TM_COMMAND_RUN_FOREVER:
+	case TM_COMMAND_RUN_TIMED:
+		if (tm_params_ramp(&new_params))
+			ramp = true;
+		else
+			err = tm->ops->run_regulated(tm->context,
+						     new_params.speed_sp);
+		break;
+	case TM_COMMAND_RUN_TO_ABS_POS:
 	case TM_COMMAND_RUN_TO_REL_POS:
-		if (new_params.ramp_up_sp || new_params.ramp_down_sp)
+		if (tm->ops->run_profile && new_params.speed_sp)
+			err = tm_run_profile(tm, &new_params);
+		else if (tm_params_ramp(&new_params))
 			ramp = true;
 		else
 			err = tm->ops->run_to_pos(tm->context,
@@ -730,7 +1672,7 @@ static int tm_send_command(struct tacho_motor_device *tm,
 						  new_params.stop_action);
 		break;
 	case TM_COMMAND_STOP:
-		if (new_params.ramp_up_sp || new_params.ramp_down_sp)
+		if (tm_params_ramp(&new_params))
 			ramp = true;
 		else
 			err = tm->ops->stop(tm->context,
@@ -748,36 +1690,810 @@ static int tm_send_command(struct tacho_motor_device *tm,
 	if (err < 0)
 		return err;
 
-	tm->active_params = new_params;
+	tm->active_params = new_params;
+
+	if (cmd == TM_COMMAND_RUN_TIMED)
+		schedule_delayed_work(&tm->run_timed_work,
+				      msecs_to_jiffies(new_params.time_sp));
+	else if (cmd == TM_COMMAND_RUN_TRAJECTORY)
+		schedule_delayed_work(&tm->trajectory_work, 0);
+
+	return 0;
+}
+
+/*
+ * Throws away the pending commands of all motors in a sync group. Must be
+ * called with tm_sync_lock held.
+ */
+static void tm_sync_discard(int group)
+{
+	struct tacho_motor_device *tm;
+
+	list_for_each_entry(tm, &tm_sync_list, sync_entry) {
+		if (tm->sync_group == group)
+			tm->sync_command = -1;
+	}
+}
+
+static ssize_t command_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t size)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	unsigned supported_commands;
+	int i;
+
+	supported_commands = get_supported_commands(tm);
+
+	for (i = 0; i < NUM_TM_COMMAND; i++) {
+		if (!sysfs_streq(buf, tacho_motor_command_names[i].name))
+			continue;
+
+		if (supported_commands & BIT(i)) {
+			int err;
+
+			/*
+			 * tm_sync_lock is global, so it is only taken for
+			 * grouped motors and not held while sending. Otherwise
+			 * every motor would wait for the bus I/O of the others.
+			 */
+			if (READ_ONCE(tm->sync_group)) {
+				bool staged;
+
+				mutex_lock(&tm_sync_lock);
+				staged = tm->sync_group && IS_RUN_CMD(i);
+				if (staged)
+					tm->sync_command = i;
+				else if (tm->sync_group)
+					tm_sync_discard(tm->sync_group);
+				mutex_unlock(&tm_sync_lock);
+
+				if (staged)
+					return size;
+			}
+
+			err = tm_send_command(tm, i);
+			if (err < 0)
+				return err;
+
+			tm_watch_state(tm);
+
+			return size;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Sends the pending commands of all motors in a sync group. Must be called
+ * with tm_sync_lock held.
+ *
+ * Drivers that implement begin_batch/end_batch queue the commands and send
+ * them all at once when the last end_batch is called. For all other drivers,
+ * the commands are sent back-to-back. Only the commands are queued; anything
+ * that a driver reads while handling a command (e.g. the current position for
+ * run-to-rel-pos) is still read right away, so it can reach the motor
+ * controller before the commands of motors earlier in the group.
+ */
+static int tm_sync_commit(int group)
+{
+	struct tacho_motor_device *tm;
+	ktime_t start, elapsed;
+	int err, ret = 0;
+
+	/*
+	 * Cancel any async work up front so that it does not add to the time
+	 * between sending the first and the last command.
+	 */
+	list_for_each_entry(tm, &tm_sync_list, sync_entry) {
+		if (tm->sync_group != group || tm->sync_command < 0)
+			continue;
+
+		cancel_delayed_work_sync(&tm->run_timed_work);
+		motor_ramp_cancel(&tm->ramp);
+		cancel_delayed_work_sync(&tm->trajectory_work);
+		if (tm->ops->begin_batch)
+			tm->ops->begin_batch(tm->context);
+	}
+
+	start = ktime_get();
+
+	list_for_each_entry(tm, &tm_sync_list, sync_entry) {
+		if (tm->sync_group != group || tm->sync_command < 0)
+			continue;
+
+		err = tm_send_command(tm, tm->sync_command);
+		if (err < 0 && !ret)
+			ret = err;
+	}
+
+	list_for_each_entry(tm, &tm_sync_list, sync_entry) {
+		if (tm->sync_group != group || tm->sync_command < 0)
+			continue;
+
+		if (tm->ops->end_batch) {
+			err = tm->ops->end_batch(tm->context);
+			if (err < 0 && !ret)
+				ret = err;
+		}
+	}
+
+	elapsed = ktime_sub(ktime_get(), start);
+
+	list_for_each_entry(tm, &tm_sync_list, sync_entry) {
+		if (tm->sync_group != group || tm->sync_command < 0)
+			continue;
+
+		tm->sync_command = -1;
+		tm->sync_commit_time = elapsed;
+		/*
+		 * Not done in the send loop since the driver may read the
+		 * state right away, before the batch is sent, and see a motor
+		 * that is not running yet.
+		 */
+		tm_watch_state(tm);
+	}
+
+	return ret;
+}
+
+enum tm_steer_command {
+	TM_STEER_FOREVER,
+	TM_STEER_TIMED,
+	TM_STEER_TO_REL_POS,
+	NUM_TM_STEER,
+};
+
+static struct tacho_motor_value_names tm_steer_command_names[NUM_TM_STEER] = {
+	[TM_STEER_FOREVER]	= { "steer-forever" },
+	[TM_STEER_TIMED]	= { "steer-timed" },
+	[TM_STEER_TO_REL_POS]	= { "steer-to-rel-pos" },
+};
+
+/*
+ * Runs the two motors of the sync group of tm as a pair. Must be called with
+ * tm_sync_lock held.
+ *
+ * The speeds follow the turn ratio of lms2012: the slower motor runs at
+ * (100 - |turn_ratio|) percent of speed_sp. Speeds are computed without
+ * polarity and then converted for each motor, so that the turn ratio means
+ * the same thing regardless of how the motors are mounted.
+ */
+static int tm_sync_steer(struct tacho_motor_device *tm,
+			 enum tm_steer_command cmd)
+{
+	struct tacho_motor_device *partner = NULL, *member;
+	struct tm_steering steering;
+	int speed, turn, partner_speed, err;
+
+	list_for_each_entry(member, &tm_sync_list, sync_entry) {
+		if (member == tm || member->sync_group != tm->sync_group)
+			continue;
+		if (partner)
+			return -EINVAL;
+		partner = member;
+	}
+	if (!partner)
+		return -EINVAL;
+
+	if (!tm->ops->run_steering
+	    || partner->ops->run_steering != tm->ops->run_steering)
+		return -EOPNOTSUPP;
+
+	speed = tm->params.speed_sp;
+	if (tm->polarity == DC_MOTOR_POLARITY_INVERSED)
+		speed *= -1;
+	turn = tm->params.turn_ratio_sp;
+	partner_speed = speed;
+	if (turn > 0)
+		partner_speed = speed * (100 - turn) / 100;
+	else
+		speed = speed * (100 + turn) / 100;
+
+	steering.speed = tm->polarity == DC_MOTOR_POLARITY_INVERSED
+			 ? -speed : speed;
+	steering.partner_speed = partner->polarity == DC_MOTOR_POLARITY_INVERSED
+				 ? -partner_speed : partner_speed;
+	steering.time = cmd == TM_STEER_TIMED ? tm->params.time_sp : 0;
+	steering.counts = cmd == TM_STEER_TO_REL_POS
+			  ? abs(tm->params.position_sp) : 0;
+	steering.stop_action = tm->params.stop_action;
+
+	if ((cmd == TM_STEER_TIMED && !steering.time)
+	    || (cmd == TM_STEER_TO_REL_POS && !steering.counts))
+		return -EINVAL;
+
+	tm_cancel_async(tm);
+	tm_cancel_async(partner);
+	tm->sync_command = -1;
+	partner->sync_command = -1;
+
+	err = tm->ops->run_steering(tm->context, partner->context, &steering);
+	if (err < 0)
+		return err;
+
+	tm->active_params = tm->params;
+	tm->active_params.command = TM_COMMAND_RUN_FOREVER;
+	tm->active_params.speed_sp = steering.speed;
+	partner->active_params = partner->params;
+	partner->active_params.command = TM_COMMAND_RUN_FOREVER;
+	partner->active_params.speed_sp = steering.partner_speed;
+	partner->active_params.stop_action = steering.stop_action;
+
+	tm_watch_state(tm);
+	tm_watch_state(partner);
+
+	return 0;
+}
+
+static ssize_t sync_command_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t size)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	int err = 0;
+
+	mutex_lock(&tm_sync_lock);
+
+	if (!tm->sync_group) {
+		err = -EINVAL;
+	} else if (sysfs_streq(buf, "commit")) {
+		err = tm_sync_commit(tm->sync_group);
+	} else if (sysfs_streq(buf, "discard")) {
+		tm_sync_discard(tm->sync_group);
+	} else {
+		int i;
+
+		err = -EINVAL;
+		for (i = 0; i < NUM_TM_STEER; i++) {
+			if (sysfs_streq(buf, tm_steer_command_names[i].name)) {
+				err = tm_sync_steer(tm, i);
+				break;
+			}
+		}
+	}
+
+	mutex_unlock(&tm_sync_lock);
+
+	return err < 0 ? err : size;
+}
+
+static ssize_t sync_group_show(struct device *dev, struct device_attribute *attr,
+			       char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	return sprintf(buf, "%d\n", tm->sync_group);
+}
+
+static ssize_t sync_group_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t size)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	int err, group;
+
+	err = kstrtoint(buf, 10, &group);
+	if (err < 0)
+		return err;
+
+	if (group < 0 || group > TM_SYNC_MAX_GROUP)
+		return -EINVAL;
+
+	mutex_lock(&tm_sync_lock);
+	WRITE_ONCE(tm->sync_group, group);
+	tm->sync_command = -1;
+	mutex_unlock(&tm_sync_lock);
+
+	return size;
+}
+
+static ssize_t sync_commit_us_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	return sprintf(buf, "%lld\n", ktime_to_us(tm->sync_commit_time));
+}
+
+static ssize_t control_period_us_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	if (!tm->ops->set_control_period)
+		return -EOPNOTSUPP;
+
+	return sprintf(buf, "%d\n", tm->pid_period_us);
+}
+
+static ssize_t control_period_us_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t size)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	int err, us;
+
+	if (!tm->ops->set_control_period)
+		return -EOPNOTSUPP;
+
+	err = kstrtoint(buf, 10, &us);
+	if (err < 0)
+		return err;
+
+	err = tm->ops->set_control_period(tm->context, us);
+	if (err < 0)
+		return err;
+
+	return size;
+}
+
+/*
+ * Telemetry character device
+ *
+ * The telemetry state is reference counted separately from the tacho motor
+ * device because the motor can be unregistered while userspace still has the
+ * character device open. tm->telemetry is RCU protected, so drivers can push
+ * records from atomic context while the motor is being unregistered.
+ */
+
+#define TM_TELEMETRY_SIZE		256	/* records, must be a power of 2 */
+#define TM_TELEMETRY_MINORS		256
+#define TM_TELEMETRY_MIN_POLL_MS	10
+#define TM_TELEMETRY_MAX_PERIOD_MS	1000
+
+struct tm_telemetry {
+	struct kref kref;
+	struct cdev *cdev;
+	int minor;
+	/* NULL after the motor is unregistered */
+	struct tacho_motor_device *tm;
+	DECLARE_KFIFO(fifo, struct tacho_motor_telemetry, TM_TELEMETRY_SIZE);
+	wait_queue_head_t wait;
+	struct mutex read_lock;
+	s64 last;
+	u32 sequence;
+	unsigned overruns;
+	bool open;
+};
+
+static dev_t tm_telemetry_devt;
+/* protects tm_telemetry_idr and the open and tm members of tm_telemetry */
+static DEFINE_MUTEX(tm_telemetry_lock);
+static DEFINE_IDR(tm_telemetry_idr);
+
+static void tm_telemetry_free(struct kref *kref)
+{
+	kfree(container_of(kref, struct tm_telemetry, kref));
+}
+
+static void tm_telemetry_put(struct tacho_motor_device *tm,
+			     struct tm_telemetry *t,
+			     struct tacho_motor_telemetry *rec)
+{
+	if (tm->ramping)
+		rec->state |= BIT(TM_STATE_RAMPING);
+
+	if (tm->polarity == DC_MOTOR_POLARITY_INVERSED) {
+		rec->position *= -1;
+		rec->speed *= -1;
+		rec->position_sp *= -1;
+		rec->speed_sp *= -1;
+		rec->duty_cycle *= -1;
+	}
+
+	rec->sequence = t->sequence++;
+	rec->reserved = 0;
+
+	if (!kfifo_put(&t->fifo, *rec))
+		t->overruns++;
+	else
+		wake_up_interruptible(&t->wait);
+}
+
+/**
+ * tacho_motor_push_telemetry - add a record to the telemetry device
+ *
+ * @tm: The tacho motor device.
+ * @rec: The record. Values are as seen by the driver, i.e. before polarity is
+ *	applied. The sequence field is filled in by this function.
+ *
+ * This is meant to be called by drivers from their control loop each time
+ * that they have a new sample. Records are dropped if there is no reader or if
+ * they are less than telemetry_period apart. This is safe to call from atomic
+ * context, but calls for the same motor must not run concurrently.
+ */
+void tacho_motor_push_telemetry(struct tacho_motor_device *tm,
+				struct tacho_motor_telemetry *rec)
+{
+	struct tm_telemetry *t;
+
+	rcu_read_lock();
+
+	t = rcu_dereference(tm->telemetry);
+	if (!t || !READ_ONCE(t->open))
+		goto out;
+
+	if (tm->telemetry_period && rec->timestamp - t->last <
+				(s64)tm->telemetry_period * NSEC_PER_MSEC)
+		goto out;
+
+	t->last = rec->timestamp;
+	tm_telemetry_put(tm, t, rec);
+out:
+	rcu_read_unlock();
+}
+EXPORT_SYMBOL_GPL(tacho_motor_push_telemetry);
+
+static int tm_fill_telemetry(struct tacho_motor_device *tm,
+			     struct tacho_motor_telemetry *rec)
+{
+	struct tacho_motor_status status;
+	int ret;
+
+	ret = tm_read_status(tm, &status);
+	if (ret < 0)
+		return ret;
+
+	rec->timestamp = ktime_to_ns(ktime_get());
+	rec->position = status.position;
+	rec->speed = status.speed;
+	rec->duty_cycle = status.duty_cycle;
+	rec->state = status.state;
+	rec->position_sp = tm->active_params.position_sp;
+	rec->speed_sp = tm->ramping ? tm->ramp_last_speed
+				    : tm->active_params.speed_sp;
+
+	return 0;
+}
+
+/*
+ * Used for drivers that don't push their own records. This is only as good
+ * as the ops, e.g. each value may be a separate bus transaction.
+ */
+static void tacho_motor_class_telemetry_work(struct work_struct *work)
+{
+	struct tacho_motor_device *tm = container_of(to_delayed_work(work),
+				struct tacho_motor_device, telemetry_work);
+	/* the work is cancelled before tm->telemetry is cleared */
+	struct tm_telemetry *t = rcu_dereference_protected(tm->telemetry, 1);
+	struct tacho_motor_telemetry rec = { };
+
+	if (tm_fill_telemetry(tm, &rec) == 0)
+		tm_telemetry_put(tm, t, &rec);
+
+	if (READ_ONCE(t->open))
+		schedule_delayed_work(&tm->telemetry_work, msecs_to_jiffies(
+			max(tm->telemetry_period, TM_TELEMETRY_MIN_POLL_MS)));
+}
+
+static int tm_telemetry_open(struct inode *inode, struct file *file)
+{
+	struct tm_telemetry *t;
+	int err = 0;
+
+	mutex_lock(&tm_telemetry_lock);
+
+	t = idr_find(&tm_telemetry_idr, iminor(inode));
+	if (!t || !t->tm) {
+		err = -ENODEV;
+		goto out;
+	}
+	if (t->open) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	kfifo_reset_out(&t->fifo);
+	t->last = 0;
+	t->sequence = 0;
+	t->overruns = 0;
+	kref_get(&t->kref);
+	file->private_data = t;
+	/* the driver may start pushing records as soon as this is set */
+	smp_wmb();
+	WRITE_ONCE(t->open, true);
+
+	if (!t->tm->driver_telemetry)
+		schedule_delayed_work(&t->tm->telemetry_work, 0);
+out:
+	mutex_unlock(&tm_telemetry_lock);
+
+	return err ? err : nonseekable_open(inode, file);
+}
+
+static int tm_telemetry_release(struct inode *inode, struct file *file)
+{
+	struct tm_telemetry *t = file->private_data;
+
+	mutex_lock(&tm_telemetry_lock);
+	WRITE_ONCE(t->open, false);
+	if (t->tm)
+		cancel_delayed_work_sync(&t->tm->telemetry_work);
+	mutex_unlock(&tm_telemetry_lock);
+
+	kref_put(&t->kref, tm_telemetry_free);
+
+	return 0;
+}
+
+static ssize_t tm_telemetry_read(struct file *file, char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct tm_telemetry *t = file->private_data;
+	unsigned copied;
+	int err;
+
+	if (count < sizeof(struct tacho_motor_telemetry))
+		return -EINVAL;
+
+	err = mutex_lock_interruptible(&t->read_lock);
+	if (err)
+		return err;
+
+	while (kfifo_is_empty(&t->fifo)) {
+		if (!READ_ONCE(t->tm)) {
+			err = -ENODEV;
+			goto out;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			err = -EAGAIN;
+			goto out;
+		}
+		err = wait_event_interruptible(t->wait,
+			!kfifo_is_empty(&t->fifo) || !READ_ONCE(t->tm));
+		if (err)
+			goto out;
+	}
+
+	/* kfifo_to_user() only copies whole records */
+	err = kfifo_to_user(&t->fifo, buf, count, &copied);
+out:
+	mutex_unlock(&t->read_lock);
+
+	return err ? err : copied;
+}
+
+static unsigned int tm_telemetry_poll(struct file *file, poll_table *wait)
+{
+	struct tm_telemetry *t = file->private_data;
+
+	poll_wait(file, &t->wait, wait);
+
+	if (!kfifo_is_empty(&t->fifo))
+		return POLLIN | POLLRDNORM;
+	if (!READ_ONCE(t->tm))
+		return POLLHUP;
+
+	return 0;
+}
+
+static const struct file_operations tm_telemetry_fops = {
+	.owner		= THIS_MODULE,
+	.open		= tm_telemetry_open,
+	.release	= tm_telemetry_release,
+	.read		= tm_telemetry_read,
+	.poll		= tm_telemetry_poll,
+	.llseek		= no_llseek,
+};
+
+static int tm_telemetry_register(struct tacho_motor_device *tm)
+{
+	struct tm_telemetry *t;
+	int err;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	kref_init(&t->kref);
+	INIT_KFIFO(t->fifo);
+	init_waitqueue_head(&t->wait);
+	mutex_init(&t->read_lock);
+	t->tm = tm;
+
+	mutex_lock(&tm_telemetry_lock);
+	t->minor = idr_alloc(&tm_telemetry_idr, t, 0, TM_TELEMETRY_MINORS,
+			     GFP_KERNEL);
+	mutex_unlock(&tm_telemetry_lock);
+	if (t->minor < 0) {
+		err = t->minor;
+		goto err_free;
+	}
+
+	t->cdev = cdev_alloc();
+	if (!t->cdev) {
+		err = -ENOMEM;
+		goto err_remove_minor;
+	}
+	t->cdev->owner = THIS_MODULE;
+	t->cdev->ops = &tm_telemetry_fops;
+
+	err = cdev_add(t->cdev, MKDEV(MAJOR(tm_telemetry_devt), t->minor), 1);
+	if (err) {
+		kobject_put(&t->cdev->kobj);
+		goto err_remove_minor;
+	}
+
+	INIT_DELAYED_WORK(&tm->telemetry_work,
+			  tacho_motor_class_telemetry_work);
+	tm->telemetry_period = 0;
+	rcu_assign_pointer(tm->telemetry, t);
+	tm->dev.devt = t->cdev->dev;
+
+	return 0;
+
+err_remove_minor:
+	mutex_lock(&tm_telemetry_lock);
+	idr_remove(&tm_telemetry_idr, t->minor);
+	mutex_unlock(&tm_telemetry_lock);
+err_free:
+	kfree(t);
+
+	return err;
+}
+
+/*
+ * Records that the driver pushes after this returns are dropped. Must be
+ * called before the device is unregistered.
+ */
+static void tm_telemetry_unregister(struct tacho_motor_device *tm)
+{
+	struct tm_telemetry *t = rcu_dereference_protected(tm->telemetry, 1);
+
+	cdev_del(t->cdev);
+
+	mutex_lock(&tm_telemetry_lock);
+	idr_remove(&tm_telemetry_idr, t->minor);
+	WRITE_ONCE(t->open, false);
+	WRITE_ONCE(t->tm, NULL);
+	cancel_delayed_work_sync(&tm->telemetry_work);
+	mutex_unlock(&tm_telemetry_lock);
+
+	RCU_INIT_POINTER(tm->telemetry, NULL);
+	/* wait for tacho_motor_push_telemetry() to stop using t */
+	synchronize_rcu();
+	wake_up_interruptible(&t->wait);
+	kref_put(&t->kref, tm_telemetry_free);
+}
+
+static ssize_t telemetry_period_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	return sprintf(buf, "%d\n", tm->telemetry_period);
+}
+
+static ssize_t telemetry_period_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t size)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	int err, ms;
+
+	err = kstrtoint(buf, 10, &ms);
+	if (err < 0)
+		return err;
+
+	if (ms < 0 || ms > TM_TELEMETRY_MAX_PERIOD_MS)
+		return -EINVAL;
+
+	tm->telemetry_period = ms;
+
+	return size;
+}
+
+static ssize_t telemetry_overruns_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	struct tm_telemetry *t;
+	ssize_t ret = -ENODEV;
+
+	rcu_read_lock();
+	t = rcu_dereference(tm->telemetry);
+	if (t)
+		ret = sprintf(buf, "%u\n", t->overruns);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static ssize_t auto_tune_show(struct device *dev, struct device_attribute *attr,
+			      char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	struct tm_auto_tune *tune = &tm->tune;
 
-	if (cmd == TM_COMMAND_RUN_TIMED)
-		schedule_delayed_work(&tm->run_timed_work,
-				      msecs_to_jiffies(new_params.time_sp));
+	if (!tm_supports_auto_tune(tm))
+		return -EOPNOTSUPP;
 
-	return 0;
+	if (tune->status == TM_AUTO_TUNE_FAILED)
+		return sprintf(buf, "status %s\nerror %d\n",
+			       tm_auto_tune_status_names[tune->status],
+			       tune->error);
+
+	if (tune->status != TM_AUTO_TUNE_DONE)
+		return sprintf(buf, "status %s\n",
+			       tm_auto_tune_status_names[tune->status]);
+
+	return sprintf(buf, "status %s\ngain %d\ndeadband %d\n"
+		       "time_constant_us %d\ndead_time_us %d\n"
+		       "speed_Kp %d\nspeed_Ki %d\nspeed_Kf %d\nhold_Kp %d\n",
+		       tm_auto_tune_status_names[tune->status], tune->gain,
+		       tune->deadband, tune->time_constant, tune->dead_time,
+		       tune->speed_Kp, tune->speed_Ki, tune->speed_Kf,
+		       tune->hold_Kp);
 }
 
-static ssize_t command_store(struct device *dev, struct device_attribute *attr,
-			     const char *buf, size_t size)
+static ssize_t status_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
 {
 	struct tacho_motor_device *tm = to_tacho_motor(dev);
-	unsigned supported_commands;
-	int i;
+	struct tacho_motor_status status;
+	int ret, i;
+	size_t size;
 
-	supported_commands = get_supported_commands(tm);
+	ret = tm_read_status(tm, &status);
+	if (ret < 0)
+		return ret;
 
-	for (i = 0; i < NUM_TM_COMMAND; i++) {
-		if (!sysfs_streq(buf, tacho_motor_command_names[i].name))
-			continue;
+	if (tm->ramping)
+		status.state |= BIT(TM_STATE_RAMPING);
 
-		if (supported_commands & BIT(i)) {
-			int err = tm_send_command(tm, i);
+	if (tm->polarity == DC_MOTOR_POLARITY_INVERSED) {
+		status.position *= -1;
+		status.speed *= -1;
+		status.duty_cycle *= -1;
+	}
 
-			return err < 0 ? err : size;
-		}
+	size = sprintf(buf, "%d %d %d", status.position, status.speed,
+		       status.duty_cycle);
+	for (i = 0; i < NUM_TM_STATE; i++) {
+		if (status.state & BIT(i))
+			size += sprintf(buf + size, " %s",
+					tacho_motor_states[i].name);
 	}
+	size += sprintf(buf + size, "\n");
 
-	return -EINVAL;
+	return size;
+}
+
+static ssize_t bin_status_read(struct file *file, struct kobject *kobj,
+			       struct bin_attribute *attr,
+			       char *buf, loff_t off, size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	struct tacho_motor_telemetry rec = { };
+	size_t size = attr->size;
+	int ret;
+
+	if (off >= size || !count)
+		return 0;
+	size -= off;
+	if (count < size)
+		size = count;
+
+	ret = tm_fill_telemetry(tm, &rec);
+	if (ret < 0)
+		return ret;
+
+	if (tm->ramping)
+		rec.state |= BIT(TM_STATE_RAMPING);
+
+	if (tm->polarity == DC_MOTOR_POLARITY_INVERSED) {
+		rec.position *= -1;
+		rec.speed *= -1;
+		rec.position_sp *= -1;
+		rec.speed_sp *= -1;
+		rec.duty_cycle *= -1;
+	}
+
+	memcpy(buf, (u8 *)&rec + off, size);
+
+	return size;
 }
 
 static void tacho_motor_class_run_timed_work(struct work_struct *work)
@@ -787,13 +2503,205 @@ static void tacho_motor_class_run_timed_work(struct work_struct *work)
 
 	tm->active_params.command = TM_COMMAND_STOP;
 
-	if (tm->active_params.ramp_down_sp) {
+	if (tm_params_ramp(&tm->active_params)) {
 		tm->active_params.speed_sp = 0;
 		tacho_motor_class_start_motor_ramp(tm, &tm->active_params);
 	} else
 		tm->ops->stop(tm->context, tm->active_params.stop_action);
 }
 
+static inline struct tm_waypoint *tm_waypoint(struct tacho_motor_device *tm,
+					      unsigned index)
+{
+	return &tm->trajectory[(tm->trajectory_head + index) % TM_TRAJECTORY_SIZE];
+}
+
+/*
+ * Ends the trajectory by running to the position of the last waypoint. Must
+ * be called with trajectory_lock held. Returns the last waypoint.
+ */
+static struct tm_waypoint tm_end_trajectory(struct tacho_motor_device *tm)
+{
+	struct tm_waypoint last = *tm_waypoint(tm, 0);
+
+	if (last.speed)
+		tm->trajectory_underruns++;
+	tm->trajectory_count = 0;
+	tm->trajectory_running = false;
+
+	return last;
+}
+
+static void tacho_motor_class_trajectory_work(struct work_struct *work)
+{
+	struct tacho_motor_device *tm = container_of(to_delayed_work(work),
+				struct tacho_motor_device, trajectory_work);
+	struct tm_waypoint *w0, *w1, last;
+	int now, position, speed, actual;
+	bool passed = false, done = false;
+
+	now = ktime_ms_delta(ktime_get(), tm->trajectory_start);
+
+	mutex_lock(&tm->trajectory_lock);
+
+	/* drop waypoints that are already behind us */
+	while (tm->trajectory_count > 1 && tm_waypoint(tm, 1)->time <= now) {
+		tm->trajectory_head = (tm->trajectory_head + 1)
+							% TM_TRAJECTORY_SIZE;
+		tm->trajectory_count--;
+		passed = true;
+	}
+
+	w0 = tm_waypoint(tm, 0);
+	if (now < w0->time) {
+		/* the first waypoint has not been reached yet */
+		position = w0->position;
+		speed = 0;
+	} else if (tm->trajectory_count > 1) {
+		w1 = tm_waypoint(tm, 1);
+		position = w0->position + div_s64((s64)(w1->position
+			- w0->position) * (now - w0->time), w1->time - w0->time);
+		speed = w0->speed + div_s64((s64)(w1->speed - w0->speed)
+			* (now - w0->time), w1->time - w0->time);
+	} else {
+		last = tm_end_trajectory(tm);
+		done = true;
+	}
+
+	mutex_unlock(&tm->trajectory_lock);
+
+	if (done) {
+		if (tm->ops->run_to_pos) {
+			tm->active_params.command = TM_COMMAND_RUN_TO_ABS_POS;
+			tm->active_params.position_sp = last.position;
+			tm->ops->run_to_pos(tm->context, last.position,
+					    tm->info->max_speed,
+					    tm->active_params.stop_action);
+		} else {
+			tm->active_params.command = TM_COMMAND_STOP;
+			tm->ops->stop(tm->context, tm->active_params.stop_action);
+		}
+		sysfs_notify(&tm->dev.kobj, NULL, "trajectory_sp");
+		return;
+	}
+
+	/*
+	 * The target speed is used as feed-forward and the position error is
+	 * added on top of it so that the motor does not drift away from the
+	 * trajectory over time.
+	 */
+	if (tm->ops->get_position(tm->context, &actual) >= 0)
+		speed += (position - actual) * MSEC_PER_SEC
+						/ TRAJECTORY_CORRECTION_MS;
+	speed = clamp(speed, -tm->info->max_speed, tm->info->max_speed);
+	tm->ops->run_regulated(tm->context, speed);
+
+	if (passed && tm->trajectory_count <= TRAJECTORY_LOW_WATER)
+		sysfs_notify(&tm->dev.kobj, NULL, "trajectory_sp");
+
+	/*
+	 * Setpoints are computed from the actual time since the start, so
+	 * jitter in running the work does not accumulate.
+	 */
+	schedule_delayed_work(&tm->trajectory_work, TRAJECTORY_PERIOD);
+}
+
+static ssize_t trajectory_sp_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	return sprintf(buf, "%u\n", tm->trajectory_count);
+}
+
+/*
+ * Parses waypoints from buf. If append is false, the waypoints are only
+ * checked. Must be called with trajectory_lock held. Returns the number of
+ * waypoints or a negative error code.
+ */
+static int tm_parse_trajectory(struct tacho_motor_device *tm, const char *buf,
+			       bool append)
+{
+	struct tm_waypoint w;
+	unsigned count = tm->trajectory_count;
+	int last_time = -1;
+	int n, num = 0;
+
+	if (count)
+		last_time = tm_waypoint(tm, count - 1)->time;
+
+	while (sscanf(buf, "%d %d %d%n", &w.time, &w.position, &w.speed,
+		      &n) == 3) {
+		buf = skip_spaces(buf + n);
+
+		if (w.time <= last_time)
+			return -EINVAL;
+		if (abs(w.speed) > tm->info->max_speed)
+			return -EINVAL;
+		if (count >= TM_TRAJECTORY_SIZE)
+			return -ENOSPC;
+
+		if (tm->polarity == DC_MOTOR_POLARITY_INVERSED) {
+			w.position *= -1;
+			w.speed *= -1;
+		}
+
+		if (append)
+			*tm_waypoint(tm, count) = w;
+
+		last_time = w.time;
+		count++;
+		num++;
+	}
+
+	if (*buf || !num)
+		return -EINVAL;
+
+	if (append)
+		tm->trajectory_count = count;
+
+	return num;
+}
+
+static ssize_t trajectory_sp_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t size)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	int err;
+
+	if (!(BIT(TM_COMMAND_RUN_TRAJECTORY) & get_supported_commands(tm)))
+		return -EOPNOTSUPP;
+
+	mutex_lock(&tm->trajectory_lock);
+
+	if (sysfs_streq(buf, "clear")) {
+		if (tm->trajectory_running) {
+			err = -EBUSY;
+		} else {
+			tm->trajectory_count = 0;
+			err = 0;
+		}
+	} else {
+		err = tm_parse_trajectory(tm, buf, false);
+		if (err >= 0)
+			err = tm_parse_trajectory(tm, buf, true);
+	}
+
+	mutex_unlock(&tm->trajectory_lock);
+
+	return err < 0 ? err : size;
+}
+
+static ssize_t trajectory_underruns_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	return sprintf(buf, "%u\n", tm->trajectory_underruns);
+}
+
 static ssize_t stop_actions_show(struct device *dev,
 				  struct device_attribute *attr, char *buf)
 {
@@ -937,6 +2845,114 @@ static ssize_t ramp_down_sp_store(struct device *dev,
 	return size;
 }
 
+static ssize_t ramp_period_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	if (!SUPPORTS_RAMPING(tm))
+		return -EOPNOTSUPP;
+
+	return sprintf(buf, "%d\n", motor_ramp_get_period(&tm->ramp));
+}
+
+static ssize_t ramp_period_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t size)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	int err, ms;
+
+	if (!SUPPORTS_RAMPING(tm))
+		return -EOPNOTSUPP;
+
+	err = kstrtoint(buf, 10, &ms);
+	if (err < 0)
+		return err;
+
+	err = motor_ramp_set_period(&tm->ramp, ms);
+	if (err < 0)
+		return err;
+
+	return size;
+}
+
+static ssize_t ramp_timing_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	if (!SUPPORTS_RAMPING(tm))
+		return -EOPNOTSUPP;
+
+	return motor_ramp_show_timing(&tm->ramp, buf);
+}
+
+static ssize_t ramp_profile_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	if (!SUPPORTS_RAMPING(tm))
+		return -EOPNOTSUPP;
+
+	return sprintf(buf, "%s\n",
+		       tm_ramp_profile_names[tm->params.ramp_profile].name);
+}
+
+static ssize_t ramp_profile_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t size)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	int i;
+
+	if (!SUPPORTS_RAMPING(tm))
+		return -EOPNOTSUPP;
+
+	for (i = 0; i < NUM_TM_RAMP_PROFILE; i++) {
+		if (sysfs_streq(buf, tm_ramp_profile_names[i].name)) {
+			tm->params.ramp_profile = i;
+			return size;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static ssize_t ramp_smoothing_sp_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	if (!SUPPORTS_RAMPING(tm))
+		return -EOPNOTSUPP;
+
+	return sprintf(buf, "%d\n", tm->params.ramp_smoothing_sp);
+}
+
+static ssize_t ramp_smoothing_sp_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t size)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	int err, ms;
+
+	if (!SUPPORTS_RAMPING(tm))
+		return -EOPNOTSUPP;
+
+	err = kstrtoint(buf, 10, &ms);
+	if (err < 0)
+		return err;
+
+	if (ms < 0 || ms > 60000)
+		return -EINVAL;
+
+	tm->params.ramp_smoothing_sp = ms;
+
+	return size;
+}
+
 static ssize_t duty_cycle_sp_show(struct device *dev,
 				  struct device_attribute *attr, char *buf)
 {
@@ -1042,6 +3058,39 @@ static ssize_t time_sp_store(struct device *dev, struct device_attribute *attr,
 	return size;
 }
 
+static ssize_t turn_ratio_sp_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+
+	if (!tm->ops->run_steering)
+		return -EOPNOTSUPP;
+
+	return sprintf(buf, "%d\n", tm->params.turn_ratio_sp);
+}
+
+static ssize_t turn_ratio_sp_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t size)
+{
+	struct tacho_motor_device *tm = to_tacho_motor(dev);
+	int err, turn;
+
+	if (!tm->ops->run_steering)
+		return -EOPNOTSUPP;
+
+	err = kstrtoint(buf, 10, &turn);
+	if (err < 0)
+		return err;
+
+	if (turn < -200 || turn > 200)
+		return -EINVAL;
+
+	tm->params.turn_ratio_sp = turn;
+
+	return size;
+}
+
 static ssize_t position_sp_show(struct device *dev,
 				struct device_attribute *attr, char *buf)
 {
@@ -1082,6 +3131,9 @@ static DEVICE_ATTR_RO(driver_name);
 static DEVICE_ATTR_RO(address);
 static DEVICE_ATTR_RW(position);
 static DEVICE_ATTR_RO(state);
+static DEVICE_ATTR_RO(state_timestamp);
+static DEVICE_ATTR_RO(status);
+static DEVICE_ATTR_RO(auto_tune);
 static DEVICE_ATTR_RO(count_per_rot);
 static DEVICE_ATTR_RO(count_per_m);
 static DEVICE_ATTR_RO(full_travel_count);
@@ -1091,7 +3143,10 @@ static DEVICE_ATTR_RO(max_speed);
 static DEVICE_ATTR_RW(duty_cycle_sp);
 static DEVICE_ATTR_RW(speed_sp);
 static DEVICE_ATTR_RW(time_sp);
+static DEVICE_ATTR_RW(turn_ratio_sp);
 static DEVICE_ATTR_RW(position_sp);
+static DEVICE_ATTR_RW(trajectory_sp);
+static DEVICE_ATTR_RO(trajectory_underruns);
 static DEVICE_ATTR_RO(commands);
 static DEVICE_ATTR_WO(command);
 static DEVICE_ATTR_RO(stop_actions);
@@ -1099,19 +3154,35 @@ static DEVICE_ATTR_RW(stop_action);
 static DEVICE_ATTR_RW(polarity);
 static DEVICE_ATTR_RW(ramp_up_sp);
 static DEVICE_ATTR_RW(ramp_down_sp);
+static DEVICE_ATTR_RW(ramp_period);
+static DEVICE_ATTR_RO(ramp_timing);
+static DEVICE_ATTR_RW(ramp_profile);
+static DEVICE_ATTR_RW(ramp_smoothing_sp);
+static DEVICE_ATTR_RW(control_period_us);
+static DEVICE_ATTR_WO(sync_command);
+static DEVICE_ATTR_RW(sync_group);
+static DEVICE_ATTR_RO(sync_commit_us);
+static DEVICE_ATTR_RW(telemetry_period);
+static DEVICE_ATTR_RO(telemetry_overruns);
 
 static struct attribute *tacho_motor_class_attrs[] = {
 	&dev_attr_driver_name.attr,
 	&dev_attr_address.attr,
 	&dev_attr_position.attr,
 	&dev_attr_state.attr,
+	&dev_attr_state_timestamp.attr,
+	&dev_attr_status.attr,
+	&dev_attr_auto_tune.attr,
 	&dev_attr_duty_cycle.attr,
 	&dev_attr_speed.attr,
 	&dev_attr_duty_cycle_sp.attr,
 	&dev_attr_speed_sp.attr,
 	&dev_attr_max_speed.attr,
 	&dev_attr_time_sp.attr,
+	&dev_attr_turn_ratio_sp.attr,
 	&dev_attr_position_sp.attr,
+	&dev_attr_trajectory_sp.attr,
+	&dev_attr_trajectory_underruns.attr,
 	&dev_attr_commands.attr,
 	&dev_attr_command.attr,
 	&dev_attr_stop_actions.attr,
@@ -1119,11 +3190,29 @@ static struct attribute *tacho_motor_class_attrs[] = {
 	&dev_attr_polarity.attr,
 	&dev_attr_ramp_up_sp.attr,
 	&dev_attr_ramp_down_sp.attr,
+	&dev_attr_ramp_period.attr,
+	&dev_attr_ramp_timing.attr,
+	&dev_attr_ramp_profile.attr,
+	&dev_attr_ramp_smoothing_sp.attr,
+	&dev_attr_control_period_us.attr,
+	&dev_attr_sync_command.attr,
+	&dev_attr_sync_group.attr,
+	&dev_attr_sync_commit_us.attr,
+	&dev_attr_telemetry_period.attr,
+	&dev_attr_telemetry_overruns.attr,
+	NULL
+};
+
+static BIN_ATTR_RO(bin_status, sizeof(struct tacho_motor_telemetry));
+
+static struct bin_attribute *tacho_motor_class_bin_attrs[] = {
+	&bin_attr_bin_status,
 	NULL
 };
 
 static const struct attribute_group tacho_motor_class_group = {
-	.attrs = tacho_motor_class_attrs,
+	.attrs		= tacho_motor_class_attrs,
+	.bin_attrs	= tacho_motor_class_bin_attrs,
 };
 
 /* Note - this group of attributes is only created for rotating motors */
@@ -1196,19 +3285,29 @@ static ssize_t name##_store(struct device *dev,			\
 		__ATTR(k, S_IWUSR | S_IRUGO, pid##_##k##_show,	\
 					     pid##_##k##_store)
 
-#define PID_ATTR_GROUP(pid)					\
+#define PID_ATTR_GROUP(pid, extra_attrs...)			\
 PID_ATTR_FUNCS(pid##_Kp)					\
 PID_ATTR_FUNCS(pid##_Ki)					\
 PID_ATTR_FUNCS(pid##_Kd)					\
+PID_ATTR_FUNCS(pid##_Tf)					\
+PID_ATTR_FUNCS(pid##_slew)					\
+PID_ATTR_FUNCS(pid##_scale)					\
 								\
 PID_ATTR(pid, Kp);						\
 PID_ATTR(pid, Ki);						\
 PID_ATTR(pid, Kd);						\
+PID_ATTR(pid, Tf);						\
+PID_ATTR(pid, slew);						\
+PID_ATTR(pid, scale);						\
 								\
 static struct attribute *tacho_motor_##pid##_pid_attrs[] = {	\
 	&dev_attr_##pid##_Kp.attr,				\
 	&dev_attr_##pid##_Ki.attr,				\
 	&dev_attr_##pid##_Kd.attr,				\
+	&dev_attr_##pid##_Tf.attr,				\
+	&dev_attr_##pid##_slew.attr,				\
+	&dev_attr_##pid##_scale.attr,				\
+	extra_attrs						\
 	NULL							\
 };								\
 								\
@@ -1218,7 +3317,14 @@ static const struct attribute_group				\
 		.attrs = tacho_motor_##pid##_pid_attrs,		\
 }
 
-PID_ATTR_GROUP(speed);
+/*
+ * Kf multiplies the setpoint, which only makes sense for a speed setpoint. For
+ * the hold PID it would just add an offset that depends on the position.
+ */
+PID_ATTR_FUNCS(speed_Kf)
+static PID_ATTR(speed, Kf);
+
+PID_ATTR_GROUP(speed, &dev_attr_speed_Kf.attr,);
 PID_ATTR_GROUP(hold);
 
 static const struct attribute_group *tacho_motor_rotation_groups[] = {
@@ -1244,22 +3350,27 @@ static void tacho_motor_release(struct device *dev)
 void tacho_motor_notify_position_ramp_down(struct tacho_motor_device *tm)
 {
 	cancel_delayed_work_sync(&tm->run_timed_work);
-	cancel_delayed_work_sync(&tm->ramp_work);
+	motor_ramp_cancel(&tm->ramp);
 
 	tm->active_params.speed_sp = 0;
 	tm->ramp_last_speed = 0;
+	tm->ramp_stopping = false;
 }
 EXPORT_SYMBOL_GPL(tacho_motor_notify_position_ramp_down);
 
+/**
+ * tacho_motor_notify_state_change - tell the class that the state may have
+ *	changed
+ *
+ * @tm: The tacho motor device.
+ *
+ * Userspace that is waiting with poll() on the state attribute is woken up if
+ * the state is different from the last call. Must be called in process
+ * context.
+ */
 void tacho_motor_notify_state_change(struct tacho_motor_device *tm)
 {
-	int newstate;
-
-	newstate = tacho_motor_get_state(tm);
-	if (newstate != tm->oldstate) {
-		sysfs_notify(&tm->dev.kobj, NULL, "state");
-		tm->oldstate = newstate;
-	}
+	tm_update_state(tm);
 }
 EXPORT_SYMBOL_GPL(tacho_motor_notify_state_change);
 
@@ -1293,13 +3404,38 @@ int register_tacho_motor(struct tacho_motor_device *tm, struct device *parent)
 
 	tacho_motor_class_reset(tm);
 
-	INIT_DELAYED_WORK(&tm->ramp_work, tacho_motor_class_ramp_work);
+	motor_ramp_init(&tm->ramp, tacho_motor_class_ramp_step);
 	INIT_DELAYED_WORK(&tm->run_timed_work, tacho_motor_class_run_timed_work);
+	INIT_DELAYED_WORK(&tm->trajectory_work,
+			  tacho_motor_class_trajectory_work);
+	mutex_init(&tm->trajectory_lock);
+	INIT_DELAYED_WORK(&tm->state_work, tacho_motor_class_state_work);
+	motor_ramp_init(&tm->tune.timer, tacho_motor_class_tune_step);
+	motor_ramp_set_period(&tm->tune.timer, TM_TUNE_PERIOD_MS);
+	tm->tune.status = TM_AUTO_TUNE_NONE;
+	mutex_init(&tm->state_lock);
+	tm->state_time = ktime_get();
+	tm->trajectory_count = 0;
+	tm->trajectory_running = false;
+
+	tm->sync_group = 0;
+	tm->sync_command = -1;
+	tm->sync_commit_time = ktime_set(0, 0);
+
+	err = tm_telemetry_register(tm);
+	if (err)
+		return err;
 
 	err = device_register(&tm->dev);
 
-	if (err)
+	if (err) {
+		tm_telemetry_unregister(tm);
 		return err;
+	}
+
+	mutex_lock(&tm_sync_lock);
+	list_add_tail(&tm->sync_entry, &tm_sync_list);
+	mutex_unlock(&tm_sync_lock);
 
 	dev_info(&tm->dev, "Registered '%s' on '%s'.\n", tm->driver_name,
 		 tm->address);
@@ -1312,8 +3448,16 @@ void unregister_tacho_motor(struct tacho_motor_device *tm)
 {
 	dev_info(&tm->dev, "Unregistered '%s' on '%s'.\n", tm->driver_name,
 		 tm->address);
+	mutex_lock(&tm_sync_lock);
+	list_del(&tm->sync_entry);
+	mutex_unlock(&tm_sync_lock);
 	cancel_delayed_work_sync(&tm->run_timed_work);
-	cancel_delayed_work_sync(&tm->ramp_work);
+	motor_ramp_cancel(&tm->ramp);
+	cancel_delayed_work_sync(&tm->trajectory_work);
+	cancel_delayed_work_sync(&tm->state_work);
+	motor_ramp_cancel(&tm->tune.timer);
+	tm_tune_stop(tm, -ENODEV);
+	tm_telemetry_unregister(tm);
 	device_unregister(&tm->dev);
 }
 EXPORT_SYMBOL_GPL(unregister_tacho_motor);
@@ -1356,9 +3500,17 @@ static int tacho_motor_class_init(void)
 {
 	int err;
 
+	err = alloc_chrdev_region(&tm_telemetry_devt, 0, TM_TELEMETRY_MINORS,
+				  "tacho-motor");
+	if (err) {
+		pr_err("unable to allocate tacho-motor device numbers\n");
+		return err;
+	}
+
 	err = class_register(&tacho_motor_class);
 	if (err) {
 		pr_err("unable to register tacho_motor_class\n");
+		unregister_chrdev_region(tm_telemetry_devt, TM_TELEMETRY_MINORS);
 		return err;
 	}
 
@@ -1369,6 +3521,8 @@ module_init(tacho_motor_class_init);
 static void tacho_motor_class_exit(void)
 {
 	class_unregister(&tacho_motor_class);
+	unregister_chrdev_region(tm_telemetry_devt, TM_TELEMETRY_MINORS);
+	idr_destroy(&tm_telemetry_idr);
 }
 module_exit(tacho_motor_class_exit);
 
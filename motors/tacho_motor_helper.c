@@ -14,6 +14,8 @@
  */
 
 #include <linux/export.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
 
 #include <dc_motor_class.h>
 #include <tacho_motor_helper.h>
@@ -73,12 +75,276 @@ void tm_speed_init(struct tm_speed *spd, int pos, ktime_t t, int count)
 }
 EXPORT_SYMBOL_GPL(tm_speed_init);
 
+/*
+ * Alpha-beta speed helper:
+ *
+ * Tracks position and speed with an alpha-beta filter. Each update predicts
+ * the position from the last estimate and corrects both estimates by a
+ * fraction of the prediction error. This uses a few words of memory instead
+ * of a buffer and is O(1) per update. Since every sample contributes, it is
+ * less noisy than tm_speed for windows of about 10 samples or more. With
+ * shorter windows, the two are about the same (tools/testing/tm_speed_test.c
+ * compares them).
+ *
+ * The gains are chosen so that the filter behaves like a least squares line
+ * fit over the last @count samples: alpha = 2(2N - 1) / (N(N + 1)) and
+ * beta = 6 / (N(N + 1)).
+ */
+
+/**
+ * tm_speed_ab_update - update the speed based on new position and time
+ *
+ * @ab: Pointer to the speed helper.
+ * @pos: The new position.
+ * @t: The timestamp of the new position.
+ */
+void tm_speed_ab_update(struct tm_speed_ab *ab, int pos, ktime_t t)
+{
+	s64 dt = ktime_us_delta(t, ab->time);
+	s64 predicted, residual;
+
+	if (dt <= 0)
+		return;
+
+	ab->time = t;
+
+	predicted = ab->pos + div_s64(ab->speed * dt, USEC_PER_SEC);
+	residual = ((s64)pos << TM_SPEED_AB_SHIFT) - predicted;
+
+	ab->pos = predicted + ((residual * ab->alpha) >> TM_SPEED_AB_SHIFT);
+	ab->speed += div_s64(((residual * ab->beta) >> TM_SPEED_AB_SHIFT)
+			     * USEC_PER_SEC, dt);
+}
+EXPORT_SYMBOL_GPL(tm_speed_ab_update);
+
+/**
+ * tm_speed_ab_init - initialize the alpha-beta speed helper
+ *
+ * @ab: Pointer to the speed helper.
+ * @pos: The current position.
+ * @t: The timestamp of the current position.
+ * @count: The length of the equivalent averaging window in terms of # calls
+ *	to tm_speed_ab_update. Larger is smoother but slower to respond.
+ */
+void tm_speed_ab_init(struct tm_speed_ab *ab, int pos, ktime_t t, int count)
+{
+	ab->pos = (s64)pos << TM_SPEED_AB_SHIFT;
+	ab->speed = 0;
+	ab->time = t;
+	tm_speed_ab_set_count(ab, count);
+}
+EXPORT_SYMBOL_GPL(tm_speed_ab_init);
+
+/**
+ * tm_speed_ab_set_count - change the window of the alpha-beta speed helper
+ *
+ * @ab: Pointer to the speed helper.
+ * @count: Same as for tm_speed_ab_init().
+ *
+ * The current estimate is kept, so this can be called while the motor is
+ * running, e.g. when the rate of calls to tm_speed_ab_update changes.
+ */
+void tm_speed_ab_set_count(struct tm_speed_ab *ab, int count)
+{
+	int n = max(count, 2);
+
+	ab->alpha = (2 * (2 * n - 1) << TM_SPEED_AB_SHIFT) / (n * (n + 1));
+	ab->beta = (6 << TM_SPEED_AB_SHIFT) / (n * (n + 1));
+}
+EXPORT_SYMBOL_GPL(tm_speed_ab_set_count);
+
+/*
+ * Position profile helper:
+ *
+ * A profile is a piecewise linear speed (a trapezoid) that is integrated to
+ * get the reference position. For an s-curve, the position is the moving
+ * average of the trapezoid over prof->smooth. This limits the jerk without
+ * changing the distance and, since the trapezoid never moves backwards, the
+ * average never overshoots the target either. Before the start, the motor is
+ * assumed to keep moving at the start speed. The average lags the trapezoid
+ * by the start speed times half of prof->smooth, so the planner starts the
+ * trapezoid that much ahead to make the average start at the current position.
+ *
+ * Positions are kept in millionths of a count so that counts per second times
+ * microseconds can be used without rounding.
+ */
+
+static const struct tm_profile_knot *
+tm_profile_knot(const struct tm_profile *prof, s64 t)
+{
+	const struct tm_profile_knot *k = prof->knots;
+
+	while (k < &prof->knots[prof->num_knots - 1] && k[1].time <= t)
+		k++;
+
+	return k;
+}
+
+static bool tm_profile_is_last(const struct tm_profile *prof,
+			       const struct tm_profile_knot *k)
+{
+	return k == &prof->knots[prof->num_knots - 1];
+}
+
+/* Returns the end of the linear piece of the profile that contains t. */
+static s64 tm_profile_next(const struct tm_profile *prof, s64 t)
+{
+	const struct tm_profile_knot *k;
+
+	if (t < 0)
+		return 0;
+
+	k = tm_profile_knot(prof, t);
+	if (tm_profile_is_last(prof, k))
+		return S64_MAX;
+
+	return k[1].time;
+}
+
+/* Returns the position of the trapezoid at time t. */
+static s64 tm_profile_pos(const struct tm_profile *prof, s64 t)
+{
+	const struct tm_profile_knot *k;
+	s64 tau, q;
+	s32 h, r;
+	int dv;
+
+	if (t < 0)
+		return prof->knots[0].pos + prof->start_speed * t;
+
+	k = tm_profile_knot(prof, t);
+	tau = t - k->time;
+	if (tm_profile_is_last(prof, k))
+		return k->pos;
+
+	dv = k[1].speed - k->speed;
+	if (!dv)
+		return k->pos + k->speed * tau;
+
+	/* speed ramps are at most a minute, so h fits in 32 bits */
+	h = k[1].time - k->time;
+	q = div_s64_rem(dv * tau, h, &r);
+
+	return k->pos + k->speed * tau
+		+ div_s64(q * tau + div_s64((s64)r * tau, h), 2);
+}
+
+/* Returns the speed of the trapezoid at time t. */
+static int tm_profile_speed(const struct tm_profile *prof, s64 t)
+{
+	const struct tm_profile_knot *k;
+	int dv;
+
+	if (t < 0)
+		return prof->start_speed;
+
+	k = tm_profile_knot(prof, t);
+	if (tm_profile_is_last(prof, k))
+		return 0;
+
+	dv = k[1].speed - k->speed;
+	if (!dv)
+		return k->speed;
+
+	return k->speed + div_s64((s64)dv * (t - k->time), k[1].time - k->time);
+}
+
+/*
+ * Returns the integral of the position of the trapezoid minus base from u to
+ * end. Both must be in the same linear piece and end - u must not be more
+ * than TM_PROFILE_MAX_SMOOTH_MS.
+ */
+static s64 tm_profile_area(const struct tm_profile *prof, s64 u, s64 end,
+			   s64 base)
+{
+	const struct tm_profile_knot *k;
+	s64 w = end - u;
+	s64 pos = tm_profile_pos(prof, u) - base;
+	s64 q, area;
+	s32 h, r;
+	int dv;
+
+	if (u < 0)
+		return pos * w + div_s64(prof->start_speed * w * w, 2);
+
+	k = tm_profile_knot(prof, u);
+	if (tm_profile_is_last(prof, k))
+		return pos * w;
+
+	dv = k[1].speed - k->speed;
+	if (!dv)
+		return pos * w + div_s64(k->speed * w * w, 2);
+
+	/* the speed at u is k->speed + (q + r / h) */
+	h = k[1].time - k->time;
+	q = div_s64_rem((s64)dv * (u - k->time), h, &r);
+
+	area = pos * w;
+	area += div_s64((k->speed + q) * w * w + div_s64((s64)r * w, h) * w, 2);
+	area += div_s64(div_s64((s64)dv * w * w, h) * w, 6);
+
+	return area;
+}
+
+/**
+ * tm_profile_eval - get the reference position and speed of a profile
+ *
+ * @prof: The profile.
+ * @now: The current time.
+ * @position: Returns the reference position in tacho counts.
+ * @speed: Returns the reference speed in tacho counts per second.
+ *
+ * Returns true if the end of the profile has been reached. This is cheap
+ * enough to call from the control loop of a driver, including in interrupt
+ * context.
+ */
+bool tm_profile_eval(const struct tm_profile *prof, ktime_t now,
+		     int *position, int *speed)
+{
+	const struct tm_profile_knot *last = &prof->knots[prof->num_knots - 1];
+	s64 t = ktime_us_delta(now, prof->start_time);
+	s64 pos, base, area, u, end;
+
+	if (t >= last->time + prof->smooth) {
+		*position = prof->target;
+		*speed = 0;
+		return true;
+	}
+
+	if (prof->smooth) {
+		base = tm_profile_pos(prof, t - prof->smooth);
+		*speed = div_s64(tm_profile_pos(prof, t) - base, prof->smooth);
+
+		area = 0;
+		for (u = t - prof->smooth; u < t; u = end) {
+			end = min(tm_profile_next(prof, u), t);
+			area += tm_profile_area(prof, u, end, base);
+		}
+		pos = base + div_s64(area, prof->smooth);
+	} else {
+		pos = tm_profile_pos(prof, t);
+		*speed = tm_profile_speed(prof, t);
+	}
+
+	if (pos < 0)
+		pos -= USEC_PER_SEC / 2;
+	else
+		pos += USEC_PER_SEC / 2;
+	*position = prof->start + div_s64(pos, USEC_PER_SEC);
+
+	return false;
+}
+EXPORT_SYMBOL_GPL(tm_profile_eval);
+
 
 /*
  * PID helper:
  *
  * This is a generic PID controller for use with motor controllers that do not
  * have speed or position regulation implemented in hardware.
+ *
+ * The gains are fixed point numbers where scale is 1.0. With the default
+ * values of Kf, Tf and slew (all 0), this is a plain discrete PID.
  */
 
 /**
@@ -86,10 +352,14 @@ EXPORT_SYMBOL_GPL(tm_speed_init);
  *
  * @pid: Pointer to the private data.
  * @value: The current input (process) value.
+ *
+ * Returns the new output (duty cycle) in the range -100 to 100.
  */
 int tm_pid_update(struct tm_pid *pid, int value)
 {
-	int duty_cycle, error, delta_error;
+	int duty_cycle, error, delta_error, d_term;
+	int scale = pid->scale ?: TM_PID_DEFAULT_SCALE;
+	s64 sum;
 
 	/* Discrete PID calculations */
 
@@ -98,8 +368,21 @@ int tm_pid_update(struct tm_pid *pid, int value)
 	delta_error = pid->prev_error - error;
 	pid->prev_error = error;
 
-	duty_cycle = ((error * pid->Kp) + (pid->integral * pid->Ki)
-		      + (delta_error * pid->Kd)) / 10000;
+	/* first order low-pass filter on the derivative to reject tacho noise */
+	if (pid->Tf) {
+		pid->d_filtered += (delta_error * 256 - pid->d_filtered)
+				   / (min(pid->Tf, TM_PID_MAX_TF) + 1);
+		d_term = pid->d_filtered / 256;
+	} else {
+		pid->d_filtered = delta_error * 256;
+		d_term = delta_error;
+	}
+
+	sum = (s64)error * pid->Kp + (s64)pid->integral * pid->Ki
+	      + (s64)d_term * pid->Kd + (s64)pid->setpoint * pid->Kf;
+	duty_cycle = clamp_t(s64, div_s64(sum, scale),
+			     -2 * DC_MOTOR_MAX_DUTY_CYCLE,
+			     2 * DC_MOTOR_MAX_DUTY_CYCLE);
 
 	/*
 	 * Subtract the value error to avoid integral windup if the resulting
@@ -112,10 +395,49 @@ int tm_pid_update(struct tm_pid *pid, int value)
 	duty_cycle = min(duty_cycle, DC_MOTOR_MAX_DUTY_CYCLE);
 	duty_cycle = max(duty_cycle, -DC_MOTOR_MAX_DUTY_CYCLE);
 
+	if (pid->slew)
+		duty_cycle = clamp(duty_cycle, pid->output - pid->slew,
+				   pid->output + pid->slew);
+	pid->output = duty_cycle;
+
 	return duty_cycle;
 }
 EXPORT_SYMBOL_GPL(tm_pid_update);
 
+/**
+ * tm_pid_transfer - take over the output of another controller
+ *
+ * @pid: Pointer to the private data. The setpoint must already be set.
+ * @value: The current input (process) value.
+ * @output: The output that was last sent to the motor.
+ *
+ * This is used for bumpless transfer when switching between controllers, e.g.
+ * from speed regulation to holding position. The integral is preset so that
+ * the next update returns about the same output instead of jumping.
+ */
+void tm_pid_transfer(struct tm_pid *pid, int value, int output)
+{
+	int scale = pid->scale ?: TM_PID_DEFAULT_SCALE;
+	int error = pid->setpoint - value;
+	s64 rest;
+
+	pid->prev_error = error;
+	pid->d_filtered = 0;
+	pid->output = output;
+	pid->overloaded = false;
+	pid->integral = 0;
+
+	if (!pid->Ki)
+		return;
+
+	rest = (s64)output * scale - (s64)error * pid->Kp
+	       - (s64)pid->setpoint * pid->Kf;
+	/* the integral term is added before it is used, so remove one error */
+	pid->integral = clamp_t(s64, div_s64(rest, pid->Ki),
+				INT_MIN / 2, INT_MAX / 2) - error;
+}
+EXPORT_SYMBOL_GPL(tm_pid_transfer);
+
 /**
  * tm_pid_reinit - reset everything except for the PID constants
  *
@@ -126,6 +448,8 @@ void tm_pid_reinit(struct tm_pid *pid)
 	pid->setpoint = 0;
 	pid->integral = 0;
 	pid->prev_error = 0;
+	pid->d_filtered = 0;
+	pid->output = 0;
 	pid->overloaded = false;
 }
 EXPORT_SYMBOL_GPL(tm_pid_reinit);
@@ -137,6 +461,9 @@ EXPORT_SYMBOL_GPL(tm_pid_reinit);
  * @Kp: PID proportional gain constant.
  * @Ki: PID proportional gain constant.
  * @Kd: PID proportional gain constant.
+ *
+ * The feed-forward gain, derivative filter and slew limit are disabled and the
+ * scale is set to TM_PID_DEFAULT_SCALE.
  */
 void tm_pid_init(struct tm_pid *pid, int Kp, int Ki, int Kd)
 {
@@ -144,5 +471,9 @@ void tm_pid_init(struct tm_pid *pid, int Kp, int Ki, int Kd)
 	pid->Kp = Kp;
 	pid->Ki = Ki;
 	pid->Kd = Kd;
+	pid->Kf = 0;
+	pid->Tf = 0;
+	pid->slew = 0;
+	pid->scale = TM_PID_DEFAULT_SCALE;
 }
 EXPORT_SYMBOL_GPL(tm_pid_init);
@@ -64,6 +64,8 @@ static int ev3_uart_sensor_set_mode(void *context, u8 mode)
 	return 0;
 }
 
+LEGO_PORT_POLL_MS_FUNCS(ev3_uart_sensor, ev3_uart_sensor_data)
+
 static int ev3_uart_sensor_probe(struct lego_device *ldev)
 {
 	struct ev3_uart_sensor_data *data;
@@ -92,6 +94,8 @@ static int ev3_uart_sensor_probe(struct lego_device *ldev)
 	data->sensor.mode_info	= data->info.mode_info;
 	data->sensor.set_mode	= ev3_uart_sensor_set_mode;
 	data->sensor.context	= data;
+	data->sensor.get_poll_ms = ev3_uart_sensor_get_poll_ms;
+	data->sensor.set_poll_ms = ev3_uart_sensor_set_poll_ms;
 
 	err = register_lego_sensor(&data->sensor, &ldev->dev);
 	if (err)
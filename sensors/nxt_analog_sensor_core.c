@@ -70,6 +70,8 @@ static int nxt_analog_sensor_set_mode(void *context, u8 mode)
 	return 0;
 }
 
+LEGO_PORT_POLL_MS_FUNCS(nxt_analog_sensor, nxt_analog_sensor_data)
+
 static int nxt_analog_sensor_probe(struct lego_device *ldev)
 {
 	struct nxt_analog_sensor_data *data;
@@ -94,6 +96,8 @@ static int nxt_analog_sensor_probe(struct lego_device *ldev)
 	data->sensor.mode_info	= data->info.mode_info;
 	data->sensor.set_mode	= nxt_analog_sensor_set_mode;
 	data->sensor.context	= data;
+	data->sensor.get_poll_ms = nxt_analog_sensor_get_poll_ms;
+	data->sensor.set_poll_ms = nxt_analog_sensor_set_poll_ms;
 
 	err = register_lego_sensor(&data->sensor, &ldev->dev);
 	if (err)
@@ -0,0 +1,194 @@
+/*
+ * Host test and benchmark for the BrickPi protocol bit packing
+ *
+ * Copyright (C) 2026 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * brickpi_pack_bits() and brickpi_unpack_bits() are checked against the
+ * bit-at-a-time routines they replaced, on random sequences of fields
+ * written over random buffer contents. Then both are timed on the field
+ * layout of a typical BRICKPI_MESSAGE_UPDATE_VALUES exchange.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../brickpi/brickpi_bits.h"
+
+#define BUF_SIZE	128
+#define NUM_CASES	200000
+#define BENCH_LOOPS	200000
+
+/* The old routines, with set_bit() and friends as they behave on the Pi */
+
+static void old_append(u8 *buf, unsigned *tail, u8 size, long value)
+{
+	unsigned end = *tail + size;
+
+	while (*tail < end) {
+		if (value & 0x01)
+			buf[*tail / 8] |= 1 << (*tail % 8);
+		else
+			buf[*tail / 8] &= ~(1 << (*tail % 8));
+		value >>= 1;
+		(*tail)++;
+	}
+}
+
+static long old_read(const u8 *buf, unsigned *head, u8 size)
+{
+	long result = 0;
+	int i = 0;
+
+	while (i < size) {
+		if (buf[*head / 8] & (1 << (*head % 8)))
+			result |= (int)(1U << i);
+		(*head)++;
+		i++;
+	}
+
+	return result;
+}
+
+static u64 rng_state = 0x2545f4914f6cdd1dULL;
+
+static u64 rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+
+	return rng_state;
+}
+
+static int check_random(void)
+{
+	u8 old_buf[BUF_SIZE], new_buf[BUF_SIZE];
+	u8 sizes[BUF_SIZE * 8];
+	int n, i, count, failures = 0;
+
+	for (n = 0; n < NUM_CASES; n++) {
+		unsigned start, old_pos, new_pos;
+
+		for (i = 0; i < BUF_SIZE; i++)
+			old_buf[i] = new_buf[i] = rng();
+
+		/* stop short of the end, a field may touch 5 bytes */
+		start = old_pos = new_pos = rng() % 64;
+		for (count = 0; new_pos + 32 < (BUF_SIZE - 1) * 8; count++) {
+			long value = rng();
+
+			sizes[count] = rng() % 33;
+			old_append(old_buf, &old_pos, sizes[count], value);
+			brickpi_pack_bits(new_buf, new_pos, sizes[count], value);
+			new_pos += sizes[count];
+		}
+		if (memcmp(old_buf, new_buf, BUF_SIZE)) {
+			fprintf(stderr, "case %d: packed buffers differ\n", n);
+			failures++;
+			continue;
+		}
+
+		old_pos = new_pos = start;
+		for (i = 0; i < count; i++) {
+			long old_value, new_value;
+
+			old_value = old_read(old_buf, &old_pos, sizes[i]);
+			new_value = brickpi_unpack_bits(new_buf, new_pos, sizes[i]);
+			new_pos += sizes[i];
+			if (old_value != new_value) {
+				fprintf(stderr, "case %d field %d (%u bits): "
+					"read %ld, expected %ld\n", n, i,
+					sizes[i], new_value, old_value);
+				failures++;
+				break;
+			}
+		}
+	}
+
+	printf("pack/unpack: %d random cases, %d failures\n", NUM_CASES,
+	       failures);
+
+	return failures;
+}
+
+/*
+ * Field sizes of one channel's UPDATE_VALUES message: the motor speed and
+ * direction fields followed by one encoder and one 10-bit analog reading
+ * per port on the reply.
+ */
+static const u8 bench_fields[] = {
+	1, 1, 1, 1, 10, 1, 10, 1, 5, 32, 5, 32, 10, 10,
+};
+
+static double elapsed_ns(const struct timespec *start,
+			 const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9
+		+ (end->tv_nsec - start->tv_nsec);
+}
+
+static volatile long sink;
+
+static void bench(void)
+{
+	struct timespec start, end;
+	u8 buf[BUF_SIZE] = { 0 };
+	int n, i, nfields = sizeof(bench_fields);
+	unsigned pos;
+	long acc;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < BENCH_LOOPS; n++) {
+		pos = 32;
+		for (i = 0; i < nfields; i++)
+			old_append(buf, &pos, bench_fields[i], n + i);
+		pos = 24;
+		acc = 0;
+		for (i = 0; i < nfields; i++)
+			acc += old_read(buf, &pos, bench_fields[i]);
+		sink = acc;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("bit at a time:  %6.1f ns per message\n",
+	       elapsed_ns(&start, &end) / BENCH_LOOPS);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (n = 0; n < BENCH_LOOPS; n++) {
+		pos = 32;
+		for (i = 0; i < nfields; i++) {
+			brickpi_pack_bits(buf, pos, bench_fields[i], n + i);
+			pos += bench_fields[i];
+		}
+		pos = 24;
+		acc = 0;
+		for (i = 0; i < nfields; i++) {
+			acc += brickpi_unpack_bits(buf, pos, bench_fields[i]);
+			pos += bench_fields[i];
+		}
+		sink = acc;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("word at a time: %6.1f ns per message\n",
+	       elapsed_ns(&start, &end) / BENCH_LOOPS);
+}
+
+int main(void)
+{
+	int failures = check_random();
+
+	bench();
+
+	return failures ? 1 : 0;
+}
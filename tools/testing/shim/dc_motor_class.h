@@ -0,0 +1,7 @@
+#ifndef _SHIM_DC_MOTOR_CLASS_H
+#define _SHIM_DC_MOTOR_CLASS_H
+
+/* tacho_motor_helper.c only needs the duty cycle limit */
+#define DC_MOTOR_MAX_DUTY_CYCLE	100
+
+#endif /* _SHIM_DC_MOTOR_CLASS_H */
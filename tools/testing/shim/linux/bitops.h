@@ -0,0 +1,9 @@
+#ifndef _SHIM_LINUX_BITOPS_H
+#define _SHIM_LINUX_BITOPS_H
+
+#include <linux/types.h>
+
+#define GENMASK_ULL(h, l) \
+	(((~0ULL) << (l)) & (~0ULL >> (63 - (h))))
+
+#endif /* _SHIM_LINUX_BITOPS_H */
@@ -0,0 +1,7 @@
+#ifndef _SHIM_LINUX_EXPORT_H
+#define _SHIM_LINUX_EXPORT_H
+
+#define EXPORT_SYMBOL(sym)
+#define EXPORT_SYMBOL_GPL(sym)
+
+#endif /* _SHIM_LINUX_EXPORT_H */
@@ -0,0 +1,30 @@
+#ifndef _SHIM_LINUX_KERNEL_H
+#define _SHIM_LINUX_KERNEL_H
+
+#include <assert.h>
+#include <limits.h>
+
+#include <linux/types.h>
+
+#define S64_MAX			INT64_MAX
+#define S64_MIN			INT64_MIN
+
+#define BUG_ON(cond)		assert(!(cond))
+
+#define ARRAY_SIZE(arr)		(int)(sizeof(arr) / sizeof((arr)[0]))
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+
+#define min(x, y)		((x) < (y) ? (x) : (y))
+#define max(x, y)		((x) > (y) ? (x) : (y))
+#define min_t(type, x, y)	min((type)(x), (type)(y))
+#define max_t(type, x, y)	max((type)(x), (type)(y))
+#define clamp(val, lo, hi)	min(max(val, lo), hi)
+#define clamp_t(type, val, lo, hi) clamp((type)(val), (type)(lo), (type)(hi))
+#define clamp_val(val, lo, hi)	clamp(val, lo, hi)
+
+#define abs(x) ({				\
+	__typeof__(x) __x = (x);		\
+	__x < 0 ? -__x : __x;			\
+})
+
+#endif /* _SHIM_LINUX_KERNEL_H */
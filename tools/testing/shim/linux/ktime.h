@@ -0,0 +1,43 @@
+#ifndef _SHIM_LINUX_KTIME_H
+#define _SHIM_LINUX_KTIME_H
+
+#include <linux/types.h>
+
+#define NSEC_PER_USEC	1000L
+#define NSEC_PER_MSEC	1000000L
+#define NSEC_PER_SEC	1000000000L
+#define USEC_PER_SEC	1000000L
+#define MSEC_PER_SEC	1000L
+
+typedef s64 ktime_t;
+
+static inline ktime_t ktime_set(s64 secs, unsigned long nsecs)
+{
+	return secs * NSEC_PER_SEC + nsecs;
+}
+
+#define ktime_sub(a, b)		((a) - (b))
+#define ktime_add(a, b)		((a) + (b))
+#define ktime_add_ns(t, ns)	((t) + (ns))
+#define ktime_add_us(t, us)	((t) + (us) * NSEC_PER_USEC)
+#define ktime_add_ms(t, ms)	((t) + (ms) * NSEC_PER_MSEC)
+#define ktime_to_ns(t)		(t)
+#define ktime_to_us(t)		((t) / NSEC_PER_USEC)
+#define ktime_to_ms(t)		((t) / NSEC_PER_MSEC)
+#define ns_to_ktime(ns)		(ns)
+#define ms_to_ktime(ms)		((ktime_t)(ms) * NSEC_PER_MSEC)
+#define ktime_compare(a, b)	((a) < (b) ? -1 : (a) > (b) ? 1 : 0)
+#define ktime_after(a, b)	((a) > (b))
+#define ktime_before(a, b)	((a) < (b))
+
+static inline s64 ktime_us_delta(ktime_t later, ktime_t earlier)
+{
+	return ktime_to_us(later - earlier);
+}
+
+static inline s64 ktime_ms_delta(ktime_t later, ktime_t earlier)
+{
+	return ktime_to_ms(later - earlier);
+}
+
+#endif /* _SHIM_LINUX_KTIME_H */
@@ -0,0 +1,327 @@
+/*
+ * Host test and benchmark for the tacho motor PID helper
+ *
+ * Copyright (C) 2026 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * tm_pid_update() is run against a first order model of an EV3 large motor
+ * (about 1050 deg/s at 100% duty cycle, 100 ms time constant) with noise on
+ * the measured speed, at the 2 ms period of the EV3 driver. The checks are:
+ *
+ * - with the default Kf, Tf and slew, the output is the same as the plain
+ *   PID that the helper replaced
+ * - the speed step response settles, with and without feed-forward
+ * - the derivative filter reduces the output jitter caused by the noise
+ * - the slew limit is respected
+ * - tm_pid_transfer() makes the next update return the transferred output
+ *
+ * Then the cost of one update is timed.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../../motors/tacho_motor_helper.c"
+
+#define PERIOD_S	0.002
+#define PLANT_GAIN	10.5	/* deg/s per percent duty cycle */
+#define PLANT_TAU_S	0.1
+#define NOISE		10	/* peak noise on the measured speed, deg/s */
+
+#define STEP_SPEED	500
+#define STEP_UPDATES	1500
+#define TAIL_UPDATES	500
+
+#define EQUIV_UPDATES	1000000
+#define TRANSFER_CASES	100000
+#define BENCH_LOOPS	10000000
+
+static u64 rng_state = 0x9e3779b97f4a7c15ULL;
+
+static u64 rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+
+	return rng_state;
+}
+
+static int rng_range(int lo, int hi)
+{
+	return lo + (int)(rng() % (u64)(hi - lo + 1));
+}
+
+/* tm_pid_update() before Kf, Tf, slew and scale were added */
+static int old_pid_update(struct tm_pid *pid, int value)
+{
+	int duty_cycle, error, delta_error;
+
+	error = pid->setpoint - value;
+	pid->integral += error;
+	delta_error = pid->prev_error - error;
+	pid->prev_error = error;
+
+	duty_cycle = ((error * pid->Kp) + (pid->integral * pid->Ki)
+		      + (delta_error * pid->Kd)) / 10000;
+
+	pid->overloaded = abs(duty_cycle) > DC_MOTOR_MAX_DUTY_CYCLE;
+	if (pid->overloaded)
+		pid->integral -= error;
+
+	duty_cycle = min(duty_cycle, DC_MOTOR_MAX_DUTY_CYCLE);
+	duty_cycle = max(duty_cycle, -DC_MOTOR_MAX_DUTY_CYCLE);
+
+	return duty_cycle;
+}
+
+static int check_equivalence(void)
+{
+	struct tm_pid old, new;
+	int i, failures = 0;
+
+	tm_pid_init(&old, 1000, 60, 500);
+	tm_pid_init(&new, 1000, 60, 500);
+
+	for (i = 0; i < EQUIV_UPDATES; i++) {
+		int value = rng_range(-1200, 1200);
+		int old_out, new_out;
+
+		/* change the gains and setpoint now and then */
+		if (i % 1000 == 0) {
+			old.Kp = new.Kp = rng_range(0, 5000);
+			old.Ki = new.Ki = rng_range(0, 200);
+			old.Kd = new.Kd = rng_range(0, 5000);
+			old.setpoint = new.setpoint = rng_range(-1000, 1000);
+		}
+
+		old_out = old_pid_update(&old, value);
+		new_out = tm_pid_update(&new, value);
+		if (old_out != new_out || old.integral != new.integral) {
+			if (failures++ < 10)
+				fprintf(stderr, "update %d: output %d, expected "
+					"%d\n", i, new_out, old_out);
+		}
+	}
+
+	printf("default gains vs old PID: %d updates, %d mismatches\n",
+	       EQUIV_UPDATES, failures);
+
+	return failures;
+}
+
+struct step_result {
+	double rise_ms;		/* 10% to 90% of the step */
+	double overshoot;	/* percent of the step */
+	double settle_ms;	/* last time outside of +/- 5% */
+	double error;		/* mean error over the tail, percent */
+	double jitter;		/* RMS output change over the tail, percent */
+	int max_slew;		/* largest output change between updates */
+};
+
+static void run_step(struct tm_pid *pid, struct step_result *res)
+{
+	double speed = 0, peak = 0, sum = 0, jitter = 0;
+	double t10 = -1, t90 = -1, settle = 0;
+	int i, output, prev_output = 0;
+
+	pid->setpoint = STEP_SPEED;
+	res->max_slew = 0;
+
+	for (i = 0; i < STEP_UPDATES; i++) {
+		int measured = lround(speed) + rng_range(-NOISE, NOISE);
+		double t = i * PERIOD_S * 1000;
+
+		output = tm_pid_update(pid, measured);
+		speed += (PLANT_GAIN * output - speed) * PERIOD_S / PLANT_TAU_S;
+
+		res->max_slew = max(res->max_slew, abs(output - prev_output));
+		if (i >= STEP_UPDATES - TAIL_UPDATES) {
+			sum += speed;
+			jitter += (output - prev_output) * (output - prev_output);
+		}
+		prev_output = output;
+
+		if (t10 < 0 && speed >= 0.1 * STEP_SPEED)
+			t10 = t;
+		if (t90 < 0 && speed >= 0.9 * STEP_SPEED)
+			t90 = t;
+		if (fabs(speed - STEP_SPEED) > 0.05 * STEP_SPEED)
+			settle = t;
+		peak = fmax(peak, speed);
+	}
+
+	res->rise_ms = t90 < 0 ? INFINITY : t90 - t10;
+	res->overshoot = 100 * (peak - STEP_SPEED) / STEP_SPEED;
+	res->settle_ms = settle;
+	res->error = 100 * (STEP_SPEED - sum / TAIL_UPDATES) / STEP_SPEED;
+	res->jitter = sqrt(jitter / TAIL_UPDATES);
+}
+
+static void print_step(const char *name, const struct step_result *res)
+{
+	printf("  %-22s rise %5.1f ms  overshoot %5.1f%%  settle %6.1f ms  "
+	       "error %5.2f%%  jitter %5.2f  max slew %3d\n", name,
+	       res->rise_ms, res->overshoot, res->settle_ms, res->error,
+	       res->jitter, res->max_slew);
+}
+
+static int check_step(void)
+{
+	struct step_result pi, ff, pid, pid_tf, slew;
+	struct tm_pid p;
+	int failures = 0;
+
+	printf("speed step 0 -> %d deg/s:\n", STEP_SPEED);
+
+	tm_pid_init(&p, 1000, 60, 0);
+	run_step(&p, &pi);
+	print_step("PI (EV3 defaults)", &pi);
+
+	tm_pid_init(&p, 1000, 60, 0);
+	p.Kf = TM_PID_DEFAULT_SCALE / PLANT_GAIN;
+	run_step(&p, &ff);
+	print_step("PI + Kf", &ff);
+
+	tm_pid_init(&p, 1000, 60, 2000);
+	run_step(&p, &pid);
+	print_step("PID, Tf 0", &pid);
+
+	tm_pid_init(&p, 1000, 60, 2000);
+	p.Tf = 8;
+	run_step(&p, &pid_tf);
+	print_step("PID, Tf 8", &pid_tf);
+
+	tm_pid_init(&p, 1000, 60, 0);
+	p.Kf = TM_PID_DEFAULT_SCALE / PLANT_GAIN;
+	p.slew = 5;
+	run_step(&p, &slew);
+	print_step("PI + Kf, slew 5", &slew);
+
+	if (pi.settle_ms > 1000 || fabs(pi.error) > 1) {
+		fprintf(stderr, "PI does not settle\n");
+		failures++;
+	}
+	if (ff.settle_ms > 1000 || fabs(ff.error) > 1
+	    || ff.rise_ms > pi.rise_ms) {
+		fprintf(stderr, "feed-forward does not settle faster\n");
+		failures++;
+	}
+	if (pid_tf.jitter >= pid.jitter) {
+		fprintf(stderr, "derivative filter does not reduce jitter\n");
+		failures++;
+	}
+	if (slew.max_slew > 5) {
+		fprintf(stderr, "slew limit exceeded\n");
+		failures++;
+	}
+
+	return failures;
+}
+
+static int check_transfer(void)
+{
+	struct tm_pid p;
+	int i, tested = 0, failures = 0;
+
+	for (i = 0; i < TRANSFER_CASES; i++) {
+		int value = rng_range(-1000, 1000);
+		int output = rng_range(-100, 100);
+		int next;
+
+		tm_pid_init(&p, rng_range(0, 100000), rng_range(1, 2000),
+			    rng_range(0, 5000));
+		p.Kf = rng_range(0, 2000);
+		p.setpoint = value + rng_range(-20, 20);
+		tm_pid_transfer(&p, value, output);
+
+		/* the integral clamp is hit, the bump can't be avoided */
+		if (abs(p.integral) >= INT_MAX / 2 - 100)
+			continue;
+
+		tested++;
+		next = tm_pid_update(&p, value);
+		if (abs(next - output) > 1) {
+			if (failures++ < 10)
+				fprintf(stderr, "transfer of %d: next output "
+					"%d\n", output, next);
+		}
+	}
+
+	printf("bumpless transfer: %d cases, %d off by more than 1%%\n",
+	       tested, failures);
+
+	return failures;
+}
+
+static double elapsed_ns(const struct timespec *start,
+			 const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9
+		+ (end->tv_nsec - start->tv_nsec);
+}
+
+static volatile int sink;
+
+static void bench_one(const char *name, struct tm_pid *p,
+		      int (*update)(struct tm_pid *pid, int value))
+{
+	struct timespec start, end;
+	int i, acc = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_LOOPS; i++)
+		acc += update(p, STEP_SPEED - 16 + (i & 31));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	sink = acc;
+
+	printf("  %-22s %5.2f ns per update\n", name,
+	       elapsed_ns(&start, &end) / BENCH_LOOPS);
+}
+
+static void bench(void)
+{
+	int (*volatile old_update)(struct tm_pid *, int) = old_pid_update;
+	int (*volatile new_update)(struct tm_pid *, int) = tm_pid_update;
+	struct tm_pid p;
+
+	printf("update cost:\n");
+
+	tm_pid_init(&p, 1000, 60, 0);
+	p.setpoint = STEP_SPEED;
+	bench_one("old PID", &p, old_update);
+
+	tm_pid_init(&p, 1000, 60, 0);
+	p.setpoint = STEP_SPEED;
+	bench_one("default gains", &p, new_update);
+
+	tm_pid_init(&p, 1000, 60, 2000);
+	p.setpoint = STEP_SPEED;
+	p.Kf = 952;
+	p.Tf = 8;
+	p.slew = 5;
+	bench_one("Kf, Tf and slew", &p, new_update);
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	failures += check_equivalence();
+	failures += check_step();
+	failures += check_transfer();
+	bench();
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,288 @@
+/*
+ * Host benchmark for the tacho motor speed helpers
+ *
+ * Copyright (C) 2026 David Lechner <david@lechnology.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+
+ * This program is distributed "as is" WITHOUT ANY WARRANTY of any
+ * kind, whether express or implied; without even the implied warranty
+ * of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Synthetic encoder traces are replayed through tm_speed and tm_speed_ab with
+ * the same window. The encoder has 1 count per degree and is sampled every
+ * 4 ms with up to +/-1 ms of jitter, like the BrickPi poll. Each case is run
+ * over several traces with a random encoder phase. This prints:
+ *
+ * - noise: the RMS error of the estimate at a constant speed
+ * - latency: the time for the estimate to cross 50% and 90% of a speed step
+ * - overshoot: of the estimate after the step
+ *
+ * For the same window, the latencies are within about 20% of each other, so
+ * the noise is compared at the same window. It fails if either estimator is biased at a constant
+ * speed, or if tm_speed_ab is noisier than tm_speed below 100 deg/s with a
+ * window of 10 or more samples. Then the cost of one update is timed.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../../motors/tacho_motor_helper.c"
+
+#define PERIOD_US	4000
+#define JITTER_US	1000
+#define TRACE_SAMPLES	5000
+#define STEP_SAMPLE	100
+#define TRACES		20
+#define BENCH_LOOPS	10000000
+
+static u64 rng_state = 0x853c49e6748fea9bULL;
+
+static u64 rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+
+	return rng_state;
+}
+
+static int rng_range(int lo, int hi)
+{
+	return lo + (int)(rng() % (u64)(hi - lo + 1));
+}
+
+struct trace {
+	int count;
+	int pos[TRACE_SAMPLES];
+	ktime_t time[TRACE_SAMPLES];
+	double speed[TRACE_SAMPLES];
+};
+
+/*
+ * Speed is @speed0 until sample STEP_SAMPLE and @speed1 after it. The phase
+ * of the encoder is random so that quantization is not the same every run.
+ */
+static void make_trace(struct trace *tr, double speed0, double speed1)
+{
+	double pos = (rng() % 1000) / 1000.0;
+	s64 t = 0;
+	int i;
+
+	tr->count = TRACE_SAMPLES;
+	for (i = 0; i < TRACE_SAMPLES; i++) {
+		double speed = i < STEP_SAMPLE ? speed0 : speed1;
+		s64 sample = (s64)i * PERIOD_US + rng_range(-JITTER_US, JITTER_US);
+
+		pos += speed * (sample - t) / USEC_PER_SEC;
+		t = sample;
+		tr->pos[i] = floor(pos);
+		tr->time[i] = t * NSEC_PER_USEC;
+		tr->speed[i] = speed;
+	}
+}
+
+struct result {
+	double sq;		/* sum of squared errors */
+	double sum;		/* sum of estimates */
+	int n;
+	double t50_ms;
+	double t90_ms;
+	double overshoot;
+};
+
+static void replay(const struct trace *tr, int window, bool ab,
+		   struct result *res)
+{
+	double step = tr->speed[TRACE_SAMPLES - 1] - tr->speed[0];
+	double peak = tr->speed[0];
+	struct tm_speed_ab spd_ab;
+	struct tm_speed spd;
+	int i;
+
+	tm_speed_init(&spd, tr->pos[0], tr->time[0], window);
+	tm_speed_ab_init(&spd_ab, tr->pos[0], tr->time[0], window);
+
+	for (i = 1; i < tr->count; i++) {
+		double est, t_ms;
+
+		if (ab) {
+			tm_speed_ab_update(&spd_ab, tr->pos[i], tr->time[i]);
+			est = tm_speed_ab_get(&spd_ab);
+		} else {
+			tm_speed_update(&spd, tr->pos[i], tr->time[i]);
+			est = tm_speed_get(&spd);
+		}
+
+		if (i < STEP_SAMPLE)
+			continue;
+
+		t_ms = (double)(tr->time[i] - tr->time[STEP_SAMPLE - 1])
+			/ NSEC_PER_MSEC;
+		if (step && !res->t50_ms && (est - tr->speed[0]) / step >= 0.5)
+			res->t50_ms = t_ms;
+		if (step && !res->t90_ms && (est - tr->speed[0]) / step >= 0.9)
+			res->t90_ms = t_ms;
+		peak = step >= 0 ? fmax(peak, est) : fmin(peak, est);
+
+		/* noise and bias are measured once the estimate has settled */
+		if (i >= 2 * STEP_SAMPLE) {
+			res->sq += (est - tr->speed[i]) * (est - tr->speed[i]);
+			res->sum += est;
+			res->n++;
+		}
+	}
+
+	if (step)
+		res->overshoot = 100 * (peak - tr->speed[i - 1]) / step;
+}
+
+static double rms(const struct result *res)
+{
+	return sqrt(res->sq / res->n);
+}
+
+static int check_constant(int window)
+{
+	static const int speeds[] = { 5, 20, 50, 100, 300, 1000 };
+	static struct trace tr;
+	struct result old_low = { 0 }, new_low = { 0 };
+	int i, j, failures = 0;
+
+	printf("constant speed, window of %d samples (RMS error, deg/s):\n",
+	       window);
+
+	for (i = 0; i < ARRAY_SIZE(speeds); i++) {
+		struct result old = { 0 }, new = { 0 };
+		double tolerance = 1 + speeds[i] * 0.02;
+
+		for (j = 0; j < TRACES; j++) {
+			make_trace(&tr, speeds[i], speeds[i]);
+			replay(&tr, window, false, &old);
+			replay(&tr, window, true, &new);
+		}
+
+		printf("  %5d deg/s   tm_speed %5.1f   tm_speed_ab %5.1f\n",
+		       speeds[i], rms(&old), rms(&new));
+
+		if (fabs(old.sum / old.n - speeds[i]) > tolerance
+		    || fabs(new.sum / new.n - speeds[i]) > tolerance) {
+			fprintf(stderr, "biased estimate at %d deg/s: %.1f "
+				"and %.1f\n", speeds[i], old.sum / old.n,
+				new.sum / new.n);
+			failures++;
+		}
+
+		if (speeds[i] < 100) {
+			old_low.sq += old.sq;
+			old_low.n += old.n;
+			new_low.sq += new.sq;
+			new_low.n += new.n;
+		}
+	}
+
+	printf("  below 100     tm_speed %5.1f   tm_speed_ab %5.1f\n",
+	       rms(&old_low), rms(&new_low));
+
+	if (window >= 10 && rms(&new_low) > rms(&old_low)) {
+		fprintf(stderr, "tm_speed_ab is noisier at low speeds\n");
+		failures++;
+	}
+
+	return failures;
+}
+
+static void check_step(int window, double from, double to)
+{
+	static struct trace tr;
+	struct result old = { 0 }, new = { 0 };
+	int j;
+
+	for (j = 0; j < TRACES; j++) {
+		struct result o = { 0 }, n = { 0 };
+
+		make_trace(&tr, from, to);
+		replay(&tr, window, false, &o);
+		replay(&tr, window, true, &n);
+		old.t50_ms += o.t50_ms / TRACES;
+		old.t90_ms += o.t90_ms / TRACES;
+		old.overshoot += o.overshoot / TRACES;
+		new.t50_ms += n.t50_ms / TRACES;
+		new.t90_ms += n.t90_ms / TRACES;
+		new.overshoot += n.overshoot / TRACES;
+	}
+
+	printf("  %4.0f -> %4.0f   tm_speed    50%% %5.1f ms  90%% %5.1f ms  "
+	       "overshoot %4.1f%%\n", from, to, old.t50_ms, old.t90_ms,
+	       old.overshoot);
+	printf("                tm_speed_ab 50%% %5.1f ms  90%% %5.1f ms  "
+	       "overshoot %4.1f%%\n", new.t50_ms, new.t90_ms, new.overshoot);
+}
+
+static double elapsed_ns(const struct timespec *start,
+			 const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9
+		+ (end->tv_nsec - start->tv_nsec);
+}
+
+static volatile int sink;
+
+static void bench(int window)
+{
+	void (*volatile old_update)(struct tm_speed *, int, ktime_t) =
+		tm_speed_update;
+	void (*volatile new_update)(struct tm_speed_ab *, int, ktime_t) =
+		tm_speed_ab_update;
+	struct timespec start, end;
+	struct tm_speed_ab spd_ab;
+	struct tm_speed spd;
+	int i, acc = 0;
+
+	printf("update cost:\n");
+
+	tm_speed_init(&spd, 0, 0, window);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 1; i <= BENCH_LOOPS; i++) {
+		old_update(&spd, i, (ktime_t)i * PERIOD_US * NSEC_PER_USEC);
+		acc += tm_speed_get(&spd);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("  tm_speed    %5.2f ns per update, %zu bytes\n",
+	       elapsed_ns(&start, &end) / BENCH_LOOPS, sizeof(spd));
+
+	tm_speed_ab_init(&spd_ab, 0, 0, window);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 1; i <= BENCH_LOOPS; i++) {
+		new_update(&spd_ab, i, (ktime_t)i * PERIOD_US * NSEC_PER_USEC);
+		acc += tm_speed_ab_get(&spd_ab);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("  tm_speed_ab %5.2f ns per update, %zu bytes\n",
+	       elapsed_ns(&start, &end) / BENCH_LOOPS, sizeof(spd_ab));
+
+	sink = acc;
+}
+
+int main(void)
+{
+	/* BRICKPI_SPEED_PERIOD / BRICKPI_POLL_MS and longer windows */
+	static const int windows[] = { 5, 10, 25 };
+	int i, failures = 0;
+
+	for (i = 0; i < ARRAY_SIZE(windows); i++) {
+		failures += check_constant(windows[i]);
+		printf("speed step, window of %d samples:\n", windows[i]);
+		check_step(windows[i], 0, 300);
+		check_step(windows[i], 300, -300);
+	}
+	bench(windows[0]);
+
+	return failures ? 1 : 0;
+}